@@ -0,0 +1,1071 @@
+#include <math.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <CL/opencl.h>
+#include "opencl_wrap.h"
+#include "cpu_ray.h"
+#include "cpu_kernels.h"
+#include "cpu_obj.h"
+#include "cpu_light.h"
+#include "cpu_visibility.h"
+#include "cpu_timeline.h"
+
+/* Headless render server. Scenes are loaded and their programs built once, then
+   every request is rendered on the warm context.
+
+   Requests are lines on a Unix domain socket, a connection can send many:
+
+       render <scene> <width> <height> <x> <y> <z> <dir x> <dir y> <dir z> <fov>
+
+   renders scenes/<scene>.map from the camera at x y z looking along dir and
+   answers `ok <bytes>` followed by that many bytes of png.
+
+       stats
+
+   answers one line with the request count and the latency percentiles in ms,
+   measured from reading the request to having its png ready. Errors are answered
+   with `error <reason>` and the connection stays open. That includes a scene that
+   cannot be read or fails on the device, it is dropped and loaded again by the
+   next request for it */
+
+#define DAEMON_SOCKET       "/tmp/raydaemon.sock"
+#define DAEMON_BACKLOG      64
+
+/* Largest image. The per pixel buffers of a scene grow with the requests up to it
+   and keep their memory for the smaller ones */
+#define DAEMON_MAX_WIDTH    1920
+#define DAEMON_MAX_HEIGHT   1080
+
+/* Requests waiting for the device, more are refused */
+#define DAEMON_QUEUE        256
+/* Requests for the same scene rendered back to back before the queue is looked at
+   again, the older requests for other scenes wait at most this many frames */
+#define DAEMON_BATCH        16
+/* Scenes kept loaded, the least recently used one is released for a new one */
+#define DAEMON_SCENES       4
+/* Latest request latencies the percentiles are taken from */
+#define DAEMON_LATENCIES    4096
+
+#define DAEMON_NAME         64
+#define DAEMON_LINE         512
+
+/* Same passes and settings as raypng */
+#define LIGHT_SAMPLES 0
+#define SHADOW_SLOTS 6
+#define SHADOW_CACHE_SIZE 4096
+#define SHADOW_SAMPLE_TABLE 4096
+#define DENOISE_PASSES 3
+#define SOFT_SHADOWS 1
+#define AA_SAMPLES 4
+#define AA_THRESHOLD 0.1f
+#define SCENE_STAGING -1
+#define PRECISION PRECISION_EXACT
+#define VISIBILITY_CACHE 1
+#define VISIBILITY_BRICKS 16
+#define MAX_DEPTH 15
+#define MIN_WEIGHT (1.0f/512.0f)
+#define ROULETTE 0
+
+
+/* Loaded scene with its own context, program and device buffers */
+typedef struct {
+    char            name[DAEMON_NAME];
+    int             loaded;
+    int             wrapped;        /* `cl_wrap_init` returned, it can be released */
+    unsigned long   last_used;
+
+    cl_wrap         wrap;
+
+    rsphere         *spheres;
+    rplane          *planes;
+    rlight          *lights;
+    cl_uint         sphere_num, plane_num, light_num;
+
+    rlight_alias    *light_alias;
+    cl_float3       *shadow_samples;
+    cl_int          *occluder_cache;
+    rvisibility     visibility;
+
+    /* Pool buffers sized by the pixels of the latest launch */
+    cl_uint         pixels;
+    cl_uint         rays, output, shadows, shadow_nums, hit_ids, gbuffer, secondary;
+    cl_uint         aa_list, colors[2];
+} rdaemon_scene;
+
+typedef struct {
+    char            scene[DAEMON_NAME];
+    rcamera         camera;
+    cl_uint         pwidth, pheight;
+
+    /* Packed colors, written by the render thread */
+    cl_uint         *pixels;
+    struct timeval  arrival;
+    int             done;
+    const char      *error;         /* Why the render failed, NULL if it did not */
+} rdaemon_job;
+
+static rdaemon_scene    scenes[DAEMON_SCENES];
+static unsigned long    scene_clock = 0;
+
+/* Waiting requests in arrival order */
+static rdaemon_job      *queue[DAEMON_QUEUE];
+static cl_uint          queue_num = 0;
+
+static double           latencies[DAEMON_LATENCIES];
+static unsigned long    latency_num = 0;
+
+static pthread_mutex_t  lock        = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   queued      = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t   rendered    = PTHREAD_COND_INITIALIZER;
+
+
+/* Builds the program for the scene and loads every argument that does not depend
+   on the request. The per request arguments are loaded by `render_views`. Returns
+   the reason if the scene cannot be loaded, `release_scene` frees what was */
+static const char* load_scene(rdaemon_scene *s, const char *name) {
+    char filename[DAEMON_NAME+16];
+    snprintf(filename, sizeof(filename), "scenes/%s.map", name);
+
+    strcpy(s->name, name);
+    s->wrapped        = 0;
+    s->spheres        = NULL;
+    s->planes         = NULL;
+    s->lights         = NULL;
+    s->light_alias    = NULL;
+    s->shadow_samples = NULL;
+    s->occluder_cache = NULL;
+    memset(&s->visibility, 0, sizeof(s->visibility));
+
+    if (!extract_robj(filename, &s->spheres, &s->sphere_num, &s->planes, &s->plane_num,
+                      &s->lights, &s->light_num)) {
+        return "cannot read the scene";
+    }
+
+    s->light_alias = rgen_light_alias(s->lights, s->light_num);
+    s->shadow_samples = rgen_shadow_samples(SHADOW_SAMPLE_TABLE);
+    if ((s->light_num && !s->light_alias) || !s->shadow_samples) {
+        return "out of memory";
+    }
+
+    cl_wrap *wrap = &s->wrap;
+    char options[512] = "", staged_options[512];
+    rtrace_options(options, sizeof(options), MAX_DEPTH, MIN_WEIGHT, ROULETTE);
+    rprecision_options(options, sizeof(options), PRECISION);
+    strcpy(staged_options, options);
+    int staged = robj_options(staged_options, sizeof(staged_options), s->sphere_num,
+                              s->plane_num, s->light_num,
+                              cl_wrap_local_memory(CL_DEVICE_TYPE_GPU), SCENE_STAGING);
+
+    /* The secondary rays are traced unsorted, so the sort kernels are left out */
+    /* The kernels in the order of src/cpu_kernels.h */
+    cl_wrap_init(wrap, CL_DEVICE_TYPE_GPU, staged_options,
+                 "src/cl/raygen.cl", "raygen",
+                 "src/cl/raytracing.cl", "raytracer",
+                 "src/cl/shadowtest.cl", "shadowtest",
+                 "src/cl/shadowgather.cl", "shadowgather",
+                 "src/cl/aadetect.cl", "aadetect",
+                 "src/cl/aatrace.cl", "aatrace",
+                 "src/cl/denoise.cl", "denoise",
+                 "src/cl/secondarytrace.cl", "secondarytrace",
+                 "src/cl/secondarygather.cl", "secondarygather", NULL);
+    s->wrapped = 1;
+
+    /* The compiler's own local memory can leave no room for the staged scene */
+    if (staged) { cl_wrap_fit_local(wrap, options); }
+
+    /* The per pixel buffers start with one pixel, `render_views` sizes them */
+    cl_uint pixels = 1;
+    cl_uint light_samples = LIGHT_SAMPLES;
+    cl_uint sample_mask = SHADOW_SAMPLE_TABLE-1;
+    cl_uint frame = 0;
+    cl_uint soft_shadows = SOFT_SHADOWS;
+
+    /* Requests of the same resolution are rendered as views of one launch */
+    cl_wrap_load_global_data(wrap, KERNEL_RAYGEN, RAYGEN_ARG_VIEWS, NULL,
+                             sizeof(rview)*DAEMON_BATCH, CL_MEM_READ_ONLY);
+
+    s->pixels      = pixels;
+    s->rays        = cl_wrap_pool_alloc(wrap, "rays", sizeof(rpacked)*pixels,
+                                        CL_MEM_READ_WRITE);
+    s->output      = cl_wrap_pool_alloc(wrap, "output", sizeof(cl_uint)*pixels,
+                                        CL_MEM_READ_WRITE);
+    s->shadows     = cl_wrap_pool_alloc(wrap, "shadow rays",
+                                        sizeof(rshadow)*SHADOW_SLOTS*pixels,
+                                        CL_MEM_READ_WRITE);
+    s->shadow_nums = cl_wrap_pool_alloc(wrap, "shadow rays", sizeof(cl_uint)*pixels,
+                                        CL_MEM_READ_WRITE);
+    s->hit_ids     = cl_wrap_pool_alloc(wrap, "gbuffer", sizeof(cl_int)*pixels,
+                                        CL_MEM_READ_WRITE);
+    s->gbuffer     = cl_wrap_pool_alloc(wrap, "gbuffer", sizeof(rgbuffer)*pixels,
+                                        CL_MEM_READ_WRITE);
+    s->secondary   = cl_wrap_pool_alloc(wrap, "secondary rays",
+                                        sizeof(rsecondary)*2*pixels, CL_MEM_READ_WRITE);
+    s->aa_list     = cl_wrap_pool_alloc(wrap, "anti-aliasing", sizeof(cl_uint)*pixels,
+                                        CL_MEM_READ_WRITE);
+    s->colors[0]   = cl_wrap_pool_alloc(wrap, "denoise", sizeof(cl_float4)*pixels,
+                                        CL_MEM_READ_WRITE);
+    s->colors[1]   = cl_wrap_pool_alloc(wrap, "denoise", sizeof(cl_float4)*pixels,
+                                        CL_MEM_READ_WRITE);
+
+    cl_wrap_load_pool_data(wrap, KERNEL_RAYGEN, RAYGEN_ARG_RAYS, s->rays);
+
+    cl_wrap_load_pool_data(wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_RAYS, s->rays);
+    cl_wrap_load_global_data(wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_SPHERES, s->spheres,
+                             sizeof(rsphere)*s->sphere_num, CL_MEM_READ_ONLY);
+    cl_wrap_load_global_data(wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_PLANES, s->planes,
+                             sizeof(rplane)*s->plane_num, CL_MEM_READ_ONLY);
+    cl_wrap_load_global_data(wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_LIGHTS, s->lights,
+                             sizeof(rlight)*s->light_num, CL_MEM_READ_ONLY);
+    cl_wrap_load_single_data(wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_SPHERES_NUM,
+                             &s->sphere_num, sizeof(cl_uint));
+    cl_wrap_load_single_data(wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_PLANES_NUM,
+                             &s->plane_num, sizeof(cl_uint));
+    cl_wrap_load_single_data(wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_LIGHT_NUM,
+                             &s->light_num, sizeof(cl_uint));
+
+    cl_wrap_load_images(wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_IM_ARR,
+                        CL_MEM_COPY_HOST_PTR, 4,
+                        "assets/cobblestone.png",
+                        "assets/sand.png",
+                        "assets/check.png",
+                        "assets/grass.png");
+
+    cl_wrap_load_images(wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_SKYBOX,
+                        CL_MEM_COPY_HOST_PTR, 1,
+                        "assets/bg/stormydays.png");
+
+    cl_wrap_load_pool_data(wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_OUTPUT, s->output);
+    cl_wrap_load_global_data(wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_LIGHT_ALIAS,
+                             s->light_alias, sizeof(rlight_alias)*s->light_num,
+                             CL_MEM_READ_ONLY);
+    cl_wrap_load_single_data(wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_LIGHT_SAMPLES,
+                             &light_samples, sizeof(cl_uint));
+
+    cl_uint shadow_slots = SHADOW_SLOTS;
+    cl_uint cache_size = SHADOW_CACHE_SIZE;
+
+    s->occluder_cache = malloc(sizeof(cl_int)*cache_size);
+    if (!s->occluder_cache) {
+        return "out of memory";
+    }
+    for (cl_uint i = 0; i < cache_size; i++) { s->occluder_cache[i] = -1; }
+
+    cl_wrap_load_pool_data(wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_SHADOW_RAYS, s->shadows);
+    cl_wrap_load_pool_data(wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_SHADOW_NUM,
+                           s->shadow_nums);
+    cl_wrap_load_single_data(wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_SHADOW_SLOTS,
+                             &shadow_slots, sizeof(cl_uint));
+    cl_wrap_load_global_data(wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_SHADOW_SAMPLES,
+                             s->shadow_samples, sizeof(cl_float3)*SHADOW_SAMPLE_TABLE,
+                             CL_MEM_READ_ONLY);
+    cl_wrap_load_single_data(wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_SAMPLE_MASK,
+                             &sample_mask, sizeof(cl_uint));
+    cl_wrap_load_single_data(wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_FRAME, &frame,
+                             sizeof(cl_uint));
+    cl_wrap_load_pool_data(wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_HIT_IDS, s->hit_ids);
+    cl_wrap_load_pool_data(wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_GBUFFER, s->gbuffer);
+    cl_wrap_load_single_data(wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_SOFT_SHADOWS,
+                             &soft_shadows, sizeof(cl_uint));
+
+    cl_mem no_trace_list = NULL;
+    cl_uint use_trace_list = 0;
+    cl_wrap_load_single_data(wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_TRACE_LIST,
+                             &no_trace_list, sizeof(cl_mem));
+    cl_wrap_load_single_data(wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_USE_TRACE_LIST,
+                             &use_trace_list, sizeof(cl_uint));
+
+    cl_uint secondary_num = 0;
+    cl_uint defer_secondary = 1;
+    cl_wrap_load_pool_data(wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_SECONDARY, s->secondary);
+    cl_wrap_load_global_data(wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_SECONDARY_NUM,
+                             &secondary_num, sizeof(cl_uint), CL_MEM_READ_WRITE);
+    cl_wrap_load_single_data(wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_DEFER_SECONDARY,
+                             &defer_secondary, sizeof(cl_uint));
+
+    cl_mem no_trace_stats = NULL;
+    cl_wrap_load_single_data(wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_TRACE_STATS,
+                             &no_trace_stats, sizeof(cl_mem));
+
+    /* Light visibility grid, the kernels trace every shadow ray without one */
+    cl_mem vis_bricks = NULL, vis_cells = NULL;
+    if (VISIBILITY_CACHE) {
+        rgen_visibility(&s->visibility, filename, s->spheres, s->sphere_num,
+                        s->planes, s->plane_num, s->lights, s->light_num,
+                        s->shadow_samples, VISIBILITY_BRICKS);
+
+        size_t bricks_size = sizeof(cl_uint)*s->visibility.grid.lights*
+                             VISIBILITY_BRICKS*VISIBILITY_BRICKS*VISIBILITY_BRICKS;
+        size_t cells_size  = VIS_BRICK_CELLS*
+                             (s->visibility.pool_num ? s->visibility.pool_num : 1);
+
+        cl_wrap_load_global_data(wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_VIS_BRICKS,
+                                 s->visibility.bricks, bricks_size, CL_MEM_READ_ONLY);
+        cl_wrap_load_global_data(wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_VIS_CELLS,
+                                 s->visibility.cells, cells_size, CL_MEM_READ_ONLY);
+        vis_bricks = wrap->buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_VIS_BRICKS];
+        vis_cells  = wrap->buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_VIS_CELLS];
+    } else {
+        cl_wrap_load_single_data(wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_VIS_BRICKS,
+                                 &vis_bricks, sizeof(cl_mem));
+        cl_wrap_load_single_data(wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_VIS_CELLS,
+                                 &vis_cells, sizeof(cl_mem));
+    }
+    cl_wrap_load_single_data(wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_VIS_GRID,
+                             &s->visibility.grid, sizeof(rvis_grid));
+
+    /* No meshes are rendered here */
+    cl_mem no_mesh = NULL;
+    cl_uint mesh_num = 0;
+    for (cl_uint arg = RAYTRACER_ARG_MESHES; arg <= RAYTRACER_ARG_MESH_NODES; arg++) {
+        cl_wrap_load_single_data(wrap, KERNEL_RAYTRACER, arg, &no_mesh,
+                                 sizeof(cl_mem));
+    }
+    cl_wrap_load_single_data(wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_MESH_NUM, &mesh_num,
+                             sizeof(cl_uint));
+
+    cl_wrap_load_pool_data(wrap, KERNEL_SHADOWTEST, SHADOWTEST_ARG_SHADOW_RAYS,
+                           s->shadows);
+    cl_wrap_load_pool_data(wrap, KERNEL_SHADOWTEST, SHADOWTEST_ARG_SHADOW_NUM,
+                           s->shadow_nums);
+    cl_wrap_load_single_data(wrap, KERNEL_SHADOWTEST, SHADOWTEST_ARG_SHADOW_SLOTS,
+                             &shadow_slots, sizeof(cl_uint));
+    cl_wrap_load_single_data(wrap, KERNEL_SHADOWTEST, SHADOWTEST_ARG_SPHERES,
+                             &wrap->buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_SPHERES],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(wrap, KERNEL_SHADOWTEST, SHADOWTEST_ARG_PLANES,
+                             &wrap->buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_PLANES],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(wrap, KERNEL_SHADOWTEST, SHADOWTEST_ARG_SPHERES_NUM,
+                             &s->sphere_num, sizeof(cl_uint));
+    cl_wrap_load_single_data(wrap, KERNEL_SHADOWTEST, SHADOWTEST_ARG_PLANES_NUM,
+                             &s->plane_num, sizeof(cl_uint));
+    cl_wrap_load_global_data(wrap, KERNEL_SHADOWTEST, SHADOWTEST_ARG_OCCLUDER_CACHE,
+                             s->occluder_cache, sizeof(cl_int)*cache_size,
+                             CL_MEM_READ_WRITE);
+    cl_wrap_load_single_data(wrap, KERNEL_SHADOWTEST, SHADOWTEST_ARG_CACHE_SIZE,
+                             &cache_size, sizeof(cl_uint));
+    for (cl_uint arg = SHADOWTEST_ARG_MESHES; arg <= SHADOWTEST_ARG_MESH_NODES; arg++) {
+        cl_wrap_load_single_data(wrap, KERNEL_SHADOWTEST, arg, &no_mesh,
+                                 sizeof(cl_mem));
+    }
+    cl_wrap_load_single_data(wrap, KERNEL_SHADOWTEST, SHADOWTEST_ARG_MESH_NUM, &mesh_num,
+                             sizeof(cl_uint));
+
+    cl_wrap_load_pool_data(wrap, KERNEL_SHADOWGATHER, SHADOWGATHER_ARG_RAYS, s->rays);
+    cl_wrap_load_pool_data(wrap, KERNEL_SHADOWGATHER, SHADOWGATHER_ARG_SHADOW_RAYS,
+                           s->shadows);
+    cl_wrap_load_pool_data(wrap, KERNEL_SHADOWGATHER, SHADOWGATHER_ARG_SHADOW_NUM,
+                           s->shadow_nums);
+    cl_wrap_load_single_data(wrap, KERNEL_SHADOWGATHER, SHADOWGATHER_ARG_SHADOW_SLOTS,
+                             &shadow_slots, sizeof(cl_uint));
+    cl_wrap_load_pool_data(wrap, KERNEL_SHADOWGATHER, SHADOWGATHER_ARG_OUTPUT, s->output);
+
+    cl_uint aa_samples = AA_SAMPLES;
+    cl_float aa_threshold = AA_THRESHOLD;
+    cl_uint aa_num = 0;
+
+    cl_wrap_load_pool_data(wrap, KERNEL_AADETECT, AADETECT_ARG_RAYS, s->rays);
+    cl_wrap_load_pool_data(wrap, KERNEL_AADETECT, AADETECT_ARG_HIT_IDS, s->hit_ids);
+    cl_wrap_load_single_data(wrap, KERNEL_AADETECT, AADETECT_ARG_THRESHOLD,
+                             &aa_threshold, sizeof(cl_float));
+    cl_wrap_load_pool_data(wrap, KERNEL_AADETECT, AADETECT_ARG_AA_LIST, s->aa_list);
+    cl_wrap_load_global_data(wrap, KERNEL_AADETECT, AADETECT_ARG_AA_NUM, &aa_num,
+                             sizeof(cl_uint), CL_MEM_READ_WRITE);
+
+    cl_wrap_load_pool_data(wrap, KERNEL_AATRACE, AATRACE_ARG_RAYS, s->rays);
+    cl_wrap_load_single_data(wrap, KERNEL_AATRACE, AATRACE_ARG_SPHERES,
+                             &wrap->buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_SPHERES],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(wrap, KERNEL_AATRACE, AATRACE_ARG_PLANES,
+                             &wrap->buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_PLANES],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(wrap, KERNEL_AATRACE, AATRACE_ARG_LIGHTS,
+                             &wrap->buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_LIGHTS],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(wrap, KERNEL_AATRACE, AATRACE_ARG_SPHERES_NUM,
+                             &s->sphere_num, sizeof(cl_uint));
+    cl_wrap_load_single_data(wrap, KERNEL_AATRACE, AATRACE_ARG_PLANES_NUM, &s->plane_num,
+                             sizeof(cl_uint));
+    cl_wrap_load_single_data(wrap, KERNEL_AATRACE, AATRACE_ARG_LIGHT_NUM, &s->light_num,
+                             sizeof(cl_uint));
+    cl_wrap_load_single_data(wrap, KERNEL_AATRACE, AATRACE_ARG_IM_ARR,
+                             &wrap->buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_IM_ARR],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(wrap, KERNEL_AATRACE, AATRACE_ARG_SKYBOX,
+                             &wrap->buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_SKYBOX],
+                             sizeof(cl_mem));
+    cl_wrap_load_pool_data(wrap, KERNEL_AATRACE, AATRACE_ARG_OUTPUT, s->output);
+    cl_wrap_load_single_data(wrap, KERNEL_AATRACE, AATRACE_ARG_LIGHT_ALIAS,
+                             &wrap->buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_LIGHT_ALIAS],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(wrap, KERNEL_AATRACE, AATRACE_ARG_LIGHT_SAMPLES,
+                             &light_samples, sizeof(cl_uint));
+    cl_wrap_load_single_data(wrap, KERNEL_AATRACE, AATRACE_ARG_SHADOW_SAMPLES,
+                             &wrap->buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_SHADOW_SAMPLES],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(wrap, KERNEL_AATRACE, AATRACE_ARG_SAMPLE_MASK, &sample_mask,
+                             sizeof(cl_uint));
+    cl_wrap_load_single_data(wrap, KERNEL_AATRACE, AATRACE_ARG_FRAME, &frame,
+                             sizeof(cl_uint));
+    cl_wrap_load_pool_data(wrap, KERNEL_AATRACE, AATRACE_ARG_AA_LIST, s->aa_list);
+    cl_wrap_load_single_data(wrap, KERNEL_AATRACE, AATRACE_ARG_AA_SAMPLES, &aa_samples,
+                             sizeof(cl_uint));
+    cl_wrap_load_single_data(wrap, KERNEL_AATRACE, AATRACE_ARG_VIEWS,
+                             &wrap->buffers[KERNEL_RAYGEN][RAYGEN_ARG_VIEWS],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(wrap, KERNEL_AATRACE, AATRACE_ARG_SOFT_SHADOWS,
+                             &soft_shadows, sizeof(cl_uint));
+    cl_wrap_load_single_data(wrap, KERNEL_AATRACE, AATRACE_ARG_VIS_BRICKS, &vis_bricks,
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(wrap, KERNEL_AATRACE, AATRACE_ARG_VIS_CELLS, &vis_cells,
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(wrap, KERNEL_AATRACE, AATRACE_ARG_VIS_GRID,
+                             &s->visibility.grid, sizeof(rvis_grid));
+    for (cl_uint arg = AATRACE_ARG_MESHES; arg <= AATRACE_ARG_MESH_NODES; arg++) {
+        cl_wrap_load_single_data(wrap, KERNEL_AATRACE, arg, &no_mesh,
+                                 sizeof(cl_mem));
+    }
+    cl_wrap_load_single_data(wrap, KERNEL_AATRACE, AATRACE_ARG_MESH_NUM, &mesh_num,
+                             sizeof(cl_uint));
+
+    cl_uint denoise_passes = DENOISE_PASSES;
+
+    cl_wrap_load_pool_data(wrap, KERNEL_DENOISE, DENOISE_ARG_RAYS, s->rays);
+    cl_wrap_load_pool_data(wrap, KERNEL_DENOISE, DENOISE_ARG_PING, s->colors[0]);
+    cl_wrap_load_pool_data(wrap, KERNEL_DENOISE, DENOISE_ARG_PONG, s->colors[1]);
+    cl_wrap_load_pool_data(wrap, KERNEL_DENOISE, DENOISE_ARG_GBUFFER, s->gbuffer);
+    cl_wrap_load_single_data(wrap, KERNEL_DENOISE, DENOISE_ARG_PASSES, &denoise_passes,
+                             sizeof(cl_uint));
+    cl_wrap_load_pool_data(wrap, KERNEL_DENOISE, DENOISE_ARG_OUTPUT, s->output);
+
+    /* Same scene arguments as the raytracer, without a sorted order */
+    cl_mem no_order = NULL;
+    cl_uint use_order = 0;
+
+    cl_wrap_load_pool_data(wrap, KERNEL_SECONDARYTRACE, SECONDARYTRACE_ARG_SECONDARY,
+                           s->secondary);
+    cl_wrap_load_single_data(wrap, KERNEL_SECONDARYTRACE,
+                             SECONDARYTRACE_ARG_SECONDARY_NUM,
+                             &wrap->buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_SECONDARY_NUM],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(wrap, KERNEL_SECONDARYTRACE, SECONDARYTRACE_ARG_ORDER,
+                             &no_order, sizeof(cl_mem));
+    cl_wrap_load_single_data(wrap, KERNEL_SECONDARYTRACE, SECONDARYTRACE_ARG_USE_ORDER,
+                             &use_order, sizeof(cl_uint));
+    cl_wrap_load_single_data(wrap, KERNEL_SECONDARYTRACE, SECONDARYTRACE_ARG_SPHERES,
+                             &wrap->buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_SPHERES],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(wrap, KERNEL_SECONDARYTRACE, SECONDARYTRACE_ARG_PLANES,
+                             &wrap->buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_PLANES],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(wrap, KERNEL_SECONDARYTRACE, SECONDARYTRACE_ARG_LIGHTS,
+                             &wrap->buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_LIGHTS],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(wrap, KERNEL_SECONDARYTRACE, SECONDARYTRACE_ARG_SPHERES_NUM,
+                             &s->sphere_num, sizeof(cl_uint));
+    cl_wrap_load_single_data(wrap, KERNEL_SECONDARYTRACE, SECONDARYTRACE_ARG_PLANES_NUM,
+                             &s->plane_num, sizeof(cl_uint));
+    cl_wrap_load_single_data(wrap, KERNEL_SECONDARYTRACE, SECONDARYTRACE_ARG_LIGHT_NUM,
+                             &s->light_num, sizeof(cl_uint));
+    cl_wrap_load_single_data(wrap, KERNEL_SECONDARYTRACE, SECONDARYTRACE_ARG_IM_ARR,
+                             &wrap->buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_IM_ARR],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(wrap, KERNEL_SECONDARYTRACE, SECONDARYTRACE_ARG_SKYBOX,
+                             &wrap->buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_SKYBOX],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(wrap, KERNEL_SECONDARYTRACE, SECONDARYTRACE_ARG_LIGHT_ALIAS,
+                             &wrap->buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_LIGHT_ALIAS],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(wrap, KERNEL_SECONDARYTRACE,
+                             SECONDARYTRACE_ARG_LIGHT_SAMPLES, &light_samples,
+                             sizeof(cl_uint));
+    cl_wrap_load_single_data(wrap, KERNEL_SECONDARYTRACE,
+                             SECONDARYTRACE_ARG_SHADOW_SAMPLES,
+                             &wrap->buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_SHADOW_SAMPLES],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(wrap, KERNEL_SECONDARYTRACE, SECONDARYTRACE_ARG_SAMPLE_MASK,
+                             &sample_mask, sizeof(cl_uint));
+    cl_wrap_load_single_data(wrap, KERNEL_SECONDARYTRACE, SECONDARYTRACE_ARG_FRAME,
+                             &frame, sizeof(cl_uint));
+    cl_wrap_load_single_data(wrap, KERNEL_SECONDARYTRACE,
+                             SECONDARYTRACE_ARG_SOFT_SHADOWS, &soft_shadows,
+                             sizeof(cl_uint));
+    cl_wrap_load_single_data(wrap, KERNEL_SECONDARYTRACE, SECONDARYTRACE_ARG_TRACE_STATS,
+                             &no_trace_stats, sizeof(cl_mem));
+    cl_wrap_load_single_data(wrap, KERNEL_SECONDARYTRACE, SECONDARYTRACE_ARG_VIS_BRICKS,
+                             &vis_bricks, sizeof(cl_mem));
+    cl_wrap_load_single_data(wrap, KERNEL_SECONDARYTRACE, SECONDARYTRACE_ARG_VIS_CELLS,
+                             &vis_cells, sizeof(cl_mem));
+    cl_wrap_load_single_data(wrap, KERNEL_SECONDARYTRACE, SECONDARYTRACE_ARG_VIS_GRID,
+                             &s->visibility.grid, sizeof(rvis_grid));
+    for (cl_uint arg = SECONDARYTRACE_ARG_MESHES; arg <= SECONDARYTRACE_ARG_MESH_NODES;
+         arg++) {
+        cl_wrap_load_single_data(wrap, KERNEL_SECONDARYTRACE, arg, &no_mesh,
+                                 sizeof(cl_mem));
+    }
+    cl_wrap_load_single_data(wrap, KERNEL_SECONDARYTRACE, SECONDARYTRACE_ARG_MESH_NUM,
+                             &mesh_num, sizeof(cl_uint));
+
+    cl_wrap_load_pool_data(wrap, KERNEL_SECONDARYGATHER, SECONDARYGATHER_ARG_RAYS,
+                           s->rays);
+    cl_wrap_load_pool_data(wrap, KERNEL_SECONDARYGATHER, SECONDARYGATHER_ARG_SECONDARY,
+                           s->secondary);
+    cl_wrap_load_single_data(wrap, KERNEL_SECONDARYGATHER,
+                             SECONDARYGATHER_ARG_SECONDARY_NUM,
+                             &wrap->buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_SECONDARY_NUM],
+                             sizeof(cl_mem));
+    cl_wrap_load_pool_data(wrap, KERNEL_SECONDARYGATHER, SECONDARYGATHER_ARG_OUTPUT,
+                           s->output);
+
+    s->loaded = 1;
+    printf("Loaded scene %s\n", name);
+    return NULL;
+}
+
+/* Releases a loaded scene, or what a failed `load_scene` left behind */
+static void release_scene(rdaemon_scene *s) {
+    if (s->loaded) { cl_wrap_pool_report(&s->wrap); }
+    if (s->wrapped) { cl_wrap_release(&s->wrap); }
+
+    free(s->spheres);
+    free(s->planes);
+    free(s->lights);
+    free(s->light_alias);
+    free(s->shadow_samples);
+    free(s->occluder_cache);
+    rfree_visibility(&s->visibility);
+
+    s->loaded = 0;
+    s->wrapped = 0;
+}
+
+/* The loaded scene with the name, else the least recently used one released for it
+   to be loaded into */
+static rdaemon_scene* find_scene(const char *name) {
+    rdaemon_scene *lru = &scenes[0];
+
+    for (cl_uint i = 0; i < DAEMON_SCENES; i++) {
+        if (scenes[i].loaded && strcmp(scenes[i].name, name) == 0) {
+            scenes[i].last_used = ++scene_clock;
+            return &scenes[i];
+        }
+        if (!scenes[i].loaded ||
+            (lru->loaded && scenes[i].last_used < lru->last_used)) {
+            lru = &scenes[i];
+        }
+    }
+
+    if (lru->loaded) {
+        printf("Released scene %s\n", lru->name);
+        release_scene(lru);
+    }
+    lru->last_used = ++scene_clock;
+    return lru;
+}
+
+/* Sizes the per pixel buffers of the scene for a launch of `pixels` pixels, within
+   the largest launch so far they keep their memory */
+static void size_buffers(rdaemon_scene *s, cl_uint pixels) {
+    cl_wrap *wrap = &s->wrap;
+
+    if (pixels == s->pixels) { return; }
+    s->pixels = pixels;
+
+    cl_wrap_pool_resize(wrap, s->rays, sizeof(rpacked)*pixels);
+    cl_wrap_pool_resize(wrap, s->output, sizeof(cl_uint)*pixels);
+    cl_wrap_pool_resize(wrap, s->shadows, sizeof(rshadow)*SHADOW_SLOTS*pixels);
+    cl_wrap_pool_resize(wrap, s->shadow_nums, sizeof(cl_uint)*pixels);
+    cl_wrap_pool_resize(wrap, s->hit_ids, sizeof(cl_int)*pixels);
+    cl_wrap_pool_resize(wrap, s->gbuffer, sizeof(rgbuffer)*pixels);
+    cl_wrap_pool_resize(wrap, s->secondary, sizeof(rsecondary)*2*pixels);
+    cl_wrap_pool_resize(wrap, s->aa_list, sizeof(cl_uint)*pixels);
+    cl_wrap_pool_resize(wrap, s->colors[0], sizeof(cl_float4)*pixels);
+    cl_wrap_pool_resize(wrap, s->colors[1], sizeof(cl_float4)*pixels);
+}
+
+/* Renders the jobs, which all have the same resolution, as the views of one launch
+with the same passes as raypng into their `pixels`. Returns the reason if a camera
+has no view, NULL if they were rendered */
+static const char* render_views(rdaemon_scene *s, rdaemon_job **jobs, cl_uint views_num) {
+    cl_wrap *wrap = &s->wrap;
+
+    cl_uint pwidth  = jobs[0]->pwidth;
+    cl_uint pheight = jobs[0]->pheight;
+    cl_uint view_pixels = pwidth*pheight;
+    cl_uint pixels  = view_pixels*views_num;
+
+    rview views[DAEMON_BATCH];
+    for (cl_uint i = 0; i < views_num; i++) {
+        if (!rgen_view(&jobs[i]->camera, &views[i], pwidth, pheight)) {
+            return "direction along the y axis";
+        }
+    }
+
+    size_buffers(s, pixels);
+
+    cl_uint shadow_records = pixels*SHADOW_SLOTS;
+    cl_uint secondary_num = 0;
+    cl_uint aa_num = 0;
+
+    cl_wrap_update_global_data(wrap, KERNEL_RAYGEN, RAYGEN_ARG_VIEWS, views,
+                               sizeof(rview)*views_num);
+    cl_wrap_load_single_data(wrap, KERNEL_RAYGEN, RAYGEN_ARG_VIEWS_NUM, &views_num,
+                             sizeof(cl_uint));
+
+    cl_wrap_load_single_data(wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_TOTAL_SIZE, &pixels,
+                             sizeof(cl_uint));
+    cl_wrap_load_single_data(wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_PWIDTH, &pwidth,
+                             sizeof(cl_uint));
+    cl_wrap_update_global_data(wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_SECONDARY_NUM,
+                               &secondary_num, sizeof(cl_uint));
+
+    cl_wrap_load_single_data(wrap, KERNEL_SHADOWTEST, SHADOWTEST_ARG_TOTAL_SIZE,
+                             &shadow_records, sizeof(cl_uint));
+    cl_wrap_load_single_data(wrap, KERNEL_SHADOWGATHER, SHADOWGATHER_ARG_TOTAL_SIZE,
+                             &pixels, sizeof(cl_uint));
+
+    cl_wrap_load_single_data(wrap, KERNEL_AADETECT, AADETECT_ARG_PWIDTH, &pwidth,
+                             sizeof(cl_uint));
+    cl_wrap_load_single_data(wrap, KERNEL_AADETECT, AADETECT_ARG_PHEIGHT, &pheight,
+                             sizeof(cl_uint));
+    cl_wrap_load_single_data(wrap, KERNEL_AADETECT, AADETECT_ARG_VIEWS_NUM, &views_num,
+                             sizeof(cl_uint));
+
+    cl_wrap_load_single_data(wrap, KERNEL_DENOISE, DENOISE_ARG_PWIDTH, &pwidth,
+                             sizeof(cl_uint));
+    cl_wrap_load_single_data(wrap, KERNEL_DENOISE, DENOISE_ARG_PHEIGHT, &pheight,
+                             sizeof(cl_uint));
+    cl_wrap_load_single_data(wrap, KERNEL_DENOISE, DENOISE_ARG_VIEWS_NUM, &views_num,
+                             sizeof(cl_uint));
+
+    /* The views are stacked, every launch covers all of them */
+    cl_wrap_output_2d(wrap, pwidth, pheight*views_num, KERNEL_RAYGEN);
+    cl_wrap_output_2d(wrap, pwidth, pheight*views_num, KERNEL_RAYTRACER);
+
+    cl_wrap_read_global_data(wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_SECONDARY_NUM,
+                             &secondary_num, sizeof(cl_uint));
+    if (secondary_num) {
+        cl_wrap_output(wrap, secondary_num, 0, KERNEL_SECONDARYTRACE, 0, 0, NULL);
+        cl_wrap_output(wrap, secondary_num, 0, KERNEL_SECONDARYGATHER, 0, 0, NULL);
+    }
+
+    cl_wrap_output(wrap, shadow_records, 0, KERNEL_SHADOWTEST, 0, 0, NULL);
+    cl_wrap_output(wrap, pixels, 0, KERNEL_SHADOWGATHER, 0, 0, NULL);
+
+    for (cl_uint denoise_pass = 0; denoise_pass < DENOISE_PASSES; denoise_pass++) {
+        cl_wrap_load_single_data(wrap, KERNEL_DENOISE, DENOISE_ARG_PASS, &denoise_pass,
+                                 sizeof(cl_uint));
+        cl_wrap_output_2d(wrap, pwidth, pheight*views_num, KERNEL_DENOISE);
+    }
+
+    cl_wrap_update_global_data(wrap, KERNEL_AADETECT, AADETECT_ARG_AA_NUM, &aa_num,
+                               sizeof(cl_uint));
+    cl_wrap_output(wrap, pixels, 0, KERNEL_AADETECT, 0, 0, NULL);
+    cl_wrap_read_global_data(wrap, KERNEL_AADETECT, AADETECT_ARG_AA_NUM, &aa_num,
+                             sizeof(cl_uint));
+
+    cl_wrap_load_single_data(wrap, KERNEL_AATRACE, AATRACE_ARG_AA_NUM, &aa_num,
+                             sizeof(cl_uint));
+    if (aa_num) {
+        cl_wrap_output(wrap, aa_num, 0, KERNEL_AATRACE, 0, 0, NULL);
+    }
+
+    /* Every view is read straight into its job */
+    for (cl_uint i = 0; i < views_num; i++) {
+        cl_wrap_wait(cl_wrap_read_async(wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_OUTPUT,
+                                        sizeof(cl_uint)*i*view_pixels,
+                                        sizeof(cl_uint)*view_pixels, jobs[i]->pixels));
+    }
+    return NULL;
+}
+
+/* Moves the first job of `batch` and the later ones of the same resolution that fit
+   in the largest image with it to the front, returns their count */
+static cl_uint take_views(rdaemon_job **batch, cl_uint batch_num) {
+    cl_uint view_pixels = batch[0]->pwidth*batch[0]->pheight;
+    cl_uint max_views = DAEMON_MAX_WIDTH*DAEMON_MAX_HEIGHT/view_pixels;
+    cl_uint views_num = 1;
+
+    for (cl_uint i = 1; i < batch_num && views_num < max_views; i++) {
+        if (batch[i]->pwidth == batch[0]->pwidth &&
+            batch[i]->pheight == batch[0]->pheight) {
+            rdaemon_job *job = batch[i];
+            memmove(&batch[views_num+1], &batch[views_num],
+                    sizeof(rdaemon_job*)*(i-views_num));
+            batch[views_num++] = job;
+        }
+    }
+
+    return views_num;
+}
+
+/* Takes the oldest request and the queued ones for the same scene after it, so the
+   device renders them back to back without switching scenes */
+static cl_uint take_batch(rdaemon_job **batch) {
+    cl_uint batch_num = 0, kept = 0;
+
+    /* The queue is compacted over its first entry, so its scene is kept aside */
+    const rdaemon_job *first = queue[0];
+
+    for (cl_uint i = 0; i < queue_num; i++) {
+        if (batch_num < DAEMON_BATCH && strcmp(queue[i]->scene, first->scene) == 0) {
+            batch[batch_num++] = queue[i];
+        } else {
+            queue[kept++] = queue[i];
+        }
+    }
+
+    queue_num = kept;
+    return batch_num;
+}
+
+/* Takes the batches of a queue of mixed scenes and fails if one holds more than one
+   scene or a request is lost or taken twice. Run before the render thread starts */
+static void check_batches(void) {
+    static const char *scenes_of[] = {"a", "b", "b", "a", "c", "a", "b", "c", "c", "a"};
+    static rdaemon_job jobs[sizeof(scenes_of)/sizeof(scenes_of[0])];
+    rdaemon_job *batch[DAEMON_BATCH];
+    cl_uint jobs_num = sizeof(jobs)/sizeof(jobs[0]), taken = 0;
+
+    for (cl_uint i = 0; i < jobs_num; i++) {
+        strcpy(jobs[i].scene, scenes_of[i]);
+        jobs[i].done = 0;
+        queue[i] = &jobs[i];
+    }
+    queue_num = jobs_num;
+
+    while (queue_num) {
+        cl_uint batch_num = take_batch(batch);
+
+        for (cl_uint i = 0; i < batch_num; i++) {
+            if (strcmp(batch[i]->scene, batch[0]->scene) != 0 || batch[i]->done) {
+                printf("ERROR:\tA batch mixes the scenes %s and %s or repeats a "
+                       "request\n", batch[0]->scene, batch[i]->scene);
+                exit(1);
+            }
+            batch[i]->done = 1;
+        }
+        taken += batch_num;
+    }
+
+    if (taken != jobs_num) {
+        printf("ERROR:\tThe batches took %u of %u requests\n", taken, jobs_num);
+        exit(1);
+    }
+}
+
+/* Hands the jobs back to their connections, failed with `error` unless it is NULL */
+static void finish_jobs(rdaemon_job **jobs, cl_uint jobs_num, const char *error) {
+    pthread_mutex_lock(&lock);
+    for (cl_uint i = 0; i < jobs_num; i++) {
+        jobs[i]->error = error;
+        jobs[i]->done = 1;
+    }
+    pthread_cond_broadcast(&rendered);
+    pthread_mutex_unlock(&lock);
+}
+
+/* The only thread using OpenCL */
+static void* render_loop(void *arg) {
+    (void)arg;
+    /* Static as it is read after a jump back from an error of the wrapper */
+    static rdaemon_job *batch[DAEMON_BATCH];
+    jmp_buf failed;
+
+    for (;;) {
+        pthread_mutex_lock(&lock);
+        while (queue_num == 0) {
+            pthread_cond_wait(&queued, &lock);
+        }
+        cl_uint batch_num = take_batch(batch);
+        pthread_mutex_unlock(&lock);
+
+        rdaemon_scene *s = find_scene(batch[0]->scene);
+        volatile cl_uint finished = 0;
+
+        /* The wrapper printed the error. The jobs not handed back yet fail and the
+           scene is dropped, the device may have lost its buffers */
+        if (setjmp(failed)) {
+            cl_wrap_recover(NULL);
+            release_scene(s);
+            finish_jobs(&batch[finished], batch_num-finished, "render failed");
+            continue;
+        }
+        cl_wrap_recover(&failed);
+
+        const char *error = s->loaded ? NULL : load_scene(s, batch[0]->scene);
+        if (error) {
+            cl_wrap_recover(NULL);
+            release_scene(s);
+            finish_jobs(batch, batch_num, error);
+            continue;
+        }
+
+        /* The jobs of one resolution are rendered together in one launch and
+           handed back as soon as they are read back, their connections encode the
+           pngs while the device renders the next views */
+        while (finished < batch_num) {
+            cl_uint views_num = take_views(&batch[finished], batch_num-finished);
+            error = render_views(s, &batch[finished], views_num);
+            finish_jobs(&batch[finished], views_num, error);
+            finished += views_num;
+        }
+        cl_wrap_recover(NULL);
+    }
+
+    return NULL;
+}
+
+static int write_all(int fd, const void *data, size_t size) {
+    const char *bytes = data;
+
+    while (size > 0) {
+        ssize_t written = write(fd, bytes, size);
+        if (written < 0) {
+            if (errno == EINTR) { continue; }
+            return 0;
+        }
+        bytes += written;
+        size -= written;
+    }
+
+    return 1;
+}
+
+static int reply(int fd, const char *line) {
+    return write_all(fd, line, strlen(line));
+}
+
+static int compare_latency(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static int reply_stats(int fd) {
+    static double sorted[DAEMON_LATENCIES];
+    char line[DAEMON_LINE];
+
+    pthread_mutex_lock(&lock);
+    unsigned long total = latency_num;
+    cl_uint waiting = queue_num;
+    cl_uint n = total < DAEMON_LATENCIES ? total : DAEMON_LATENCIES;
+    memcpy(sorted, latencies, sizeof(double)*n);
+
+    qsort(sorted, n, sizeof(double), compare_latency);
+
+    if (n == 0) {
+        snprintf(line, sizeof(line), "requests 0 queued %u\n", waiting);
+    } else {
+        snprintf(line, sizeof(line),
+                 "requests %lu queued %u p50 %.2f p90 %.2f p99 %.2f max %.2f\n",
+                 total, waiting, sorted[(n-1)*50/100], sorted[(n-1)*90/100],
+                 sorted[(n-1)*99/100], sorted[n-1]);
+    }
+    pthread_mutex_unlock(&lock);
+
+    return reply(fd, line);
+}
+
+/* Parses a render request, returns the reason on error */
+static const char* parse_render(char *line, rdaemon_job *job) {
+    cl_float3 origin, dir;
+    cl_float fov;
+    int consumed = 0;
+
+    if (sscanf(line, "render %63s %u %u %f %f %f %f %f %f %f %n", job->scene,
+               &job->pwidth, &job->pheight, &origin.x, &origin.y, &origin.z,
+               &dir.x, &dir.y, &dir.z, &fov, &consumed) != 10 || line[consumed]) {
+        return "expected: render <scene> <width> <height> <x> <y> <z> "
+               "<dir x> <dir y> <dir z> <fov>";
+    }
+
+    /* Scene names are file names in scenes/, nothing that leaves the directory */
+    for (const char *c = job->scene; *c; c++) {
+        if (!(*c >= 'a' && *c <= 'z') && !(*c >= 'A' && *c <= 'Z') &&
+            !(*c >= '0' && *c <= '9') && *c != '_' && *c != '-') {
+            return "invalid scene name";
+        }
+    }
+
+    char filename[DAEMON_NAME+16];
+    snprintf(filename, sizeof(filename), "scenes/%s.map", job->scene);
+    if (access(filename, R_OK) != 0) {
+        return "unknown scene";
+    }
+
+    if (job->pwidth == 0 || job->pheight == 0 ||
+        job->pwidth > DAEMON_MAX_WIDTH || job->pheight > DAEMON_MAX_HEIGHT) {
+        return "resolution out of range";
+    }
+    if (!(fov > 0.0f && fov < 180.0f)) {
+        return "fov out of range";
+    }
+    if (!(dir.x*dir.x+dir.y*dir.y+dir.z*dir.z > 0.0f)) {
+        return "zero direction";
+    }
+
+    /* The view is made again when the request is rendered */
+    rview view;
+    job->camera = rinit_camera(origin, dir, fov, 1.0f);
+    if (!rgen_view(&job->camera, &view, job->pwidth, job->pheight)) {
+        return "direction along the y axis";
+    }
+    return NULL;
+}
+
+/* Queues the request, waits for the render thread and answers with the png */
+static int serve_render(int fd, char *line) {
+    rdaemon_job job = {.done = 0, .error = NULL};
+    gettimeofday(&job.arrival, NULL);
+
+    const char *error = parse_render(line, &job);
+    if (error) {
+        char answer[DAEMON_LINE];
+        snprintf(answer, sizeof(answer), "error %s\n", error);
+        return reply(fd, answer);
+    }
+
+    job.pixels = malloc(sizeof(cl_uint)*job.pwidth*job.pheight);
+    if (!job.pixels) {
+        return reply(fd, "error out of memory\n");
+    }
+
+    pthread_mutex_lock(&lock);
+    if (queue_num == DAEMON_QUEUE) {
+        pthread_mutex_unlock(&lock);
+        free(job.pixels);
+        return reply(fd, "error queue full\n");
+    }
+    queue[queue_num++] = &job;
+    pthread_cond_signal(&queued);
+
+    while (!job.done) {
+        pthread_cond_wait(&rendered, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+
+    if (job.error) {
+        char answer[DAEMON_LINE];
+        snprintf(answer, sizeof(answer), "error %s\n", job.error);
+        free(job.pixels);
+        return reply(fd, answer);
+    }
+
+    size_t size = 0;
+    unsigned char *png = png_encode(job.pixels, job.pwidth, job.pheight, &size);
+    free(job.pixels);
+    if (!png) {
+        return reply(fd, "error encoding failed\n");
+    }
+
+    struct timeval stop;
+    gettimeofday(&stop, NULL);
+
+    pthread_mutex_lock(&lock);
+    latencies[latency_num++ % DAEMON_LATENCIES] = relapsed_ms(&job.arrival, &stop);
+    pthread_mutex_unlock(&lock);
+
+    char answer[DAEMON_LINE];
+    snprintf(answer, sizeof(answer), "ok %zu\n", size);
+    int sent = reply(fd, answer) && write_all(fd, png, size);
+
+    free(png);
+    return sent;
+}
+
+static void* serve_connection(void *arg) {
+    int fd = *(int*)arg;
+    free(arg);
+
+    FILE *in = fdopen(fd, "r");
+    if (!in) {
+        close(fd);
+        return NULL;
+    }
+
+    char line[DAEMON_LINE];
+    while (fgets(line, sizeof(line), in)) {
+        line[strcspn(line, "\r\n")] = '\0';
+
+        int sent;
+        if (strncmp(line, "render ", 7) == 0) {
+            sent = serve_render(fd, line);
+        } else if (strcmp(line, "stats") == 0) {
+            sent = reply_stats(fd);
+        } else {
+            sent = reply(fd, "error unknown request\n");
+        }
+
+        if (!sent) {
+            break;
+        }
+    }
+
+    fclose(in);
+    return NULL;
+}
+
+int main() {
+    /* A client leaving before its answer must not end the daemon */
+    signal(SIGPIPE, SIG_IGN);
+
+    check_batches();
+
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server < 0) {
+        printf("ERROR:\tCould not create the socket\n");
+        exit(1);
+    }
+
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    strncpy(address.sun_path, DAEMON_SOCKET, sizeof(address.sun_path)-1);
+    unlink(DAEMON_SOCKET);
+
+    if (bind(server, (struct sockaddr*)&address, sizeof(address)) != 0 ||
+        listen(server, DAEMON_BACKLOG) != 0) {
+        printf("ERROR:\tCould not listen on %s\n", DAEMON_SOCKET);
+        exit(1);
+    }
+
+    pthread_t renderer;
+    if (pthread_create(&renderer, NULL, render_loop, NULL) != 0) {
+        printf("ERROR:\tCould not start the render thread\n");
+        exit(1);
+    }
+
+    printf("Listening on %s\n", DAEMON_SOCKET);
+    fflush(stdout);
+
+    for (;;) {
+        int client = accept(server, NULL, NULL);
+        if (client < 0) {
+            continue;
+        }
+
+        int *fd = malloc(sizeof(int));
+        if (!fd) {
+            close(client);
+            continue;
+        }
+        *fd = client;
+
+        pthread_t connection;
+        if (pthread_create(&connection, NULL, serve_connection, fd) != 0) {
+            close(client);
+            free(fd);
+            continue;
+        }
+        pthread_detach(connection);
+    }
+
+    return 0;
+}
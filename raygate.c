@@ -0,0 +1,104 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/* Image quality gate of the precision tiers. Every scene is rendered by raypng in
+   the exact and the fast tier, and the gate fails with exit code 1 if the fast
+   image of any scene falls below GATE_MIN_PSNR against the exact one. Run it from
+   the repository root like raypng, or pass the scenes to check as arguments */
+
+/* The renderer, run with the scene, the tier and an rgb output to stdout */
+#define GATE_RAYPNG "./raypng"
+
+/* Lowest PSNR of the fast tier in dB. 40 dB is a root mean square error of 2.55,
+   about two and a half 8 bit steps across the image; one step would be 48 dB */
+#define GATE_MIN_PSNR 40.0
+
+/* Scenes checked when none are given */
+static const char *gate_scenes[] = {
+    "scenes/render.map",
+    NULL
+};
+
+
+/* Renders the scene in the tier and returns its malloc'd 8 bit rgb frame, whose
+   byte count goes to `size`. NULL if raypng fails or writes no whole frame */
+static unsigned char* render(const char* scene, const char* tier, size_t* size) {
+    char            command[512];
+    unsigned char   *rgb = NULL;
+    size_t          capacity = 0, got;
+    FILE            *reader;
+
+
+    snprintf(command, sizeof(command), "%s '%s' %s rgb:-", GATE_RAYPNG, scene, tier);
+
+    /* raypng prints to stderr when its frame goes to stdout */
+    if ((reader = popen(command, "r")) == NULL) {
+        printf("ERROR:\tCannot run \"%s\"\n", command);
+        return NULL;
+    }
+
+    /* The rgb output has no header, the frame is all of it */
+    *size = 0;
+    do {
+        if (*size == capacity) {
+            capacity = capacity ? 2*capacity : 1 << 20;
+            rgb = realloc(rgb, capacity);
+        }
+        got = fread(rgb+*size, 1, capacity-*size, reader);
+        *size += got;
+    } while (got);
+
+    if (pclose(reader) != 0 || *size == 0 || *size % 3) {
+        printf("ERROR:\tNo whole rgb frame from \"%s\"\n", command);
+        free(rgb);
+        return NULL;
+    }
+
+    return rgb;
+}
+
+/* PSNR over all color channels in dB, infinite for the same images */
+static double psnr(unsigned char* exact, unsigned char* fast, size_t size) {
+    double error = 0.0;
+
+    for (size_t i = 0; i < size; i++) {
+        double d = (double)exact[i]-fast[i];
+        error += d*d;
+    }
+
+    if (error == 0.0) { return INFINITY; }
+    return 10.0*log10(255.0*255.0*size/error);
+}
+
+int main(int argc, char** argv) {
+    const char      **scenes = argc > 1 ? (const char**)argv+1 : gate_scenes;
+    unsigned char   *exact, *fast;
+    size_t          exact_size, fast_size;
+    int             failed = 0;
+
+
+    for (const char **scene = scenes; *scene; scene++) {
+        if ((exact = render(*scene, "exact", &exact_size)) == NULL) { exit(1); }
+        if ((fast = render(*scene, "fast", &fast_size)) == NULL) { exit(1); }
+
+        if (exact_size != fast_size) {
+            printf("ERROR:\tThe tiers rendered %s at different sizes\n", *scene);
+            exit(1);
+        }
+
+        double db = psnr(exact, fast, exact_size);
+        int passed = db >= GATE_MIN_PSNR;
+
+        printf("%-32s %8.2f dB  %s\n", *scene, db, passed ? "pass" : "FAIL");
+        failed |= !passed;
+
+        free(exact);
+        free(fast);
+    }
+
+    printf("Fast tier %s the %.1f dB gate\n", failed ? "fails" : "passes", GATE_MIN_PSNR);
+    return failed;
+}
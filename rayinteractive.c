@@ -1,11 +1,18 @@
+#include <string.h>
 #include <math.h>
 #include <sys/time.h>
 #include <CL/opencl.h>
 #include <MiniFB.h>
 
 #include "opencl_wrap.h"
+#include "opencl_reload.h"
 #include "cpu_ray.h"
+#include "cpu_kernels.h"
 #include "cpu_obj.h"
+#include "cpu_light.h"
+#include "cpu_visibility.h"
+#include "cpu_timeline.h"
+#include "cpu_sink.h"
 
 
 #define TITLE "Interactive Raytracer"
@@ -16,18 +23,96 @@
 #define CAMERA_SPEED 0.05f;
 #define MOVE_SPEED 0.1f
 
+/* Lights shaded per hit, picked by power. 0 shades every light */
+#define LIGHT_SAMPLES 0
+
+/* Shadow rays per pixel deferred to the shadow pass. 0 traces them inline */
+#define SHADOW_SLOTS 6
+/* Tiles sharing a last occluder entry in the shadow pass */
+#define SHADOW_CACHE_SIZE 4096
+/* Points in the soft shadow sample table, must be a power of two */
+#define SHADOW_SAMPLE_TABLE 4096
+
+/* A-trous denoiser passes over the colors. 0 disables the denoiser */
+#define DENOISE_PASSES 3
+/* Shadow rays per shaded light, one is enough when denoising */
+#define SOFT_SHADOWS 1
+
+/* Extra jittered rays traced for edge pixels. 0 disables anti-aliasing */
+#define AA_SAMPLES 4
+/* Luminance difference to a neighbour that makes a pixel an edge pixel */
+#define AA_THRESHOLD 0.1f
+
+/* 1 counts the ray segments and their intersection tests for the report every
+   100 frames, which takes two atomics per traced ray */
+#define COUNT_TRACE_STATS 1
+
+/* Reprojected pixels are retraced at least every this many frames. 0 traces every
+   pixel every frame */
+#define TEMPORAL_REFRESH 8
+
+/* Bounces followed per ray at most */
+#define MAX_DEPTH 15
+/* Rays whose weight in the pixel falls below this are ended, half of an 8 bit
+   step cannot change the output. 0 follows every ray to MAX_DEPTH */
+#define MIN_WEIGHT (1.0f/512.0f)
+/* 1 ends the rays below MIN_WEIGHT at random and weights up the survivors, which
+   keeps the image unbiased */
+#define ROULETTE 0
+
+/* 1 sorts the secondary rays by origin and direction before tracing them, 0 never
+   sorts and -1 sorts when it measures faster */
+#define SECONDARY_SORT -1
+/* Frames between two measurements of the sorted and unsorted secondary pass */
+#define SORT_PROBE_FRAMES 256
+
+/* Precision tier of the kernels, PRECISION_FAST builds them with fused multiply-adds
+   and native functions. Check it against PRECISION_EXACT on the scenes with raygate */
+#define PRECISION PRECISION_EXACT
+
+/* 1 stages the scene into each work group's local memory, 0 reads it from global
+   memory and -1 stages it when it fits the device's local memory */
+#define SCENE_STAGING -1
+
+/* 1 reads the light visibility of the static scene from a cache next to the scene
+   file, built first if the scene changed. Only the points near a shadow edge trace
+   shadow rays then. VISIBILITY_BRICKS sets the grid to 4x that many cells per axis */
+#define VISIBILITY_CACHE 1
+#define VISIBILITY_BRICKS 16
+
+/* 1 rebuilds the kernels in the background when a file in src/cl changes and
+   swaps them in between frames */
+#define HOT_RELOAD 1
+
+/* The temporal pass takes the view by value, cl_wrap keeps it for the rebuilds */
+_Static_assert(sizeof(rview) <= __MAX_ARG_SIZE, "rview does not fit a kept argument");
+
+/* Records every shown frame when set, like "y4m:-" to pipe them into an encoder
+   or "shm:/raytracer" for a viewer. See `rsink_open` for the outputs */
+#define RECORD NULL
+/* Frame rate noted in y4m recordings */
+#define RECORD_FPS 60
+
+/* File the timeline of the host stages and device commands is written to at exit,
+   open it in chrome://tracing or ui.perfetto.dev. NULL records nothing */
+#define TIMELINE_FILE NULL
+/* Latest spans kept for the timeline, the oldest frames drop out */
+#define TIMELINE_SPANS 65536
+
 
 rcamera camera;
 float X_ROT = M_PI_2;
 float Y_ROT = M_PI_2;
 
-/* Camera perspective values for ray generation */
-cl_float3 im_corner, camera_origin, up, right;
-cl_float  w_factor, h_factor;
+/* Camera perspective values for the ray generation and the temporal reprojection */
+rview     view;
 
 cl_wrap wrap;
 
 
+static long elapsed_us(struct timeval *start, struct timeval *stop) {
+    return (stop->tv_sec-start->tv_sec)*1000000L+(stop->tv_usec-start->tv_usec);
+}
 
 void camera_control(struct mfb_window *window, mfb_key key, mfb_key_mod mod,
                     bool isPressed) {
@@ -58,24 +143,24 @@ void camera_control(struct mfb_window *window, mfb_key key, mfb_key_mod mod,
         camera.pos_dir.origin.z -= MOVE_SPEED*camera.pos_dir.dir.z;
         break;
     case KB_KEY_A:
-        camera.pos_dir.origin.x -= MOVE_SPEED*right.x;
-        camera.pos_dir.origin.y -= MOVE_SPEED*right.y;
-        camera.pos_dir.origin.z -= MOVE_SPEED*right.z;
+        camera.pos_dir.origin.x -= MOVE_SPEED*view.right.x;
+        camera.pos_dir.origin.y -= MOVE_SPEED*view.right.y;
+        camera.pos_dir.origin.z -= MOVE_SPEED*view.right.z;
         break;
     case KB_KEY_D:
-        camera.pos_dir.origin.x += MOVE_SPEED*right.x;
-        camera.pos_dir.origin.y += MOVE_SPEED*right.y;
-        camera.pos_dir.origin.z += MOVE_SPEED*right.z;
+        camera.pos_dir.origin.x += MOVE_SPEED*view.right.x;
+        camera.pos_dir.origin.y += MOVE_SPEED*view.right.y;
+        camera.pos_dir.origin.z += MOVE_SPEED*view.right.z;
         break;
     case KB_KEY_SPACE:
-        camera.pos_dir.origin.x += MOVE_SPEED*up.x;
-        camera.pos_dir.origin.y += MOVE_SPEED*up.y;
-        camera.pos_dir.origin.z += MOVE_SPEED*up.z;
+        camera.pos_dir.origin.x += MOVE_SPEED*view.up.x;
+        camera.pos_dir.origin.y += MOVE_SPEED*view.up.y;
+        camera.pos_dir.origin.z += MOVE_SPEED*view.up.z;
         break;
     case KB_KEY_LEFT_SHIFT:
-        camera.pos_dir.origin.x -= MOVE_SPEED*up.x;
-        camera.pos_dir.origin.y -= MOVE_SPEED*up.y;
-        camera.pos_dir.origin.z -= MOVE_SPEED*up.z;
+        camera.pos_dir.origin.x -= MOVE_SPEED*view.up.x;
+        camera.pos_dir.origin.y -= MOVE_SPEED*view.up.y;
+        camera.pos_dir.origin.z -= MOVE_SPEED*view.up.z;
         break;
 
     default:
@@ -91,22 +176,27 @@ void camera_control(struct mfb_window *window, mfb_key key, mfb_key_mod mod,
     /* Normalized already so do not use rlookat */
     camera.pos_dir.dir = new_dir;
 
-    rgen_perspective(&camera, &im_corner, &camera_origin, &up, &right,
-                     &w_factor, &h_factor, WIDTH, HEIGHT);
-
-    /* Load the new generated perspective values*/
-    cl_wrap_load_single_data(&wrap, 0, 0, &im_corner, sizeof(cl_float3));
-    cl_wrap_load_single_data(&wrap, 0, 1, &camera_origin, sizeof(cl_float3));
-    cl_wrap_load_single_data(&wrap, 0, 2, &up, sizeof(cl_float3));
-    cl_wrap_load_single_data(&wrap, 0, 3, &right, sizeof(cl_float3));
-    cl_wrap_load_single_data(&wrap, 0, 4, &w_factor, sizeof(cl_float));
-    cl_wrap_load_single_data(&wrap, 0, 5, &h_factor, sizeof(cl_float));
+    /* Load the new generated perspective values, the anti-aliasing rays come from
+       the same camera */
+    rgen_view(&camera, &view, WIDTH, HEIGHT);
+    cl_wrap_update_global_data(&wrap, KERNEL_RAYGEN, RAYGEN_ARG_VIEWS, &view,
+                               sizeof(rview));
+    cl_wrap_load_single_data(&wrap, KERNEL_TEMPORAL, TEMPORAL_ARG_VIEW, &view,
+                             sizeof(rview));
 }
 
 int main() {
     cl_uint pwidth  = WIDTH;
     cl_uint pheight = HEIGHT;
 
+    if (TIMELINE_FILE) { rtimeline_start(TIMELINE_FILE, TIMELINE_SPANS); }
+
+    /* Opened first, a recording to stdout moves the prints to stderr */
+    rsink record;
+    if (RECORD && !rsink_open(&record, RECORD, WIDTH, HEIGHT, RECORD_FPS)) {
+        exit(1);
+    }
+
     /* Initialize the default camera looking into +Z*/
     camera = rinit_camera(
         (cl_float3){.x = 0.8f, .y = 2.5f, .z = -8.0f},
@@ -121,74 +211,800 @@ int main() {
 
     mfb_set_keyboard_callback(window, camera_control);
 
-    cl_uchar sphere_num, plane_num, light_num;
+    cl_uint  sphere_num, plane_num, light_num;
     rsphere *ext_spheres;
     rplane  *ext_planes;
     rlight  *ext_lights;
 
-    extract_robj("scenes/render.map", &ext_spheres, &sphere_num, &ext_planes, &plane_num,
-                    &ext_lights, &light_num);
+    if (!extract_robj("scenes/render.map", &ext_spheres, &sphere_num, &ext_planes,
+                      &plane_num, &ext_lights, &light_num)) {
+        printf("ERROR:\tCannot read the scene \"scenes/render.map\"\n");
+        exit(1);
+    }
+
+    cl_uint light_samples = LIGHT_SAMPLES;
+    rlight_alias *light_alias = rgen_light_alias(ext_lights, light_num);
 
-    cl_wrap_init(&wrap, CL_DEVICE_TYPE_GPU,
+    cl_float3 *shadow_samples = rgen_shadow_samples(SHADOW_SAMPLE_TABLE);
+    cl_uint sample_mask = SHADOW_SAMPLE_TABLE-1;
+    cl_uint frame = 0;
+    cl_uint soft_shadows = SOFT_SHADOWS;
+
+    char options[512] = "", staged_options[512];
+    rtrace_options(options, sizeof(options), MAX_DEPTH, MIN_WEIGHT, ROULETTE);
+    rprecision_options(options, sizeof(options), PRECISION);
+    strcpy(staged_options, options);
+    int staged = robj_options(staged_options, sizeof(staged_options), sphere_num,
+                              plane_num, light_num, cl_wrap_local_memory(CL_DEVICE_TYPE_GPU),
+                              SCENE_STAGING);
+
+    /* The kernels in the order of src/cpu_kernels.h */
+    cl_wrap_init(&wrap, CL_DEVICE_TYPE_GPU, staged_options,
                  "src/cl/raygen.cl", "raygen",
-                 "src/cl/raytracing.cl", "raytracer", NULL);
+                 "src/cl/raytracing.cl", "raytracer",
+                 "src/cl/shadowtest.cl", "shadowtest",
+                 "src/cl/shadowgather.cl", "shadowgather",
+                 "src/cl/aadetect.cl", "aadetect",
+                 "src/cl/aatrace.cl", "aatrace",
+                 "src/cl/denoise.cl", "denoise",
+                 "src/cl/secondarytrace.cl", "secondarytrace",
+                 "src/cl/secondarygather.cl", "secondarygather",
+                 "src/cl/secondarykey.cl", "secondarykey",
+                 "src/cl/sorthist.cl", "sorthist",
+                 "src/cl/sortscan.cl", "sortscan",
+                 "src/cl/sortscatter.cl", "sortscatter",
+                 "src/cl/temporal.cl", "temporal", NULL);
+
+    /* The compiler's own local memory can leave no room for the staged scene */
+    if (staged && cl_wrap_fit_local(&wrap, options)) { staged = 0; }
+    printf("Scene read from %s memory\n", staged ? "local" : "global");
 
 
-    rgen_perspective(&camera, &im_corner, &camera_origin, &up, &right,
-                     &w_factor, &h_factor, WIDTH, HEIGHT);    
+    rgen_view(&camera, &view, WIDTH, HEIGHT);
 
 
     cl_uint pixels = WIDTH*HEIGHT;
-    cl_uint ray_size = sizeof(rray)*pixels;
+    cl_uint ray_size = sizeof(rpacked)*pixels;
 
     cl_uint buffer_size = pixels*sizeof(cl_uint);
     cl_uint *buffer = malloc(buffer_size);
 
-    cl_wrap_load_single_data(&wrap, 0, 0, &im_corner, sizeof(cl_float3));
-    cl_wrap_load_single_data(&wrap, 0, 1, &camera_origin, sizeof(cl_float3));
-    cl_wrap_load_single_data(&wrap, 0, 2, &up, sizeof(cl_float3));
-    cl_wrap_load_single_data(&wrap, 0, 3, &right, sizeof(cl_float3));
-    cl_wrap_load_single_data(&wrap, 0, 4, &w_factor, sizeof(cl_float));
-    cl_wrap_load_single_data(&wrap, 0, 5, &h_factor, sizeof(cl_float));
-    cl_wrap_load_single_data(&wrap, 0, 6, &pwidth, sizeof(cl_uint));
-    cl_wrap_load_single_data(&wrap, 0, 7, &pheight, sizeof(cl_uint));
+    cl_uint views_num = 1;
 
-    cl_wrap_load_global_data(&wrap, 0, 8, NULL, ray_size, CL_MEM_READ_WRITE);
+    cl_wrap_load_global_data(&wrap, KERNEL_RAYGEN, RAYGEN_ARG_VIEWS, &view,
+                             sizeof(rview), CL_MEM_READ_ONLY);
+    cl_wrap_load_single_data(&wrap, KERNEL_RAYGEN, RAYGEN_ARG_VIEWS_NUM, &views_num,
+                             sizeof(cl_uint));
+
+    cl_wrap_load_global_data(&wrap, KERNEL_RAYGEN, RAYGEN_ARG_RAYS, NULL, ray_size,
+                             CL_MEM_READ_WRITE);
     
-    cl_wrap_load_single_data(&wrap, 1, 0, &wrap.buffers[0][8], sizeof(cl_mem));
-    cl_wrap_load_global_data(&wrap, 1, 1, ext_spheres, sizeof(rsphere)*sphere_num,
-                             CL_MEM_READ_ONLY);
-    cl_wrap_load_global_data(&wrap, 1, 2, ext_planes, sizeof(rplane)*plane_num,
-                             CL_MEM_READ_ONLY);
-    cl_wrap_load_global_data(&wrap, 1, 3, ext_lights, sizeof(rlight)*light_num,
-                             CL_MEM_READ_ONLY);
-    cl_wrap_load_single_data(&wrap, 1, 4, &sphere_num, sizeof(cl_uchar));
-    cl_wrap_load_single_data(&wrap, 1, 5, &plane_num, sizeof(cl_uchar));
-    cl_wrap_load_single_data(&wrap, 1, 6, &light_num, sizeof(cl_uchar));
-    cl_wrap_load_single_data(&wrap, 1, 7, &pixels, sizeof(cl_uint));
+    cl_wrap_load_single_data(&wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_RAYS,
+                             &wrap.buffers[KERNEL_RAYGEN][RAYGEN_ARG_RAYS],
+                             sizeof(cl_mem));
+    cl_wrap_load_global_data(&wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_SPHERES, ext_spheres,
+                             sizeof(rsphere)*sphere_num, CL_MEM_READ_ONLY);
+    cl_wrap_load_global_data(&wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_PLANES, ext_planes,
+                             sizeof(rplane)*plane_num, CL_MEM_READ_ONLY);
+    cl_wrap_load_global_data(&wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_LIGHTS, ext_lights,
+                             sizeof(rlight)*light_num, CL_MEM_READ_ONLY);
+    cl_wrap_load_single_data(&wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_SPHERES_NUM,
+                             &sphere_num, sizeof(cl_uint));
+    cl_wrap_load_single_data(&wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_PLANES_NUM,
+                             &plane_num, sizeof(cl_uint));
+    cl_wrap_load_single_data(&wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_LIGHT_NUM,
+                             &light_num, sizeof(cl_uint));
+    cl_wrap_load_single_data(&wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_TOTAL_SIZE, &pixels,
+                             sizeof(cl_uint));
 
-    cl_wrap_load_images(&wrap, 1, 8,  CL_MEM_COPY_HOST_PTR, 4, 
+    cl_wrap_load_images(&wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_IM_ARR,
+                        CL_MEM_COPY_HOST_PTR, 4,
                         "assets/cobblestone.png",
                         "assets/sand.png",
                         "assets/check.png",
                         "assets/grass.png");
 
-    cl_wrap_load_images(&wrap, 1, 9,  CL_MEM_COPY_HOST_PTR, 1, 
+    cl_wrap_load_images(&wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_SKYBOX,
+                        CL_MEM_COPY_HOST_PTR, 1,
                         "assets/bg/stormydays.png");
 
-    cl_wrap_load_global_data(&wrap, 1, 10, NULL, buffer_size, CL_MEM_WRITE_ONLY);
+    cl_wrap_load_global_data(&wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_OUTPUT, NULL,
+                             buffer_size, CL_MEM_WRITE_ONLY);
+
+    cl_wrap_load_global_data(&wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_LIGHT_ALIAS,
+                             light_alias, sizeof(rlight_alias)*light_num,
+                             CL_MEM_READ_ONLY);
+    cl_wrap_load_single_data(&wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_LIGHT_SAMPLES,
+                             &light_samples, sizeof(cl_uint));
+
+    /* Deferred shadow rays, a single dummy record when they are traced inline */
+    cl_uint shadow_slots = SHADOW_SLOTS;
+    cl_uint shadow_records = pixels*shadow_slots;
+    cl_uint shadow_size = sizeof(rshadow)*(shadow_records ? shadow_records : 1);
+    cl_uint shadow_num_size = sizeof(cl_uint)*(shadow_records ? pixels : 1);
+    cl_uint cache_size = SHADOW_CACHE_SIZE;
+
+    /* The occluder cache is kept between frames, neighbouring frames are shadowed
+       by the same objects */
+    cl_int *occluder_cache = malloc(sizeof(cl_int)*cache_size);
+    for (cl_uint i = 0; i < cache_size; i++) { occluder_cache[i] = -1; }
+
+    cl_wrap_load_global_data(&wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_SHADOW_RAYS, NULL,
+                             shadow_size, CL_MEM_READ_WRITE);
+    cl_wrap_load_global_data(&wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_SHADOW_NUM, NULL,
+                             shadow_num_size, CL_MEM_READ_WRITE);
+    cl_wrap_load_single_data(&wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_SHADOW_SLOTS,
+                             &shadow_slots, sizeof(cl_uint));
+    cl_wrap_load_global_data(&wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_SHADOW_SAMPLES,
+                             shadow_samples, sizeof(cl_float3)*SHADOW_SAMPLE_TABLE,
+                             CL_MEM_READ_ONLY);
+    cl_wrap_load_single_data(&wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_SAMPLE_MASK,
+                             &sample_mask, sizeof(cl_uint));
+    cl_wrap_load_single_data(&wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_FRAME, &frame,
+                             sizeof(cl_uint));
+    cl_wrap_load_global_data(&wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_HIT_IDS, NULL,
+                             sizeof(cl_int)*pixels, CL_MEM_READ_WRITE);
+    cl_wrap_load_global_data(&wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_GBUFFER, NULL,
+                             sizeof(rgbuffer)*pixels, CL_MEM_READ_WRITE);
+    cl_wrap_load_single_data(&wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_SOFT_SHADOWS,
+                             &soft_shadows, sizeof(cl_uint));
+
+    /* The raytracer only traces the pixels the temporal pass could not reuse */
+    cl_uint temporal_refresh = TEMPORAL_REFRESH;
+    cl_uint use_trace_list = temporal_refresh > 0;
+    cl_uint trace_num = 0;
+
+    cl_wrap_load_global_data(&wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_TRACE_LIST, NULL,
+                             sizeof(cl_uint)*pixels, CL_MEM_READ_WRITE);
+    cl_wrap_load_single_data(&wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_USE_TRACE_LIST,
+                             &use_trace_list, sizeof(cl_uint));
+
+    /* At most a reflected and a refracted ray per pixel go to the secondary pass */
+    cl_uint secondary_records = 2*pixels;
+    cl_uint secondary_num = 0;
+    cl_uint defer_secondary = 1;
+
+    cl_wrap_load_global_data(&wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_SECONDARY, NULL,
+                             sizeof(rsecondary)*secondary_records, CL_MEM_READ_WRITE);
+    cl_wrap_load_global_data(&wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_SECONDARY_NUM,
+                             &secondary_num, sizeof(cl_uint), CL_MEM_READ_WRITE);
+    cl_wrap_load_single_data(&wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_DEFER_SECONDARY,
+                             &defer_secondary, sizeof(cl_uint));
+    cl_wrap_load_single_data(&wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_PWIDTH, &pwidth,
+                             sizeof(cl_uint));
+
+    /* Ray segments and their intersection tests in the raytracer and the secondary
+       pass, 64 bits each as the kernels add them. NULL counts none */
+    cl_ulong trace_stats[TRACE_STATS] = {0};
+    cl_mem no_trace_stats = NULL;
+    if (COUNT_TRACE_STATS) {
+        cl_wrap_load_global_data(&wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_TRACE_STATS,
+                                 trace_stats, sizeof(trace_stats), CL_MEM_READ_WRITE);
+    } else {
+        cl_wrap_load_single_data(&wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_TRACE_STATS,
+                                 &no_trace_stats, sizeof(cl_mem));
+    }
+
+    /* Light visibility grid, the kernels trace every shadow ray without one */
+    rvisibility visibility = {0};
+    cl_mem vis_bricks = NULL, vis_cells = NULL;
+    if (VISIBILITY_CACHE) {
+        rgen_visibility(&visibility, "scenes/render.map", ext_spheres, sphere_num,
+                        ext_planes, plane_num, ext_lights, light_num,
+                        shadow_samples, VISIBILITY_BRICKS);
+
+        size_t bricks_size = sizeof(cl_uint)*visibility.grid.lights*
+                             VISIBILITY_BRICKS*VISIBILITY_BRICKS*VISIBILITY_BRICKS;
+        size_t cells_size  = VIS_BRICK_CELLS*
+                             (visibility.pool_num ? visibility.pool_num : 1);
+
+        cl_wrap_load_global_data(&wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_VIS_BRICKS,
+                                 visibility.bricks, bricks_size, CL_MEM_READ_ONLY);
+        cl_wrap_load_global_data(&wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_VIS_CELLS,
+                                 visibility.cells, cells_size, CL_MEM_READ_ONLY);
+        vis_bricks = wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_VIS_BRICKS];
+        vis_cells  = wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_VIS_CELLS];
+    } else {
+        cl_wrap_load_single_data(&wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_VIS_BRICKS,
+                                 &vis_bricks, sizeof(cl_mem));
+        cl_wrap_load_single_data(&wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_VIS_CELLS,
+                                 &vis_cells, sizeof(cl_mem));
+    }
+    cl_wrap_load_single_data(&wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_VIS_GRID,
+                             &visibility.grid, sizeof(rvis_grid));
+
+    /* No meshes are rendered here */
+    cl_mem no_mesh = NULL;
+    cl_uint mesh_num = 0;
+    for (cl_uint arg = RAYTRACER_ARG_MESHES; arg <= RAYTRACER_ARG_MESH_NODES; arg++) {
+        cl_wrap_load_single_data(&wrap, KERNEL_RAYTRACER, arg, &no_mesh,
+                                 sizeof(cl_mem));
+    }
+    cl_wrap_load_single_data(&wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_MESH_NUM, &mesh_num,
+                             sizeof(cl_uint));
+
+    cl_wrap_load_single_data(&wrap, KERNEL_SHADOWTEST, SHADOWTEST_ARG_SHADOW_RAYS,
+                             &wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_SHADOW_RAYS],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&wrap, KERNEL_SHADOWTEST, SHADOWTEST_ARG_SHADOW_NUM,
+                             &wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_SHADOW_NUM],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&wrap, KERNEL_SHADOWTEST, SHADOWTEST_ARG_SHADOW_SLOTS,
+                             &shadow_slots, sizeof(cl_uint));
+    cl_wrap_load_single_data(&wrap, KERNEL_SHADOWTEST, SHADOWTEST_ARG_SPHERES,
+                             &wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_SPHERES],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&wrap, KERNEL_SHADOWTEST, SHADOWTEST_ARG_PLANES,
+                             &wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_PLANES],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&wrap, KERNEL_SHADOWTEST, SHADOWTEST_ARG_SPHERES_NUM,
+                             &sphere_num, sizeof(cl_uint));
+    cl_wrap_load_single_data(&wrap, KERNEL_SHADOWTEST, SHADOWTEST_ARG_PLANES_NUM,
+                             &plane_num, sizeof(cl_uint));
+    cl_wrap_load_single_data(&wrap, KERNEL_SHADOWTEST, SHADOWTEST_ARG_TOTAL_SIZE,
+                             &shadow_records, sizeof(cl_uint));
+    cl_wrap_load_global_data(&wrap, KERNEL_SHADOWTEST, SHADOWTEST_ARG_OCCLUDER_CACHE,
+                             occluder_cache, sizeof(cl_int)*cache_size,
+                             CL_MEM_READ_WRITE);
+    cl_wrap_load_single_data(&wrap, KERNEL_SHADOWTEST, SHADOWTEST_ARG_CACHE_SIZE,
+                             &cache_size, sizeof(cl_uint));
+    for (cl_uint arg = SHADOWTEST_ARG_MESHES; arg <= SHADOWTEST_ARG_MESH_NODES; arg++) {
+        cl_wrap_load_single_data(&wrap, KERNEL_SHADOWTEST, arg, &no_mesh,
+                                 sizeof(cl_mem));
+    }
+    cl_wrap_load_single_data(&wrap, KERNEL_SHADOWTEST, SHADOWTEST_ARG_MESH_NUM,
+                             &mesh_num, sizeof(cl_uint));
+
+    cl_wrap_load_single_data(&wrap, KERNEL_SHADOWGATHER, SHADOWGATHER_ARG_RAYS,
+                             &wrap.buffers[KERNEL_RAYGEN][RAYGEN_ARG_RAYS],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&wrap, KERNEL_SHADOWGATHER, SHADOWGATHER_ARG_SHADOW_RAYS,
+                             &wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_SHADOW_RAYS],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&wrap, KERNEL_SHADOWGATHER, SHADOWGATHER_ARG_SHADOW_NUM,
+                             &wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_SHADOW_NUM],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&wrap, KERNEL_SHADOWGATHER, SHADOWGATHER_ARG_SHADOW_SLOTS,
+                             &shadow_slots, sizeof(cl_uint));
+    cl_wrap_load_single_data(&wrap, KERNEL_SHADOWGATHER, SHADOWGATHER_ARG_TOTAL_SIZE,
+                             &pixels, sizeof(cl_uint));
+    cl_wrap_load_single_data(&wrap, KERNEL_SHADOWGATHER, SHADOWGATHER_ARG_OUTPUT,
+                             &wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_OUTPUT],
+                             sizeof(cl_mem));
+
+    /* Anti-aliasing of the edge pixels */
+    cl_uint aa_samples = AA_SAMPLES;
+    cl_float aa_threshold = AA_THRESHOLD;
+    cl_uint aa_num = 0;
+    cl_ulong aa_total = 0;
+
+    cl_wrap_load_single_data(&wrap, KERNEL_AADETECT, AADETECT_ARG_RAYS,
+                             &wrap.buffers[KERNEL_RAYGEN][RAYGEN_ARG_RAYS],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&wrap, KERNEL_AADETECT, AADETECT_ARG_HIT_IDS,
+                             &wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_HIT_IDS],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&wrap, KERNEL_AADETECT, AADETECT_ARG_PWIDTH, &pwidth,
+                             sizeof(cl_uint));
+    cl_wrap_load_single_data(&wrap, KERNEL_AADETECT, AADETECT_ARG_PHEIGHT, &pheight,
+                             sizeof(cl_uint));
+    cl_wrap_load_single_data(&wrap, KERNEL_AADETECT, AADETECT_ARG_THRESHOLD,
+                             &aa_threshold, sizeof(cl_float));
+    cl_wrap_load_global_data(&wrap, KERNEL_AADETECT, AADETECT_ARG_AA_LIST, NULL,
+                             sizeof(cl_uint)*pixels, CL_MEM_READ_WRITE);
+    cl_wrap_load_global_data(&wrap, KERNEL_AADETECT, AADETECT_ARG_AA_NUM, &aa_num,
+                             sizeof(cl_uint), CL_MEM_READ_WRITE);
+    cl_wrap_load_single_data(&wrap, KERNEL_AADETECT, AADETECT_ARG_VIEWS_NUM, &views_num,
+                             sizeof(cl_uint));
+
+    /* Same scene arguments as the raytracer */
+    cl_wrap_load_single_data(&wrap, KERNEL_AATRACE, AATRACE_ARG_RAYS,
+                             &wrap.buffers[KERNEL_RAYGEN][RAYGEN_ARG_RAYS],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&wrap, KERNEL_AATRACE, AATRACE_ARG_SPHERES,
+                             &wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_SPHERES],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&wrap, KERNEL_AATRACE, AATRACE_ARG_PLANES,
+                             &wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_PLANES],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&wrap, KERNEL_AATRACE, AATRACE_ARG_LIGHTS,
+                             &wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_LIGHTS],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&wrap, KERNEL_AATRACE, AATRACE_ARG_SPHERES_NUM, &sphere_num,
+                             sizeof(cl_uint));
+    cl_wrap_load_single_data(&wrap, KERNEL_AATRACE, AATRACE_ARG_PLANES_NUM, &plane_num,
+                             sizeof(cl_uint));
+    cl_wrap_load_single_data(&wrap, KERNEL_AATRACE, AATRACE_ARG_LIGHT_NUM, &light_num,
+                             sizeof(cl_uint));
+    cl_wrap_load_single_data(&wrap, KERNEL_AATRACE, AATRACE_ARG_AA_NUM, &aa_num,
+                             sizeof(cl_uint));
+    cl_wrap_load_single_data(&wrap, KERNEL_AATRACE, AATRACE_ARG_IM_ARR,
+                             &wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_IM_ARR],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&wrap, KERNEL_AATRACE, AATRACE_ARG_SKYBOX,
+                             &wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_SKYBOX],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&wrap, KERNEL_AATRACE, AATRACE_ARG_OUTPUT,
+                             &wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_OUTPUT],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&wrap, KERNEL_AATRACE, AATRACE_ARG_LIGHT_ALIAS,
+                             &wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_LIGHT_ALIAS],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&wrap, KERNEL_AATRACE, AATRACE_ARG_LIGHT_SAMPLES,
+                             &light_samples, sizeof(cl_uint));
+    cl_wrap_load_single_data(&wrap, KERNEL_AATRACE, AATRACE_ARG_SHADOW_SAMPLES,
+                             &wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_SHADOW_SAMPLES],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&wrap, KERNEL_AATRACE, AATRACE_ARG_SAMPLE_MASK,
+                             &sample_mask, sizeof(cl_uint));
+    cl_wrap_load_single_data(&wrap, KERNEL_AATRACE, AATRACE_ARG_FRAME, &frame,
+                             sizeof(cl_uint));
+    cl_wrap_load_single_data(&wrap, KERNEL_AATRACE, AATRACE_ARG_AA_LIST,
+                             &wrap.buffers[KERNEL_AADETECT][AADETECT_ARG_AA_LIST],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&wrap, KERNEL_AATRACE, AATRACE_ARG_AA_SAMPLES, &aa_samples,
+                             sizeof(cl_uint));
+    cl_wrap_load_single_data(&wrap, KERNEL_AATRACE, AATRACE_ARG_VIEWS,
+                             &wrap.buffers[KERNEL_RAYGEN][RAYGEN_ARG_VIEWS],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&wrap, KERNEL_AATRACE, AATRACE_ARG_SOFT_SHADOWS,
+                             &soft_shadows, sizeof(cl_uint));
+    cl_wrap_load_single_data(&wrap, KERNEL_AATRACE, AATRACE_ARG_VIS_BRICKS, &vis_bricks,
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&wrap, KERNEL_AATRACE, AATRACE_ARG_VIS_CELLS, &vis_cells,
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&wrap, KERNEL_AATRACE, AATRACE_ARG_VIS_GRID,
+                             &visibility.grid, sizeof(rvis_grid));
+    for (cl_uint arg = AATRACE_ARG_MESHES; arg <= AATRACE_ARG_MESH_NODES; arg++) {
+        cl_wrap_load_single_data(&wrap, KERNEL_AATRACE, arg, &no_mesh,
+                                 sizeof(cl_mem));
+    }
+    cl_wrap_load_single_data(&wrap, KERNEL_AATRACE, AATRACE_ARG_MESH_NUM, &mesh_num,
+                             sizeof(cl_uint));
+
+    /* Denoiser ping-pong buffers */
+    cl_uint denoise_passes = DENOISE_PASSES;
+    cl_uint denoise_pass = 0;
+    cl_uint color_size = sizeof(cl_float4)*pixels;
+
+    cl_wrap_load_single_data(&wrap, KERNEL_DENOISE, DENOISE_ARG_RAYS,
+                             &wrap.buffers[KERNEL_RAYGEN][RAYGEN_ARG_RAYS],
+                             sizeof(cl_mem));
+    cl_wrap_load_global_data(&wrap, KERNEL_DENOISE, DENOISE_ARG_PING, NULL, color_size,
+                             CL_MEM_READ_WRITE);
+    cl_wrap_load_global_data(&wrap, KERNEL_DENOISE, DENOISE_ARG_PONG, NULL, color_size,
+                             CL_MEM_READ_WRITE);
+    cl_wrap_load_single_data(&wrap, KERNEL_DENOISE, DENOISE_ARG_GBUFFER,
+                             &wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_GBUFFER],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&wrap, KERNEL_DENOISE, DENOISE_ARG_PWIDTH, &pwidth,
+                             sizeof(cl_uint));
+    cl_wrap_load_single_data(&wrap, KERNEL_DENOISE, DENOISE_ARG_PHEIGHT, &pheight,
+                             sizeof(cl_uint));
+    cl_wrap_load_single_data(&wrap, KERNEL_DENOISE, DENOISE_ARG_PASS, &denoise_pass,
+                             sizeof(cl_uint));
+    cl_wrap_load_single_data(&wrap, KERNEL_DENOISE, DENOISE_ARG_PASSES, &denoise_passes,
+                             sizeof(cl_uint));
+    cl_wrap_load_single_data(&wrap, KERNEL_DENOISE, DENOISE_ARG_OUTPUT,
+                             &wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_OUTPUT],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&wrap, KERNEL_DENOISE, DENOISE_ARG_VIEWS_NUM, &views_num,
+                             sizeof(cl_uint));
+
+    /* Temporal reprojection, the history starts out empty */
+    cl_uint temporal_pass = 0;
+    cl_float4 *history = calloc(pixels, sizeof(cl_float4));
+    cl_int *history_hit = calloc(pixels, sizeof(cl_int));
+    cl_ulong traced = 0;
+
+    cl_wrap_load_single_data(&wrap, KERNEL_TEMPORAL, TEMPORAL_ARG_RAYS,
+                             &wrap.buffers[KERNEL_RAYGEN][RAYGEN_ARG_RAYS],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&wrap, KERNEL_TEMPORAL, TEMPORAL_ARG_GBUFFER,
+                             &wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_GBUFFER],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&wrap, KERNEL_TEMPORAL, TEMPORAL_ARG_HIT_IDS,
+                             &wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_HIT_IDS],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&wrap, KERNEL_TEMPORAL, TEMPORAL_ARG_SHADOW_NUM,
+                             &wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_SHADOW_NUM],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&wrap, KERNEL_TEMPORAL, TEMPORAL_ARG_SHADOW_SLOTS,
+                             &shadow_slots, sizeof(cl_uint));
+    cl_wrap_load_single_data(&wrap, KERNEL_TEMPORAL, TEMPORAL_ARG_OUTPUT,
+                             &wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_OUTPUT],
+                             sizeof(cl_mem));
+    cl_wrap_load_global_data(&wrap, KERNEL_TEMPORAL, TEMPORAL_ARG_HIST_COLOR, history,
+                             color_size, CL_MEM_READ_WRITE);
+    cl_wrap_load_global_data(&wrap, KERNEL_TEMPORAL, TEMPORAL_ARG_HIST_POS, history,
+                             color_size, CL_MEM_READ_WRITE);
+    cl_wrap_load_global_data(&wrap, KERNEL_TEMPORAL, TEMPORAL_ARG_HIST_HIT, history_hit,
+                             sizeof(cl_int)*pixels, CL_MEM_READ_WRITE);
+    cl_wrap_load_global_data(&wrap, KERNEL_TEMPORAL, TEMPORAL_ARG_REPROJ_DEPTH, NULL,
+                             sizeof(cl_uint)*pixels, CL_MEM_READ_WRITE);
+    cl_wrap_load_global_data(&wrap, KERNEL_TEMPORAL, TEMPORAL_ARG_REPROJ_COLOR, history,
+                             color_size, CL_MEM_READ_WRITE);
+    cl_wrap_load_global_data(&wrap, KERNEL_TEMPORAL, TEMPORAL_ARG_REPROJ_POS, history,
+                             color_size, CL_MEM_READ_WRITE);
+    cl_wrap_load_global_data(&wrap, KERNEL_TEMPORAL, TEMPORAL_ARG_REPROJ_HIT,
+                             history_hit, sizeof(cl_int)*pixels, CL_MEM_READ_WRITE);
+    cl_wrap_load_single_data(&wrap, KERNEL_TEMPORAL, TEMPORAL_ARG_TRACE_LIST,
+                             &wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_TRACE_LIST],
+                             sizeof(cl_mem));
+    cl_wrap_load_global_data(&wrap, KERNEL_TEMPORAL, TEMPORAL_ARG_TRACE_NUM, &trace_num,
+                             sizeof(cl_uint), CL_MEM_READ_WRITE);
+    cl_wrap_load_single_data(&wrap, KERNEL_TEMPORAL, TEMPORAL_ARG_VIEW, &view,
+                             sizeof(rview));
+    cl_wrap_load_single_data(&wrap, KERNEL_TEMPORAL, TEMPORAL_ARG_PASS, &temporal_pass,
+                             sizeof(cl_uint));
+    cl_wrap_load_single_data(&wrap, KERNEL_TEMPORAL, TEMPORAL_ARG_FRAME, &frame,
+                             sizeof(cl_uint));
+    cl_wrap_load_single_data(&wrap, KERNEL_TEMPORAL, TEMPORAL_ARG_REFRESH,
+                             &temporal_refresh, sizeof(cl_uint));
+
+    /* Sort keys of the secondary rays place their origins in the scene's box */
+    cl_float3 bounds_min, bounds_scale;
+    robj_bounds(ext_spheres, sphere_num, ext_lights, light_num,
+                &bounds_min, &bounds_scale);
+
+    cl_int  secondary_sort = SECONDARY_SORT;
+    cl_uint use_order = secondary_sort > 0;
+    cl_uint sort_blocks = (secondary_records+SORT_BLOCK-1)/SORT_BLOCK;
+    cl_uint shift = 0;
+    /* Secondary pass time per ray of the last measurement in ns, unsorted and
+       sorted, and the records of the frame both trace */
+    long    secondary_time[2] = {0, 0};
+    rsecondary *probe_records = NULL;
+    if (secondary_sort < 0) {
+        probe_records = malloc(sizeof(rsecondary)*secondary_records);
+    }
+
+    cl_wrap_load_single_data(&wrap, KERNEL_SECONDARYKEY, SECONDARYKEY_ARG_SECONDARY,
+                             &wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_SECONDARY],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&wrap, KERNEL_SECONDARYKEY, SECONDARYKEY_ARG_SECONDARY_NUM,
+                             &wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_SECONDARY_NUM],
+                             sizeof(cl_mem));
+    cl_wrap_load_global_data(&wrap, KERNEL_SECONDARYKEY, SECONDARYKEY_ARG_KEYS, NULL,
+                             sizeof(cl_uint)*secondary_records, CL_MEM_READ_WRITE);
+    cl_wrap_load_global_data(&wrap, KERNEL_SECONDARYKEY, SECONDARYKEY_ARG_ORDER, NULL,
+                             sizeof(cl_uint)*secondary_records, CL_MEM_READ_WRITE);
+    cl_wrap_load_single_data(&wrap, KERNEL_SECONDARYKEY, SECONDARYKEY_ARG_BOUNDS_MIN,
+                             &bounds_min, sizeof(cl_float3));
+    cl_wrap_load_single_data(&wrap, KERNEL_SECONDARYKEY, SECONDARYKEY_ARG_BOUNDS_SCALE,
+                             &bounds_scale, sizeof(cl_float3));
+
+    cl_wrap_load_single_data(&wrap, KERNEL_SORTHIST, SORTHIST_ARG_KEYS,
+                             &wrap.buffers[KERNEL_SECONDARYKEY][SECONDARYKEY_ARG_KEYS],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&wrap, KERNEL_SORTHIST, SORTHIST_ARG_SECONDARY_NUM,
+                             &wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_SECONDARY_NUM],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&wrap, KERNEL_SORTHIST, SORTHIST_ARG_SHIFT, &shift,
+                             sizeof(cl_uint));
+    cl_wrap_load_global_data(&wrap, KERNEL_SORTHIST, SORTHIST_ARG_HIST, NULL,
+                             sizeof(cl_uint)*SORT_BUCKETS*sort_blocks, CL_MEM_READ_WRITE);
+    cl_wrap_load_single_data(&wrap, KERNEL_SORTHIST, SORTHIST_ARG_BLOCKS, &sort_blocks,
+                             sizeof(cl_uint));
+
+    cl_wrap_load_single_data(&wrap, KERNEL_SORTSCAN, SORTSCAN_ARG_HIST,
+                             &wrap.buffers[KERNEL_SORTHIST][SORTHIST_ARG_HIST],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&wrap, KERNEL_SORTSCAN, SORTSCAN_ARG_BLOCKS, &sort_blocks,
+                             sizeof(cl_uint));
+
+    cl_wrap_load_single_data(&wrap, KERNEL_SORTSCATTER, SORTSCATTER_ARG_KEYS_IN,
+                             &wrap.buffers[KERNEL_SECONDARYKEY][SECONDARYKEY_ARG_KEYS],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&wrap, KERNEL_SORTSCATTER, SORTSCATTER_ARG_ORDER_IN,
+                             &wrap.buffers[KERNEL_SECONDARYKEY][SECONDARYKEY_ARG_ORDER],
+                             sizeof(cl_mem));
+    cl_wrap_load_global_data(&wrap, KERNEL_SORTSCATTER, SORTSCATTER_ARG_KEYS_OUT, NULL,
+                             sizeof(cl_uint)*secondary_records, CL_MEM_READ_WRITE);
+    cl_wrap_load_global_data(&wrap, KERNEL_SORTSCATTER, SORTSCATTER_ARG_ORDER_OUT, NULL,
+                             sizeof(cl_uint)*secondary_records, CL_MEM_READ_WRITE);
+    cl_wrap_load_single_data(&wrap, KERNEL_SORTSCATTER, SORTSCATTER_ARG_SECONDARY_NUM,
+                             &wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_SECONDARY_NUM],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&wrap, KERNEL_SORTSCATTER, SORTSCATTER_ARG_SHIFT, &shift,
+                             sizeof(cl_uint));
+    cl_wrap_load_single_data(&wrap, KERNEL_SORTSCATTER, SORTSCATTER_ARG_HIST,
+                             &wrap.buffers[KERNEL_SORTHIST][SORTHIST_ARG_HIST],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&wrap, KERNEL_SORTSCATTER, SORTSCATTER_ARG_BLOCKS,
+                             &sort_blocks, sizeof(cl_uint));
+
+    /* Same scene arguments as the raytracer */
+    cl_wrap_load_single_data(&wrap, KERNEL_SECONDARYTRACE, SECONDARYTRACE_ARG_SECONDARY,
+                             &wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_SECONDARY],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&wrap, KERNEL_SECONDARYTRACE,
+                             SECONDARYTRACE_ARG_SECONDARY_NUM,
+                             &wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_SECONDARY_NUM],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&wrap, KERNEL_SECONDARYTRACE, SECONDARYTRACE_ARG_ORDER,
+                             &wrap.buffers[KERNEL_SECONDARYKEY][SECONDARYKEY_ARG_ORDER],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&wrap, KERNEL_SECONDARYTRACE, SECONDARYTRACE_ARG_USE_ORDER,
+                             &use_order, sizeof(cl_uint));
+    cl_wrap_load_single_data(&wrap, KERNEL_SECONDARYTRACE, SECONDARYTRACE_ARG_SPHERES,
+                             &wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_SPHERES],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&wrap, KERNEL_SECONDARYTRACE, SECONDARYTRACE_ARG_PLANES,
+                             &wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_PLANES],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&wrap, KERNEL_SECONDARYTRACE, SECONDARYTRACE_ARG_LIGHTS,
+                             &wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_LIGHTS],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&wrap, KERNEL_SECONDARYTRACE,
+                             SECONDARYTRACE_ARG_SPHERES_NUM, &sphere_num,
+                             sizeof(cl_uint));
+    cl_wrap_load_single_data(&wrap, KERNEL_SECONDARYTRACE, SECONDARYTRACE_ARG_PLANES_NUM,
+                             &plane_num, sizeof(cl_uint));
+    cl_wrap_load_single_data(&wrap, KERNEL_SECONDARYTRACE, SECONDARYTRACE_ARG_LIGHT_NUM,
+                             &light_num, sizeof(cl_uint));
+    cl_wrap_load_single_data(&wrap, KERNEL_SECONDARYTRACE, SECONDARYTRACE_ARG_IM_ARR,
+                             &wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_IM_ARR],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&wrap, KERNEL_SECONDARYTRACE, SECONDARYTRACE_ARG_SKYBOX,
+                             &wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_SKYBOX],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&wrap, KERNEL_SECONDARYTRACE,
+                             SECONDARYTRACE_ARG_LIGHT_ALIAS,
+                             &wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_LIGHT_ALIAS],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&wrap, KERNEL_SECONDARYTRACE,
+                             SECONDARYTRACE_ARG_LIGHT_SAMPLES, &light_samples,
+                             sizeof(cl_uint));
+    cl_wrap_load_single_data(&wrap, KERNEL_SECONDARYTRACE,
+                             SECONDARYTRACE_ARG_SHADOW_SAMPLES,
+                             &wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_SHADOW_SAMPLES],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&wrap, KERNEL_SECONDARYTRACE,
+                             SECONDARYTRACE_ARG_SAMPLE_MASK, &sample_mask,
+                             sizeof(cl_uint));
+    cl_wrap_load_single_data(&wrap, KERNEL_SECONDARYTRACE, SECONDARYTRACE_ARG_FRAME,
+                             &frame, sizeof(cl_uint));
+    cl_wrap_load_single_data(&wrap, KERNEL_SECONDARYTRACE,
+                             SECONDARYTRACE_ARG_SOFT_SHADOWS, &soft_shadows,
+                             sizeof(cl_uint));
+    cl_wrap_load_single_data(&wrap, KERNEL_SECONDARYTRACE,
+                             SECONDARYTRACE_ARG_TRACE_STATS,
+                             COUNT_TRACE_STATS ?
+                             &wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_TRACE_STATS] :
+                             &no_trace_stats,
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&wrap, KERNEL_SECONDARYTRACE, SECONDARYTRACE_ARG_VIS_BRICKS,
+                             &vis_bricks, sizeof(cl_mem));
+    cl_wrap_load_single_data(&wrap, KERNEL_SECONDARYTRACE, SECONDARYTRACE_ARG_VIS_CELLS,
+                             &vis_cells, sizeof(cl_mem));
+    cl_wrap_load_single_data(&wrap, KERNEL_SECONDARYTRACE, SECONDARYTRACE_ARG_VIS_GRID,
+                             &visibility.grid, sizeof(rvis_grid));
+    for (cl_uint arg = SECONDARYTRACE_ARG_MESHES; arg <= SECONDARYTRACE_ARG_MESH_NODES;
+         arg++) {
+        cl_wrap_load_single_data(&wrap, KERNEL_SECONDARYTRACE, arg, &no_mesh,
+                                 sizeof(cl_mem));
+    }
+    cl_wrap_load_single_data(&wrap, KERNEL_SECONDARYTRACE, SECONDARYTRACE_ARG_MESH_NUM,
+                             &mesh_num, sizeof(cl_uint));
+
+    cl_wrap_load_single_data(&wrap, KERNEL_SECONDARYGATHER, SECONDARYGATHER_ARG_RAYS,
+                             &wrap.buffers[KERNEL_RAYGEN][RAYGEN_ARG_RAYS],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&wrap, KERNEL_SECONDARYGATHER,
+                             SECONDARYGATHER_ARG_SECONDARY,
+                             &wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_SECONDARY],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&wrap, KERNEL_SECONDARYGATHER,
+                             SECONDARYGATHER_ARG_SECONDARY_NUM,
+                             &wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_SECONDARY_NUM],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&wrap, KERNEL_SECONDARYGATHER, SECONDARYGATHER_ARG_OUTPUT,
+                             &wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_OUTPUT],
+                             sizeof(cl_mem));
+
+    struct timeval secondary_start, secondary_stop;
 
     struct mfb_timer* timer = mfb_timer_create();
 
+    cl_reload reload;
+    if (HOT_RELOAD) {
+        cl_reload_start(&reload, &wrap, "src/cl");
+    }
+
     while (mfb_wait_sync(window)) {
         int state;
 
-        cl_wrap_output(&wrap, WIDTH*HEIGHT, 0, 0, 0, 0, NULL);
-        /* Because we do not copy the ray memory buffer from the first kernel to the second,
-        we just say to read the ray buffer which is stored on the first kernel 8:th arg */
-        cl_wrap_output(&wrap, WIDTH*HEIGHT, buffer_size, 1, 1, 10, buffer);
+        rtimeline_begin("frame");
+        if (HOT_RELOAD && cl_reload_poll(&reload)) {
+            printf("Swapped in the rebuilt kernels\n");
+        }
+
+        if (temporal_refresh) {
+            /* Move the last frame into the new view before the rays are generated */
+            for (temporal_pass = 0; temporal_pass < 3; temporal_pass++) {
+                cl_wrap_load_single_data(&wrap, KERNEL_TEMPORAL, TEMPORAL_ARG_PASS,
+                                         &temporal_pass, sizeof(cl_uint));
+                cl_wrap_output(&wrap, WIDTH*HEIGHT, 0, KERNEL_TEMPORAL, 0, 0, NULL);
+            }
+        }
+        cl_wrap_output_2d(&wrap, WIDTH, HEIGHT, KERNEL_RAYGEN);
 
-        state = mfb_update_ex(window, buffer, WIDTH, HEIGHT);
+        secondary_num = 0;
+        cl_wrap_update_global_data(&wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_SECONDARY_NUM,
+                                   &secondary_num, sizeof(cl_uint));
+        if (temporal_refresh) {
+            /* Reuse what was reprojected and list the rest for the raytracer */
+            trace_num = 0;
+            temporal_pass = 3;
+            cl_wrap_update_global_data(&wrap, KERNEL_TEMPORAL, TEMPORAL_ARG_TRACE_NUM,
+                                       &trace_num, sizeof(cl_uint));
+            cl_wrap_load_single_data(&wrap, KERNEL_TEMPORAL, TEMPORAL_ARG_PASS,
+                                     &temporal_pass, sizeof(cl_uint));
+            cl_wrap_output(&wrap, WIDTH*HEIGHT, 0, KERNEL_TEMPORAL, 0, 0, NULL);
+            cl_wrap_read_global_data(&wrap, KERNEL_TEMPORAL, TEMPORAL_ARG_TRACE_NUM,
+                                     &trace_num, sizeof(cl_uint));
+
+            cl_wrap_load_single_data(&wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_TOTAL_SIZE,
+                                     &trace_num, sizeof(cl_uint));
+            if (trace_num) {
+                cl_wrap_output(&wrap, trace_num, 0, KERNEL_RAYTRACER, 0, 0, NULL);
+            }
+            traced += trace_num;
+        } else {
+            cl_wrap_output_2d(&wrap, WIDTH, HEIGHT, KERNEL_RAYTRACER);
+            traced += pixels;
+        }
+
+        /* The first frame of every probe period traces its secondary rays unsorted
+           and then again sorted from a copy of the records, the faster way is kept
+           until the next probe */
+        cl_wrap_read_global_data(&wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_SECONDARY_NUM,
+                                 &secondary_num, sizeof(cl_uint));
+        if (probe_records && frame % SORT_PROBE_FRAMES == 0 && secondary_num) {
+            size_t records_size = sizeof(rsecondary)*secondary_num;
+            cl_wrap_read_global_data(&wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_SECONDARY,
+                                     probe_records, records_size);
+            if (COUNT_TRACE_STATS) {
+                cl_wrap_read_global_data(&wrap, KERNEL_RAYTRACER,
+                                         RAYTRACER_ARG_TRACE_STATS, trace_stats,
+                                         sizeof(trace_stats));
+            }
+
+            for (cl_uint sorted = 0; sorted < 2; sorted++) {
+                /* The unsorted trace is undone, counters included */
+                if (sorted) {
+                    cl_wrap_update_global_data(&wrap, KERNEL_RAYTRACER,
+                                               RAYTRACER_ARG_SECONDARY, probe_records,
+                                               records_size);
+                    if (COUNT_TRACE_STATS) {
+                        cl_wrap_update_global_data(&wrap, KERNEL_RAYTRACER,
+                                                   RAYTRACER_ARG_TRACE_STATS,
+                                                   trace_stats, sizeof(trace_stats));
+                    }
+                }
+                cl_wrap_load_single_data(&wrap, KERNEL_SECONDARYTRACE,
+                                         SECONDARYTRACE_ARG_USE_ORDER, &sorted,
+                                         sizeof(cl_uint));
+
+                gettimeofday(&secondary_start, NULL);
+                if (sorted) {
+                    rsort_secondary(&wrap, secondary_num);
+                }
+                cl_wrap_output(&wrap, secondary_num, 0, KERNEL_SECONDARYTRACE, 0, 0,
+                               NULL);
+                gettimeofday(&secondary_stop, NULL);
+                secondary_time[sorted] = 1000*elapsed_us(&secondary_start,
+                                                         &secondary_stop)/secondary_num;
+            }
+            cl_wrap_output(&wrap, secondary_num, 0, KERNEL_SECONDARYGATHER, 0, 0, NULL);
+
+            /* The records hold the sorted trace, the next frames follow the faster */
+            use_order = secondary_time[1] < secondary_time[0];
+            printf("Secondary pass: %ld ns/ray unsorted, %ld ns/ray sorted, %s\n",
+                   secondary_time[0], secondary_time[1],
+                   use_order ? "sorting" : "not sorting");
+
+        } else if (secondary_num) {
+            cl_wrap_load_single_data(&wrap, KERNEL_SECONDARYTRACE,
+                                     SECONDARYTRACE_ARG_USE_ORDER, &use_order,
+                                     sizeof(cl_uint));
+            if (use_order) {
+                rsort_secondary(&wrap, secondary_num);
+            }
+            cl_wrap_output(&wrap, secondary_num, 0, KERNEL_SECONDARYTRACE, 0, 0, NULL);
+            cl_wrap_output(&wrap, secondary_num, 0, KERNEL_SECONDARYGATHER, 0, 0, NULL);
+        }
+        if (shadow_records) {
+            cl_wrap_output(&wrap, shadow_records, 0, KERNEL_SHADOWTEST, 0, 0, NULL);
+            cl_wrap_output(&wrap, WIDTH*HEIGHT, 0, KERNEL_SHADOWGATHER, 0, 0, NULL);
+        }
+        for (denoise_pass = 0; denoise_pass < denoise_passes; denoise_pass++) {
+            cl_wrap_load_single_data(&wrap, KERNEL_DENOISE, DENOISE_ARG_PASS,
+                                     &denoise_pass, sizeof(cl_uint));
+            cl_wrap_output_2d(&wrap, WIDTH, HEIGHT, KERNEL_DENOISE);
+        }
+        if (aa_samples) {
+            /* Compact the edge pixels and trace the extra rays only for them */
+            aa_num = 0;
+            cl_wrap_update_global_data(&wrap, KERNEL_AADETECT, AADETECT_ARG_AA_NUM,
+                                       &aa_num, sizeof(cl_uint));
+            cl_wrap_output(&wrap, WIDTH*HEIGHT, 0, KERNEL_AADETECT, 0, 0, NULL);
+            cl_wrap_read_global_data(&wrap, KERNEL_AADETECT, AADETECT_ARG_AA_NUM,
+                                     &aa_num, sizeof(cl_uint));
+
+            cl_wrap_load_single_data(&wrap, KERNEL_AATRACE, AATRACE_ARG_AA_NUM, &aa_num,
+                                     sizeof(cl_uint));
+            if (aa_num) {
+                cl_wrap_output(&wrap, aa_num, 0, KERNEL_AATRACE, 0, 0, NULL);
+            }
+            aa_total += aa_num;
+        }
+        if (temporal_refresh) {
+            /* Keep the finished frame as the next frame's history */
+            temporal_pass = 4;
+            cl_wrap_load_single_data(&wrap, KERNEL_TEMPORAL, TEMPORAL_ARG_PASS,
+                                     &temporal_pass, sizeof(cl_uint));
+            cl_wrap_output(&wrap, WIDTH*HEIGHT, 0, KERNEL_TEMPORAL, 0, 0, NULL);
+        }
+        /* Every pass writes its packed colors to the raytracer's 10:th arg. A
+           recorded frame is read straight into the recording */
+        cl_uint *shown = RECORD ? rsink_frame(&record) : buffer;
+        cl_wrap_read_global_data(&wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_OUTPUT, shown,
+                                 buffer_size);
+
+        rtimeline_begin("present");
+        state = mfb_update_ex(window, shown, WIDTH, HEIGHT);
+        rtimeline_end();
+
+        if (RECORD && !rsink_submit(&record)) {
+            printf("ERROR:\tCannot write the frame to %s\n", record.path);
+            exit(1);
+        }
+        rtimeline_end();
+
+        /* Move on to the next run of shadow samples */
+        frame++;
+        cl_wrap_load_single_data(&wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_FRAME, &frame,
+                                 sizeof(cl_uint));
+        cl_wrap_load_single_data(&wrap, KERNEL_AATRACE, AATRACE_ARG_FRAME, &frame,
+                                 sizeof(cl_uint));
+        cl_wrap_load_single_data(&wrap, KERNEL_TEMPORAL, TEMPORAL_ARG_FRAME, &frame,
+                                 sizeof(cl_uint));
+        cl_wrap_load_single_data(&wrap, KERNEL_SECONDARYTRACE, SECONDARYTRACE_ARG_FRAME,
+                                 &frame, sizeof(cl_uint));
+
+        if (frame % 100 == 0) {
+            if (temporal_refresh) {
+                printf("Traced %.1f%% of the pixels in the last 100 frames\n",
+                       100.0*traced/(100.0*pixels));
+            }
+            if (COUNT_TRACE_STATS) {
+                cl_wrap_read_global_data(&wrap, KERNEL_RAYTRACER,
+                                         RAYTRACER_ARG_TRACE_STATS, trace_stats,
+                                         sizeof(trace_stats));
+                printf("Average depth: %.2f segments per traced pixel\n",
+                       (double)trace_stats[TRACE_STAT_SEGMENTS]/traced);
+                printf("Intersection tests: %.1f per traced pixel, %.1f per segment\n",
+                       (double)trace_stats[TRACE_STAT_TESTS]/traced,
+                       (double)trace_stats[TRACE_STAT_TESTS]/
+                       (double)(trace_stats[TRACE_STAT_SEGMENTS] ?
+                                trace_stats[TRACE_STAT_SEGMENTS] : 1));
+
+                memset(trace_stats, 0, sizeof(trace_stats));
+                cl_wrap_update_global_data(&wrap, KERNEL_RAYTRACER,
+                                           RAYTRACER_ARG_TRACE_STATS, trace_stats,
+                                           sizeof(trace_stats));
+            }
+            if (aa_samples) {
+                printf("Anti-aliasing: %.1f edge pixels and %.1f extra rays per frame "
+                       "(%.1f%% of %ux supersampling)\n", aa_total/100.0,
+                       aa_total*aa_samples/100.0, 100.0*aa_total/(100.0*pixels),
+                       aa_samples+1);
+            }
+            traced = 0;
+            aa_total = 0;
+        }
 
         if (state < 0) {
             window = NULL;
@@ -198,12 +1014,27 @@ int main() {
 
     mfb_timer_destroy(timer);
 
+    if (HOT_RELOAD) {
+        cl_reload_stop(&reload);
+    }
+
     /* Release the OpenCL program */
     cl_wrap_release(&wrap);
 
+    if (RECORD) {
+        rsink_close(&record);
+    }
+
     free(ext_spheres);
     free(ext_planes);
     free(ext_lights);
+    free(light_alias);
+    free(occluder_cache);
+    free(shadow_samples);
+    free(probe_records);
+    rfree_visibility(&visibility);
+    free(history);
+    free(history_hit);
     free(buffer);
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,170 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/time.h>
+#include <CL/opencl.h>
+#include "cpu_mesh.h"
+
+
+/* Converts a Wavefront OBJ model into the binary mesh file the renderers map, see
+   `rmesh_header`. Only the vertex positions and the faces are kept, polygons are
+   split into fans of triangles, and the hierarchy the kernels trace the triangles
+   with is built here once. Usage: raymesh <model.obj> <model.mesh> */
+
+/* Vertices and triangles the arrays first grow to */
+#define FIRST_CAPACITY 65536
+
+
+/* Three columns of equally sized items growing together */
+typedef struct {
+    void        *columns[3];
+    size_t      item;
+    size_t      num, capacity;
+} rcolumns;
+
+static void grow(rcolumns* c) {
+    if (c->num < c->capacity) { return; }
+
+    /* The kernels index them with 32 bits */
+    if (c->num >= UINT32_MAX) {
+        printf("ERROR:\tThe model has %u or more vertices or triangles\n", UINT32_MAX);
+        exit(1);
+    }
+
+    c->capacity = c->capacity ? 2*c->capacity : FIRST_CAPACITY;
+    if (c->capacity > UINT32_MAX) { c->capacity = UINT32_MAX; }
+
+    for (int i = 0; i < 3; i++) {
+        if ((c->columns[i] = realloc(c->columns[i], c->item*c->capacity)) == NULL) {
+            printf("ERROR:\tOut of memory at %zu vertices or triangles\n", c->num);
+            exit(1);
+        }
+    }
+}
+
+/* Vertex of a face corner like "7", "7/2", "7//3" or "-1/2/3". Negative ones count
+   back from the latest vertex. Returns 0 if it is not a vertex in range */
+static int corner(const char** cursor, size_t vertex_num, cl_uint* index) {
+    char *end;
+    long i = strtol(*cursor, &end, 10);
+
+    if (end == *cursor) { return 0; }
+
+    /* The texture and normal references are skipped */
+    while (*end && *end != ' ' && *end != '\t' && *end != '\r' && *end != '\n') {
+        end++;
+    }
+    *cursor = end;
+
+    i = (i < 0) ? (long)vertex_num+i : i-1;
+    if (i < 0 || (size_t)i >= vertex_num) { return 0; }
+
+    *index = i;
+    return 1;
+}
+
+int main(int argc, char** argv) {
+    FILE            *reader;
+    char            *line = NULL;
+    size_t          line_size = 0;
+    size_t          line_num = 0;
+    rcolumns        vertices = {.item = sizeof(cl_float)};
+    rcolumns        triangles = {.item = sizeof(cl_uint)};
+    struct timeval  start, stop;
+
+
+    if (argc != 3) {
+        printf("Usage:\t%s <model.obj> <model.mesh>\n", argv[0]);
+        exit(1);
+    }
+
+    if ((reader = fopen(argv[1], "r")) == NULL) {
+        printf("ERROR:\tCannot open \"%s\"\n", argv[1]);
+        exit(1);
+    }
+
+    gettimeofday(&start, NULL);
+    while (getline(&line, &line_size, reader) > 0) {
+        const char *cursor = line+1;
+        line_num++;
+
+        if (line[0] == 'v' && (line[1] == ' ' || line[1] == '\t')) {
+            char *end;
+
+            grow(&vertices);
+            for (int a = 0; a < 3; a++) {
+                ((cl_float*)vertices.columns[a])[vertices.num] = strtof(cursor, &end);
+                if (end == cursor) {
+                    printf("ERROR:\tVertex without 3 coordinates on line %zu\n", line_num);
+                    exit(1);
+                }
+                cursor = end;
+            }
+            vertices.num++;
+
+        } else if (line[0] == 'f' && (line[1] == ' ' || line[1] == '\t')) {
+            cl_uint first = 0, previous = 0, next;
+            int corners = 0;
+
+            /* Fan of triangles around the first corner */
+            while (*cursor) {
+                while (*cursor == ' ' || *cursor == '\t') { cursor++; }
+                if (*cursor == '\0' || *cursor == '\r' || *cursor == '\n') { break; }
+
+                if (!corner(&cursor, vertices.num, &next)) {
+                    printf("ERROR:\tFace with a vertex out of range on line %zu\n",
+                           line_num);
+                    exit(1);
+                }
+
+                if (corners >= 2) {
+                    grow(&triangles);
+                    ((cl_uint*)triangles.columns[0])[triangles.num] = first;
+                    ((cl_uint*)triangles.columns[1])[triangles.num] = previous;
+                    ((cl_uint*)triangles.columns[2])[triangles.num] = next;
+                    triangles.num++;
+                }
+
+                if (corners == 0) { first = next; }
+                previous = next;
+                corners++;
+            }
+
+            if (corners < 3) {
+                printf("ERROR:\tFace with fewer than 3 vertices on line %zu\n", line_num);
+                exit(1);
+            }
+        }
+    }
+    fclose(reader);
+    free(line);
+
+    size_t node_capacity = triangles.num ? 2*triangles.num-1 : 1;
+    rmesh_node *nodes = malloc(sizeof(rmesh_node)*node_capacity);
+    if (nodes == NULL) {
+        printf("ERROR:\tOut of memory for the hierarchy of %zu triangles\n",
+               triangles.num);
+        exit(1);
+    }
+    cl_uint node_num = rbuild_mesh_bvh(nodes, (const cl_float**)vertices.columns,
+                                       (cl_uint**)triangles.columns, triangles.num);
+
+    if (!dump_rmesh(argv[2], (const cl_float**)vertices.columns, vertices.num,
+                    (const cl_uint**)triangles.columns, triangles.num, nodes, node_num)) {
+        printf("ERROR:\tCannot write \"%s\"\n", argv[2]);
+        exit(1);
+    }
+    gettimeofday(&stop, NULL);
+
+    printf("%zu vertices, %zu triangles and %u hierarchy nodes written to %s in %ld ms\n",
+           vertices.num, triangles.num, node_num, argv[2],
+           (stop.tv_sec-start.tv_sec)*1000+(stop.tv_usec-start.tv_usec)/1000);
+
+    for (int i = 0; i < 3; i++) {
+        free(vertices.columns[i]);
+        free(triangles.columns[i]);
+    }
+    free(nodes);
+    return 0;
+}
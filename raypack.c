@@ -0,0 +1,142 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <CL/opencl.h>
+#include "cpu_ray.h"
+
+
+/* Error check of the compressed rays, on the CPU. Random rays go through
+   `rpack_ray` and `runpack_ray`, which mirror `pack_ray` and `unpack_ray` of
+   src/cl/primitives.cl, and the check fails with exit code 1 if a field comes
+   back further off than its bound below. Printed are the largest errors found */
+
+/* Random rays checked */
+#define RAYS            (1 << 20)
+
+/* Largest angle in radians between a direction and its unpacked one. The 16 bit
+   octahedral grid has a step of 2/65535, rounding both coordinates moves a point
+   up to 2.2e-5 on the octahedron and the mapping onto the sphere stretches that
+   threefold at the face centres, 6.5e-5 */
+#define DIR_MAX_ANGLE   7e-5
+/* Largest distance of an unpacked direction from unit length */
+#define DIR_MAX_LENGTH  1e-6
+
+/* Largest error of the half precision colors relative to the value, a half keeps
+   11 significant bits and rounds to the nearest, so half a unit in the last place */
+#define HALF_MAX_RELATIVE   (1.0/2048.0)
+/* Below the smallest normal half, 2^-14, the step is fixed at 2^-24 */
+#define HALF_MIN_NORMAL     (1.0/16384.0)
+#define HALF_MAX_ABSOLUTE   (1.0/33554432.0)
+/* Largest finite half, values rounding above it become infinity */
+#define HALF_MAX            65504.0
+
+
+static cl_uint state = 2463534242u;
+
+/* Uniform in [0, 1) */
+static double uniform(void) {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state/4294967296.0;
+}
+
+/* Uniform on the unit sphere */
+static cl_float3 random_dir(void) {
+    double z = 1.0-2.0*uniform();
+    double r = sqrt(fmax(0.0, 1.0-z*z));
+    double phi = 2.0*M_PI*uniform();
+    return (cl_float3){.x = r*cos(phi), .y = r*sin(phi), .z = z};
+}
+
+/* Colors and throughputs over the subnormal and normal halfs and past them */
+static cl_float random_color(void) {
+    if (uniform() < 0.01) { return 0.0f; }
+    return (cl_float)exp2(-26.0+44.0*uniform());
+}
+
+/* Error of the half `got` for the float `want`, in units of its bound. Above 1
+   fails */
+static double half_error(cl_float want, cl_float got) {
+    if (want > HALF_MAX*(1.0+HALF_MAX_RELATIVE/2)) {
+        return isinf(got) ? 0.0 : INFINITY;
+    }
+    if (want < HALF_MIN_NORMAL) { return fabs(got-want)/HALF_MAX_ABSOLUTE; }
+    return fabs(got-want)/(want*HALF_MAX_RELATIVE);
+}
+
+int main(void) {
+    double      dir_angle = 0.0, dir_length = 0.0, color = 0.0;
+    cl_uint     failed = 0;
+    cl_float3   edges[] = {{.x = 1, .y = 0, .z = 0}, {.x = -1, .y = 0, .z = 0},
+                           {.x = 0, .y = 1, .z = 0}, {.x = 0, .y = -1, .z = 0},
+                           {.x = 0, .y = 0, .z = 1}, {.x = 0, .y = 0, .z = -1},
+                           {.x = 0.57735027f, .y = 0.57735027f, .z = -0.57735027f},
+                           {.x = -0.57735027f, .y = 0.57735027f, .z = -0.57735027f},
+                           {.x = 0.70710678f, .y = -0.70710678f, .z = 0}};
+    cl_uint     edge_num = sizeof(edges)/sizeof(edges[0]);
+
+
+    for (cl_uint i = 0; i < RAYS+edge_num; i++) {
+        rray ray;
+        ray.origin  = (cl_float3){.x = uniform()*200.0-100.0, .y = uniform()*200.0-100.0,
+                                  .z = uniform()*200.0-100.0};
+        ray.dir     = (i < edge_num) ? edges[i] : random_dir();
+        ray.rgb     = (cl_float3){.x = random_color(), .y = random_color(),
+                                  .z = random_color()};
+        ray.depth   = i & RPACKED_DEPTH_MASK;
+
+        rray back = runpack_ray(rpack_ray(ray));
+
+        double d = ray.dir.x*back.dir.x+ray.dir.y*back.dir.y+ray.dir.z*back.dir.z;
+        double cross[3] = {ray.dir.y*back.dir.z-ray.dir.z*back.dir.y,
+                           ray.dir.z*back.dir.x-ray.dir.x*back.dir.z,
+                           ray.dir.x*back.dir.y-ray.dir.y*back.dir.x};
+        double angle = atan2(sqrt(cross[0]*cross[0]+cross[1]*cross[1]+
+                                  cross[2]*cross[2]), d);
+        double length = fabs(sqrt(back.dir.x*back.dir.x+back.dir.y*back.dir.y+
+                                  back.dir.z*back.dir.z)-1.0);
+        double error = fmax(half_error(ray.rgb.x, back.rgb.x),
+                            fmax(half_error(ray.rgb.y, back.rgb.y),
+                                 half_error(ray.rgb.z, back.rgb.z)));
+
+        dir_angle   = fmax(dir_angle, angle);
+        dir_length  = fmax(dir_length, length);
+        color       = fmax(color, error);
+
+        if (!(angle <= DIR_MAX_ANGLE) || !(length <= DIR_MAX_LENGTH) || !(error <= 1.0) ||
+            back.origin.x != ray.origin.x || back.origin.y != ray.origin.y ||
+            back.origin.z != ray.origin.z || back.depth != ray.depth) {
+            if (failed++ < 8) {
+                printf("ERROR:\tRay %u: dir (%f, %f, %f) came back off by %.3g rad, "
+                       "rgb (%g, %g, %g) as (%g, %g, %g), depth %d as %d\n", i,
+                       ray.dir.x, ray.dir.y, ray.dir.z, angle, ray.rgb.x, ray.rgb.y,
+                       ray.rgb.z, back.rgb.x, back.rgb.y, back.rgb.z, ray.depth,
+                       back.depth);
+            }
+        }
+    }
+
+    /* Every finite half has to come back as itself */
+    for (cl_uint h = 0; h < 0x10000; h++) {
+        if ((h & 0x7C00) == 0x7C00) { continue; }
+
+        rpacked packed = {.rgb = {h, h, h}};
+        rpacked again = rpack_ray(runpack_ray(packed));
+        if (again.rgb[0] != h) {
+            if (failed++ < 8) {
+                printf("ERROR:\tHalf 0x%04x came back as 0x%04x\n", h, again.rgb[0]);
+            }
+        }
+    }
+
+    printf("%u rays, largest errors: direction %.3g rad (bound %.3g), unit length "
+           "%.3g (bound %.3g), color %.3f of its bound\n", RAYS+edge_num, dir_angle,
+           DIR_MAX_ANGLE, dir_length, DIR_MAX_LENGTH, color);
+
+    if (failed) {
+        printf("ERROR:\t%u checks out of bounds\n", failed);
+        exit(1);
+    }
+    return 0;
+}
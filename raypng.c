@@ -1,18 +1,270 @@
+#include <math.h>
+#include <string.h>
+#include <limits.h>
 #include <CL/opencl.h>
 #include <sys/time.h>
 #include "opencl_wrap.h"
 #include "cpu_ray.h"
+#include "cpu_kernels.h"
 #include "cpu_obj.h"
+#include "cpu_light.h"
+#include "cpu_visibility.h"
+#include "cpu_mesh.h"
+#include "cpu_timeline.h"
+#include "cpu_sink.h"
 
 
 #define WIDTH 800
 #define HEIGHT 600
 
-int main() {
+/* Lights shaded per hit, picked by power. 0 shades every light */
+#define LIGHT_SAMPLES 0
+
+/* Shadow rays per pixel deferred to the shadow pass. 0 traces them inline */
+#define SHADOW_SLOTS 6
+/* Tiles sharing a last occluder entry in the shadow pass */
+#define SHADOW_CACHE_SIZE 4096
+/* Points in the soft shadow sample table, must be a power of two */
+#define SHADOW_SAMPLE_TABLE 4096
+
+/* A-trous denoiser passes over the colors. 0 disables the denoiser */
+#define DENOISE_PASSES 3
+/* Shadow rays per shaded light, one is enough when denoising */
+#define SOFT_SHADOWS 1
+
+/* Extra jittered rays traced for edge pixels. 0 disables anti-aliasing */
+#define AA_SAMPLES 4
+/* Luminance difference to a neighbour that makes a pixel an edge pixel */
+#define AA_THRESHOLD 0.1f
+
+/* 1 sorts the secondary rays by origin and direction before tracing them. The
+   sort and trace times are printed so both can be compared on a scene */
+#define SECONDARY_SORT 0
+
+/* 1 builds the kernels with the light pass the single closest hit pass replaced,
+   the intersection tests printed at the end then compare the two traversals */
+#define LEGACY_TRAVERSAL 0
+
+/* Bounces followed per ray at most */
+#define MAX_DEPTH 15
+/* Rays whose weight in the pixel falls below this are ended, half of an 8 bit
+   step cannot change the output. 0 follows every ray to MAX_DEPTH */
+#define MIN_WEIGHT (1.0f/512.0f)
+/* 1 ends the rays below MIN_WEIGHT at random and weights up the survivors, which
+   keeps the image unbiased */
+#define ROULETTE 0
+
+/* 1 compares the compressed primary rays with the float rays they were made from,
+   it reads the last band back and walks it on the host. raypack checks the error
+   bounds of every packed field without a device */
+#define CHECK_PACKED_RAYS 0
+
+/* Precision tier of the kernels, PRECISION_FAST builds them with fused multiply-adds
+   and native functions. Check it against PRECISION_EXACT on the scenes with raygate */
+#define PRECISION PRECISION_EXACT
+
+/* 1 stages the scene into each work group's local memory, 0 reads it from global
+   memory and -1 stages it when it fits the device's local memory */
+#define SCENE_STAGING -1
+
+/* 1 reads the light visibility of the static scene from a cache next to the scene
+   file, built first if the scene changed. Only the points near a shadow edge trace
+   shadow rays then. VISIBILITY_BRICKS sets the grid to 4x that many cells per axis */
+#define VISIBILITY_CACHE 1
+#define VISIBILITY_BRICKS 16
+
+/* Share of the device memory the buffers growing with the image may take. Larger
+   images are rendered in bands of rows that fit, BAND_ROWS forces the band height */
+#define DEVICE_MEMORY_SHARE 0.5
+#define BAND_ROWS 0
+
+/* Rows per strip of the last passes of a band. Each strip is read back and
+   converted for the output as soon as it is done, while the device goes on with
+   the next strips. 0 reads a band back once it is done as a whole */
+#define STRIP_ROWS 64
+
+/* Scene rendered when none is given on the command line */
+#define SCENE "scenes/render.map"
+
+/* Triangle mesh rendered into the scene, a binary mesh made from an OBJ model by
+   raymesh with the hierarchy its triangles are traced through. NULL renders the
+   scene alone. MESH_TEXTURE is its texture or -1 */
+#define MESH_FILE NULL
+#define MESH_MATERIAL plastic
+#define MESH_TEXTURE -1
+
+/* Where the frame goes: "png:<file>", "y4m:<file>" or "rgb:<file>" with "-" for
+   stdout, or "shm:<name>" for a viewer. See `rsink_open` */
+#define OUTPUT "png:out/scene.png"
+
+/* File the timeline of the host stages and device commands is written to at exit,
+   open it in chrome://tracing or ui.perfetto.dev. NULL records nothing */
+#define TIMELINE_FILE NULL
+/* Latest spans kept for the timeline */
+#define TIMELINE_SPANS 65536
+
+/* Device bytes per pixel of the buffers growing with the image, `largest` is set
+   to the largest of them */
+static size_t pixel_bytes(size_t *largest) {
+    const size_t sizes[] = {
+        sizeof(rpacked),                    /* Rays */
+        sizeof(cl_uint),                    /* Packed output colors */
+        sizeof(rshadow)*SHADOW_SLOTS,       /* Deferred shadow rays */
+        sizeof(cl_uint),                    /* Shadow ray counts */
+        sizeof(cl_int),                     /* Hit ids */
+        sizeof(rgbuffer),                   /* Primary hits for the denoiser */
+        sizeof(rsecondary)*2,               /* Secondary rays */
+        sizeof(cl_uint)*2, sizeof(cl_uint)*2,
+        sizeof(cl_uint)*2, sizeof(cl_uint)*2,
+                                            /* Their sort keys and orders */
+        sizeof(cl_uint),                    /* Edge pixels */
+        sizeof(cl_float4), sizeof(cl_float4)
+                                            /* Denoiser colors */
+    };
+
+    size_t bytes = 0;
+    *largest = 0;
+    for (size_t i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++) {
+        bytes += sizes[i];
+        if (sizes[i] > *largest) { *largest = sizes[i]; }
+    }
+    return bytes;
+}
+
+/* Starts reading back the rows `row` to `row+height` of the band, clipped to the
+   rows it keeps, straight into the frame. The band's row 0 is row `first` of the
+   frame and it keeps `rows` rows from its row `keep` on. Returns NULL if the strip
+   is all apron, else the read and in `end` the frame row after it */
+static cl_event read_strip(cl_wrap *wrap, cl_uint *frame, cl_uint first, cl_uint keep,
+                           cl_uint rows, cl_uint row, cl_uint height, cl_uint *end) {
+    cl_uint from = (row > keep) ? row : keep;
+    cl_uint to   = (row+height < keep+rows) ? row+height : keep+rows;
+
+    if (from >= to) { return NULL; }
+
+    *end = first+to;
+    return cl_wrap_read_async(wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_OUTPUT,
+                              sizeof(cl_uint)*from*WIDTH,
+                              sizeof(cl_uint)*(to-from)*WIDTH, frame+(first+from)*WIDTH);
+}
+
+/* Rows per band such that a band with its aprons and the `scene_bytes` of the
+   buffers not growing with the image fit in DEVICE_MEMORY_SHARE of the device
+   memory, and each buffer in one allocation. `scene_largest` is the largest of the
+   scene's buffers.
+   Only the per pixel buffers are banded. The spheres, planes, lights, meshes and
+   their BVHs are uploaded whole, so a scene larger than the device still fails
+   here instead of being streamed in chunks across passes */
+static cl_uint fit_band_rows(cl_wrap *wrap, cl_uint apron, cl_ulong scene_bytes,
+                             cl_ulong scene_largest) {
+
+    cl_ulong global_size, max_alloc;
+    cl_wrap_memory(wrap, &global_size, &max_alloc);
+
+    /* The buffer sizes are kept in a cl_uint */
+    if (max_alloc > UINT_MAX) { max_alloc = UINT_MAX; }
+
+    cl_ulong share = global_size*DEVICE_MEMORY_SHARE;
+    if (scene_largest > max_alloc) {
+        printf("ERROR:\tA scene buffer of %lu MB is larger than the %lu MB the device "
+               "allocates at once, scenes are not streamed\n",
+               (unsigned long)(scene_largest >> 20), (unsigned long)(max_alloc >> 20));
+        exit(1);
+    }
+    if (scene_bytes >= share) {
+        printf("ERROR:\tThe scene's %lu MB do not fit the %lu MB of device memory used, "
+               "scenes are not streamed\n", (unsigned long)(scene_bytes >> 20),
+               (unsigned long)(share >> 20));
+        exit(1);
+    }
+
+    if (BAND_ROWS) {
+        return (BAND_ROWS < HEIGHT) ? BAND_ROWS : HEIGHT;
+    }
+
+    size_t largest;
+    size_t bytes = pixel_bytes(&largest);
+
+    cl_ulong rows = (share-scene_bytes)/(bytes*WIDTH);
+    if (max_alloc/(largest*WIDTH) < rows) { rows = max_alloc/(largest*WIDTH); }
+
+    if (rows >= HEIGHT) {
+        return HEIGHT;
+    }
+    if (rows <= 2*apron) {
+        printf("ERROR:\tNot even %u rows of the image fit on the device\n", 2*apron+1);
+        exit(1);
+    }
+    return rows-2*apron;
+}
+
+/* Prints the largest angle between the compressed primary rays and the float
+   directions `raygen` computes, and the largest origin difference. The colors are
+   not checked here, raypack does */
+static void check_packed_rays(rpacked *rays, cl_float3 im_corner, cl_float3 origin,
+                              cl_float3 up, cl_float3 right,
+                              cl_float w_factor, cl_float h_factor,
+                              cl_uint pwidth, cl_uint pheight) {
+    double max_angle = 0.0, max_origin = 0.0;
+
+    for (cl_uint id = 0; id < pwidth*pheight; id++) {
+        cl_float w = (cl_float)(id % pwidth);
+        cl_float h = (cl_float)(id / pwidth);
+
+        cl_float3 vec = {
+            .x = im_corner.x+right.x*w_factor*w-up.x*h_factor*h,
+            .y = im_corner.y+right.y*w_factor*w-up.y*h_factor*h,
+            .z = im_corner.z+right.z*w_factor*w-up.z*h_factor*h
+        };
+        double len = sqrt((double)vec.x*vec.x+(double)vec.y*vec.y+(double)vec.z*vec.z);
+
+        rray ray = runpack_ray(rays[id]);
+
+        /* atan2 of the cross and dot products stays exact for tiny angles */
+        double cx = ray.dir.y*vec.z-ray.dir.z*vec.y;
+        double cy = ray.dir.z*vec.x-ray.dir.x*vec.z;
+        double cz = ray.dir.x*vec.y-ray.dir.y*vec.x;
+        double dot = ray.dir.x*vec.x+ray.dir.y*vec.y+ray.dir.z*vec.z;
+        double angle = atan2(sqrt(cx*cx+cy*cy+cz*cz)/len, dot/len);
+
+        double d = fabs(ray.origin.x-origin.x)+fabs(ray.origin.y-origin.y)+
+                   fabs(ray.origin.z-origin.z);
+
+        if (angle > max_angle) { max_angle = angle; }
+        if (d > max_origin) { max_origin = d; }
+    }
+
+    /* Angle between the rays of two neighbouring pixels at the image center */
+    double pixel = atan2(w_factor*sqrt(right.x*right.x+right.y*right.y+right.z*right.z),
+                         sqrt(im_corner.x*im_corner.x+im_corner.y*im_corner.y+
+                              im_corner.z*im_corner.z));
+
+    printf("Packed rays: max direction error %.2e rad (%.3f pixels), "
+           "max origin error %.2e\n", max_angle, max_angle/pixel, max_origin);
+}
+
+/* Usage: raypng [scene] [exact|fast] [output] [mesh], the missing ones are SCENE,
+   PRECISION, OUTPUT and MESH_FILE */
+int main(int argc, char** argv) {
     cl_uint pwidth  = WIDTH;
     cl_uint pheight = HEIGHT;
 
-    struct timeval start, stop;
+    struct timeval start, stop, shadow_start, shadow_stop, mesh_start, mesh_stop;
+
+    const char *scene_file = argc > 1 ? argv[1] : SCENE;
+    int precision = argc > 2 ? rprecision_tier(argv[2]) : PRECISION;
+    if (precision < 0) {
+        printf("ERROR:\tUnknown precision tier \"%s\", use exact or fast\n", argv[2]);
+        exit(1);
+    }
+
+    if (TIMELINE_FILE) { rtimeline_start(TIMELINE_FILE, TIMELINE_SPANS); }
+
+    /* Opened first, an output to stdout moves the prints to stderr */
+    rsink sink;
+    if (!rsink_open(&sink, argc > 3 ? argv[3] : OUTPUT, WIDTH, HEIGHT, 1)) {
+        exit(1);
+    }
 
     rcamera camera = rinit_camera(
         (cl_float3){.x = 0.8f, .y = 2.5f, .z = -8.0f},
@@ -20,18 +272,81 @@ int main() {
         90.0f, 1.0f
     );
 
-    cl_uchar sphere_num, plane_num, light_num;
+    cl_uint  sphere_num, plane_num, light_num;
     rsphere *ext_spheres;
     rplane  *ext_planes;
     rlight  *ext_lights;
 
-    extract_robj("scenes/render.map", &ext_spheres, &sphere_num, &ext_planes, &plane_num,
-                    &ext_lights, &light_num);
+    if (!extract_robj(scene_file, &ext_spheres, &sphere_num, &ext_planes, &plane_num,
+                      &ext_lights, &light_num)) {
+        printf("ERROR:\tCannot read the scene \"%s\"\n", scene_file);
+        exit(1);
+    }
+
+    /* The mesh is mapped, the device buffers are filled straight from the file */
+    const char *mesh_name = argc > 4 ? argv[4] : MESH_FILE;
+    rmesh_file mesh_file = {0};
+    rmeshes meshes = {0};
+    if (mesh_name) {
+        rmaterial mesh_material = MESH_MATERIAL;
+        mesh_material.texture_id = MESH_TEXTURE;
+
+        gettimeofday(&mesh_start, NULL);
+        if (!map_rmesh(&mesh_file, mesh_name)) {
+            exit(1);
+        }
+        rgen_meshes(&meshes, &mesh_file, &mesh_material, 1);
+        gettimeofday(&mesh_stop, NULL);
+
+        printf("Mesh of %u triangles mapped from %s in %.0f ms\n", meshes.triangle_num,
+               mesh_name, relapsed_ms(&mesh_start, &mesh_stop));
+    }
+
+    cl_uint light_samples = LIGHT_SAMPLES;
+    rlight_alias *light_alias = rgen_light_alias(ext_lights, light_num);
+
+    cl_float3 *shadow_samples = rgen_shadow_samples(SHADOW_SAMPLE_TABLE);
+    cl_uint sample_mask = SHADOW_SAMPLE_TABLE-1;
+    cl_uint frame = 0;
+    cl_uint soft_shadows = SOFT_SHADOWS;
 
     cl_wrap cl_wrap;
-    cl_wrap_init(&cl_wrap, CL_DEVICE_TYPE_GPU,
+    char options[512] = "", staged_options[512];
+    printf("Kernels built in the %s precision tier\n",
+           precision == PRECISION_FAST ? "fast" : "exact");
+    rtrace_options(options, sizeof(options), MAX_DEPTH, MIN_WEIGHT, ROULETTE);
+    rprecision_options(options, sizeof(options), precision);
+    if (LEGACY_TRAVERSAL) {
+        size_t used = strlen(options);
+        snprintf(options+used, sizeof(options)-used, "%s-D LEGACY_TRAVERSAL",
+                 used ? " " : "");
+    }
+    strcpy(staged_options, options);
+    int staged = robj_options(staged_options, sizeof(staged_options), sphere_num,
+                              plane_num, light_num, cl_wrap_local_memory(CL_DEVICE_TYPE_GPU),
+                              SCENE_STAGING);
+
+    /* The kernels in the order of src/cpu_kernels.h */
+    cl_wrap_init(&cl_wrap, CL_DEVICE_TYPE_GPU, staged_options,
                  "src/cl/raygen.cl", "raygen",
-                 "src/cl/raytracing.cl", "raytracer", NULL);
+                 "src/cl/raytracing.cl", "raytracer",
+                 "src/cl/shadowtest.cl", "shadowtest",
+                 "src/cl/shadowgather.cl", "shadowgather",
+                 "src/cl/aadetect.cl", "aadetect",
+                 "src/cl/aatrace.cl", "aatrace",
+                 "src/cl/denoise.cl", "denoise",
+                 "src/cl/secondarytrace.cl", "secondarytrace",
+                 "src/cl/secondarygather.cl", "secondarygather",
+                 "src/cl/secondarykey.cl", "secondarykey",
+                 "src/cl/sorthist.cl", "sorthist",
+                 "src/cl/sortscan.cl", "sortscan",
+                 "src/cl/sortscatter.cl", "sortscatter", NULL);
+
+    /* The compiler's own local memory can leave no room for the staged scene */
+    if (staged && cl_wrap_fit_local(&cl_wrap, options)) { staged = 0; }
+    printf("Scene read from %s memory\n", staged ? "local" : "global");
+
+    rtimeline_begin("arguments");
 
     /* Camera perspective values for ray generation */
     cl_float3 im_corner, camera_origin, up, right;
@@ -40,68 +355,790 @@ int main() {
                      &w_factor, &h_factor, WIDTH, HEIGHT);    
 
 
-    cl_uint pixels = WIDTH*HEIGHT;
-    cl_uint ray_size = sizeof(rray)*pixels;
+    /* The textures and the visibility grid come first, the bands are fit next to
+       them and the rest of the scene */
+    cl_wrap_load_images(&cl_wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_IM_ARR,
+                        CL_MEM_COPY_HOST_PTR, 4,
+                        "assets/cobblestone.png",
+                        "assets/sand.png",
+                        "assets/check.png",
+                        "assets/grass.png");
+
+    cl_wrap_load_images(&cl_wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_SKYBOX,
+                        CL_MEM_COPY_HOST_PTR, 1,
+                        "assets/bg/stormydays.png");
+
+    /* Light visibility grid, the kernels trace every shadow ray without one. It is
+       built from the spheres and planes, so there is none with a mesh */
+    rvisibility visibility = {0};
+    size_t bricks_size = 0, cells_size = 0;
+    if (VISIBILITY_CACHE && meshes.mesh_num == 0) {
+        rgen_visibility(&visibility, scene_file, ext_spheres, sphere_num,
+                        ext_planes, plane_num, ext_lights, light_num,
+                        shadow_samples, VISIBILITY_BRICKS);
+
+        bricks_size = sizeof(cl_uint)*visibility.grid.lights*
+                      VISIBILITY_BRICKS*VISIBILITY_BRICKS*VISIBILITY_BRICKS;
+        cells_size  = VIS_BRICK_CELLS*(visibility.pool_num ? visibility.pool_num : 1);
+    }
+
+    /* The frame is rendered in bands of rows whose buffers fit on the device. Each
+       band is rendered with `apron` more rows above and below, so the denoiser and
+       the edge detection see the same neighbours as in a whole frame */
+    cl_uint apron = 2*((1u << DENOISE_PASSES)-1)+1;
+
+    /* Device buffers not growing with the image */
+    const cl_ulong scene_sizes[] = {
+        sizeof(rsphere)*sphere_num,
+        sizeof(rplane)*plane_num,
+        sizeof(rlight)*light_num,
+        sizeof(rlight_alias)*light_num,
+        sizeof(cl_float3)*SHADOW_SAMPLE_TABLE,
+        sizeof(cl_int)*SHADOW_CACHE_SIZE,   /* Occluder cache */
+        cl_wrap_buffer_size(&cl_wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_IM_ARR),
+        cl_wrap_buffer_size(&cl_wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_SKYBOX),
+        bricks_size, cells_size,
+        sizeof(rmesh)*meshes.mesh_num,
+        3*sizeof(cl_float)*(cl_ulong)meshes.vertex_num,
+        3*sizeof(cl_uint)*(cl_ulong)meshes.triangle_num,
+        sizeof(rmesh_node)*(cl_ulong)meshes.node_num
+    };
+    cl_ulong scene_bytes = 0, scene_largest = 0;
+    for (size_t i = 0; i < sizeof(scene_sizes)/sizeof(scene_sizes[0]); i++) {
+        scene_bytes += scene_sizes[i];
+        if (scene_sizes[i] > scene_largest) { scene_largest = scene_sizes[i]; }
+    }
+
+    cl_uint band_rows = fit_band_rows(&cl_wrap, apron, scene_bytes, scene_largest);
+    pheight = (band_rows+2*apron < HEIGHT) ? band_rows+2*apron : HEIGHT;
+    if (band_rows < HEIGHT) {
+        printf("Rendering in %u bands of %u rows\n", (HEIGHT+band_rows-1)/band_rows,
+               band_rows);
+    }
+
+    /* The device buffers hold the pixels of one band */
+    cl_uint pixels = WIDTH*pheight;
+    cl_uint ray_size = sizeof(rpacked)*pixels;
 
     cl_uint buffer_size = pixels*sizeof(cl_uint);
-    cl_uint *buffer = malloc(buffer_size);
+    cl_uint *buffer = rsink_frame(&sink);
 
 
-    cl_wrap_load_single_data(&cl_wrap, 0, 0, &im_corner, sizeof(cl_float3));
-    cl_wrap_load_single_data(&cl_wrap, 0, 1, &camera_origin, sizeof(cl_float3));
-    cl_wrap_load_single_data(&cl_wrap, 0, 2, &up, sizeof(cl_float3));
-    cl_wrap_load_single_data(&cl_wrap, 0, 3, &right, sizeof(cl_float3));
-    cl_wrap_load_single_data(&cl_wrap, 0, 4, &w_factor, sizeof(cl_float));
-    cl_wrap_load_single_data(&cl_wrap, 0, 5, &h_factor, sizeof(cl_float));
-    cl_wrap_load_single_data(&cl_wrap, 0, 6, &pwidth, sizeof(cl_uint));
-    cl_wrap_load_single_data(&cl_wrap, 0, 7, &pheight, sizeof(cl_uint));
+    /* One view, moved down the frame band by band */
+    rview view;
+    rgen_view(&camera, &view, WIDTH, HEIGHT);
+    view.pheight = pheight;
+    cl_uint views_num = 1;
 
-    cl_wrap_load_global_data(&cl_wrap, 0, 8, NULL, ray_size, CL_MEM_READ_WRITE);
+    cl_wrap_load_global_data(&cl_wrap, KERNEL_RAYGEN, RAYGEN_ARG_VIEWS, &view,
+                             sizeof(rview), CL_MEM_READ_ONLY);
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_RAYGEN, RAYGEN_ARG_VIEWS_NUM, &views_num,
+                             sizeof(cl_uint));
+    cl_wrap_load_global_data(&cl_wrap, KERNEL_RAYGEN, RAYGEN_ARG_RAYS, NULL, ray_size,
+                             CL_MEM_READ_WRITE);
     
-    cl_wrap_load_single_data(&cl_wrap, 1, 0, &cl_wrap.buffers[0][8], sizeof(cl_mem));
-    cl_wrap_load_global_data(&cl_wrap, 1, 1, ext_spheres, sizeof(rsphere)*sphere_num,
-                             CL_MEM_READ_ONLY);
-    cl_wrap_load_global_data(&cl_wrap, 1, 2, ext_planes, sizeof(rplane)*plane_num,
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_RAYS,
+                             &cl_wrap.buffers[KERNEL_RAYGEN][RAYGEN_ARG_RAYS],
+                             sizeof(cl_mem));
+    cl_wrap_load_global_data(&cl_wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_SPHERES,
+                             ext_spheres, sizeof(rsphere)*sphere_num, CL_MEM_READ_ONLY);
+    cl_wrap_load_global_data(&cl_wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_PLANES,
+                             ext_planes, sizeof(rplane)*plane_num, CL_MEM_READ_ONLY);
+    cl_wrap_load_global_data(&cl_wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_LIGHTS,
+                             ext_lights, sizeof(rlight)*light_num, CL_MEM_READ_ONLY);
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_SPHERES_NUM,
+                             &sphere_num, sizeof(cl_uint));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_PLANES_NUM,
+                             &plane_num, sizeof(cl_uint));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_LIGHT_NUM,
+                             &light_num, sizeof(cl_uint));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_TOTAL_SIZE,
+                             &pixels, sizeof(cl_uint));
+
+    cl_wrap_load_global_data(&cl_wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_OUTPUT, NULL,
+                             buffer_size, CL_MEM_WRITE_ONLY);
+
+    cl_wrap_load_global_data(&cl_wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_LIGHT_ALIAS,
+                             light_alias, sizeof(rlight_alias)*light_num,
                              CL_MEM_READ_ONLY);
-    cl_wrap_load_global_data(&cl_wrap, 1, 3, ext_lights, sizeof(rlight)*light_num,
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_LIGHT_SAMPLES,
+                             &light_samples, sizeof(cl_uint));
+
+    /* Deferred shadow rays, a single dummy record when they are traced inline */
+    cl_uint shadow_slots = SHADOW_SLOTS;
+    cl_uint shadow_records = pixels*shadow_slots;
+    cl_uint shadow_size = sizeof(rshadow)*(shadow_records ? shadow_records : 1);
+    cl_uint shadow_num_size = sizeof(cl_uint)*(shadow_records ? pixels : 1);
+    cl_uint cache_size = SHADOW_CACHE_SIZE;
+
+    cl_int *occluder_cache = malloc(sizeof(cl_int)*cache_size);
+    for (cl_uint i = 0; i < cache_size; i++) { occluder_cache[i] = -1; }
+
+    cl_wrap_load_global_data(&cl_wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_SHADOW_RAYS, NULL,
+                             shadow_size, CL_MEM_READ_WRITE);
+    cl_wrap_load_global_data(&cl_wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_SHADOW_NUM, NULL,
+                             shadow_num_size, CL_MEM_READ_WRITE);
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_SHADOW_SLOTS,
+                             &shadow_slots, sizeof(cl_uint));
+    cl_wrap_load_global_data(&cl_wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_SHADOW_SAMPLES,
+                             shadow_samples, sizeof(cl_float3)*SHADOW_SAMPLE_TABLE,
                              CL_MEM_READ_ONLY);
-    cl_wrap_load_single_data(&cl_wrap, 1, 4, &sphere_num, sizeof(cl_uchar));
-    cl_wrap_load_single_data(&cl_wrap, 1, 5, &plane_num, sizeof(cl_uchar));
-    cl_wrap_load_single_data(&cl_wrap, 1, 6, &light_num, sizeof(cl_uchar));
-    cl_wrap_load_single_data(&cl_wrap, 1, 7, &pixels, sizeof(cl_uint));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_SAMPLE_MASK,
+                             &sample_mask, sizeof(cl_uint));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_FRAME, &frame,
+                             sizeof(cl_uint));
+    cl_wrap_load_global_data(&cl_wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_HIT_IDS, NULL,
+                             sizeof(cl_int)*pixels, CL_MEM_READ_WRITE);
+    cl_wrap_load_global_data(&cl_wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_GBUFFER, NULL,
+                             sizeof(rgbuffer)*pixels, CL_MEM_READ_WRITE);
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_SOFT_SHADOWS,
+                             &soft_shadows, sizeof(cl_uint));
 
+    /* Every pixel is traced, there is no trace list */
+    cl_mem no_trace_list = NULL;
+    cl_uint use_trace_list = 0;
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_TRACE_LIST,
+                             &no_trace_list, sizeof(cl_mem));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_USE_TRACE_LIST,
+                             &use_trace_list, sizeof(cl_uint));
 
-    cl_wrap_load_images(&cl_wrap, 1, 8,  CL_MEM_COPY_HOST_PTR, 4, 
-                        "assets/cobblestone.png",
-                        "assets/sand.png",
-                        "assets/check.png",
-                        "assets/grass.png");
+    /* At most a reflected and a refracted ray per pixel go to the secondary pass */
+    cl_uint secondary_records = 2*pixels;
+    cl_uint secondary_num = 0;
+    cl_uint defer_secondary = 1;
 
-    cl_wrap_load_images(&cl_wrap, 1, 9,  CL_MEM_COPY_HOST_PTR, 1, 
-                        "assets/bg/stormydays.png");
+    cl_wrap_load_global_data(&cl_wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_SECONDARY, NULL,
+                             sizeof(rsecondary)*secondary_records, CL_MEM_READ_WRITE);
+    cl_wrap_load_global_data(&cl_wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_SECONDARY_NUM,
+                             &secondary_num, sizeof(cl_uint), CL_MEM_READ_WRITE);
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_DEFER_SECONDARY,
+                             &defer_secondary, sizeof(cl_uint));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_PWIDTH, &pwidth,
+                             sizeof(cl_uint));
+
+    /* Ray segments and their intersection tests in the raytracer and the secondary
+       pass, 64 bits each as the kernels add them */
+    cl_ulong trace_stats[TRACE_STATS] = {0};
+    cl_wrap_load_global_data(&cl_wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_TRACE_STATS,
+                             trace_stats, sizeof(trace_stats), CL_MEM_READ_WRITE);
+
+    /* The visibility grid built above, NULL buffers without one */
+    cl_mem vis_bricks = NULL, vis_cells = NULL;
+    if (VISIBILITY_CACHE && meshes.mesh_num == 0) {
+        cl_wrap_load_global_data(&cl_wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_VIS_BRICKS,
+                                 visibility.bricks, bricks_size, CL_MEM_READ_ONLY);
+        cl_wrap_load_global_data(&cl_wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_VIS_CELLS,
+                                 visibility.cells, cells_size, CL_MEM_READ_ONLY);
+        vis_bricks = cl_wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_VIS_BRICKS];
+        vis_cells  = cl_wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_VIS_CELLS];
+    } else {
+        cl_wrap_load_single_data(&cl_wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_VIS_BRICKS,
+                                 &vis_bricks, sizeof(cl_mem));
+        cl_wrap_load_single_data(&cl_wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_VIS_CELLS,
+                                 &vis_cells, sizeof(cl_mem));
+    }
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_VIS_GRID,
+                             &visibility.grid, sizeof(rvis_grid));
+
+    /* Meshes, NULL buffers without any */
+    cl_mem mesh_list = NULL, mesh_vertices = NULL, mesh_indices = NULL;
+    cl_mem mesh_nodes = NULL;
+    if (meshes.mesh_num) {
+        cl_wrap_load_global_data(&cl_wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_MESHES,
+                                 meshes.meshes, sizeof(rmesh)*meshes.mesh_num,
+                                 CL_MEM_READ_ONLY);
+        cl_wrap_load_global_data(&cl_wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_VERTICES,
+                                 meshes.vertices, 3*sizeof(cl_float)*meshes.vertex_num,
+                                 CL_MEM_READ_ONLY);
+        cl_wrap_load_global_data(&cl_wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_INDICES,
+                                 meshes.indices, 3*sizeof(cl_uint)*meshes.triangle_num,
+                                 CL_MEM_READ_ONLY);
+        cl_wrap_load_global_data(&cl_wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_MESH_NODES,
+                                 meshes.nodes, sizeof(rmesh_node)*meshes.node_num,
+                                 CL_MEM_READ_ONLY);
+        mesh_list       = cl_wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_MESHES];
+        mesh_vertices   = cl_wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_VERTICES];
+        mesh_indices    = cl_wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_INDICES];
+        mesh_nodes      = cl_wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_MESH_NODES];
+    } else {
+        cl_wrap_load_single_data(&cl_wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_MESHES,
+                                 &mesh_list, sizeof(cl_mem));
+        cl_wrap_load_single_data(&cl_wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_VERTICES,
+                                 &mesh_vertices, sizeof(cl_mem));
+        cl_wrap_load_single_data(&cl_wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_INDICES,
+                                 &mesh_indices, sizeof(cl_mem));
+        cl_wrap_load_single_data(&cl_wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_MESH_NODES,
+                                 &mesh_nodes, sizeof(cl_mem));
+    }
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_MESH_NUM,
+                             &meshes.mesh_num, sizeof(cl_uint));
+
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_SHADOWTEST, SHADOWTEST_ARG_SHADOW_RAYS,
+                             &cl_wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_SHADOW_RAYS],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_SHADOWTEST, SHADOWTEST_ARG_SHADOW_NUM,
+                             &cl_wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_SHADOW_NUM],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_SHADOWTEST, SHADOWTEST_ARG_SHADOW_SLOTS,
+                             &shadow_slots, sizeof(cl_uint));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_SHADOWTEST, SHADOWTEST_ARG_SPHERES,
+                             &cl_wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_SPHERES],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_SHADOWTEST, SHADOWTEST_ARG_PLANES,
+                             &cl_wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_PLANES],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_SHADOWTEST, SHADOWTEST_ARG_SPHERES_NUM,
+                             &sphere_num, sizeof(cl_uint));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_SHADOWTEST, SHADOWTEST_ARG_PLANES_NUM,
+                             &plane_num, sizeof(cl_uint));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_SHADOWTEST, SHADOWTEST_ARG_TOTAL_SIZE,
+                             &shadow_records, sizeof(cl_uint));
+    cl_wrap_load_global_data(&cl_wrap, KERNEL_SHADOWTEST, SHADOWTEST_ARG_OCCLUDER_CACHE,
+                             occluder_cache, sizeof(cl_int)*cache_size,
+                             CL_MEM_READ_WRITE);
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_SHADOWTEST, SHADOWTEST_ARG_CACHE_SIZE,
+                             &cache_size, sizeof(cl_uint));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_SHADOWTEST, SHADOWTEST_ARG_MESHES,
+                             &mesh_list, sizeof(cl_mem));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_SHADOWTEST, SHADOWTEST_ARG_VERTICES,
+                             &mesh_vertices, sizeof(cl_mem));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_SHADOWTEST, SHADOWTEST_ARG_INDICES,
+                             &mesh_indices, sizeof(cl_mem));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_SHADOWTEST, SHADOWTEST_ARG_MESH_NODES,
+                             &mesh_nodes, sizeof(cl_mem));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_SHADOWTEST, SHADOWTEST_ARG_MESH_NUM,
+                             &meshes.mesh_num, sizeof(cl_uint));
+
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_SHADOWGATHER, SHADOWGATHER_ARG_RAYS,
+                             &cl_wrap.buffers[KERNEL_RAYGEN][RAYGEN_ARG_RAYS],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_SHADOWGATHER, SHADOWGATHER_ARG_SHADOW_RAYS,
+                             &cl_wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_SHADOW_RAYS],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_SHADOWGATHER, SHADOWGATHER_ARG_SHADOW_NUM,
+                             &cl_wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_SHADOW_NUM],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_SHADOWGATHER,
+                             SHADOWGATHER_ARG_SHADOW_SLOTS, &shadow_slots,
+                             sizeof(cl_uint));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_SHADOWGATHER, SHADOWGATHER_ARG_TOTAL_SIZE,
+                             &pixels, sizeof(cl_uint));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_SHADOWGATHER, SHADOWGATHER_ARG_OUTPUT,
+                             &cl_wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_OUTPUT],
+                             sizeof(cl_mem));
+
+    /* Anti-aliasing of the edge pixels */
+    cl_uint aa_samples = AA_SAMPLES;
+    cl_float aa_threshold = AA_THRESHOLD;
+    cl_uint aa_num = 0;
+    /* One edge count per row, a strip counts into the one of its first row */
+    cl_uint *aa_nums = calloc(pheight, sizeof(cl_uint));
+
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_AADETECT, AADETECT_ARG_RAYS,
+                             &cl_wrap.buffers[KERNEL_RAYGEN][RAYGEN_ARG_RAYS],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_AADETECT, AADETECT_ARG_HIT_IDS,
+                             &cl_wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_HIT_IDS],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_AADETECT, AADETECT_ARG_PWIDTH, &pwidth,
+                             sizeof(cl_uint));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_AADETECT, AADETECT_ARG_PHEIGHT, &pheight,
+                             sizeof(cl_uint));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_AADETECT, AADETECT_ARG_THRESHOLD,
+                             &aa_threshold, sizeof(cl_float));
+    cl_wrap_load_global_data(&cl_wrap, KERNEL_AADETECT, AADETECT_ARG_AA_LIST, NULL,
+                             sizeof(cl_uint)*pixels, CL_MEM_READ_WRITE);
+    cl_wrap_load_global_data(&cl_wrap, KERNEL_AADETECT, AADETECT_ARG_AA_NUM, aa_nums,
+                             sizeof(cl_uint)*pheight, CL_MEM_READ_WRITE);
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_AADETECT, AADETECT_ARG_VIEWS_NUM,
+                             &views_num, sizeof(cl_uint));
+
+    /* Same scene arguments as the raytracer */
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_AATRACE, AATRACE_ARG_RAYS,
+                             &cl_wrap.buffers[KERNEL_RAYGEN][RAYGEN_ARG_RAYS],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_AATRACE, AATRACE_ARG_SPHERES,
+                             &cl_wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_SPHERES],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_AATRACE, AATRACE_ARG_PLANES,
+                             &cl_wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_PLANES],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_AATRACE, AATRACE_ARG_LIGHTS,
+                             &cl_wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_LIGHTS],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_AATRACE, AATRACE_ARG_SPHERES_NUM,
+                             &sphere_num, sizeof(cl_uint));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_AATRACE, AATRACE_ARG_PLANES_NUM,
+                             &plane_num, sizeof(cl_uint));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_AATRACE, AATRACE_ARG_LIGHT_NUM, &light_num,
+                             sizeof(cl_uint));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_AATRACE, AATRACE_ARG_AA_NUM, &aa_num,
+                             sizeof(cl_uint));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_AATRACE, AATRACE_ARG_IM_ARR,
+                             &cl_wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_IM_ARR],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_AATRACE, AATRACE_ARG_SKYBOX,
+                             &cl_wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_SKYBOX],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_AATRACE, AATRACE_ARG_OUTPUT,
+                             &cl_wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_OUTPUT],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_AATRACE, AATRACE_ARG_LIGHT_ALIAS,
+                             &cl_wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_LIGHT_ALIAS],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_AATRACE, AATRACE_ARG_LIGHT_SAMPLES,
+                             &light_samples, sizeof(cl_uint));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_AATRACE, AATRACE_ARG_SHADOW_SAMPLES,
+                             &cl_wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_SHADOW_SAMPLES],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_AATRACE, AATRACE_ARG_SAMPLE_MASK,
+                             &sample_mask, sizeof(cl_uint));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_AATRACE, AATRACE_ARG_FRAME, &frame,
+                             sizeof(cl_uint));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_AATRACE, AATRACE_ARG_AA_LIST,
+                             &cl_wrap.buffers[KERNEL_AADETECT][AADETECT_ARG_AA_LIST],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_AATRACE, AATRACE_ARG_AA_SAMPLES,
+                             &aa_samples, sizeof(cl_uint));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_AATRACE, AATRACE_ARG_VIEWS,
+                             &cl_wrap.buffers[KERNEL_RAYGEN][RAYGEN_ARG_VIEWS],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_AATRACE, AATRACE_ARG_SOFT_SHADOWS,
+                             &soft_shadows, sizeof(cl_uint));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_AATRACE, AATRACE_ARG_VIS_BRICKS,
+                             &vis_bricks, sizeof(cl_mem));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_AATRACE, AATRACE_ARG_VIS_CELLS, &vis_cells,
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_AATRACE, AATRACE_ARG_VIS_GRID,
+                             &visibility.grid, sizeof(rvis_grid));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_AATRACE, AATRACE_ARG_MESHES, &mesh_list,
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_AATRACE, AATRACE_ARG_VERTICES,
+                             &mesh_vertices, sizeof(cl_mem));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_AATRACE, AATRACE_ARG_INDICES,
+                             &mesh_indices, sizeof(cl_mem));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_AATRACE, AATRACE_ARG_MESH_NODES,
+                             &mesh_nodes, sizeof(cl_mem));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_AATRACE, AATRACE_ARG_MESH_NUM,
+                             &meshes.mesh_num, sizeof(cl_uint));
+
+    /* Denoiser ping-pong buffers */
+    cl_uint denoise_passes = DENOISE_PASSES;
+    cl_uint denoise_pass = 0;
+    cl_uint color_size = sizeof(cl_float4)*pixels;
+
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_DENOISE, DENOISE_ARG_RAYS,
+                             &cl_wrap.buffers[KERNEL_RAYGEN][RAYGEN_ARG_RAYS],
+                             sizeof(cl_mem));
+    cl_wrap_load_global_data(&cl_wrap, KERNEL_DENOISE, DENOISE_ARG_PING, NULL,
+                             color_size, CL_MEM_READ_WRITE);
+    cl_wrap_load_global_data(&cl_wrap, KERNEL_DENOISE, DENOISE_ARG_PONG, NULL,
+                             color_size, CL_MEM_READ_WRITE);
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_DENOISE, DENOISE_ARG_GBUFFER,
+                             &cl_wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_GBUFFER],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_DENOISE, DENOISE_ARG_PWIDTH, &pwidth,
+                             sizeof(cl_uint));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_DENOISE, DENOISE_ARG_PHEIGHT, &pheight,
+                             sizeof(cl_uint));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_DENOISE, DENOISE_ARG_PASS, &denoise_pass,
+                             sizeof(cl_uint));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_DENOISE, DENOISE_ARG_PASSES,
+                             &denoise_passes, sizeof(cl_uint));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_DENOISE, DENOISE_ARG_OUTPUT,
+                             &cl_wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_OUTPUT],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_DENOISE, DENOISE_ARG_VIEWS_NUM, &views_num,
+                             sizeof(cl_uint));
+
+    /* Sort keys of the secondary rays place their origins in the scene's box */
+    cl_float3 bounds_min, bounds_scale;
+    robj_bounds(ext_spheres, sphere_num, ext_lights, light_num,
+                &bounds_min, &bounds_scale);
+
+    cl_uint use_order = SECONDARY_SORT;
+    cl_uint sort_blocks = (secondary_records+SORT_BLOCK-1)/SORT_BLOCK;
+    cl_uint shift = 0;
+
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_SECONDARYKEY, SECONDARYKEY_ARG_SECONDARY,
+                             &cl_wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_SECONDARY],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_SECONDARYKEY,
+                             SECONDARYKEY_ARG_SECONDARY_NUM,
+                             &cl_wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_SECONDARY_NUM],
+                             sizeof(cl_mem));
+    cl_wrap_load_global_data(&cl_wrap, KERNEL_SECONDARYKEY, SECONDARYKEY_ARG_KEYS, NULL,
+                             sizeof(cl_uint)*secondary_records, CL_MEM_READ_WRITE);
+    cl_wrap_load_global_data(&cl_wrap, KERNEL_SECONDARYKEY, SECONDARYKEY_ARG_ORDER, NULL,
+                             sizeof(cl_uint)*secondary_records, CL_MEM_READ_WRITE);
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_SECONDARYKEY, SECONDARYKEY_ARG_BOUNDS_MIN,
+                             &bounds_min, sizeof(cl_float3));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_SECONDARYKEY,
+                             SECONDARYKEY_ARG_BOUNDS_SCALE, &bounds_scale,
+                             sizeof(cl_float3));
+
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_SORTHIST, SORTHIST_ARG_KEYS,
+                             &cl_wrap.buffers[KERNEL_SECONDARYKEY][SECONDARYKEY_ARG_KEYS],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_SORTHIST, SORTHIST_ARG_SECONDARY_NUM,
+                             &cl_wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_SECONDARY_NUM],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_SORTHIST, SORTHIST_ARG_SHIFT, &shift,
+                             sizeof(cl_uint));
+    cl_wrap_load_global_data(&cl_wrap, KERNEL_SORTHIST, SORTHIST_ARG_HIST, NULL,
+                             sizeof(cl_uint)*SORT_BUCKETS*sort_blocks, CL_MEM_READ_WRITE);
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_SORTHIST, SORTHIST_ARG_BLOCKS,
+                             &sort_blocks, sizeof(cl_uint));
+
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_SORTSCAN, SORTSCAN_ARG_HIST,
+                             &cl_wrap.buffers[KERNEL_SORTHIST][SORTHIST_ARG_HIST],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_SORTSCAN, SORTSCAN_ARG_BLOCKS,
+                             &sort_blocks, sizeof(cl_uint));
 
-    cl_wrap_load_global_data(&cl_wrap, 1, 10, NULL, buffer_size, CL_MEM_WRITE_ONLY);
+    /* The scatter alternates between the key buffers of `secondarykey` and its own */
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_SORTSCATTER, SORTSCATTER_ARG_KEYS_IN,
+                             &cl_wrap.buffers[KERNEL_SECONDARYKEY][SECONDARYKEY_ARG_KEYS],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_SORTSCATTER, SORTSCATTER_ARG_ORDER_IN,
+                             &cl_wrap.buffers[KERNEL_SECONDARYKEY][SECONDARYKEY_ARG_ORDER],
+                             sizeof(cl_mem));
+    cl_wrap_load_global_data(&cl_wrap, KERNEL_SORTSCATTER, SORTSCATTER_ARG_KEYS_OUT,
+                             NULL, sizeof(cl_uint)*secondary_records, CL_MEM_READ_WRITE);
+    cl_wrap_load_global_data(&cl_wrap, KERNEL_SORTSCATTER, SORTSCATTER_ARG_ORDER_OUT,
+                             NULL, sizeof(cl_uint)*secondary_records, CL_MEM_READ_WRITE);
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_SORTSCATTER, SORTSCATTER_ARG_SECONDARY_NUM,
+                             &cl_wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_SECONDARY_NUM],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_SORTSCATTER, SORTSCATTER_ARG_SHIFT, &shift,
+                             sizeof(cl_uint));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_SORTSCATTER, SORTSCATTER_ARG_HIST,
+                             &cl_wrap.buffers[KERNEL_SORTHIST][SORTHIST_ARG_HIST],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_SORTSCATTER, SORTSCATTER_ARG_BLOCKS,
+                             &sort_blocks, sizeof(cl_uint));
+
+    /* Same scene arguments as the raytracer */
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_SECONDARYTRACE,
+                             SECONDARYTRACE_ARG_SECONDARY,
+                             &cl_wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_SECONDARY],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_SECONDARYTRACE,
+                             SECONDARYTRACE_ARG_SECONDARY_NUM,
+                             &cl_wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_SECONDARY_NUM],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_SECONDARYTRACE, SECONDARYTRACE_ARG_ORDER,
+                             &cl_wrap.buffers[KERNEL_SECONDARYKEY][SECONDARYKEY_ARG_ORDER],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_SECONDARYTRACE,
+                             SECONDARYTRACE_ARG_USE_ORDER, &use_order, sizeof(cl_uint));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_SECONDARYTRACE, SECONDARYTRACE_ARG_SPHERES,
+                             &cl_wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_SPHERES],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_SECONDARYTRACE, SECONDARYTRACE_ARG_PLANES,
+                             &cl_wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_PLANES],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_SECONDARYTRACE, SECONDARYTRACE_ARG_LIGHTS,
+                             &cl_wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_LIGHTS],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_SECONDARYTRACE,
+                             SECONDARYTRACE_ARG_SPHERES_NUM, &sphere_num,
+                             sizeof(cl_uint));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_SECONDARYTRACE,
+                             SECONDARYTRACE_ARG_PLANES_NUM, &plane_num, sizeof(cl_uint));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_SECONDARYTRACE,
+                             SECONDARYTRACE_ARG_LIGHT_NUM, &light_num, sizeof(cl_uint));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_SECONDARYTRACE, SECONDARYTRACE_ARG_IM_ARR,
+                             &cl_wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_IM_ARR],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_SECONDARYTRACE, SECONDARYTRACE_ARG_SKYBOX,
+                             &cl_wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_SKYBOX],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_SECONDARYTRACE,
+                             SECONDARYTRACE_ARG_LIGHT_ALIAS,
+                             &cl_wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_LIGHT_ALIAS],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_SECONDARYTRACE,
+                             SECONDARYTRACE_ARG_LIGHT_SAMPLES, &light_samples,
+                             sizeof(cl_uint));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_SECONDARYTRACE,
+                             SECONDARYTRACE_ARG_SHADOW_SAMPLES,
+                             &cl_wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_SHADOW_SAMPLES],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_SECONDARYTRACE,
+                             SECONDARYTRACE_ARG_SAMPLE_MASK, &sample_mask,
+                             sizeof(cl_uint));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_SECONDARYTRACE, SECONDARYTRACE_ARG_FRAME,
+                             &frame, sizeof(cl_uint));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_SECONDARYTRACE,
+                             SECONDARYTRACE_ARG_SOFT_SHADOWS, &soft_shadows,
+                             sizeof(cl_uint));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_SECONDARYTRACE,
+                             SECONDARYTRACE_ARG_TRACE_STATS,
+                             &cl_wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_TRACE_STATS],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_SECONDARYTRACE,
+                             SECONDARYTRACE_ARG_VIS_BRICKS, &vis_bricks, sizeof(cl_mem));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_SECONDARYTRACE,
+                             SECONDARYTRACE_ARG_VIS_CELLS, &vis_cells, sizeof(cl_mem));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_SECONDARYTRACE,
+                             SECONDARYTRACE_ARG_VIS_GRID, &visibility.grid,
+                             sizeof(rvis_grid));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_SECONDARYTRACE, SECONDARYTRACE_ARG_MESHES,
+                             &mesh_list, sizeof(cl_mem));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_SECONDARYTRACE,
+                             SECONDARYTRACE_ARG_VERTICES, &mesh_vertices, sizeof(cl_mem));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_SECONDARYTRACE, SECONDARYTRACE_ARG_INDICES,
+                             &mesh_indices, sizeof(cl_mem));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_SECONDARYTRACE,
+                             SECONDARYTRACE_ARG_MESH_NODES, &mesh_nodes, sizeof(cl_mem));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_SECONDARYTRACE,
+                             SECONDARYTRACE_ARG_MESH_NUM, &meshes.mesh_num,
+                             sizeof(cl_uint));
+
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_SECONDARYGATHER, SECONDARYGATHER_ARG_RAYS,
+                             &cl_wrap.buffers[KERNEL_RAYGEN][RAYGEN_ARG_RAYS],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_SECONDARYGATHER,
+                             SECONDARYGATHER_ARG_SECONDARY,
+                             &cl_wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_SECONDARY],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_SECONDARYGATHER,
+                             SECONDARYGATHER_ARG_SECONDARY_NUM,
+                             &cl_wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_SECONDARY_NUM],
+                             sizeof(cl_mem));
+    cl_wrap_load_single_data(&cl_wrap, KERNEL_SECONDARYGATHER,
+                             SECONDARYGATHER_ARG_OUTPUT,
+                             &cl_wrap.buffers[KERNEL_RAYTRACER][RAYTRACER_ARG_OUTPUT],
+                             sizeof(cl_mem));
+
+    struct timeval sort_start, sort_stop, secondary_stop;
+
+    double sort_time = 0.0, secondary_time = 0.0, shadow_time = 0.0;
+    cl_ulong secondary_total = 0, shadow_total = 0, aa_total = 0, traced = 0;
+    cl_uint *shadow_num = malloc(shadow_num_size);
+
+    /* Reads and edge counts of the strips of a band. A single denoise pass filters
+       the colors of the rays in place, its strips would read the denoised rows of
+       the strips before them, so the band goes as one strip then */
+    cl_uint strip_rows = (STRIP_ROWS && STRIP_ROWS < pheight && denoise_passes != 1) ?
+                         STRIP_ROWS : pheight;
+    cl_uint strips_max = (pheight+strip_rows-1)/strip_rows;
+    cl_event *strip_reads = malloc(sizeof(cl_event)*strips_max);
+    cl_event *strip_counted = malloc(sizeof(cl_event)*strips_max);
+    cl_uint *strip_ends = malloc(sizeof(cl_uint)*strips_max);
+    cl_uint *strip_aa = malloc(sizeof(cl_uint)*strips_max);
+    cl_float3 band_corner = im_corner;
+
+    rtimeline_end();
 
     gettimeofday(&start, NULL);
-    cl_wrap_output(&cl_wrap, WIDTH*HEIGHT, 0, 0, 0, 0, NULL);
-    /* Because we do not copy the ray memory buffer from the first kernel to the second,
-       we just say to read the ray buffer which is stored on the first kernel 8:th arg */
-    cl_wrap_output(&cl_wrap, WIDTH*HEIGHT, buffer_size, 1, 1, 10, buffer);
+    for (cl_uint band_start = 0; band_start < HEIGHT; band_start += band_rows) {
+        rtimeline_begin("band");
+
+        /* Rows rendered for the band, the aprons are cut off again */
+        cl_uint rows  = (band_start+band_rows < HEIGHT) ? band_rows : HEIGHT-band_start;
+        cl_uint first = (band_start > apron) ? band_start-apron : 0;
+        cl_uint last  = (band_start+rows+apron < HEIGHT) ? band_start+rows+apron : HEIGHT;
+
+        pheight = last-first;
+        cl_uint band_pixels = WIDTH*pheight;
+        cl_uint band_shadow_records = band_pixels*shadow_slots;
+        traced += band_pixels;
+
+        /* Row 0 of the band is row `first` of the image */
+        band_corner = (cl_float3){.x = im_corner.x-up.x*h_factor*first,
+                                  .y = im_corner.y-up.y*h_factor*first,
+                                  .z = im_corner.z-up.z*h_factor*first};
+
+        view.im_corner = band_corner;
+        view.pheight = pheight;
+        cl_wrap_update_global_data(&cl_wrap, KERNEL_RAYGEN, RAYGEN_ARG_VIEWS, &view,
+                                   sizeof(rview));
+        cl_wrap_load_single_data(&cl_wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_TOTAL_SIZE,
+                                 &band_pixels, sizeof(cl_uint));
+        cl_wrap_load_single_data(&cl_wrap, KERNEL_SHADOWTEST, SHADOWTEST_ARG_TOTAL_SIZE,
+                                 &band_shadow_records, sizeof(cl_uint));
+        cl_wrap_load_single_data(&cl_wrap, KERNEL_SHADOWGATHER,
+                                 SHADOWGATHER_ARG_TOTAL_SIZE, &band_pixels,
+                                 sizeof(cl_uint));
+        cl_wrap_load_single_data(&cl_wrap, KERNEL_AADETECT, AADETECT_ARG_PHEIGHT,
+                                 &pheight, sizeof(cl_uint));
+        cl_wrap_load_single_data(&cl_wrap, KERNEL_DENOISE, DENOISE_ARG_PHEIGHT, &pheight,
+                                 sizeof(cl_uint));
+
+        secondary_num = 0;
+        cl_wrap_update_global_data(&cl_wrap, KERNEL_RAYTRACER,
+                                   RAYTRACER_ARG_SECONDARY_NUM, &secondary_num,
+                                   sizeof(cl_uint));
+
+        cl_wrap_output_2d(&cl_wrap, WIDTH, pheight, KERNEL_RAYGEN);
+        cl_wrap_output_2d(&cl_wrap, WIDTH, pheight, KERNEL_RAYTRACER);
+
+        cl_wrap_read_global_data(&cl_wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_SECONDARY_NUM,
+                                 &secondary_num, sizeof(cl_uint));
+        secondary_total += secondary_num;
+        gettimeofday(&sort_start, NULL);
+        if (secondary_num && use_order) {
+            rsort_secondary(&cl_wrap, secondary_num);
+        }
+        gettimeofday(&sort_stop, NULL);
+        if (secondary_num) {
+            cl_wrap_output(&cl_wrap, secondary_num, 0, KERNEL_SECONDARYTRACE, 0, 0, NULL);
+            cl_wrap_output(&cl_wrap, secondary_num, 0, KERNEL_SECONDARYGATHER, 0, 0,
+                           NULL);
+        }
+        gettimeofday(&secondary_stop, NULL);
+        sort_time += relapsed_ms(&sort_start, &sort_stop);
+        secondary_time += relapsed_ms(&sort_stop, &secondary_stop);
+
+        if (band_shadow_records) {
+            gettimeofday(&shadow_start, NULL);
+            cl_wrap_output(&cl_wrap, band_shadow_records, 0, KERNEL_SHADOWTEST, 0, 0,
+                           NULL);
+            gettimeofday(&shadow_stop, NULL);
+            shadow_time += relapsed_ms(&shadow_start, &shadow_stop);
+
+            cl_wrap_output(&cl_wrap, band_pixels, 0, KERNEL_SHADOWGATHER, 0, 0, NULL);
+
+            /* The per pixel shadow ray counts are left on the device by the raytracer */
+            cl_wrap_read_global_data(&cl_wrap, KERNEL_RAYTRACER,
+                                     RAYTRACER_ARG_SHADOW_NUM, shadow_num,
+                                     sizeof(cl_uint)*band_pixels);
+            for (cl_uint i = 0; i < band_pixels; i++) { shadow_total += shadow_num[i]; }
+        }
+        for (denoise_pass = 0; denoise_pass+1 < denoise_passes; denoise_pass++) {
+            cl_wrap_load_single_data(&cl_wrap, KERNEL_DENOISE, DENOISE_ARG_PASS,
+                                     &denoise_pass, sizeof(cl_uint));
+            cl_wrap_output_2d(&cl_wrap, WIDTH, pheight, KERNEL_DENOISE);
+        }
+        cl_wrap_load_single_data(&cl_wrap, KERNEL_DENOISE, DENOISE_ARG_PASS,
+                                 &denoise_pass, sizeof(cl_uint));
+        if (aa_samples) {
+            cl_wrap_update_global_data(&cl_wrap, KERNEL_AADETECT, AADETECT_ARG_AA_NUM,
+                                       aa_nums, sizeof(cl_uint)*pheight);
+        }
+
+        /* The last denoise pass and the anti-aliasing go strip by strip with global
+           offsets. The edges of a strip are looked for once the strip below it is
+           denoised, all before the first extra rays change a color */
+        cl_uint strips = (pheight+strip_rows-1)/strip_rows;
+        cl_uint keep = band_start-first;
+
+        for (cl_uint i = 0; i <= strips; i++) {
+            cl_uint row = i*strip_rows;
+            cl_uint height = (row+strip_rows < pheight) ? strip_rows : pheight-row;
+
+            if (i < strips && denoise_passes) {
+                cl_wrap_enqueue_2d(&cl_wrap, WIDTH, row, height, KERNEL_DENOISE);
+            }
+            if (i < strips && !aa_samples) {
+                strip_reads[i] = read_strip(&cl_wrap, buffer, first, keep, rows, row,
+                                            height, &strip_ends[i]);
+            }
+            if (aa_samples && i > 0) {
+                row -= strip_rows;
+                height = (row+strip_rows < pheight) ? strip_rows : pheight-row;
+                cl_wrap_enqueue(&cl_wrap, row*WIDTH, height*WIDTH, KERNEL_AADETECT);
+                strip_counted[i-1] = cl_wrap_read_async(&cl_wrap, KERNEL_AADETECT,
+                                                        AADETECT_ARG_AA_NUM,
+                                                        sizeof(cl_uint)*row,
+                                                        sizeof(cl_uint), &strip_aa[i-1]);
+            }
+        }
+
+        /* The extra rays of a strip come from its part of the edge list, which
+           starts at its first pixel */
+        for (cl_uint i = 0; aa_samples && i < strips; i++) {
+            cl_uint row = i*strip_rows;
+            cl_uint height = (row+strip_rows < pheight) ? strip_rows : pheight-row;
+
+            cl_wrap_wait(strip_counted[i]);
+            aa_num = row*WIDTH+strip_aa[i];
+            cl_wrap_load_single_data(&cl_wrap, KERNEL_AATRACE, AATRACE_ARG_AA_NUM,
+                                     &aa_num, sizeof(cl_uint));
+            if (strip_aa[i]) {
+                cl_wrap_enqueue(&cl_wrap, row*WIDTH, strip_aa[i], KERNEL_AATRACE);
+            }
+            aa_total += strip_aa[i];
+
+            strip_reads[i] = read_strip(&cl_wrap, buffer, first, keep, rows, row,
+                                        height, &strip_ends[i]);
+        }
+
+        /* Every pass writes its packed colors to the raytracer's 10:th arg. A strip
+           is converted for the output while the next ones are still on the device,
+           `rsink_submit` reports if any of them could not be written */
+        for (cl_uint i = 0; i < strips; i++) {
+            if (!strip_reads[i]) { continue; }
+
+            cl_wrap_wait(strip_reads[i]);
+            rsink_rows(&sink, strip_ends[i]);
+        }
+        rtimeline_end();
+    }
     gettimeofday(&stop, NULL);
 
-    long milli_time, seconds, useconds;
-    seconds = stop.tv_sec - start.tv_sec; //seconds
-    useconds = stop.tv_usec - start.tv_usec; //milliseconds
-    milli_time = ((seconds) * 1000 + useconds/1000.0);
-    printf("Done, took: %ld ms\n", milli_time);
+    printf("Done, took: %.0f ms\n", relapsed_ms(&start, &stop));
+
+    if (shadow_slots) {
+        printf("Shadow pass: %lu rays, took: %.0f ms (%.2f Mrays/s)\n",
+               (unsigned long)shadow_total, shadow_time,
+               shadow_total/(1000.0*(shadow_time > 0.0 ? shadow_time : 1.0)));
+    }
+
+    printf("Secondary pass: %lu rays, sort took: %.0f ms, trace took: %.0f ms\n",
+           (unsigned long)secondary_total, sort_time, secondary_time);
+
+    /* The aprons are traced more than once and counted as often */
+    cl_wrap_read_global_data(&cl_wrap, KERNEL_RAYTRACER, RAYTRACER_ARG_TRACE_STATS,
+                             trace_stats, sizeof(trace_stats));
+    printf("Average depth: %.2f segments per pixel (max depth %u, min weight %g%s)\n",
+           (double)trace_stats[TRACE_STAT_SEGMENTS]/traced, MAX_DEPTH, MIN_WEIGHT,
+           ROULETTE ? ", roulette" : "");
+    printf("Intersection tests: %.1f per pixel, %.1f per segment\n",
+           (double)trace_stats[TRACE_STAT_TESTS]/traced,
+           (double)trace_stats[TRACE_STAT_TESTS]/
+           (trace_stats[TRACE_STAT_SEGMENTS] ? trace_stats[TRACE_STAT_SEGMENTS] : 1));
+
+    if (aa_samples) {
+        printf("Anti-aliasing: %lu edge pixels, %lu extra rays "
+               "(%.1f%% of %ux supersampling)\n", (unsigned long)aa_total,
+               (unsigned long)aa_total*aa_samples, 100.0*aa_total/traced, aa_samples+1);
+    }
+
+    if (CHECK_PACKED_RAYS) {
+        /* The passes after raygen only change the colors of the rays, the device
+           holds the rays of the last band */
+        rpacked *rays = malloc(sizeof(rpacked)*WIDTH*pheight);
+        cl_wrap_read_global_data(&cl_wrap, KERNEL_RAYGEN, RAYGEN_ARG_RAYS, rays,
+                                 sizeof(rpacked)*WIDTH*pheight);
+        check_packed_rays(rays, band_corner, camera_origin, up, right,
+                          w_factor, h_factor, pwidth, pheight);
+        free(rays);
+    }
 
     cl_wrap_release(&cl_wrap);
 
-    png_dump("out/scene.png", buffer, WIDTH, HEIGHT);
+    if (!rsink_submit(&sink)) {
+        printf("ERROR:\tCannot write the frame to %s\n", sink.path);
+    }
+    rsink_close(&sink);
 
     free(ext_spheres);
     free(ext_planes);
     free(ext_lights);
-    free(buffer);
+    free(light_alias);
+    free(occluder_cache);
+    free(shadow_samples);
+    rfree_visibility(&visibility);
+    rfree_meshes(&meshes);
+    unmap_rmesh(&mesh_file);
+    free(shadow_num);
+    free(aa_nums);
+    free(strip_reads);
+    free(strip_counted);
+    free(strip_ends);
+    free(strip_aa);
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,179 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <CL/opencl.h>
+#include "cpu_light.h"
+
+
+/* Error of the soft shadow samplers against the sample count, on the CPU. A row of
+   shading points looks at a sphere light that an opaque sphere partly covers, so
+   the row crosses the penumbra. Every point estimates the share of the light it
+   sees from `spp` shadow rays, with the xorshift and trigonometry sampler the
+   kernels used before, with the bare Sobol table and with the table turned about
+   the z axis by a per pixel angle as the kernels index it now. Printed is the
+   root mean square error of the estimates over the points and frames, and of the
+   means of two neighbouring points, which the denoiser smooths alike */
+
+/* The same as in raypng */
+#define SHADOW_SAMPLE_TABLE 4096
+
+#define LIGHT_RADIUS    0.5f
+#define OCCLUDER_RADIUS 0.25f
+#define POINTS          4000
+#define FRAMES          4
+/* Samples of the reference visibility of every point */
+#define REFERENCE       (1 << 16)
+
+
+static const cl_float3 light_origin     = {.x = 0.0f, .y = 0.0f, .z = 0.0f};
+static const cl_float3 occluder_origin  = {.x = 0.3f, .y = -1.0f, .z = 0.0f};
+
+/* Shading point `i`, the row spans the shadow, the penumbra and the lit floor */
+static cl_float3 point(cl_uint i) {
+    return (cl_float3){.x = -1.5f+3.0f*i/(POINTS-1), .y = -2.5f, .z = 0.0f};
+}
+
+/* 1 if the segment from `from` to the light sample `to` misses the occluder */
+static int visible(cl_float3 from, cl_float3 to) {
+    cl_float3 d  = {.x = to.x-from.x, .y = to.y-from.y, .z = to.z-from.z};
+    cl_float3 oc = {.x = from.x-occluder_origin.x, .y = from.y-occluder_origin.y,
+                    .z = from.z-occluder_origin.z};
+
+    float a = d.x*d.x+d.y*d.y+d.z*d.z;
+    float b = 2.0f*(oc.x*d.x+oc.y*d.y+oc.z*d.z);
+    float c = oc.x*oc.x+oc.y*oc.y+oc.z*oc.z-OCCLUDER_RADIUS*OCCLUDER_RADIUS;
+    float disc = b*b-4.0f*a*c;
+    if (disc < 0.0f) { return 1; }
+
+    /* Blocked if the sphere is entered between the ends */
+    float t = (-b-sqrtf(disc))/(2.0f*a);
+    return !(t > 0.0f && t < 1.0f);
+}
+
+static cl_float3 on_light(cl_float3 unit) {
+    return (cl_float3){.x = light_origin.x+LIGHT_RADIUS*unit.x,
+                       .y = light_origin.y+LIGHT_RADIUS*unit.y,
+                       .z = light_origin.z+LIGHT_RADIUS*unit.z};
+}
+
+/* `xorshift32` of src/cl/primitives.cl, its range included */
+static float xorshift32(cl_uint* state) {
+    cl_uint x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+
+    return ((float)x)/2147483648.0f*2.0f;
+}
+
+/* The sampler the kernels used before the table, seeded with the pixel only */
+static float xorshift_visibility(cl_uint i, cl_uint spp) {
+    cl_uint state = i;
+    cl_uint seen = 0;
+
+    for (cl_uint j = 0; j < spp; j++) {
+        float theta = 2*M_PI*xorshift32(&state);
+        float phi = M_PI*xorshift32(&state);
+
+        cl_float3 unit = {.x = sinf(phi)*cosf(theta), .y = sinf(phi)*sinf(theta),
+                          .z = cosf(phi)};
+        seen += visible(point(i), on_light(unit));
+    }
+    return (float)seen/spp;
+}
+
+/* `shadow_sample_hash` of src/cl/primitives.cl */
+static cl_uint sample_hash(cl_uint x) {
+    x ^= x >> 16;
+    x *= 0x7FEB352Du;
+    x ^= x >> 15;
+    x *= 0x846CA68Bu;
+    x ^= x >> 16;
+    return x;
+}
+
+/* `shadow_sample_base` and `shadow_sample_rotation` of src/cl/primitives.cl for
+   the first light and bounce, unturned if `rotate` is 0 */
+static float table_visibility(const cl_float3* table, cl_uint i, cl_uint frame,
+                              cl_uint spp, int rotate) {
+    cl_uint base = (i+frame*1299709u)*spp;
+    cl_uint seen = 0;
+    float angle = rotate ? 2*M_PI*(sample_hash(i)*(1.0f/4294967296.0f)) : 0.0f;
+    float c = cosf(angle), s = sinf(angle);
+
+    for (cl_uint j = 0; j < spp; j++) {
+        cl_float3 unit = table[(base+j) & (SHADOW_SAMPLE_TABLE-1)];
+        cl_float3 turned = {.x = c*unit.x-s*unit.y, .y = s*unit.x+c*unit.y, .z = unit.z};
+        seen += visible(point(i), on_light(turned));
+    }
+    return (float)seen/spp;
+}
+
+int main(void) {
+    cl_float3   *table = rgen_shadow_samples(SHADOW_SAMPLE_TABLE);
+    cl_float3   *reference = rgen_shadow_samples(REFERENCE);
+    float       *truth = malloc(POINTS*sizeof(float));
+    float       *estimate[3];
+
+
+    estimate[0] = malloc(POINTS*sizeof(float));
+    estimate[1] = malloc(POINTS*sizeof(float));
+    estimate[2] = malloc(POINTS*sizeof(float));
+    if (!table || !reference || !truth || !estimate[0] || !estimate[1] ||
+        !estimate[2]) {
+        printf("ERROR:\tOut of memory for the sample tables\n");
+        exit(1);
+    }
+
+    for (cl_uint i = 0; i < POINTS; i++) {
+        cl_uint seen = 0;
+        for (cl_uint j = 0; j < REFERENCE; j++) {
+            seen += visible(point(i), on_light(reference[j]));
+        }
+        truth[i] = (float)seen/REFERENCE;
+    }
+
+    printf("Visibility RMSE of %u points x %u frames, light radius %.2f, occluder "
+           "radius %.2f\n", POINTS, FRAMES, LIGHT_RADIUS, OCCLUDER_RADIUS);
+    printf("spp  xorshift+trig  Sobol table  turned table  "
+           "(2px: xorshift / Sobol / turned)\n");
+
+    for (cl_uint spp = 1; spp <= 8; spp *= 2) {
+        double error[3] = {0.0, 0.0, 0.0}, pair_error[3] = {0.0, 0.0, 0.0};
+
+        for (cl_uint frame = 0; frame < FRAMES; frame++) {
+            for (cl_uint i = 0; i < POINTS; i++) {
+                estimate[0][i] = xorshift_visibility(i, spp);
+                estimate[1][i] = table_visibility(table, i, frame, spp, 0);
+                estimate[2][i] = table_visibility(table, i, frame, spp, 1);
+            }
+
+            for (cl_uint s = 0; s < 3; s++) {
+                for (cl_uint i = 0; i < POINTS; i++) {
+                    double e = estimate[s][i]-truth[i];
+                    error[s] += e*e;
+                }
+                for (cl_uint i = 0; i+1 < POINTS; i += 2) {
+                    double e = (estimate[s][i]+estimate[s][i+1]-truth[i]-truth[i+1])/2;
+                    pair_error[s] += e*e;
+                }
+            }
+        }
+
+        printf("%-4u %-14.3f %-12.3f %-13.3f %.3f / %.3f / %.3f\n", spp,
+               sqrt(error[0]/(POINTS*FRAMES)), sqrt(error[1]/(POINTS*FRAMES)),
+               sqrt(error[2]/(POINTS*FRAMES)),
+               sqrt(pair_error[0]/(POINTS/2*FRAMES)),
+               sqrt(pair_error[1]/(POINTS/2*FRAMES)),
+               sqrt(pair_error[2]/(POINTS/2*FRAMES)));
+    }
+
+    free(table);
+    free(reference);
+    free(truth);
+    free(estimate[0]);
+    free(estimate[1]);
+    free(estimate[2]);
+    return 0;
+}
@@ -0,0 +1,45 @@
+#include "src/cl/types.cl"             /* All used types */
+#include "src/cl/primitives.cl"        /* Intersection functions */
+
+
+
+/* Finds the pixels that need anti-aliasing: the ones where a 4-neighbour sees
+   another object or differs in luminance by more than `threshold`. Their indices
+   are appended to `aa_list` and counted in `aa_num` which must start at 0. The
+   `views_num` views of pwidth x pheight are stacked like in `raygen` and the
+   neighbours are looked up only in the pixel's own view.
+   A launch over a strip of rows with a global offset keeps its own list and count,
+   from the strip's first pixel on in `aa_list` and in the `aa_num` of its first row */
+__kernel void aadetect(__global rpacked* rays, __global int* hit_ids,
+                       uint pwidth, uint pheight, float threshold,
+                       __global uint* aa_list, __global uint* aa_num, uint views_num) {
+
+    uint id = get_global_id(0);
+    if (id >= pwidth*pheight*views_num) { return; }
+
+    uint first = id/(pwidth*pheight)*(pwidth*pheight);
+    int x = (id-first) % pwidth;
+    int y = (id-first) / pwidth;
+
+    int hit_id = hit_ids[id];
+    float lum = luminance(load_ray_rgb(&rays[id]));
+
+    int2 neighbours[4] = {(int2){1, 0}, (int2){-1, 0}, (int2){0, 1}, (int2){0, -1}};
+
+    bool edge = false;
+    for (uint i = 0; i < 4 && !edge; i++) {
+        int nx = x+neighbours[i].x;
+        int ny = y+neighbours[i].y;
+        if (nx < 0 || ny < 0 || nx >= (int)pwidth || ny >= (int)pheight) {
+            continue;
+        }
+
+        uint nid = first+ny*pwidth+nx;
+        edge = hit_ids[nid] != hit_id || fabs(luminance(load_ray_rgb(&rays[nid]))-lum) > threshold;
+    }
+
+    if (edge) {
+        uint strip = get_global_offset(0);
+        aa_list[strip+atomic_inc(&aa_num[strip/pwidth])] = id;
+    }
+}
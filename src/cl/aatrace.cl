@@ -0,0 +1,111 @@
+#include "src/cl/types.cl"             /* All used types */
+#include "src/cl/primitives.cl"        /* Intersection functions */
+#include "src/cl/trace.cl"             /* Recursive ray tracing */
+
+
+
+/* Traces `aa_samples` extra jittered primary rays for every pixel in `aa_list` and
+   averages them with the color the raytracer already found for the pixel. The
+   views are the same as for `raygen` */
+__kernel void aatrace(__global rpacked* rays,
+                      __global rsphere* spheres,
+                      __global rplane* planes, __global rlight* lights,
+                      uint spheres_num, uint planes_num, uint light_num,
+                      uint aa_num,
+                      read_only image2d_array_t im_arr,
+                      read_only image2d_array_t skybox,
+                      __global uint* output,
+                      __global rlight_alias* light_alias, uint light_samples,
+                      __global float3* shadow_samples, uint sample_mask, uint frame,
+                      __global uint* aa_list, uint aa_samples,
+                      __global rview* views, uint soft_shadows,
+                      __global uint* vis_bricks, __global uchar* vis_cells,
+                      rvis_grid vis_grid,
+                      __global rmesh* meshes, __global float* vertices,
+                      __global uint* indices, __global rmesh_node* mesh_nodes,
+                      uint mesh_num) {
+
+    rscene scene;
+#ifdef SCENE_LOCAL
+    /* The whole work group reads the scene from one local copy */
+    __local rsphere local_spheres[SCENE_SPHERES];
+    __local rplane  local_planes[SCENE_PLANES];
+    __local rlight  local_lights[SCENE_LIGHTS];
+
+    stage_scene(spheres, planes, lights, spheres_num, planes_num, light_num,
+                local_spheres, local_planes, local_lights);
+
+    scene.spheres           = local_spheres;
+    scene.planes            = local_planes;
+    scene.lights            = local_lights;
+#else
+    scene.spheres           = spheres;
+    scene.planes            = planes;
+    scene.lights            = lights;
+#endif
+
+    uint i = get_global_id(0);
+    if (i >= aa_num) {
+        return;
+    }
+
+    uint id = aa_list[i];
+
+    scene.spheres_num       = spheres_num;
+    scene.planes_num        = planes_num;
+    scene.light_num         = light_num;
+    scene.meshes.meshes     = meshes;
+    scene.meshes.vertices   = vertices;
+    scene.meshes.indices    = indices;
+    scene.meshes.nodes      = mesh_nodes;
+    scene.meshes.mesh_num   = mesh_num;
+    scene.light_alias       = light_alias;
+    scene.light_samples     = light_samples;
+    scene.shadow_samples    = shadow_samples;
+    scene.sample_mask       = sample_mask;
+    scene.frame             = frame;
+    scene.soft_shadows      = soft_shadows;
+    scene.vis_bricks        = vis_bricks;
+    scene.vis_cells         = vis_cells;
+    scene.vis_grid          = vis_grid;
+    scene.segments          = 0;
+    scene.tests             = 0;
+
+    uint pixels = views[0].pwidth*views[0].pheight;
+    rview view = views[id/pixels];
+
+    uint local_id = id%pixels;
+
+    float w = (float)(local_id % view.pwidth);
+    float h = (float)(local_id / view.pwidth);
+
+    float3 rgb = load_ray_rgb(&rays[id]);
+
+    for (uint j = 1; j <= aa_samples; j++) {
+        /* Halton points inside the pixel, the raytracer's ray went through its
+           corner */
+        float jw = radical_inverse(j, 2);
+        float jh = radical_inverse(j, 3);
+
+        float3 vec = view.im_corner+view.right*view.w_factor*(w+jw)-
+                         view.up*view.h_factor*(h+jh);
+
+        rray ray;
+        ray.origin  = view.origin;
+        ray.dir     = normalize(vec);
+        ray.rgb     = (float3){0.0f, 0.0f, 0.0f};
+        ray.depth   = 0;
+
+        /* All shadow rays are traced inline, other seeds for the light sampling */
+        uint    shadow_count = 0;
+        int     hit_id;
+        rgbuffer gbuf;
+        rgb += trace_ray(ray, DEFAULT_N, 1.0f, id+j*65537u, &scene, im_arr, skybox,
+                         NULL, 0, &shadow_count, NULL, NULL, &hit_id, &gbuf);
+    }
+
+    rgb /= (float)(aa_samples+1);
+
+    store_ray_rgb(&rays[id], rgb);
+    output[id] = pack_rgb(rgb);
+}
@@ -0,0 +1,80 @@
+#include "src/cl/types.cl"             /* All used types */
+#include "src/cl/primitives.cl"        /* Intersection functions */
+
+
+
+/* Edge stopping strengths of the denoiser */
+#define DENOISE_SIGMA_NORMAL 64.0f     /* Exponent on the cosine between normals */
+#define DENOISE_SIGMA_DEPTH 0.05f      /* Depth difference relative to the depth */
+#define DENOISE_SIGMA_ALBEDO 0.02f     /* Squared albedo distance */
+
+
+
+/* One pass of the edge-avoiding a-trous wavelet filter (Dammertz et al.) with a
+   5x5 B3 spline kernel whose taps are 2^pass pixels apart. Taps are weighted down
+   by normal, depth and albedo differences in the primary hits so only noise on the
+   same surface gets smoothed, pixels without a normal in `gbuffer` are kept as is.
+   The first pass reads the raytracer's colors, the passes in between ping-pong
+   between `ping` and `pong` and the last one writes back and packs the output.
+   The `views_num` views of pwidth x pheight are stacked like in `raygen`, taps
+   never reach into another view */
+__kernel void denoise(__global rpacked* rays, __global float4* ping, __global float4* pong,
+                      __global rgbuffer* gbuffer, uint pwidth, uint pheight,
+                      uint pass, uint passes, __global uint* output, uint views_num) {
+
+    uint id = pixel_id(pwidth);
+    if (id >= pwidth*pheight*views_num) { return; }
+
+    __global float4 *src = (pass % 2) ? ping : pong;
+    __global float4 *dst = (pass % 2) ? pong : ping;
+
+    rgbuffer g = gbuffer[id];
+    float3 rgb = (pass == 0) ? load_ray_rgb(&rays[id]) : load_color(src, id);
+
+    if (dot(g.normal, g.normal) > 0.0f) {
+        const float kernel_h[3] = {3.0f/8.0f, 1.0f/4.0f, 1.0f/16.0f};
+
+        uint first = id/(pwidth*pheight)*(pwidth*pheight);
+        int x = (id-first) % pwidth;
+        int y = (id-first) / pwidth;
+        int step = 1 << pass;
+
+        float3 sum = (float3){0.0f, 0.0f, 0.0f};
+        float weights = 0.0f;
+
+        for (int dy = -2; dy <= 2; dy++) {
+            for (int dx = -2; dx <= 2; dx++) {
+                int nx = x+dx*step;
+                int ny = y+dy*step;
+                if (nx < 0 || ny < 0 || nx >= (int)pwidth || ny >= (int)pheight) {
+                    continue;
+                }
+
+                uint nid = first+ny*pwidth+nx;
+                rgbuffer q = gbuffer[nid];
+
+                float w = kernel_h[abs(dx)]*kernel_h[abs(dy)];
+                w *= shade_pow(max(0.0f, dot(g.normal, q.normal)), DENOISE_SIGMA_NORMAL);
+                if (w == 0.0f) { continue; }
+
+                float3 albedo_d = g.albedo-q.albedo;
+                w *= shade_exp(-fabs(g.depth-q.depth)/(DENOISE_SIGMA_DEPTH*g.depth*step));
+                w *= shade_exp(-dot(albedo_d, albedo_d)/DENOISE_SIGMA_ALBEDO);
+
+                sum += w*((pass == 0) ? load_ray_rgb(&rays[nid]) : load_color(src, nid));
+                weights += w;
+            }
+        }
+
+        /* The center tap always has a weight */
+        rgb = sum/weights;
+    }
+
+    if (pass+1 < passes) {
+        store_color(dst, id, rgb);
+        return;
+    }
+
+    store_ray_rgb(&rays[id], rgb);
+    output[id] = pack_rgb(rgb);
+}
@@ -0,0 +1,43 @@
+#ifndef __PRECISION_CL
+#define __PRECISION_CL
+
+/* Precision tiers. The exact tier uses the full precision built-ins everywhere. The
+   host builds the fast tier with PRECISION_FAST, -cl-mad-enable and
+   -cl-no-signed-zeros, the shading and the denoiser then use the native functions
+   and the colors between denoise passes are kept as half. Ray generation and the
+   intersection tests call the exact built-ins in both tiers, an error there moves
+   the geometry instead of changing a color a little, but the compiler may fuse
+   their multiplies and adds too. Infinities stay, the tests start from INFINITY.
+   raygate.c compares the images of both tiers */
+#ifdef PRECISION_FAST
+/* The native powr of 0 is undefined, a smallest float base still gives 0 or 1 */
+#define shade_pow(x, y)         native_powr(fmax(x, FLT_MIN), y)
+#define shade_exp(x)            native_exp(x)
+#define shade_normalize(v)      fast_normalize(v)
+#define shade_distance(a, b)    fast_distance(a, b)
+#else
+#define shade_pow(x, y)         pow(x, y)
+#define shade_exp(x)            exp(x)
+#define shade_normalize(v)      normalize(v)
+#define shade_distance(a, b)    distance(a, b)
+#endif
+
+/* Color `id` of a denoise buffer. The fast tier packs them as 4 halves, so a pass
+   reads and writes half the bytes and the back half of the buffer stays unused */
+float3 load_color(__global float4* colors, uint id) {
+#ifdef PRECISION_FAST
+    return vload_half4(id, (__global half*)colors).xyz;
+#else
+    return colors[id].xyz;
+#endif
+}
+
+void store_color(__global float4* colors, uint id, float3 rgb) {
+#ifdef PRECISION_FAST
+    vstore_half4((float4){rgb.x, rgb.y, rgb.z, 0.0f}, id, (__global half*)colors);
+#else
+    colors[id] = (float4){rgb.x, rgb.y, rgb.z, 0.0f};
+#endif
+}
+
+#endif
@@ -6,6 +6,11 @@
 #define INVERSE_SQUARE_LIGHT M_1_PI_F
 #define TRANSPERENT_THROUGH 0.8f
 
+/* The triangle test settles the edges through the ray in double where it can */
+#ifdef cl_khr_fp64
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+#endif
+
 
 #define PRINT_VEC(v) printf("%f %f %f\n", v.x, v.y, v.z)
 
@@ -112,7 +117,7 @@ typedef struct {
     uint x;
 } xorshift32_state;
 
-/* Pseudo random generator for soft shadow sampling */
+/* Pseudo random generator for stochastic light picking */
 float xorshift32(xorshift32_state *state) {
     uint x = state->x;
     x ^= x << 13;
@@ -124,6 +129,54 @@ float xorshift32(xorshift32_state *state) {
     return ((float)x)/2147483648.0f*2.0f;
 }
 
+/* Same generator but uniform in [0, 1) */
+float xorshift32_unit(xorshift32_state *state) {
+    xorshift32(state);
+    return (float)(state->x >> 8)*(1.0f/16777216.0f);
+}
+
+/* Picks a light index from the power weighted alias table, `pdf` is set to the
+   probability of having picked the returned light */
+uint sample_light(__global rlight_alias *table, uint light_num,
+                  xorshift32_state *state, float *pdf) {
+    float u = xorshift32_unit(state)*(float)light_num;
+    uint bucket = min((uint)u, light_num-1);
+
+    rlight_alias entry = table[bucket];
+    uint i = (u-(float)bucket < entry.prob) ? bucket : entry.alias;
+
+    *pdf = table[i].pdf;
+    return i;
+}
+
+/* Index of the first soft shadow sample of a pixel, light, bounce and frame in
+   the shadow sample table. Runs start at a multiple of `count`, so for a power of
+   two `count` they are stratified. Neighbouring pixels take neighbouring runs of
+   the sequence which keeps their samples stratified together as well */
+uint shadow_sample_base(uint pixel, uint light, uint depth, uint frame, uint count) {
+    return (pixel+light*7919u+depth*104729u+frame*1299709u)*count;
+}
+
+/* Integer hash with full avalanche, for seeds that are only a pixel index */
+uint shadow_sample_hash(uint x) {
+    x ^= x >> 16;
+    x *= 0x7FEB352Du;
+    x ^= x >> 15;
+    x *= 0x846CA68Bu;
+    x ^= x >> 16;
+    return x;
+}
+
+/* Cosine and sine of the angle a pixel turns its shadow samples by about the z
+   axis. The table index repeats every table size/`count` pixels, the turn is a
+   Cranley-Patterson rotation of the table's azimuth that keeps those pixels from
+   sharing the same samples while each run stays stratified */
+float2 shadow_sample_rotation(uint pixel) {
+    float angle = 2.0f*M_PI_F*(float)shadow_sample_hash(pixel)*(1.0f/4294967296.0f);
+    float c, s = sincos(angle, &c);
+    return (float2){c, s};
+}
+
 float3 reflect(float3 *incident, float3 *normal) {
     float cosI = -dot(*normal, *incident);
     return *incident + 2*cosI * (*normal);
@@ -159,6 +212,95 @@ float compute_schlick(float n1, float n2, float3* incident, float3 *normal) {
     return r0+(1.0f-r0)*x*x*x*x*x;
 }
 
+/* Index of the work item's pixel. 2D launches cover the image in tiles and may
+   reach past its right edge, those work items get UINT_MAX. 1D launches index
+   the pixels directly */
+uint pixel_id(uint pwidth) {
+    if (get_work_dim() == 1) { return get_global_id(0); }
+    if (get_global_id(0) >= pwidth) { return UINT_MAX; }
+
+    return get_global_id(1)*pwidth+get_global_id(0);
+}
+
+/* Compresses a ray, see `rpacked` */
+rpacked pack_ray(rray ray) {
+    rpacked packed;
+
+    packed.origin[0] = ray.origin.x;
+    packed.origin[1] = ray.origin.y;
+    packed.origin[2] = ray.origin.z;
+
+    /* Project the direction onto the octahedron and fold the lower half over */
+    float3 d = ray.dir/(fabs(ray.dir.x)+fabs(ray.dir.y)+fabs(ray.dir.z));
+    float2 o = d.xy;
+    if (d.z < 0.0f) {
+        o = (1.0f-fabs(d.yx))*(float2){(d.x >= 0.0f) ? 1.0f : -1.0f,
+                                        (d.y >= 0.0f) ? 1.0f : -1.0f};
+    }
+
+    ushort2 e = convert_ushort2_sat_rte((o*0.5f+0.5f)*65535.0f);
+    packed.dir[0] = e.x;
+    packed.dir[1] = e.y;
+
+    vstore_half3(ray.rgb, 0, (half*)packed.rgb);
+    packed.depth_flags = ray.depth & RPACKED_DEPTH_MASK;
+
+    return packed;
+}
+
+/* Expands a compressed ray, see `rpacked` */
+rray unpack_ray(rpacked packed) {
+    rray ray;
+
+    ray.origin = (float3){packed.origin[0], packed.origin[1], packed.origin[2]};
+
+    float2 o = (float2){packed.dir[0], packed.dir[1]}/65535.0f*2.0f-1.0f;
+    float3 d = (float3){o.x, o.y, 1.0f-fabs(o.x)-fabs(o.y)};
+    float  t = max(-d.z, 0.0f);
+    d.x += (d.x >= 0.0f) ? -t : t;
+    d.y += (d.y >= 0.0f) ? -t : t;
+
+    ray.dir     = normalize(d);
+    ray.rgb     = vload_half3(0, (half*)packed.rgb);
+    ray.depth   = packed.depth_flags & RPACKED_DEPTH_MASK;
+
+    return ray;
+}
+
+/* Color of a compressed ray in global memory */
+float3 load_ray_rgb(__global rpacked *ray) {
+    return vload_half3(0, (__global half*)ray->rgb);
+}
+
+void store_ray_rgb(__global rpacked *ray, float3 rgb) {
+    vstore_half3(rgb, 0, (__global half*)ray->rgb);
+}
+
+/* Packs a linear rgb color into the 0RGB output pixel format */
+uint pack_rgb(float3 rgb) {
+    float3 rgb_ = clamp(rgb, 0.0f, 1.0f)*255.0f;
+    return 0 << 24 | (uint)rgb_.x << 16 | (uint)rgb_.y << 8 | (uint)rgb_.z;
+}
+
+/* Relative luminance of a clamped linear rgb color */
+float luminance(float3 rgb) {
+    return dot(clamp(rgb, 0.0f, 1.0f), (float3){0.2126f, 0.7152f, 0.0722f});
+}
+
+/* Radical inverse of `i` in the given base, used for the Halton sequence */
+float radical_inverse(uint i, uint base) {
+    float inv_base = 1.0f/(float)base;
+    float f = inv_base;
+    float r = 0.0f;
+
+    while (i > 0) {
+        r += f*(float)(i % base);
+        i /= base;
+        f *= inv_base;
+    }
+    return r;
+}
+
 int euclidean_modulo(int a, int b) {
   int m = a % b;
   if (m < 0) {
@@ -258,143 +400,504 @@ float3 plane_texture_pixel(rplane *plane, float3 *interpoint, image2d_array_t im
     return pixelf;
 }
 
+/* Slab test of the ray against a box. Returns where the ray enters it, INFINITY
+   if it misses the box or enters it more than `t_max` away. `inv_dir` is 1/dir.
+   The far distance is widened by a few ulps so the rounding cannot lose a
+   triangle lying in a face of the box */
+float enter_box(rray *ray, float3 inv_dir, float3 box_min, float3 box_max, float t_max) {
+    float3 t0 = (box_min-ray->origin)*inv_dir;
+    float3 t1 = (box_max-ray->origin)*inv_dir;
+
+    float3 slab_near = fmin(t0, t1);
+    float3 slab_far  = fmax(t0, t1);
+
+    float t_near = fmax(fmax(slab_near.x, slab_near.y), slab_near.z);
+    float t_far  = fmin(fmin(slab_far.x, slab_far.y), slab_far.z)*1.0000004f;
+
+    return (t_near <= t_far && t_far > 0.0f && t_near <= t_max) ? t_near : INFINITY;
+}
+
+/* Ray set up once for `intersect_triangle`. Its axes are permuted so it runs
+   along z the most, `k` holds the source axis of the permuted x, y and z */
+typedef struct {
+    int3    k;
+    float3  shear;      /* Sx, Sy and Sz of the shear onto the z axis */
+    float3  origin;     /* Permuted origin */
+} rtriangle_ray;
+
+float axis_of(float3 v, int k) {
+    return (k == 0) ? v.x : (k == 1) ? v.y : v.z;
+}
+
+rtriangle_ray triangle_ray(rray *ray) {
+    rtriangle_ray r;
+    float3 d = fabs(ray->dir);
+
+    int kz = (d.x > d.y) ? ((d.x > d.z) ? 0 : 2) : ((d.y > d.z) ? 1 : 2);
+    int kx = (kz+1) % 3;
+    int ky = (kx+1) % 3;
+
+    /* Swapped for a ray going down z, which keeps the sign of the edge functions */
+    if (axis_of(ray->dir, kz) < 0.0f) {
+        int k = kx;
+        kx = ky;
+        ky = k;
+    }
+
+    float dz = axis_of(ray->dir, kz);
+
+    r.k         = (int3){kx, ky, kz};
+    r.shear     = (float3){axis_of(ray->dir, kx)/dz, axis_of(ray->dir, ky)/dz, 1.0f/dz};
+    r.origin    = (float3){axis_of(ray->origin, kx), axis_of(ray->origin, ky),
+                           axis_of(ray->origin, kz)};
+    return r;
+}
+
+/* Watertight ray-triangle test of Woop, Benthin and Wald (2013) on corners already
+   permuted like the ray. A ray through an edge or vertex shared by triangles hits
+   at least one of them, so no rays slip through the seams of a mesh. Both sides
+   are hit, `t` is set if the hit is at most `t_max` away */
+bool intersect_triangle(rtriangle_ray *r, float3 a, float3 b, float3 c, float t_max,
+                        float *t) {
+    float3 A = a-r->origin;
+    float3 B = b-r->origin;
+    float3 C = c-r->origin;
+
+    float Ax = A.x-r->shear.x*A.z;
+    float Ay = A.y-r->shear.y*A.z;
+    float Bx = B.x-r->shear.x*B.z;
+    float By = B.y-r->shear.y*B.z;
+    float Cx = C.x-r->shear.x*C.z;
+    float Cy = C.y-r->shear.y*C.z;
+
+    /* Scaled barycentric coordinates */
+    float U = Cx*By-Cy*Bx;
+    float V = Ax*Cy-Ay*Cx;
+    float W = Bx*Ay-By*Ax;
+
+#ifdef cl_khr_fp64
+    /* On an edge the rounded products may put the ray outside of both triangles
+       sharing it */
+    if (U == 0.0f || V == 0.0f || W == 0.0f) {
+        U = (float)((double)Cx*(double)By-(double)Cy*(double)Bx);
+        V = (float)((double)Ax*(double)Cy-(double)Ay*(double)Cx);
+        W = (float)((double)Bx*(double)Ay-(double)By*(double)Ax);
+    }
+#endif
+
+    if ((U < 0.0f || V < 0.0f || W < 0.0f) && (U > 0.0f || V > 0.0f || W > 0.0f)) {
+        return false;
+    }
+
+    float det = U+V+W;
+    if (det == 0.0f) {
+        return false;
+    }
+
+    float T = U*r->shear.z*A.z+V*r->shear.z*B.z+W*r->shear.z*C.z;
+
+    /* 0 < T/det <= t_max without the division */
+    if ((det > 0.0f) ? (T <= 0.0f || T > t_max*det) : (T >= 0.0f || T < t_max*det)) {
+        return false;
+    }
+
+    *t = T/det;
+    return true;
+}
+
+/* Tests the ray against triangle `i` of the mesh. The vertex array of every axis
+   is read in the permuted order of the ray */
+bool intersect_mesh_triangle(rmesh_scene *meshes, __global rmesh *mesh,
+                             rtriangle_ray *r, uint i, float t_max, float *t) {
+    __global float* vertices = meshes->vertices+3*mesh->first_vertex;
+    __global uint*  corners  = meshes->indices+3*mesh->first_triangle;
+
+    __global float* px = vertices+r->k.x*mesh->vertex_num;
+    __global float* py = vertices+r->k.y*mesh->vertex_num;
+    __global float* pz = vertices+r->k.z*mesh->vertex_num;
+
+    uint a = corners[i];
+    uint b = corners[mesh->triangle_num+i];
+    uint c = corners[2*mesh->triangle_num+i];
+
+    return intersect_triangle(r, (float3){px[a], py[a], pz[a]},
+                                 (float3){px[b], py[b], pz[b]},
+                                 (float3){px[c], py[c], pz[c]}, t_max, t);
+}
+
+/* Geometric normal of triangle `i` of the mesh, counter-clockwise corners face it */
+float3 mesh_normal(rmesh_scene *meshes, __global rmesh *mesh, uint i) {
+    __global float* vertices = meshes->vertices+3*mesh->first_vertex;
+    __global uint*  corners  = meshes->indices+3*mesh->first_triangle;
+    uint            n        = mesh->vertex_num;
+
+    uint a = corners[i];
+    uint b = corners[mesh->triangle_num+i];
+    uint c = corners[2*mesh->triangle_num+i];
+
+    float3 A = (float3){vertices[a], vertices[n+a], vertices[2*n+a]};
+    float3 B = (float3){vertices[b], vertices[n+b], vertices[2*n+b]};
+    float3 C = (float3){vertices[c], vertices[n+c], vertices[2*n+c]};
+
+    return normalize(cross(B-A, C-A));
+}
+
+/* Walk of a ray through a mesh hierarchy, the nearer child of a node first */
+typedef struct {
+    __global rmesh_node*    nodes;
+    float3                  inv_dir;        /* 1/dir of the ray */
+
+    int                     node;           /* Next node, -1 to take one off the stack */
+    uint                    top;
+    uint                    stack[RMESH_MAX_DEPTH];     /* Farther children */
+    float                   entry[RMESH_MAX_DEPTH];     /* Where the ray enters them */
+} rmesh_walk;
+
+/* Starts the walk at the root of the mesh, if the ray enters it before `t_max` */
+void begin_walk(rmesh_walk *walk, rray *ray, rmesh_scene *meshes,
+                __global rmesh *mesh, float t_max, ulong *tests) {
+    __global rmesh_node *root = meshes->nodes+mesh->first_node;
+
+    walk->nodes     = root;
+    walk->inv_dir   = 1.0f/ray->dir;
+    walk->top       = 0;
+    walk->node      = (enter_box(ray, walk->inv_dir, vload3(0, root->min),
+                                 vload3(0, root->max), t_max) < INFINITY) ? 0 : -1;
+    (*tests)++;
+}
+
+/* The next leaf of the walk the ray enters at most `t_max` away, NULL once there
+   are none. `t_max` may shrink between the calls, the farther nodes left behind
+   are skipped then. The boxes tested are added to `tests` */
+__global rmesh_node* next_leaf(rmesh_walk *walk, rray *ray, float t_max, ulong *tests) {
+    while (true) {
+        if (walk->node < 0) {
+            do {
+                if (walk->top == 0) { return NULL; }
+                walk->top--;
+            } while (walk->entry[walk->top] > t_max);
+
+            walk->node = walk->stack[walk->top];
+        }
+
+        __global rmesh_node *node = &walk->nodes[walk->node];
+        walk->node = -1;
+
+        if (node->count > 0) { return node; }
+
+        __global rmesh_node *first  = &walk->nodes[node->index];
+        __global rmesh_node *second = first+1;
+
+        float t_first  = enter_box(ray, walk->inv_dir, vload3(0, first->min),
+                                   vload3(0, first->max), t_max);
+        float t_second = enter_box(ray, walk->inv_dir, vload3(0, second->min),
+                                   vload3(0, second->max), t_max);
+        *tests += 2;
+
+        if (t_first == INFINITY && t_second == INFINITY) { continue; }
+
+        uint  near   = (t_first <= t_second) ? node->index : node->index+1;
+        float t_far  = fmax(t_first, t_second);
+
+        /* The farther child waits on the stack, one entry per level at most */
+        if (t_far < INFINITY) {
+            walk->stack[walk->top] = (near == node->index) ? node->index+1 : node->index;
+            walk->entry[walk->top] = t_far;
+            walk->top++;
+        }
+        walk->node = near;
+    }
+}
+
+/* Share of the light the meshes let through between the ray's origin and `t`. An
+   opaque triangle ends the path, its index among all triangles of the scene goes
+   to `occluder`. A transparent mesh lets TRANSPERENT_THROUGH through once, like a
+   transparent sphere */
+float mesh_shadow(rray *ray, float t, rmesh_scene *meshes, uint *occluder) {
+    float opacity = 1.0f;
+
+    if (meshes->mesh_num == 0) {
+        return opacity;
+    }
+
+    rtriangle_ray tri = triangle_ray(ray);
+    ulong tests = 0;
+
+    for (uint m = 0; m < meshes->mesh_num; m++) {
+        __global rmesh *mesh = &meshes->meshes[m];
+        __global rmesh_node *leaf;
+        rmesh_walk walk;
+        bool through = false;
+
+        begin_walk(&walk, ray, meshes, mesh, t, &tests);
+        while (!through && (leaf = next_leaf(&walk, ray, t, &tests)) != NULL) {
+            for (uint i = leaf->index; i < leaf->index+leaf->count; i++) {
+                float _t;
+                if (!intersect_mesh_triangle(meshes, mesh, &tri, i, t, &_t) || _t >= t) {
+                    continue;
+                }
+
+                if (mesh->material.transperent) {
+                    opacity *= TRANSPERENT_THROUGH;
+                    through = true;
+                    break;
+                }
+
+                *occluder = mesh->first_triangle+i;
+                return 0.0f;
+            }
+        }
+    }
+
+    return opacity;
+}
+
 
+#ifdef LEGACY_TRAVERSAL
+/* The light pass the single pass of `findClosestIntersection` replaced, built with
+   LEGACY_TRAVERSAL to compare their intersection tests. It finds the closest light
+   and tests the spheres and planes again for an opaque one at or before it. The
+   meshes came later, their blockers are found like shadow rays and not counted */
 bool findLightIntersection(rray *ray,
-                        __global rlight *lights,
-                        __global rsphere *spheres,
-                        __global rplane *planes,
-                        uint light_num,
-                        uint sphere_num,
-                        uint plane_num,
-                        float3 *color) {
-    bool did_intersect = false;
+                           SCENE_AS rlight *lights,
+                           SCENE_AS rsphere *spheres,
+                           SCENE_AS rplane *planes,
+                           uint light_num, uint spheres_num, uint planes_num,
+                           rmesh_scene *meshes, float3 *color, ulong *tests) {
     float t = INFINITY;
-    float3 color_;
+    int light_id = -1;
 
-    for (uchar i = 0; i < light_num; i++) {
-        rlight light = lights[i];
+    for (uint i = 0; i < light_num; i++) {
+        float3 origin = lights[i].origin;
 
         float _t;
-        bool _intersect = intersect_sphere(ray, &light.origin, light.radius, &_t);
-        if (!_intersect || _t >= t) {
-            continue;
+        (*tests)++;
+        if (intersect_sphere(ray, &origin, lights[i].radius, &_t) && _t < t) {
+            t = _t;
+            light_id = i;
         }
-
-        t = _t;     
-        float3 interpoint = ray->origin+ray->dir*t;
-        float d = distance(ray->origin, interpoint);
-
-        color_ = light.rgb*light.intensity*INVERSE_SQUARE_LIGHT*(1/d*d);
-        did_intersect = true;
     }
 
-    /* If have not intersected with a light: return */
-    if (!did_intersect) { return false; }
+    if (light_id < 0) { return false; }
+
+    for (uint i = 0; i < spheres_num; i++) {
+        float3 origin = spheres[i].origin;
 
-    for (uint i = 0; i < sphere_num; i++) {
-        rsphere sphere = spheres[i];
-        
         float _t;
-        bool _intersect = intersect_sphere(ray, &sphere.origin, sphere.radius, &_t);
-        if (_intersect && _t <= t && !sphere.material.transperent) {
-            /* Did NOT intersect with light object because of a solid object */
+        (*tests)++;
+        if (intersect_sphere(ray, &origin, spheres[i].radius, &_t) && _t <= t &&
+            !spheres[i].material.transperent) {
             return false;
         }
     }
 
-    for (uint i = 0; i < plane_num; i++) {
-        rplane      plane = planes[i];
+    for (uint i = 0; i < planes_num; i++) {
+        float3 plane_normal = planes[i].normal;
+        float3 point_in_plane = planes[i].point_in_plane;
 
         float _t;
-        bool _intersect = intersect_plane(ray, &plane.normal, &plane.point_in_plane,&_t);
-        if (_intersect && _t <= t) {
+        (*tests)++;
+        if (intersect_plane(ray, &plane_normal, &point_in_plane, &_t) && _t <= t) {
             return false;
         }
     }
 
-    /* If no previous returns, the ray did indeed intersect with a light object */ 
-    *color = color_;
+    uint occluder;
+    if (mesh_shadow(ray, t, meshes, &occluder) == 0.0f) { return false; }
+
+    rlight light = lights[light_id];
+
+    float3 interpoint = ray->origin+ray->dir*t;
+    float d = distance(ray->origin, interpoint);
+
+    *color = light.rgb*light.intensity*INVERSE_SQUARE_LIGHT*(1/d*d);
     return true;
 }
+#endif
+
+
+/*  RETURN CLOSEST_NONE:  NO INTERSECTION
+    RETURN CLOSEST_SOLID: INTERSECTION SOLID OBJECT
+    RETURN CLOSEST_LIGHT: INTERSECTION LIGHT OBJECT */
+#define CLOSEST_NONE    0
+#define CLOSEST_SOLID   1
+#define CLOSEST_LIGHT   2
+
+/* Finds the closest hit among the lights, spheres, planes and meshes in a single
+   pass over the scene. A light is hit if no opaque object lies at or before it,
+   transparent spheres and meshes in front of a light are looked through. A light
+   hit sets `color`, a solid one the point, normal and material of the closest
+   object only, and `object_id` indexes the spheres followed by the planes and the
+   meshes. The objects, hierarchy boxes and triangles tested are added to `tests`.
+   With LEGACY_TRAVERSAL the lights are found by `findLightIntersection` first and
+   the pass takes the solid objects only */
+uint findClosestIntersection(rray *ray,
+                             SCENE_AS rlight *lights,
+                             SCENE_AS rsphere *spheres,
+                             SCENE_AS rplane *planes,
+                             uint light_num, uint spheres_num, uint planes_num,
+                             rmesh_scene *meshes,
+                             float3* intersection, float3* normal, rmaterial* material,
+                             int* object_id, float3 *color, ulong *tests,
+                             read_only image2d_array_t im_arr) {
+
+    float   t_light     = INFINITY;
+    float   t           = INFINITY;
+    int     light_id    = -1;
+    int     target_id   = -1;
+    uint    triangle    = 0;
+    bool    blocked     = false;
+
+#ifdef LEGACY_TRAVERSAL
+    if (findLightIntersection(ray, lights, spheres, planes, light_num, spheres_num,
+                              planes_num, meshes, color, tests)) {
+        return CLOSEST_LIGHT;
+    }
+    light_num = 0;
+#endif
 
-/*  RETURN 0: NO INTERSECTION
-    RETURN 1: INTERSECTION SOLID OBJECT */
-bool findSolidIntersection(rray *ray,
-                      __global rsphere* spheres, __global rplane* planes,
-                      uchar spheres_num, uchar planes_num,
-                      float3* intersection, float3* normal, rmaterial* material,
-                      read_only image2d_array_t im_arr) {
-                        
-    rmaterial           transfer_material;
+    for (uint i = 0; i < light_num; i++) {
+        float3 origin = lights[i].origin;
 
-    bool did_intersect      = false;
+        float _t;
+        (*tests)++;
+        bool _intersect = intersect_sphere(ray, &origin, lights[i].radius, &_t);
+        if (_intersect && _t < t_light) {
+            t_light = _t;
+            light_id = i;
+        }
+    }
 
-    float t                 = INFINITY;
-    float3 target_normal;
-    float3 interpoint;
+    for (uint i = 0; i < spheres_num; i++) {
+        float3 origin = spheres[i].origin;
 
-    /* Find closest intersection with spheres */
-    for (uchar i = 0; i < spheres_num; i++) {
-        rsphere sphere = spheres[i];
-        
         float _t;
-        bool _intersect = intersect_sphere(ray, &sphere.origin, sphere.radius, &_t);
-        if (!_intersect || _t >= t) {
+        (*tests)++;
+        bool _intersect = intersect_sphere(ray, &origin, spheres[i].radius, &_t);
+        if (!_intersect) {
             continue;
         }
 
-        t = _t;
-        interpoint = ray->origin+ray->dir*t;
-        target_normal = normalize(interpoint-sphere.origin);
-        /* To avoid self shadow */
-        interpoint += target_normal*EPSILON;
-
-        transfer_material = sphere.material;
-        did_intersect = true;
+        if (_t <= t_light && !spheres[i].material.transperent) { blocked = true; }
+        if (_t < t) {
+            t = _t;
+            target_id = i;
+        }
     }
 
-    /* Find closest intersection with planes */
-    for (uchar i = 0; i < planes_num; i++) {
-        rplane      plane = planes[i];
+    for (uint i = 0; i < planes_num; i++) {
+        float3 plane_normal = planes[i].normal;
+        float3 point_in_plane = planes[i].point_in_plane;
 
         float _t;
-        bool _intersect = intersect_plane(ray, &plane.normal, &plane.point_in_plane,&_t);
-        if (!_intersect || _t >= t) {
+        (*tests)++;
+        bool _intersect = intersect_plane(ray, &plane_normal, &point_in_plane, &_t);
+        if (!_intersect) {
             continue;
         }
-        
-        t = _t;
-        interpoint = ray->origin+ray->dir*t;
 
-        target_normal = plane.normal;
+        if (_t <= t_light) { blocked = true; }
+        if (_t < t) {
+            t = _t;
+            target_id = spheres_num+i;
+        }
+    }
+
+    /* Only the leaves of the mesh hierarchies the ray enters before both the
+       closest hit and the light are tested, nearest first */
+    if (meshes->mesh_num > 0) {
+        rtriangle_ray tri = triangle_ray(ray);
+
+        for (uint m = 0; m < meshes->mesh_num; m++) {
+            __global rmesh *mesh = &meshes->meshes[m];
+            __global rmesh_node *leaf;
+            rmesh_walk walk;
+            float bound = (light_id >= 0) ? fmax(t, t_light) : t;
+
+            begin_walk(&walk, ray, meshes, mesh, bound, tests);
+            while ((leaf = next_leaf(&walk, ray, bound, tests)) != NULL) {
+                *tests += leaf->count;
+
+                for (uint i = leaf->index; i < leaf->index+leaf->count; i++) {
+                    float _t;
+                    if (!intersect_mesh_triangle(meshes, mesh, &tri, i, bound, &_t)) {
+                        continue;
+                    }
+
+                    if (_t <= t_light && !mesh->material.transperent) { blocked = true; }
+                    if (_t < t) {
+                        t = _t;
+                        target_id = spheres_num+planes_num+m;
+                        triangle = i;
+                        bound = (light_id >= 0) ? fmax(t, t_light) : t;
+                    }
+                }
+            }
+        }
+    }
+
+    if (light_id >= 0 && !blocked) {
+        rlight light = lights[light_id];
+
+        float3 interpoint = ray->origin+ray->dir*t_light;
+        float d = distance(ray->origin, interpoint);
+
+        *color = light.rgb*light.intensity*INVERSE_SQUARE_LIGHT*(1/d*d);
+        return CLOSEST_LIGHT;
+    }
+
+    if (target_id < 0) { return CLOSEST_NONE; }
 
-        transfer_material = plane.material;
+    /* Only the closest object is shaded, its texture is read once */
+    float3 interpoint = ray->origin+ray->dir*t;
+
+    if (target_id < spheres_num) {
+        rsphere sphere = spheres[target_id];
+
+        *normal     = normalize(interpoint-sphere.origin);
+        *material   = sphere.material;
+    } else if (target_id < spheres_num+planes_num) {
+        rplane plane = planes[target_id-spheres_num];
+
+        *normal     = plane.normal;
+        *material   = plane.material;
 
         /* If there's a texture attached on the plane */
         if (plane.material.texture_id >= 0) {
+            material->rgb = plane_texture_pixel(&plane, &interpoint, im_arr);
+        }
+    } else {
+        __global rmesh *mesh = &meshes->meshes[target_id-spheres_num-planes_num];
 
+        *normal     = mesh_normal(meshes, mesh, triangle);
+        *material   = mesh->material;
 
-            transfer_material.rgb = plane_texture_pixel(&plane, &interpoint, im_arr);
+        /* Opaque meshes may be open surfaces, their normal faces the ray. The
+           transparent ones keep the winding, it tells the inside from the outside */
+        if (!material->transperent && dot(*normal, ray->dir) > 0.0f) {
+            *normal = -(*normal);
         }
 
-        interpoint += target_normal*EPSILON;
+        /* The texture is projected along the normal like on a plane */
+        if (material->texture_id >= 0) {
+            rplane plane;
+            plane.normal    = *normal;
+            plane.material  = *material;
 
-        did_intersect = true;
+            material->rgb = plane_texture_pixel(&plane, &interpoint, im_arr);
+        }
     }
 
+    /* To avoid self shadow */
+    *intersection   = interpoint+(*normal)*EPSILON;
+    *object_id      = target_id;
 
-
-    if (!did_intersect) { return 0; }
-
-    *intersection   = interpoint;
-    *normal         = target_normal;
-    *material       = transfer_material;
-
-    return 1;
+    return CLOSEST_SOLID;
 }
 
-float testShadowPath(float3 *to, float3 *from, __global rsphere *spheres,
-                    __global rplane *planes, uint spheres_num, uint planes_num) {
+float testShadowPath(float3 *to, float3 *from, SCENE_AS rsphere *spheres,
+                    SCENE_AS rplane *planes, uint spheres_num, uint planes_num,
+                    rmesh_scene *meshes) {
 
     rray ray;
     ray.origin = *from;
@@ -405,7 +908,7 @@ float testShadowPath(float3 *to, float3 *from, __global rsphere *spheres,
     float opacity = 1.0f;
 
     /* Find closest intersection with spheres */
-    for (uchar i = 0; i < spheres_num; i++) {
+    for (uint i = 0; i < spheres_num; i++) {
         rsphere sphere = spheres[i];
         
         float _t;
@@ -424,7 +927,7 @@ float testShadowPath(float3 *to, float3 *from, __global rsphere *spheres,
     }
 
     /* Find closest intersection with planes */
-    for (uchar i = 0; i < planes_num; i++) {
+    for (uint i = 0; i < planes_num; i++) {
         rplane      plane = planes[i];
 
         float _t;
@@ -438,7 +941,137 @@ float testShadowPath(float3 *to, float3 *from, __global rsphere *spheres,
         return 0.0f;
     }
 
-    return opacity;
+    uint occluder;
+    return opacity*mesh_shadow(&ray, t, meshes, &occluder);
+}
+
+/* Any-hit version of `testShadowPath` for the shadow pass. The occluder index in
+   `cache` (spheres first, then planes and the triangles of all meshes, -1 for
+   none) is tested before the scene is scanned and every newly found opaque
+   occluder is stored back into it */
+float testShadowPathCached(float3 *to, float3 *from, SCENE_AS rsphere *spheres,
+                           SCENE_AS rplane *planes, uint spheres_num, uint planes_num,
+                           rmesh_scene *meshes, __global int *cache) {
+
+    rray ray;
+    ray.origin = *from;
+    ray.dir = normalize((*to)-(*from));
+
+    float t                 = distance(*to, *from);
+    float _t;
+
+    int cached              = *cache;
+
+    /* Only opaque occluders are cached, they end the path on their own */
+    if (cached >= 0 && cached < (int)spheres_num) {
+        rsphere sphere = spheres[cached];
+
+        if (!sphere.material.transperent &&
+            intersect_sphere(&ray, &sphere.origin, sphere.radius, &_t) && _t < t) {
+            return 0.0f;
+        }
+    } else if (cached >= (int)spheres_num && cached < (int)(spheres_num+planes_num)) {
+        rplane plane = planes[cached-spheres_num];
+
+        if (intersect_plane(&ray, &plane.normal, &plane.point_in_plane, &_t) && _t < t) {
+            return 0.0f;
+        }
+    } else if (cached >= (int)(spheres_num+planes_num)) {
+        uint i = cached-spheres_num-planes_num;
+        uint m = 0;
+
+        /* The mesh holding the triangle, there are only a few of them */
+        while (m < meshes->mesh_num &&
+               i >= meshes->meshes[m].first_triangle+meshes->meshes[m].triangle_num) {
+            m++;
+        }
+
+        if (m < meshes->mesh_num) {
+            __global rmesh *mesh = &meshes->meshes[m];
+            rtriangle_ray tri = triangle_ray(&ray);
+
+            if (!mesh->material.transperent &&
+                intersect_mesh_triangle(meshes, mesh, &tri, i-mesh->first_triangle, t,
+                                        &_t) && _t < t) {
+                return 0.0f;
+            }
+        }
+    }
+
+    float opacity = 1.0f;
+
+    for (uint i = 0; i < spheres_num; i++) {
+        rsphere sphere = spheres[i];
+
+        bool _intersect = intersect_sphere(&ray, &sphere.origin, sphere.radius, &_t);
+        if (!_intersect || _t >= t) {
+            continue;
+        }
+
+        /* If transperent material just let a fraction of light to pass */
+        if (sphere.material.transperent) {
+            opacity *= TRANSPERENT_THROUGH;
+            continue;
+        }
+
+        atomic_xchg(cache, (int)i);
+        return 0.0f;
+    }
+
+    for (uint i = 0; i < planes_num; i++) {
+        rplane      plane = planes[i];
+
+        bool _intersect = intersect_plane(&ray, &plane.normal, &plane.point_in_plane,&_t);
+        if (!_intersect || _t >= t) {
+            continue;
+        }
+
+        atomic_xchg(cache, (int)(spheres_num+i));
+        return 0.0f;
+    }
+
+    uint occluder;
+    float through = mesh_shadow(&ray, t, meshes, &occluder);
+    if (through == 0.0f) {
+        atomic_xchg(cache, (int)(spheres_num+planes_num+occluder));
+        return 0.0f;
+    }
+
+    return opacity*through;
+}
+
+#ifdef SCENE_LOCAL
+/* Copies the scene objects into the work group's local copies. The objects are
+   16 byte aligned so they are moved as float4s. Every work item of the group has
+   to call it before any of them returns */
+void stage_scene(__global rsphere *spheres, __global rplane *planes,
+                 __global rlight *lights,
+                 uint spheres_num, uint planes_num, uint light_num,
+                 __local rsphere *local_spheres, __local rplane *local_planes,
+                 __local rlight *local_lights) {
+    /* The copies share one event */
+    event_t event = 0;
+
+    if (spheres_num > 0) {
+        event = async_work_group_copy((__local float4*)local_spheres,
+                                      (__global const float4*)spheres,
+                                      spheres_num*sizeof(rsphere)/sizeof(float4), event);
+    }
+    if (planes_num > 0) {
+        event = async_work_group_copy((__local float4*)local_planes,
+                                      (__global const float4*)planes,
+                                      planes_num*sizeof(rplane)/sizeof(float4), event);
+    }
+    if (light_num > 0) {
+        event = async_work_group_copy((__local float4*)local_lights,
+                                      (__global const float4*)lights,
+                                      light_num*sizeof(rlight)/sizeof(float4), event);
+    }
+
+    if (spheres_num > 0 || planes_num > 0 || light_num > 0) {
+        wait_group_events(1, &event);
+    }
 }
+#endif
 
 #endif
\ No newline at end of file
@@ -2,24 +2,31 @@
 #include "src/cl/primitives.cl"
 
 
-__kernel void raygen(float3 image_lt_corner, float3 camera_origin,
-                     float3 up, float3 right,
-                     float w_factor, float h_factor,
-                     uint pwidth, uint pheight, __global rray* rays) {
+/* Generates the primary rays of `views_num` views at once. The views share the
+   resolution of the first one and are stacked from top to bottom in `rays`, so
+   view `v` covers the pixels from v*pwidth*pheight on and a 2D launch covers
+   pwidth x pheight*views_num */
+__kernel void raygen(__global rview* views, uint views_num, __global rpacked* rays) {
 
-    uint id = get_global_id(0);
-    if (id >= pwidth*pheight) { return; }
+    uint pwidth  = views[0].pwidth;
+    uint pheight = views[0].pheight;
 
-    float w = (float)(id % pwidth);
-    float h = (float)(id / pwidth);
+    uint id = pixel_id(pwidth);
+    if (id >= pwidth*pheight*views_num) { return; }
 
-    float3 vec = image_lt_corner+right*w_factor*w-up*h_factor*h;
+    rview view = views[id/(pwidth*pheight)];
+    uint local_id = id%(pwidth*pheight);
 
-    //printf("%f\n", h);
+    float w = (float)(local_id % pwidth);
+    float h = (float)(local_id / pwidth);
 
-    rays[id].depth = 0;
-    rays[id].dir = normalize(vec);
-    //PRINT_VEC(rays[id].dir);
-    rays[id].origin = camera_origin;
-    rays[id].rgb = (float3){0.0f, 0.0f, 0.0f};
+    float3 vec = view.im_corner+view.right*view.w_factor*w-view.up*view.h_factor*h;
+
+    rray ray;
+    ray.depth = 0;
+    ray.dir = normalize(vec);
+    ray.origin = view.origin;
+    ray.rgb = (float3){0.0f, 0.0f, 0.0f};
+
+    rays[id] = pack_ray(ray);
 }
@@ -1,195 +1,108 @@
 #include "src/cl/types.cl"             /* All used types */
 #include "src/cl/primitives.cl"        /* Intersection functions */
+#include "src/cl/trace.cl"             /* Recursive ray tracing */
 
 
 
-/* N value for the air surrounding */
-#define DEFAULT_N 1.0f
-
-#define MAX_DEPTH 15
-#define MAX_SOFT_SHADOWS 2
-
-
-
-__kernel void raytracer(__global rray* rays,
+__kernel void raytracer(__global rpacked* rays,
                         __global rsphere* spheres,
                         __global rplane* planes, __global rlight* lights,
-                        uchar spheres_num, uchar planes_num, uchar light_num,
+                        uint spheres_num, uint planes_num, uint light_num,
                         uint total_size,
                         read_only image2d_array_t im_arr,
                         read_only image2d_array_t skybox,
-                        __global uint* output) {
-
-    uint id = get_global_id(0);
+                        __global uint* output,
+                        __global rlight_alias* light_alias, uint light_samples,
+                        __global rshadow* shadow_rays, __global uint* shadow_num,
+                        uint shadow_slots,
+                        __global float3* shadow_samples, uint sample_mask, uint frame,
+                        __global int* hit_ids,
+                        __global rgbuffer* gbuffer, uint soft_shadows,
+                        __global uint* trace_list, uint use_trace_list,
+                        __global rsecondary* secondary, __global uint* secondary_num,
+                        uint defer_secondary, uint pwidth,
+                        __global uint* trace_stats,
+                        __global uint* vis_bricks, __global uchar* vis_cells,
+                        rvis_grid vis_grid,
+                        __global rmesh* meshes, __global float* vertices,
+                        __global uint* indices, __global rmesh_node* mesh_nodes,
+                        uint mesh_num) {
+
+    rscene scene;
+#ifdef SCENE_LOCAL
+    /* The whole work group reads the scene from one local copy */
+    __local rsphere local_spheres[SCENE_SPHERES];
+    __local rplane  local_planes[SCENE_PLANES];
+    __local rlight  local_lights[SCENE_LIGHTS];
+
+    stage_scene(spheres, planes, lights, spheres_num, planes_num, light_num,
+                local_spheres, local_planes, local_lights);
+
+    scene.spheres           = local_spheres;
+    scene.planes            = local_planes;
+    scene.lights            = local_lights;
+#else
+    scene.spheres           = spheres;
+    scene.planes            = planes;
+    scene.lights            = lights;
+#endif
+
+    /* Every work item takes part in the staging before the out of range ones leave */
+    uint id = pixel_id(pwidth);
     if (id >= total_size) {
         return;
     }
 
-    rray    ray_stack[MAX_DEPTH];
-    float   n_stack[MAX_DEPTH];
-    float   f_stack[MAX_DEPTH];
-
-    xorshift32_state rand_state;
-    rand_state.x = id;
-
-    uint    stack_size = 1;
-
-    ray_stack[0]    = rays[id];
-    n_stack[0]      = DEFAULT_N;
-    f_stack[0]      = 1.0f;
-    
-    while (stack_size > 0) {
-        while (ray_stack[stack_size - 1].depth < MAX_DEPTH) {
-            float3 intersection;
-            float3 normal;
-            rmaterial material;
-
-            float3 light_color;
-            if (findLightIntersection(&ray_stack[stack_size - 1],
-                                      lights, spheres, planes,
-                                      light_num, spheres_num, planes_num, 
-                                      &light_color)) {
-                ray_stack[stack_size - 1].rgb += f_stack[stack_size-1]*light_color;
-                break;
-            }
-
-            uint intersect = findSolidIntersection(&ray_stack[stack_size-1], spheres, planes, 
-                                            spheres_num, planes_num,
-                                            &intersection, &normal, &material, im_arr);
-
-            /* Sample skybox texture if no intersection */
-            if (!intersect) {
-                int2 uv = map_to_cube(&ray_stack[stack_size-1].dir,
-                                      get_image_dim(skybox).x/4);
-
-
-                int4 pixel_fetch = (int4) {
-                                    uv.x, get_image_dim(skybox).y-uv.y,
-                                    0, 0};
-
-                int4    pixeli = read_imagei(skybox, pixel_fetch);
-                /* Cast to normalized float manually */
-                float3  pixelf = (float3){
-                    (float)pixeli.x/255.0f,
-                    (float)pixeli.y/255.0f,
-                    (float)pixeli.z/255.0f
-                };
-
-                ray_stack[stack_size-1].rgb += f_stack[stack_size-1]*pixelf;
-                break;
-                
-            }
-
-            ray_stack[stack_size-1].rgb += f_stack[stack_size-1]*\
-                                                material.rgb * material.ambient;
-
-            /* Calculate direct illumination on non light objects */
-            for(uchar i = 0; i < light_num; i++) {
-                rlight light = lights[i];
-
-                /* Amount of soft shadows not blocked by objects */
-                float soft_shadows = 0.0f;
-
-                /* Main soft shadow through light center point */
-                float3 shadow_dir = normalize(light.origin-intersection);
-
-                for (uint j = 0; j < MAX_SOFT_SHADOWS; j++) {
-                    /* Use xorshift pseudorandom generator to sample on the light
-                       object's sphere (VERY SLOW) */
-                    float theta = 2*M_PI*xorshift32(&rand_state);
-                    float phi = M_PI*xorshift32(&rand_state);
-
-                    float x = light.radius*sin(phi)*cos(theta);
-                    float y = light.radius*sin(phi)*sin(theta);
-                    float z = light.radius*cos(phi);
-
-                    float3 sample = light.origin+(float3){x,y,z};
-
-                    soft_shadows += testShadowPath(&sample, &intersection, 
-                                            spheres, planes, spheres_num, planes_num);
-                }
-
-                /* Soft shadow ratio */
-                float ssr = soft_shadows/(float)MAX_SOFT_SHADOWS;
-
-                float d = distance(light.origin, intersection);
-
-                
-                float3 light_rgb =light.rgb*light.intensity*INVERSE_SQUARE_LIGHT*1/(d*d);
-                /* Apply the soft shadow ratio */
-                light_rgb*=ssr;
-
-                /* v points from the intersection to the ray origin */
-                float3 v = normalize(ray_stack[stack_size-1].origin - intersection);
-                /* h is the bisector of v and reflected ray */
-                float3 h = normalize(v+shadow_dir);
-
-                /* Specular component */
-                float3 spec_f = pow(max(0.0f, dot(normal, h)),(float)material.shininess);
-                ray_stack[stack_size-1].rgb += f_stack[stack_size-1]*\
-                                                    material.specular*light_rgb*spec_f; 
-
-                /* Diffuse component */
-                float3 diff_f = max(0.0f, dot(normal, shadow_dir));
-                ray_stack[stack_size-1].rgb += f_stack[stack_size-1]*\
-                                                    material.diffuse*light_rgb*diff_f;
-            }
-
-            /* Save the incident ray before it gets updated */
-            float3 incident = ray_stack[stack_size-1].dir;
-
-            float n1 = n_stack[stack_size-1];
-            float n2 = material.n;
-            
-            n2 = (n1 == DEFAULT_N) ? n2 : DEFAULT_N;
-
-            float reflect_amount = material.reflectivity;
-            if (material.dielectric) {
-                float fr = compute_schlick(n1, n2, &incident, &normal);
-                reflect_amount=material.reflectivity+(1.0f-material.reflectivity)*fr;
-            }
-
-            
-            float old_f = f_stack[stack_size-1];
-            f_stack[stack_size-1]*= reflect_amount;
-
-            ray_stack[stack_size-1].dir = reflect(&ray_stack[stack_size-1].dir, &normal);
-
-            ray_stack[stack_size-1].origin = intersection;
-            ray_stack[stack_size-1].depth++;
-
-            if (material.transperent && stack_size < MAX_DEPTH && reflect_amount < 1.0f) {
-                
-                ray_stack[stack_size]   = ray_stack[stack_size - 1];
-                if (n1 < n2) {
-                    ray_stack[stack_size].origin -= 2*EPSILON*normal;
-                } else {
-                    normal *= -1;
-                }
-                f_stack[stack_size]     = old_f*(1.0f-reflect_amount);
-                ray_stack[stack_size].rgb = (float3){0.0f, 0.0f, 0.0f};
-
-                n_stack[stack_size]     = n2;
-                ray_stack[stack_size].dir = refract(n1, n2, &incident, &normal);
-                if (isnan(ray_stack[stack_size].dir.x)) { continue; }
-
-
-
-                stack_size++;
-            }
-        }
+    /* Only the listed pixels are traced, `total_size` is the length of the list */
+    if (use_trace_list) {
+        id = trace_list[id];
+    }
 
-        /* Only one in stack - raytracing completed for this ray */
-        if (stack_size == 1) { break; }
+    scene.spheres_num       = spheres_num;
+    scene.planes_num        = planes_num;
+    scene.light_num         = light_num;
+    scene.meshes.meshes     = meshes;
+    scene.meshes.vertices   = vertices;
+    scene.meshes.indices    = indices;
+    scene.meshes.nodes      = mesh_nodes;
+    scene.meshes.mesh_num   = mesh_num;
+    scene.light_alias       = light_alias;
+    scene.light_samples     = light_samples;
+    scene.shadow_samples    = shadow_samples;
+    scene.sample_mask       = sample_mask;
+    scene.frame             = frame;
+    scene.soft_shadows      = soft_shadows;
+    scene.vis_bricks        = vis_bricks;
+    scene.vis_cells         = vis_cells;
+    scene.vis_grid          = vis_grid;
+    scene.segments          = 0;
+    scene.tests             = 0;
+
+    /* Shadow rays deferred to the shadow pass, the ones that do not fit in the
+       pixel's `shadow_slots` are traced right away */
+    uint    shadow_count = 0;
+    int     hit_id;
+    rgbuffer gbuf;
+
+    /* The reflections and refractions are followed here unless they are deferred
+       to the secondary pass */
+    float3  rgb = trace_ray(unpack_ray(rays[id]), DEFAULT_N, 1.0f, id, &scene,
+                            im_arr, skybox,
+                            shadow_rays, shadow_slots, &shadow_count,
+                            defer_secondary ? secondary : NULL, secondary_num,
+                            &hit_id, &gbuf);
+
+    /* Keep the unpacked color for the passes that run after this kernel */
+    store_ray_rgb(&rays[id], rgb);
+    hit_ids[id] = hit_id;
+    gbuffer[id] = gbuf;
+    if (shadow_slots > 0) {
+        shadow_num[id] = shadow_count;
+    }
 
-        /* If previous rays in stack - just add the current ray rgb and decrement
-           the stack size */
-    
-        ray_stack[stack_size - 2].rgb += ray_stack[stack_size - 1].rgb;
+    output[id] = pack_rgb(rgb);
 
-        stack_size--;
+    if (trace_stats) {
+        add_trace_stats(trace_stats, &scene);
     }
-
-    float3 rgb_ = clamp(ray_stack[0].rgb, 0.0f, 1.0f)*255.0f;
-    output[id] = 0 << 24 | (uint)rgb_.x << 16 | (uint)rgb_.y << 8 | (uint)rgb_.z;
 }
@@ -0,0 +1,28 @@
+#ifndef __RPACKED_H
+#define __RPACKED_H
+
+/* Shared by the host (src/cpu_ray.h) and the kernels (src/cl/types.cl) */
+#ifdef __OPENCL_VERSION__
+#define RPACKED_FLOAT   float
+#define RPACKED_USHORT  ushort
+#else
+#define RPACKED_FLOAT   cl_float
+#define RPACKED_USHORT  cl_ushort
+#endif
+
+/* Bits of `depth_flags` holding the depth, the rest are for flags */
+#define RPACKED_DEPTH_MASK  0x0FFF
+
+/* Compressed ray, 24 bytes instead of the 64 bytes of `rray`. The direction is a
+   unit vector in octahedral encoding with 16 bits per coordinate, the color is in
+   half precision */
+struct __rpacked {
+    RPACKED_FLOAT   origin[3];
+    RPACKED_USHORT  dir[2];
+    RPACKED_USHORT  rgb[3];
+    RPACKED_USHORT  depth_flags;
+};
+
+typedef struct __rpacked rpacked;
+
+#endif
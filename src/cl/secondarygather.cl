@@ -0,0 +1,26 @@
+#include "src/cl/types.cl"             /* All used types */
+#include "src/cl/primitives.cl"        /* Intersection functions */
+
+
+
+/* Adds the traced secondary rays to the colors of their pixels and packs the
+   result. Only the first record of a pixel does the work, so no pixel is
+   written twice */
+__kernel void secondarygather(__global rpacked* rays, __global rsecondary* secondary,
+                              __global uint* secondary_num, __global uint* output) {
+
+    uint id = get_global_id(0);
+    if (id >= *secondary_num || secondary[id].records == 0) {
+        return;
+    }
+
+    uint pixel = secondary[id].pixel;
+    float3 rgb = load_ray_rgb(&rays[pixel]);
+
+    for (uint i = 0; i < secondary[id].records; i++) {
+        rgb += load_ray_rgb(&secondary[id+i].ray);
+    }
+
+    store_ray_rgb(&rays[pixel], rgb);
+    output[pixel] = pack_rgb(rgb);
+}
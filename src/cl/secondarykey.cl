@@ -0,0 +1,43 @@
+#include "src/cl/types.cl"             /* All used types */
+#include "src/cl/primitives.cl"        /* Ray unpacking */
+#include "src/cl/sort.cl"              /* Key layout */
+
+
+
+/* Spreads the 7 lowest bits of `v` so that two zero bits follow each of them */
+uint spread_bits(uint v) {
+    v = (v | (v << 8)) & 0x0000F00Fu;
+    v = (v | (v << 4)) & 0x000C30C3u;
+    v = (v | (v << 2)) & 0x00249249u;
+    return v;
+}
+
+/* Computes the sort key of every secondary ray and the identity order. The key is
+   the direction octant above the Morton code of the origin's cell, so rays going
+   the same way from nearby points end up next to each other. `bounds_min` and
+   `bounds_scale` map the scene to the unit cube which is split into
+   MORTON_CELLS^3 cells, outside points are clamped to the border cells */
+__kernel void secondarykey(__global rsecondary* secondary, __global uint* secondary_num,
+                           __global uint* keys, __global uint* order,
+                           float3 bounds_min, float3 bounds_scale) {
+
+    uint id = get_global_id(0);
+    if (id >= *secondary_num) {
+        return;
+    }
+
+    rray ray = unpack_ray(secondary[id].ray);
+
+    float3 cell = clamp((ray.origin-bounds_min)*bounds_scale*(float)MORTON_CELLS,
+                        0.0f, (float)(MORTON_CELLS-1));
+
+    uint morton = spread_bits((uint)cell.x) |
+                  (spread_bits((uint)cell.y) << 1) |
+                  (spread_bits((uint)cell.z) << 2);
+
+    uint octant = (ray.dir.x < 0.0f) | ((ray.dir.y < 0.0f) << 1) |
+                  ((ray.dir.z < 0.0f) << 2);
+
+    keys[id]  = (octant << 21) | morton;
+    order[id] = id;
+}
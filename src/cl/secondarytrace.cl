@@ -0,0 +1,91 @@
+#include "src/cl/types.cl"             /* All used types */
+#include "src/cl/primitives.cl"        /* Intersection functions */
+#include "src/cl/trace.cl"             /* Recursive ray tracing */
+
+
+
+/* Traces the secondary rays deferred by the raytracer, with their shadow rays
+   inline. With `use_order` the work items take the rays in the sorted `order`
+   so neighbouring work items follow similar paths through the scene. The traced
+   segments are added to `trace_stats` unless it is NULL */
+__kernel void secondarytrace(__global rsecondary* secondary,
+                             __global uint* secondary_num,
+                             __global uint* order, uint use_order,
+                             __global rsphere* spheres,
+                             __global rplane* planes, __global rlight* lights,
+                             uint spheres_num, uint planes_num, uint light_num,
+                             read_only image2d_array_t im_arr,
+                             read_only image2d_array_t skybox,
+                             __global rlight_alias* light_alias, uint light_samples,
+                             __global float3* shadow_samples, uint sample_mask,
+                             uint frame, uint soft_shadows,
+                             __global uint* trace_stats,
+                             __global uint* vis_bricks, __global uchar* vis_cells,
+                             rvis_grid vis_grid,
+                             __global rmesh* meshes, __global float* vertices,
+                             __global uint* indices, __global rmesh_node* mesh_nodes,
+                             uint mesh_num) {
+
+    rscene scene;
+#ifdef SCENE_LOCAL
+    /* The whole work group reads the scene from one local copy */
+    __local rsphere local_spheres[SCENE_SPHERES];
+    __local rplane  local_planes[SCENE_PLANES];
+    __local rlight  local_lights[SCENE_LIGHTS];
+
+    stage_scene(spheres, planes, lights, spheres_num, planes_num, light_num,
+                local_spheres, local_planes, local_lights);
+
+    scene.spheres           = local_spheres;
+    scene.planes            = local_planes;
+    scene.lights            = local_lights;
+#else
+    scene.spheres           = spheres;
+    scene.planes            = planes;
+    scene.lights            = lights;
+#endif
+
+    uint i = get_global_id(0);
+    if (i >= *secondary_num) {
+        return;
+    }
+
+    uint id = use_order ? order[i] : i;
+
+    scene.spheres_num       = spheres_num;
+    scene.planes_num        = planes_num;
+    scene.light_num         = light_num;
+    scene.meshes.meshes     = meshes;
+    scene.meshes.vertices   = vertices;
+    scene.meshes.indices    = indices;
+    scene.meshes.nodes      = mesh_nodes;
+    scene.meshes.mesh_num   = mesh_num;
+    scene.light_alias       = light_alias;
+    scene.light_samples     = light_samples;
+    scene.shadow_samples    = shadow_samples;
+    scene.sample_mask       = sample_mask;
+    scene.frame             = frame;
+    scene.soft_shadows      = soft_shadows;
+    scene.vis_bricks        = vis_bricks;
+    scene.vis_cells         = vis_cells;
+    scene.vis_grid          = vis_grid;
+    scene.segments          = 0;
+    scene.tests             = 0;
+
+    rsecondary record = secondary[id];
+
+    uint    shadow_count = 0;
+    int     hit_id;
+    rgbuffer gbuf;
+
+    /* The pixel seeds the light sampling as if the ray was traced by the raytracer */
+    float3  rgb = trace_ray(unpack_ray(record.ray), record.n, record.weight, record.pixel,
+                            &scene, im_arr, skybox,
+                            NULL, 0, &shadow_count, NULL, NULL, &hit_id, &gbuf);
+
+    store_ray_rgb(&secondary[id].ray, rgb);
+
+    if (trace_stats) {
+        add_trace_stats(trace_stats, &scene);
+    }
+}
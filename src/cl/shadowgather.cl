@@ -0,0 +1,26 @@
+#include "src/cl/types.cl"             /* All used types */
+#include "src/cl/primitives.cl"        /* Intersection functions */
+
+
+
+/* Adds the resolved shadow ray contributions of every pixel to the color computed
+   by the raytracer and packs the result */
+__kernel void shadowgather(__global rpacked* rays, __global rshadow* shadow_rays,
+                           __global uint* shadow_num, uint shadow_slots,
+                           uint total_size, __global uint* output) {
+
+    uint id = get_global_id(0);
+    if (id >= total_size) {
+        return;
+    }
+
+    float3 rgb = load_ray_rgb(&rays[id]);
+
+    uint count = shadow_num[id];
+    for (uint i = 0; i < count; i++) {
+        rgb += shadow_rays[id*shadow_slots+i].rgb;
+    }
+
+    store_ray_rgb(&rays[id], rgb);
+    output[id] = pack_rgb(rgb);
+}
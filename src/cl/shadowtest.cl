@@ -0,0 +1,56 @@
+#include "src/cl/types.cl"             /* All used types */
+#include "src/cl/primitives.cl"        /* Intersection functions */
+
+
+
+/* Resolves the shadow rays deferred by the raytracer, one shadow ray per work item.
+   Every work group (tile) shares an entry of `occluder_cache` with the last opaque
+   occluder it found, which is tested first. Big spheres and walls usually shadow
+   whole tiles so most blocked rays end after a single intersection test */
+__kernel void shadowtest(__global rshadow* shadow_rays, __global uint* shadow_num,
+                         uint shadow_slots,
+                         __global rsphere* spheres, __global rplane* planes,
+                         uint spheres_num, uint planes_num,
+                         uint total_size,
+                         __global int* occluder_cache, uint cache_size,
+                         __global rmesh* meshes, __global float* vertices,
+                         __global uint* indices, __global rmesh_node* mesh_nodes,
+                         uint mesh_num) {
+
+#ifdef SCENE_LOCAL
+    /* Only the solid objects block shadow rays */
+    __local rsphere local_spheres[SCENE_SPHERES];
+    __local rplane  local_planes[SCENE_PLANES];
+
+    stage_scene(spheres, planes, NULL, spheres_num, planes_num, 0,
+                local_spheres, local_planes, NULL);
+
+    SCENE_AS rsphere* scene_spheres = local_spheres;
+    SCENE_AS rplane*  scene_planes  = local_planes;
+#else
+    SCENE_AS rsphere* scene_spheres = spheres;
+    SCENE_AS rplane*  scene_planes  = planes;
+#endif
+
+    uint id = get_global_id(0);
+    if (id >= total_size || id % shadow_slots >= shadow_num[id / shadow_slots]) {
+        return;
+    }
+
+    rshadow shadow_ray = shadow_rays[id];
+
+    rmesh_scene scene_meshes;
+    scene_meshes.meshes     = meshes;
+    scene_meshes.vertices   = vertices;
+    scene_meshes.indices    = indices;
+    scene_meshes.nodes      = mesh_nodes;
+    scene_meshes.mesh_num   = mesh_num;
+
+    float opacity = testShadowPathCached(&shadow_ray.to, &shadow_ray.from,
+                                         scene_spheres, scene_planes,
+                                         spheres_num, planes_num, &scene_meshes,
+                                         &occluder_cache[get_group_id(0) % cache_size]);
+
+    /* Leave only the part of the contribution that reaches the pixel */
+    shadow_rays[id].rgb = shadow_ray.rgb*opacity;
+}
@@ -0,0 +1,16 @@
+#ifndef __SORT_CL
+#define __SORT_CL
+
+/* Radix sort of the secondary ray keys. Every pass sorts by SORT_RADIX_BITS bits
+   of the key, the passes go from the lowest bits up to SORT_KEY_BITS */
+#define SORT_KEY_BITS       24
+#define SORT_RADIX_BITS     4
+#define SORT_BUCKETS        (1 << SORT_RADIX_BITS)
+
+/* Keys handled by one work item of the histogram and scatter kernels */
+#define SORT_BLOCK          256
+
+/* Origin cells per axis of the secondary ray keys */
+#define MORTON_CELLS        128
+
+#endif
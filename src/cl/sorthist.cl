@@ -0,0 +1,29 @@
+#include "src/cl/sort.cl"              /* Key layout */
+
+
+
+/* Counts the digits at `shift` in every SORT_BLOCK keys. The counts are stored
+   digit major, `hist[digit*blocks+block]`, so that one scan over `hist` gives the
+   output position of every block's first key of every digit */
+__kernel void sorthist(__global uint* keys, __global uint* secondary_num,
+                       uint shift, __global uint* hist, uint blocks) {
+
+    uint block = get_global_id(0);
+    if (block >= blocks) {
+        return;
+    }
+
+    uint counts[SORT_BUCKETS];
+    for (uint d = 0; d < SORT_BUCKETS; d++) { counts[d] = 0; }
+
+    uint start = block*SORT_BLOCK;
+    uint end   = min(start+SORT_BLOCK, *secondary_num);
+
+    for (uint i = start; i < end; i++) {
+        counts[(keys[i] >> shift) & (SORT_BUCKETS-1)]++;
+    }
+
+    for (uint d = 0; d < SORT_BUCKETS; d++) {
+        hist[d*blocks+block] = counts[d];
+    }
+}
@@ -0,0 +1,32 @@
+#include "src/cl/sort.cl"              /* Key layout */
+
+
+
+/* Exclusive prefix sum over the digit major histogram. Runs as a single work group,
+   every one of the first SORT_BUCKETS work items scans one digit's row */
+__kernel void sortscan(__global uint* hist, uint blocks) {
+
+    __local uint totals[SORT_BUCKETS];
+
+    uint d = get_local_id(0);
+
+    if (d < SORT_BUCKETS) {
+        uint total = 0;
+        for (uint b = 0; b < blocks; b++) { total += hist[d*blocks+b]; }
+        totals[d] = total;
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (d < SORT_BUCKETS) {
+        /* Keys with smaller digits go first */
+        uint offset = 0;
+        for (uint i = 0; i < d; i++) { offset += totals[i]; }
+
+        for (uint b = 0; b < blocks; b++) {
+            uint count = hist[d*blocks+b];
+            hist[d*blocks+b] = offset;
+            offset += count;
+        }
+    }
+}
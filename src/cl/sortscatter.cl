@@ -0,0 +1,31 @@
+#include "src/cl/sort.cl"              /* Key layout */
+
+
+
+/* Moves every SORT_BLOCK keys and their order entries to the positions found by
+   `sortscan`. A block is walked in order so equal digits keep their order and
+   the passes together sort by the whole key */
+__kernel void sortscatter(__global uint* keys_in, __global uint* order_in,
+                          __global uint* keys_out, __global uint* order_out,
+                          __global uint* secondary_num, uint shift,
+                          __global uint* hist, uint blocks) {
+
+    uint block = get_global_id(0);
+    if (block >= blocks) {
+        return;
+    }
+
+    uint offsets[SORT_BUCKETS];
+    for (uint d = 0; d < SORT_BUCKETS; d++) { offsets[d] = hist[d*blocks+block]; }
+
+    uint start = block*SORT_BLOCK;
+    uint end   = min(start+SORT_BLOCK, *secondary_num);
+
+    for (uint i = start; i < end; i++) {
+        uint key = keys_in[i];
+        uint pos = offsets[(key >> shift) & (SORT_BUCKETS-1)]++;
+
+        keys_out[pos]  = key;
+        order_out[pos] = order_in[i];
+    }
+}
@@ -0,0 +1,128 @@
+#include "src/cl/types.cl"             /* All used types */
+#include "src/cl/primitives.cl"        /* Intersection functions */
+
+
+
+/* Passes of the temporal reprojection, run in this order every frame */
+#define TEMPORAL_CLEAR      0   /* Forget the last frame's reprojection */
+#define TEMPORAL_DEPTH      1   /* Splat the history depths into the new view */
+#define TEMPORAL_SCATTER    2   /* Move the closest history samples into the new view */
+#define TEMPORAL_RESOLVE    3   /* After raygen: reuse pixels or list them for tracing */
+#define TEMPORAL_STORE      4   /* After every other pass: keep the frame as history */
+
+/* History position kinds in the w component */
+#define HISTORY_NONE        0.0f    /* Sky or light, nothing to reproject */
+#define HISTORY_REUSE       1.0f    /* Diffuse surface, the color can be reused */
+#define HISTORY_OCCLUDER   -1.0f    /* View dependent surface, only hides others */
+
+
+
+/* Maps a point in the scene to the pixel whose primary ray passes closest to it.
+   Returns false if the point is behind the camera or outside the image */
+bool project_to_view(rview *view, float3 point, uint *pixel) {
+    float3 center = view->im_corner+view->right*(view->w_factor*view->pwidth*0.5f)-
+                        view->up*(view->h_factor*view->pheight*0.5f);
+    float3 d = point-view->origin;
+
+    float cd = dot(d, center);
+    if (cd <= 0.0f) { return false; }
+
+    /* Intersection with the image plane relative to the left top corner */
+    float3 rel = d*(dot(center, center)/cd)-view->im_corner;
+
+    int x = (int)floor(dot(rel, view->right)/
+                       (view->w_factor*dot(view->right, view->right))+0.5f);
+    int y = (int)floor(-dot(rel, view->up)/
+                       (view->h_factor*dot(view->up, view->up))+0.5f);
+
+    if (x < 0 || y < 0 || x >= (int)view->pwidth || y >= (int)view->pheight) {
+        return false;
+    }
+
+    *pixel = y*view->pwidth+x;
+    return true;
+}
+
+/* Reuses the previous frame during camera motion. The history keeps the color and
+   the hit position of every pixel, those are splatted into the new view with a
+   depth test. Pixels that got nothing (disocclusions), got a view dependent surface
+   or are in this frame's rotating `1/refresh` subset are listed in `trace_list`,
+   the others take the history color and are skipped by the raytracer */
+__kernel void temporal(__global rpacked* rays, __global rgbuffer* gbuffer,
+                       __global int* hit_ids,
+                       __global uint* shadow_num, uint shadow_slots,
+                       __global uint* output,
+                       __global float4* hist_color, __global float4* hist_pos,
+                       __global int* hist_hit,
+                       __global uint* reproj_depth, __global float4* reproj_color,
+                       __global float4* reproj_pos, __global int* reproj_hit,
+                       __global uint* trace_list, __global uint* trace_num,
+                       rview view, uint pass, uint frame, uint refresh) {
+
+    uint id = get_global_id(0);
+    if (id >= view.pwidth*view.pheight) { return; }
+
+    uint pixel;
+
+    if (pass == TEMPORAL_CLEAR) {
+        reproj_depth[id] = UINT_MAX;
+    } else if (pass == TEMPORAL_DEPTH || pass == TEMPORAL_SCATTER) {
+        float4 pos = hist_pos[id];
+        if (pos.w == HISTORY_NONE || !project_to_view(&view, pos.xyz, &pixel)) {
+            return;
+        }
+
+        /* Positive floats order the same way as their bits */
+        uint depth = as_uint(distance(view.origin, pos.xyz));
+
+        if (pass == TEMPORAL_DEPTH) {
+            atomic_min(&reproj_depth[pixel], depth);
+        } else if (reproj_depth[pixel] == depth) {
+            reproj_color[pixel] = hist_color[id];
+            reproj_pos[pixel]   = pos;
+            reproj_hit[pixel]   = hist_hit[id];
+        }
+    } else if (pass == TEMPORAL_RESOLVE) {
+        bool refreshed = ((id*0x9E3779B1u >> 16)+frame) % refresh == 0;
+
+        if (reproj_depth[id] == UINT_MAX || reproj_pos[id].w != HISTORY_REUSE ||
+            refreshed) {
+            reproj_pos[id].w = HISTORY_NONE;
+            trace_list[atomic_inc(trace_num)] = id;
+            return;
+        }
+
+        float3 rgb = reproj_color[id].xyz;
+
+        store_ray_rgb(&rays[id], rgb);
+        output[id]          = pack_rgb(rgb);
+        hit_ids[id]         = reproj_hit[id];
+        /* The history was denoised already */
+        gbuffer[id].normal  = (float3){0.0f, 0.0f, 0.0f};
+        if (shadow_slots > 0) {
+            shadow_num[id]  = 0;
+        }
+    } else if (pass == TEMPORAL_STORE) {
+        float4 pos = reproj_pos[id];
+
+        /* Traced this frame, the position comes from the primary ray */
+        if (pos.w != HISTORY_REUSE) {
+            rgbuffer g = gbuffer[id];
+
+            if (isinf(g.depth)) {
+                pos.w = HISTORY_NONE;
+            } else {
+                rray ray = unpack_ray(rays[id]);
+                pos.xyz = ray.origin+ray.dir*g.depth;
+                pos.w = (dot(g.normal, g.normal) > 0.0f) ? HISTORY_REUSE :
+                                                           HISTORY_OCCLUDER;
+            }
+        }
+
+        float3 rgb = load_ray_rgb(&rays[id]);
+
+        hist_pos[id]    = pos;
+        hist_color[id]  = (float4){rgb.x, rgb.y, rgb.z, 0.0f};
+        hist_hit[id]    = hit_ids[id];
+    }
+}
@@ -0,0 +1,457 @@
+#ifndef __TRACE_CL
+#define __TRACE_CL
+
+#include "src/cl/types.cl"             /* All used types */
+#include "src/cl/primitives.cl"        /* Intersection functions */
+
+
+
+/* N value for the air surrounding */
+#define DEFAULT_N 1.0f
+
+/* Ray termination, set by the frontends through the build options */
+#ifndef MAX_DEPTH
+#define MAX_DEPTH 15
+#endif
+/* Rays whose weight in the pixel falls below this are ended, 0 follows every
+   contributing ray to MAX_DEPTH */
+#ifndef MIN_WEIGHT
+#define MIN_WEIGHT 0.0f
+#endif
+/* 1 ends the rays below MIN_WEIGHT at random instead, the survivors are weighted
+   up to MIN_WEIGHT so the expected color stays the same */
+#ifndef ROULETTE
+#define ROULETTE 0
+#endif
+
+/* Counters of `trace_stats`, summed over all traced rays. Each is 64 bits wide as
+   a low and a high uint, see `add_trace_stats` */
+#define STAT_SEGMENTS 0
+#define STAT_TESTS 1
+
+/* Classes of the light visibility grid cells, the same as in src/cpu_visibility.h.
+   A brick entry below VIS_POOL gives the class of all its cells, the others point
+   to VIS_BRICK^3 cell classes at (entry-VIS_POOL)*VIS_BRICK^3 in the cell pool */
+#define VIS_VISIBLE     0       /* Every point sees all of the light */
+#define VIS_OCCLUDED    1       /* No point sees any of the light */
+#define VIS_MIXED       2       /* Near a shadow edge, the shadow rays are traced */
+#define VIS_POOL        3
+#define VIS_BRICK       4
+
+/* Primary hits on surfaces reflecting more than this are not denoised */
+#define DENOISE_MAX_REFLECTIVITY 0.5f
+
+/* Hit ids of the primary ray that are not scene objects */
+#define HIT_SKY -1
+#define HIT_LIGHT -2
+
+
+/* Everything the tracer reads from the scene, gathered from the kernel arguments */
+typedef struct {
+    SCENE_AS rsphere*       spheres;
+    SCENE_AS rplane*        planes;
+    SCENE_AS rlight*        lights;
+
+    uint                    spheres_num;
+    uint                    planes_num;
+    uint                    light_num;
+
+    rmesh_scene             meshes;
+
+    __global rlight_alias*  light_alias;
+    uint                    light_samples;
+
+    __global float3*        shadow_samples;
+    uint                    sample_mask;
+    uint                    frame;
+    uint                    soft_shadows;       /* Shadow rays per shaded light */
+
+    /* Light visibility grid of a static scene, `vis_bricks` is NULL without one */
+    __global uint*          vis_bricks;
+    __global uchar*         vis_cells;
+    rvis_grid               vis_grid;
+
+    uint                    segments;           /* Ray segments traced so far */
+    ulong                   tests;              /* Their intersection tests */
+} rscene;
+
+
+/* Adds the counters of the traced rays to `trace_stats`. 64 bit atomics are an
+   extension, so the low words are added first and a carry out of them goes to the
+   high words with theirs. The sums are whole once every ray added its counts */
+void add_trace_stats(__global uint* trace_stats, rscene *scene) {
+    ulong counts[2];
+    counts[STAT_SEGMENTS] = scene->segments;
+    counts[STAT_TESTS]    = scene->tests;
+
+    for (uint i = 0; i < 2; i++) {
+        uint low  = (uint)counts[i];
+        uint old  = atomic_add(&trace_stats[2*i], low);
+        uint high = (uint)(counts[i] >> 32)+(old+low < old);
+
+        if (high) { atomic_add(&trace_stats[2*i+1], high); }
+    }
+}
+
+/* With a MIN_WEIGHT the rays of zero weight are ended too */
+#define RAY_ENDED(weight) (MIN_WEIGHT > 0.0f && (weight) <= 0.0f)
+
+/* Weight of a ray after the termination test, 0 if the ray is ended */
+float terminate_ray(float weight, xorshift32_state *rand_state) {
+    if (MIN_WEIGHT <= 0.0f || weight >= MIN_WEIGHT) {
+        return weight;
+    }
+#if ROULETTE
+    /* Survives with the probability weight/MIN_WEIGHT */
+    if (weight > 0.0f && xorshift32_unit(rand_state)*MIN_WEIGHT < weight) {
+        return MIN_WEIGHT;
+    }
+#endif
+    return 0.0f;
+}
+
+
+/* Class of the grid cell around `point` for the light, VIS_MIXED outside the grid
+   or without one */
+uint light_visibility(rscene *scene, uint light, float3 point) {
+    if (!scene->vis_bricks) { return VIS_MIXED; }
+
+    rvis_grid grid  = scene->vis_grid;
+    uint cells      = grid.bricks*VIS_BRICK;
+    float3 g        = (point-grid.min)/grid.cell;
+
+    if (g.x < 0.0f || g.y < 0.0f || g.z < 0.0f ||
+        g.x >= (float)cells || g.y >= (float)cells || g.z >= (float)cells) {
+        return VIS_MIXED;
+    }
+
+    uint3 c = convert_uint3(g);
+    uint3 b = c/VIS_BRICK;
+
+    uint entry = scene->vis_bricks[((light*grid.bricks+b.z)*grid.bricks+b.y)*
+                                   grid.bricks+b.x];
+    if (entry < VIS_POOL) { return entry; }
+
+    uint3 l = c%VIS_BRICK;
+    return scene->vis_cells[(entry-VIS_POOL)*VIS_BRICK*VIS_BRICK*VIS_BRICK+
+                            (l.z*VIS_BRICK+l.y)*VIS_BRICK+l.x];
+}
+
+
+/* Traces the ray with all its reflections and refractions and returns its color.
+   `id` seeds the light sampling and picks the shadow samples. While
+   `shadow_count` is below `shadow_slots` the shadow rays are written to the
+   `id`:th slots of `shadow_rays` instead of being traced. If `secondary` is set,
+   the rays leaving the first hit are appended to it (counted by `secondary_num`)
+   and not followed. `n` is the refraction index around the ray's origin and
+   `weight` the ray's share of the pixel, the color is returned scaled by it.
+   `hit_id` is set to the object the ray hits first (spheres, planes, meshes) or
+   HIT_SKY / HIT_LIGHT and `gbuffer` describes that hit for the denoiser */
+float3 trace_ray(rray ray, float n, float weight, uint id, rscene *scene,
+                 read_only image2d_array_t im_arr, read_only image2d_array_t skybox,
+                 __global rshadow *shadow_rays, uint shadow_slots, uint *shadow_count,
+                 __global rsecondary *secondary, __global uint *secondary_num,
+                 int *hit_id, rgbuffer *gbuffer) {
+
+    /* The ray being traced is kept unpacked, the rays waiting under it are packed */
+    rray    cur = ray;
+    rpacked ray_stack[MAX_DEPTH];
+    float   n_stack[MAX_DEPTH];
+    float   f_stack[MAX_DEPTH];
+
+    xorshift32_state rand_state;
+    rand_state.x = id;
+
+    SCENE_AS rsphere*       spheres     = scene->spheres;
+    SCENE_AS rplane*        planes      = scene->planes;
+    SCENE_AS rlight*        lights      = scene->lights;
+    uint                    spheres_num = scene->spheres_num;
+    uint                    planes_num  = scene->planes_num;
+    uint                    light_num   = scene->light_num;
+
+    uint    stack_size = 1;
+
+    /* Many-light mode: only `light_samples` lights picked from the alias table are
+       shaded per hit instead of all of them. 0 shades every light */
+    uint    shade_num = (scene->light_samples > 0 && scene->light_samples < light_num) ?
+                            scene->light_samples : light_num;
+
+    n_stack[0]      = n;
+    f_stack[0]      = weight;
+
+    *hit_id         = HIT_SKY;
+
+    /* A zero normal keeps the pixel out of the denoiser */
+    gbuffer->normal = (float3){0.0f, 0.0f, 0.0f};
+    gbuffer->albedo = (float3){0.0f, 0.0f, 0.0f};
+    gbuffer->depth  = INFINITY;
+    
+    while (stack_size > 0) {
+        while (cur.depth < MAX_DEPTH) {
+            /* Hand the reflected and refracted rays of the first hit to the secondary
+               pass, the ones that do not contribute are dropped */
+            if (secondary && (stack_size == 1 ? cur.depth :
+                              ray_stack[0].depth_flags & RPACKED_DEPTH_MASK) ==
+                             ray.depth+1) {
+                uint count = 0;
+                for (uint k = 0; k < stack_size; k++) {
+                    if (f_stack[k] > 0.0f) { count++; }
+                }
+
+                uint slot = (count > 0) ? atomic_add(secondary_num, count) : 0;
+                for (uint k = 0, first = slot; k < stack_size; k++) {
+                    if (f_stack[k] <= 0.0f) { continue; }
+
+                    rray next = (k == stack_size-1) ? cur : unpack_ray(ray_stack[k]);
+                    next.rgb = (float3){0.0f, 0.0f, 0.0f};
+
+                    rsecondary record;
+                    record.ray          = pack_ray(next);
+                    record.weight       = f_stack[k];
+                    record.n            = n_stack[k];
+                    record.pixel        = id;
+                    record.records      = (slot == first) ? count : 0;
+
+                    secondary[slot++] = record;
+                }
+
+                return (stack_size == 1) ? cur.rgb : unpack_ray(ray_stack[0]).rgb;
+            }
+
+            float3 intersection;
+            float3 normal;
+            rmaterial material;
+            int object_id;
+            float3 light_color;
+
+            /* One pass over the scene, lights included */
+            scene->segments++;
+
+            uint closest = findClosestIntersection(&cur, lights, spheres, planes,
+                                                   light_num, spheres_num, planes_num,
+                                                   &scene->meshes,
+                                                   &intersection, &normal, &material,
+                                                   &object_id, &light_color,
+                                                   &scene->tests, im_arr);
+            if (closest == CLOSEST_LIGHT) {
+                cur.rgb += f_stack[stack_size-1]*light_color;
+                if (stack_size == 1 && cur.depth == 0) { *hit_id = HIT_LIGHT; }
+                break;
+            }
+
+            bool intersect = closest == CLOSEST_SOLID;
+
+            /* The object seen through the pixel */
+            if (stack_size == 1 && cur.depth == 0) {
+                *hit_id = intersect ? object_id : HIT_SKY;
+
+                if (intersect) {
+                    gbuffer->depth = shade_distance(ray.origin, intersection);
+                }
+
+                /* Surfaces that mostly show other objects are not denoised */
+                if (intersect && !material.transperent &&
+                    material.reflectivity < DENOISE_MAX_REFLECTIVITY) {
+                    gbuffer->normal = normal;
+                    gbuffer->albedo = material.rgb;
+                }
+            }
+
+            /* Sample skybox texture if no intersection */
+            if (!intersect) {
+                int2 uv = map_to_cube(&cur.dir,
+                                      get_image_dim(skybox).x/4);
+
+
+                int4 pixel_fetch = (int4) {
+                                    uv.x, get_image_dim(skybox).y-uv.y,
+                                    0, 0};
+
+                int4    pixeli = read_imagei(skybox, pixel_fetch);
+                /* Cast to normalized float manually */
+                float3  pixelf = (float3){
+                    (float)pixeli.x/255.0f,
+                    (float)pixeli.y/255.0f,
+                    (float)pixeli.z/255.0f
+                };
+
+                cur.rgb += f_stack[stack_size-1]*pixelf;
+                break;
+                
+            }
+
+            cur.rgb += f_stack[stack_size-1]*\
+                                                material.rgb * material.ambient;
+
+            /* Calculate direct illumination on non light objects */
+            for(uint s = 0; s < shade_num; s++) {
+                uint i = s;
+                /* Inverse of the probability that the light got picked */
+                float light_weight = 1.0f;
+
+                if (shade_num < light_num) {
+                    float pdf;
+                    i = sample_light(scene->light_alias, light_num, &rand_state, &pdf);
+                    light_weight = 1.0f/(pdf*(float)shade_num);
+                }
+
+                rlight light = lights[i];
+
+                /* Only the points near a shadow edge of a cached light trace the
+                   shadow rays */
+                uint visibility = light_visibility(scene, i, intersection);
+                if (visibility == VIS_OCCLUDED) { continue; }
+
+                /* Main soft shadow through light center point */
+                float3 shadow_dir = shade_normalize(light.origin-intersection);
+
+                float d = shade_distance(light.origin, intersection);
+
+                
+                float3 light_rgb =light.rgb*light.intensity*INVERSE_SQUARE_LIGHT*1/(d*d);
+                /* Apply the sampling weight */
+                light_rgb*=light_weight;
+
+                /* v points from the intersection to the ray origin */
+                float3 v = shade_normalize(cur.origin - intersection);
+                /* h is the bisector of v and reflected ray */
+                float3 h = shade_normalize(v+shadow_dir);
+
+                /* Specular component */
+                float3 spec_f = shade_pow(max(0.0f, dot(normal, h)),(float)material.shininess);
+                /* Diffuse component */
+                float3 diff_f = max(0.0f, dot(normal, shadow_dir));
+
+                /* Contribution of the light if none of the soft shadows are blocked */
+                float3 light_f = f_stack[stack_size-1]*(material.specular*light_rgb*spec_f+
+                                                        material.diffuse*light_rgb*diff_f);
+
+                if (visibility == VIS_VISIBLE) {
+                    cur.rgb += light_f;
+                    continue;
+                }
+
+                /* Amount of soft shadows not blocked by objects */
+                float soft_shadows = 0.0f;
+
+                uint sample_base = shadow_sample_base(id, i,
+                                        cur.depth, scene->frame,
+                                        scene->soft_shadows);
+                float2 turn = shadow_sample_rotation(id);
+
+                for (uint j = 0; j < scene->soft_shadows; j++) {
+                    /* Sample on the light object's sphere from the precomputed
+                       Sobol table, turned by the pixel's angle */
+                    float3 unit = scene->shadow_samples[(sample_base+j) &
+                                                        scene->sample_mask];
+                    float3 sample = light.origin+light.radius*\
+                                        (float3){turn.x*unit.x-turn.y*unit.y,
+                                                 turn.y*unit.x+turn.x*unit.y, unit.z};
+
+                    /* The shadow pass adds the contribution if the path is free */
+                    if (*shadow_count < shadow_slots) {
+                        rshadow shadow_ray;
+                        shadow_ray.from = intersection;
+                        shadow_ray.to   = sample;
+                        shadow_ray.rgb  = light_f/(float)scene->soft_shadows;
+
+                        shadow_rays[id*shadow_slots+(*shadow_count)++] = shadow_ray;
+                        continue;
+                    }
+
+                    soft_shadows += testShadowPath(&sample, &intersection, 
+                                            spheres, planes, spheres_num, planes_num,
+                                            &scene->meshes);
+                }
+
+                /* Soft shadow ratio */
+                float ssr = soft_shadows/(float)scene->soft_shadows;
+
+                cur.rgb += light_f*ssr;
+            }
+
+            /* Save the incident ray before it gets updated */
+            float3 incident = cur.dir;
+
+            float n1 = n_stack[stack_size-1];
+            float n2 = material.n;
+            
+            n2 = (n1 == DEFAULT_N) ? n2 : DEFAULT_N;
+
+            float reflect_amount = material.reflectivity;
+            if (material.dielectric) {
+                float fr = compute_schlick(n1, n2, &incident, &normal);
+                reflect_amount=material.reflectivity+(1.0f-material.reflectivity)*fr;
+            }
+
+            
+            float old_f = f_stack[stack_size-1];
+            float reflect_f = terminate_ray(old_f*reflect_amount, &rand_state);
+            float refract_f = 0.0f;
+            bool  follow_refraction = material.transperent && reflect_amount < 1.0f;
+            if (follow_refraction) {
+                refract_f = terminate_ray(old_f*(1.0f-reflect_amount), &rand_state);
+                follow_refraction = !RAY_ENDED(refract_f);
+            }
+            bool  reflect_ended = RAY_ENDED(reflect_f);
+
+            f_stack[stack_size-1] = reflect_f;
+
+            cur.dir = reflect(&cur.dir, &normal);
+
+            cur.origin = intersection;
+            cur.depth++;
+
+            if (follow_refraction && (stack_size < MAX_DEPTH || reflect_ended)) {
+                
+                rray refracted = cur;
+                if (n1 < n2) {
+                    refracted.origin -= 2*EPSILON*normal;
+                } else {
+                    normal *= -1;
+                }
+                refracted.rgb = (float3){0.0f, 0.0f, 0.0f};
+                refracted.dir = refract(n1, n2, &incident, &normal);
+                if (isnan(refracted.dir.x)) {
+                    if (reflect_ended) { break; }
+                    continue;
+                }
+
+                if (reflect_ended) {
+                    /* The ended reflection leaves its place to the refracted ray */
+                    refracted.rgb           = cur.rgb;
+                    f_stack[stack_size-1]   = refract_f;
+                    n_stack[stack_size-1]   = n2;
+
+                    cur = refracted;
+                    continue;
+                }
+
+                /* The reflected ray waits packed under the refracted one */
+                ray_stack[stack_size-1] = pack_ray(cur);
+                f_stack[stack_size]     = refract_f;
+                n_stack[stack_size]     = n2;
+
+                cur = refracted;
+                stack_size++;
+            } else if (reflect_ended) {
+                break;
+            }
+        }
+
+        /* Only one in stack - raytracing completed for this ray */
+        if (stack_size == 1) { break; }
+
+        /* If previous rays in stack - continue with the one below and add the
+           current ray rgb to it */
+        float3 rgb = cur.rgb;
+        cur = unpack_ray(ray_stack[stack_size-2]);
+        cur.rgb += rgb;
+
+        stack_size--;
+    }
+
+    return cur.rgb;
+}
+
+#endif
@@ -1,6 +1,18 @@
 #ifndef __TYPES_CL
 #define __TYPES_CL
 
+#include "src/cl/rpacked.h"            /* Compressed ray shared with the host */
+#include "src/cl/precision.cl"         /* Math of the precision tier */
+
+/* Address space the tracing functions read the scene objects from. The host builds
+   with SCENE_LOCAL and the SCENE_SPHERES, SCENE_PLANES and SCENE_LIGHTS array sizes
+   when the scene fits into local memory, the kernels then stage it there */
+#ifdef SCENE_LOCAL
+#define SCENE_AS __local
+#else
+#define SCENE_AS __global
+#endif
+
 struct __rmaterial {
     float3              rgb;
 
@@ -41,10 +53,59 @@ struct __rlight {
     float3              rgb;   
 } __attribute__ ((aligned (16)));
 
+/* One bucket of the power weighted alias table used for many-light sampling */
+struct __rlight_alias {
+    float               prob;       /* Probability of keeping the bucket's light */
+    uint                alias;      /* Light that is picked otherwise */
+    float               pdf;        /* Probability of picking the bucket's light */
+};
+
+/* Levels of a mesh hierarchy below its root at most, the same as in src/cpu_mesh.h */
+#define RMESH_MAX_DEPTH 32
+
+/* Triangle mesh, see src/cpu_mesh.h. Its vertex positions are the x, y and z
+   arrays of `vertex_num` floats from `first_vertex*3` on in the vertex buffer, its
+   triangles the three corner arrays of `triangle_num` indices into them from
+   `first_triangle*3` on in the index buffer and its hierarchy the `node_num`
+   nodes from `first_node` on in the node buffer */
+struct __rmesh {
+    uint                first_vertex;
+    uint                vertex_num;
+    uint                first_triangle;
+    uint                triangle_num;
+    uint                first_node;
+    uint                node_num;
+
+    struct __rmaterial  material;
+} __attribute__ ((aligned (16)));
+
+/* Node of a mesh hierarchy. A leaf holds the `count` triangles from `index` on,
+   an inner node has a `count` of 0 and its two children at `index` and `index+1`,
+   counted from the mesh's first node */
+struct __rmesh_node {
+    float               min[3];
+    uint                index;
+    float               max[3];
+    uint                count;
+};
+
 typedef struct __rmaterial  rmaterial;
 typedef struct __rsphere    rsphere;
 typedef struct __rplane     rplane;
 typedef struct __rlight     rlight;
+typedef struct __rlight_alias rlight_alias;
+typedef struct __rmesh      rmesh;
+typedef struct __rmesh_node rmesh_node;
+
+/* Meshes of the scene, gathered from the kernel arguments. They stay in global
+   memory when the other objects are staged */
+typedef struct {
+    __global rmesh*     meshes;
+    __global rmesh_node* nodes;
+    __global float*     vertices;
+    __global uint*      indices;
+    uint                mesh_num;
+} rmesh_scene;
 
 
 struct __rray {
@@ -58,5 +119,65 @@ struct __rray {
 
 typedef struct __rray rray;
 
+/* Ray leaving a primary hit, deferred by the raytracer to the secondary pass.
+   `ray.rgb` receives the traced color already scaled by `weight`. The records of
+   a pixel are consecutive, the first one holds their count in `records` */
+struct __rsecondary {
+    rpacked  ray;
+
+    float    weight;    /* Share of the ray in the pixel color */
+    float    n;         /* Refraction index of the medium the ray travels in */
+    uint     pixel;
+    uint     records;
+};
+
+typedef struct __rsecondary rsecondary;
+
+/* The perspective values of a camera for a given resolution */
+struct __rview {
+    float3   im_corner;
+    float3   origin;
+    float3   up;
+    float3   right;
+
+    float    w_factor;
+    float    h_factor;
+    uint     pwidth;
+    uint     pheight;
+} __attribute__ ((aligned (16)));
+
+typedef struct __rview rview;
+
+/* Placement of the light visibility grid, see `light_visibility` in trace.cl */
+struct __rvis_grid {
+    float3   min;       /* Corner of the grid */
+    float    cell;      /* Edge length of the cubic cells */
+    uint     bricks;    /* Bricks per axis */
+    uint     lights;
+} __attribute__ ((aligned (16)));
+
+typedef struct __rvis_grid rvis_grid;
+
+/* Shadow ray deferred by the raytracer to the shadow pass. `rgb` is the
+   contribution to the pixel if nothing blocks the path between the points */
+struct __rshadow {
+    float3   from;
+    float3   to;
+
+    float3   rgb;
+} __attribute__ ((aligned (16)));
+
+typedef struct __rshadow rshadow;
+
+/* What the primary ray of a pixel hit, guides the denoiser */
+struct __rgbuffer {
+    float3   normal;    /* Zero when the pixel is not denoised */
+    float3   albedo;
+
+    float    depth;     /* INFINITY when the ray did not hit a solid object */
+} __attribute__ ((aligned (16)));
+
+typedef struct __rgbuffer rgbuffer;
+
 
 #endif
\ No newline at end of file
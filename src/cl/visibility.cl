@@ -0,0 +1,89 @@
+#include "src/cl/types.cl"             /* All used types */
+#include "src/cl/primitives.cl"        /* Intersection functions */
+#include "src/cl/trace.cl"             /* Visibility classes */
+
+
+
+/* Points on the light tested from every vertex: the center and the first
+   VIS_LIGHT_POINTS-1 entries of the shadow sample table, which are stratified */
+#define VIS_LIGHT_POINTS 9
+
+
+/* `testShadowPath` without the objects the vertex is in: the spheres containing it
+   and the planes it is behind. The vertices inside an object then agree with the
+   ones in front of its lit surface instead of making every surface a shadow edge */
+float vertex_path(float3 to, float3 from, __global rsphere *spheres,
+                  __global rplane *planes, uint spheres_num, uint planes_num) {
+
+    rray ray;
+    ray.origin = from;
+    ray.dir = normalize(to-from);
+
+    float t = distance(to, from);
+    float opacity = 1.0f;
+
+    for (uint i = 0; i < spheres_num; i++) {
+        rsphere sphere = spheres[i];
+        if (distance(from, sphere.origin) < sphere.radius) { continue; }
+
+        float _t;
+        if (!intersect_sphere(&ray, &sphere.origin, sphere.radius, &_t) || _t >= t) {
+            continue;
+        }
+
+        if (sphere.material.transperent) {
+            opacity *= TRANSPERENT_THROUGH;
+            continue;
+        }
+
+        return 0.0f;
+    }
+
+    for (uint i = 0; i < planes_num; i++) {
+        rplane plane = planes[i];
+        if (dot(from-plane.point_in_plane, plane.normal) < 0.0f) { continue; }
+
+        float _t;
+        if (intersect_plane(&ray, &plane.normal, &plane.point_in_plane, &_t) && _t < t) {
+            return 0.0f;
+        }
+    }
+
+    return opacity;
+}
+
+/* Classifies every vertex of the visibility grid for the light: VIS_VISIBLE if all
+   the tested points on the light are seen from it, VIS_OCCLUDED if none is and
+   VIS_MIXED otherwise. The vertices are indexed x first, the grid has
+   bricks*VIS_BRICK+1 of them per axis */
+__kernel void visibility(__global rsphere* spheres,
+                         __global rplane* planes, __global rlight* lights,
+                         uint spheres_num, uint planes_num, uint light,
+                         __global float3* shadow_samples, rvis_grid grid,
+                         __global uchar* vertex_vis) {
+
+    uint verts = grid.bricks*VIS_BRICK+1;
+
+    uint id = get_global_id(0);
+    if (id >= verts*verts*verts) { return; }
+
+    float3 vertex = grid.min+grid.cell*(float3){(float)(id%verts),
+                                                (float)(id/verts%verts),
+                                                (float)(id/(verts*verts))};
+
+    rlight l = lights[light];
+    uint seen = 0, blocked = 0;
+
+    for (uint j = 0; j < VIS_LIGHT_POINTS; j++) {
+        float3 point = l.origin;
+        if (j > 0) { point += l.radius*shadow_samples[j-1]; }
+
+        float opacity = vertex_path(point, vertex, spheres, planes,
+                                    spheres_num, planes_num);
+        if (opacity >= 1.0f) { seen++; }
+        if (opacity <= 0.0f) { blocked++; }
+    }
+
+    vertex_vis[id] = (seen == VIS_LIGHT_POINTS)    ? VIS_VISIBLE :
+                     (blocked == VIS_LIGHT_POINTS) ? VIS_OCCLUDED : VIS_MIXED;
+}
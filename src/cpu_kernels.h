@@ -0,0 +1,228 @@
+#pragma once
+
+
+/* Kernel indices in the cl_wrap of the frontends. Every frontend passes the
+   kernels to `cl_wrap_init` in this order and leaves out the ones after the
+   last it uses: raydaemon stops at secondarygather, raypng at sortscatter */
+#define KERNEL_RAYGEN           0
+#define KERNEL_RAYTRACER        1
+#define KERNEL_SHADOWTEST       2
+#define KERNEL_SHADOWGATHER     3
+#define KERNEL_AADETECT         4
+#define KERNEL_AATRACE          5
+#define KERNEL_DENOISE          6
+#define KERNEL_SECONDARYTRACE   7
+#define KERNEL_SECONDARYGATHER  8
+#define KERNEL_SECONDARYKEY     9
+#define KERNEL_SORTHIST         10
+#define KERNEL_SORTSCAN         11
+#define KERNEL_SORTSCATTER      12
+#define KERNEL_TEMPORAL         13
+
+/* Argument indices of every kernel, in the order of its parameters in src/cl */
+
+/* raygen */
+#define RAYGEN_ARG_VIEWS      0
+#define RAYGEN_ARG_VIEWS_NUM  1
+#define RAYGEN_ARG_RAYS       2
+
+/* raytracer */
+#define RAYTRACER_ARG_RAYS             0
+#define RAYTRACER_ARG_SPHERES          1
+#define RAYTRACER_ARG_PLANES           2
+#define RAYTRACER_ARG_LIGHTS           3
+#define RAYTRACER_ARG_SPHERES_NUM      4
+#define RAYTRACER_ARG_PLANES_NUM       5
+#define RAYTRACER_ARG_LIGHT_NUM        6
+#define RAYTRACER_ARG_TOTAL_SIZE       7
+#define RAYTRACER_ARG_IM_ARR           8
+#define RAYTRACER_ARG_SKYBOX           9
+#define RAYTRACER_ARG_OUTPUT           10
+#define RAYTRACER_ARG_LIGHT_ALIAS      11
+#define RAYTRACER_ARG_LIGHT_SAMPLES    12
+#define RAYTRACER_ARG_SHADOW_RAYS      13
+#define RAYTRACER_ARG_SHADOW_NUM       14
+#define RAYTRACER_ARG_SHADOW_SLOTS     15
+#define RAYTRACER_ARG_SHADOW_SAMPLES   16
+#define RAYTRACER_ARG_SAMPLE_MASK      17
+#define RAYTRACER_ARG_FRAME            18
+#define RAYTRACER_ARG_HIT_IDS          19
+#define RAYTRACER_ARG_GBUFFER          20
+#define RAYTRACER_ARG_SOFT_SHADOWS     21
+#define RAYTRACER_ARG_TRACE_LIST       22
+#define RAYTRACER_ARG_USE_TRACE_LIST   23
+#define RAYTRACER_ARG_SECONDARY        24
+#define RAYTRACER_ARG_SECONDARY_NUM    25
+#define RAYTRACER_ARG_DEFER_SECONDARY  26
+#define RAYTRACER_ARG_PWIDTH           27
+#define RAYTRACER_ARG_TRACE_STATS      28
+#define RAYTRACER_ARG_VIS_BRICKS       29
+#define RAYTRACER_ARG_VIS_CELLS        30
+#define RAYTRACER_ARG_VIS_GRID         31
+#define RAYTRACER_ARG_MESHES           32
+#define RAYTRACER_ARG_VERTICES         33
+#define RAYTRACER_ARG_INDICES          34
+#define RAYTRACER_ARG_MESH_NODES       35
+#define RAYTRACER_ARG_MESH_NUM         36
+
+/* shadowtest */
+#define SHADOWTEST_ARG_SHADOW_RAYS     0
+#define SHADOWTEST_ARG_SHADOW_NUM      1
+#define SHADOWTEST_ARG_SHADOW_SLOTS    2
+#define SHADOWTEST_ARG_SPHERES         3
+#define SHADOWTEST_ARG_PLANES          4
+#define SHADOWTEST_ARG_SPHERES_NUM     5
+#define SHADOWTEST_ARG_PLANES_NUM      6
+#define SHADOWTEST_ARG_TOTAL_SIZE      7
+#define SHADOWTEST_ARG_OCCLUDER_CACHE  8
+#define SHADOWTEST_ARG_CACHE_SIZE      9
+#define SHADOWTEST_ARG_MESHES          10
+#define SHADOWTEST_ARG_VERTICES        11
+#define SHADOWTEST_ARG_INDICES         12
+#define SHADOWTEST_ARG_MESH_NODES      13
+#define SHADOWTEST_ARG_MESH_NUM        14
+
+/* shadowgather */
+#define SHADOWGATHER_ARG_RAYS          0
+#define SHADOWGATHER_ARG_SHADOW_RAYS   1
+#define SHADOWGATHER_ARG_SHADOW_NUM    2
+#define SHADOWGATHER_ARG_SHADOW_SLOTS  3
+#define SHADOWGATHER_ARG_TOTAL_SIZE    4
+#define SHADOWGATHER_ARG_OUTPUT        5
+
+/* aadetect */
+#define AADETECT_ARG_RAYS       0
+#define AADETECT_ARG_HIT_IDS    1
+#define AADETECT_ARG_PWIDTH     2
+#define AADETECT_ARG_PHEIGHT    3
+#define AADETECT_ARG_THRESHOLD  4
+#define AADETECT_ARG_AA_LIST    5
+#define AADETECT_ARG_AA_NUM     6
+#define AADETECT_ARG_VIEWS_NUM  7
+
+/* aatrace */
+#define AATRACE_ARG_RAYS            0
+#define AATRACE_ARG_SPHERES         1
+#define AATRACE_ARG_PLANES          2
+#define AATRACE_ARG_LIGHTS          3
+#define AATRACE_ARG_SPHERES_NUM     4
+#define AATRACE_ARG_PLANES_NUM      5
+#define AATRACE_ARG_LIGHT_NUM       6
+#define AATRACE_ARG_AA_NUM          7
+#define AATRACE_ARG_IM_ARR          8
+#define AATRACE_ARG_SKYBOX          9
+#define AATRACE_ARG_OUTPUT          10
+#define AATRACE_ARG_LIGHT_ALIAS     11
+#define AATRACE_ARG_LIGHT_SAMPLES   12
+#define AATRACE_ARG_SHADOW_SAMPLES  13
+#define AATRACE_ARG_SAMPLE_MASK     14
+#define AATRACE_ARG_FRAME           15
+#define AATRACE_ARG_AA_LIST         16
+#define AATRACE_ARG_AA_SAMPLES      17
+#define AATRACE_ARG_VIEWS           18
+#define AATRACE_ARG_SOFT_SHADOWS    19
+#define AATRACE_ARG_VIS_BRICKS      20
+#define AATRACE_ARG_VIS_CELLS       21
+#define AATRACE_ARG_VIS_GRID        22
+#define AATRACE_ARG_MESHES          23
+#define AATRACE_ARG_VERTICES        24
+#define AATRACE_ARG_INDICES         25
+#define AATRACE_ARG_MESH_NODES      26
+#define AATRACE_ARG_MESH_NUM        27
+
+/* denoise */
+#define DENOISE_ARG_RAYS       0
+#define DENOISE_ARG_PING       1
+#define DENOISE_ARG_PONG       2
+#define DENOISE_ARG_GBUFFER    3
+#define DENOISE_ARG_PWIDTH     4
+#define DENOISE_ARG_PHEIGHT    5
+#define DENOISE_ARG_PASS       6
+#define DENOISE_ARG_PASSES     7
+#define DENOISE_ARG_OUTPUT     8
+#define DENOISE_ARG_VIEWS_NUM  9
+
+/* secondarytrace */
+#define SECONDARYTRACE_ARG_SECONDARY       0
+#define SECONDARYTRACE_ARG_SECONDARY_NUM   1
+#define SECONDARYTRACE_ARG_ORDER           2
+#define SECONDARYTRACE_ARG_USE_ORDER       3
+#define SECONDARYTRACE_ARG_SPHERES         4
+#define SECONDARYTRACE_ARG_PLANES          5
+#define SECONDARYTRACE_ARG_LIGHTS          6
+#define SECONDARYTRACE_ARG_SPHERES_NUM     7
+#define SECONDARYTRACE_ARG_PLANES_NUM      8
+#define SECONDARYTRACE_ARG_LIGHT_NUM       9
+#define SECONDARYTRACE_ARG_IM_ARR          10
+#define SECONDARYTRACE_ARG_SKYBOX          11
+#define SECONDARYTRACE_ARG_LIGHT_ALIAS     12
+#define SECONDARYTRACE_ARG_LIGHT_SAMPLES   13
+#define SECONDARYTRACE_ARG_SHADOW_SAMPLES  14
+#define SECONDARYTRACE_ARG_SAMPLE_MASK     15
+#define SECONDARYTRACE_ARG_FRAME           16
+#define SECONDARYTRACE_ARG_SOFT_SHADOWS    17
+#define SECONDARYTRACE_ARG_TRACE_STATS     18
+#define SECONDARYTRACE_ARG_VIS_BRICKS      19
+#define SECONDARYTRACE_ARG_VIS_CELLS       20
+#define SECONDARYTRACE_ARG_VIS_GRID        21
+#define SECONDARYTRACE_ARG_MESHES          22
+#define SECONDARYTRACE_ARG_VERTICES        23
+#define SECONDARYTRACE_ARG_INDICES         24
+#define SECONDARYTRACE_ARG_MESH_NODES      25
+#define SECONDARYTRACE_ARG_MESH_NUM        26
+
+/* secondarygather */
+#define SECONDARYGATHER_ARG_RAYS           0
+#define SECONDARYGATHER_ARG_SECONDARY      1
+#define SECONDARYGATHER_ARG_SECONDARY_NUM  2
+#define SECONDARYGATHER_ARG_OUTPUT         3
+
+/* secondarykey */
+#define SECONDARYKEY_ARG_SECONDARY      0
+#define SECONDARYKEY_ARG_SECONDARY_NUM  1
+#define SECONDARYKEY_ARG_KEYS           2
+#define SECONDARYKEY_ARG_ORDER          3
+#define SECONDARYKEY_ARG_BOUNDS_MIN     4
+#define SECONDARYKEY_ARG_BOUNDS_SCALE   5
+
+/* sorthist */
+#define SORTHIST_ARG_KEYS           0
+#define SORTHIST_ARG_SECONDARY_NUM  1
+#define SORTHIST_ARG_SHIFT          2
+#define SORTHIST_ARG_HIST           3
+#define SORTHIST_ARG_BLOCKS         4
+
+/* sortscan */
+#define SORTSCAN_ARG_HIST    0
+#define SORTSCAN_ARG_BLOCKS  1
+
+/* sortscatter */
+#define SORTSCATTER_ARG_KEYS_IN        0
+#define SORTSCATTER_ARG_ORDER_IN       1
+#define SORTSCATTER_ARG_KEYS_OUT       2
+#define SORTSCATTER_ARG_ORDER_OUT      3
+#define SORTSCATTER_ARG_SECONDARY_NUM  4
+#define SORTSCATTER_ARG_SHIFT          5
+#define SORTSCATTER_ARG_HIST           6
+#define SORTSCATTER_ARG_BLOCKS         7
+
+/* temporal */
+#define TEMPORAL_ARG_RAYS          0
+#define TEMPORAL_ARG_GBUFFER       1
+#define TEMPORAL_ARG_HIT_IDS       2
+#define TEMPORAL_ARG_SHADOW_NUM    3
+#define TEMPORAL_ARG_SHADOW_SLOTS  4
+#define TEMPORAL_ARG_OUTPUT        5
+#define TEMPORAL_ARG_HIST_COLOR    6
+#define TEMPORAL_ARG_HIST_POS      7
+#define TEMPORAL_ARG_HIST_HIT      8
+#define TEMPORAL_ARG_REPROJ_DEPTH  9
+#define TEMPORAL_ARG_REPROJ_COLOR  10
+#define TEMPORAL_ARG_REPROJ_POS    11
+#define TEMPORAL_ARG_REPROJ_HIT    12
+#define TEMPORAL_ARG_TRACE_LIST    13
+#define TEMPORAL_ARG_TRACE_NUM     14
+#define TEMPORAL_ARG_VIEW          15
+#define TEMPORAL_ARG_PASS          16
+#define TEMPORAL_ARG_FRAME         17
+#define TEMPORAL_ARG_REFRESH       18
@@ -0,0 +1,135 @@
+#include <stdlib.h>
+#include <math.h>
+
+#include "cpu_light.h"
+
+
+/* Base 2 radical inverse, the first dimension of the Sobol sequence */
+static cl_uint sobol_first(cl_uint i) {
+    i = (i << 16) | (i >> 16);
+    i = ((i & 0x00FF00FF) << 8) | ((i & 0xFF00FF00) >> 8);
+    i = ((i & 0x0F0F0F0F) << 4) | ((i & 0xF0F0F0F0) >> 4);
+    i = ((i & 0x33333333) << 2) | ((i & 0xCCCCCCCC) >> 2);
+    i = ((i & 0x55555555) << 1) | ((i & 0xAAAAAAAA) >> 1);
+    return i;
+}
+
+static cl_uint sobol_second(cl_uint i) {
+    cl_uint r = 0;
+    for (cl_uint v = 1U << 31; i; i >>= 1, v ^= v >> 1) {
+        if (i & 1) { r ^= v; }
+    }
+    return r;
+}
+
+static cl_float light_power(const rlight* light) {
+    return light->intensity*(light->rgb.x+light->rgb.y+light->rgb.z)/3.0f;
+}
+
+rlight_alias* rgen_light_alias(const rlight* rlights, cl_uint rlight_num) {
+    rlight_alias    *table;
+    cl_float        *scaled;
+    cl_uint         *small, *large;
+    cl_uint         small_num, large_num;
+    cl_float        total;
+
+
+    if (rlight_num == 0) { return NULL; }
+
+    table   = malloc(rlight_num*sizeof(rlight_alias));
+    scaled  = malloc(rlight_num*sizeof(cl_float));
+    small   = malloc(rlight_num*sizeof(cl_uint));
+    large   = malloc(rlight_num*sizeof(cl_uint));
+    if (!table || !scaled || !small || !large) {
+        free(table);
+        free(scaled);
+        free(small);
+        free(large);
+        return NULL;
+    }
+
+    total = 0.0f;
+    for (cl_uint i = 0; i < rlight_num; i++) {
+        cl_float power = light_power(&rlights[i]);
+        total += (power > 0.0f) ? power : 0.0f;
+    }
+
+    /* Scale the probabilities so that the mean bucket is exactly 1. Without any
+       light power at all fall back to uniform sampling */
+    for (cl_uint i = 0; i < rlight_num; i++) {
+        cl_float power = light_power(&rlights[i]);
+        power = (power > 0.0f) ? power : 0.0f;
+
+        table[i].pdf = (total > 0.0f) ? power/total : 1.0f/rlight_num;
+        scaled[i] = table[i].pdf*rlight_num;
+    }
+
+    small_num = 0;
+    large_num = 0;
+    for (cl_uint i = 0; i < rlight_num; i++) {
+        if (scaled[i] < 1.0f) {
+            small[small_num++] = i;
+        } else {
+            large[large_num++] = i;
+        }
+    }
+
+    /* Fill every underfull bucket with the remainder of an overfull one */
+    while (small_num > 0 && large_num > 0) {
+        cl_uint s = small[--small_num];
+        cl_uint l = large[--large_num];
+
+        table[s].prob   = scaled[s];
+        table[s].alias  = l;
+
+        scaled[l] = (scaled[l]+scaled[s])-1.0f;
+        if (scaled[l] < 1.0f) {
+            small[small_num++] = l;
+        } else {
+            large[large_num++] = l;
+        }
+    }
+
+    /* Leftovers are full buckets, only off from 1 by floating point error */
+    while (large_num > 0) {
+        cl_uint l = large[--large_num];
+        table[l].prob   = 1.0f;
+        table[l].alias  = l;
+    }
+    while (small_num > 0) {
+        cl_uint s = small[--small_num];
+        table[s].prob   = 1.0f;
+        table[s].alias  = s;
+    }
+
+    free(scaled);
+    free(small);
+    free(large);
+
+    return table;
+}
+
+cl_float3* rgen_shadow_samples(cl_uint count) {
+    cl_float3 *samples;
+
+
+    if (count == 0 || (count & (count-1))) { return NULL; }
+
+    samples = malloc(count*sizeof(cl_float3));
+    if (!samples) { return NULL; }
+
+    for (cl_uint i = 0; i < count; i++) {
+        /* Offset by half a step to stay off the poles */
+        cl_float u = (sobol_first(i)+0.5f*(0xFFFFFFFFU/count))/4294967296.0f;
+        cl_float v = sobol_second(i)/4294967296.0f;
+
+        /* Area preserving mapping of the unit square onto the sphere */
+        cl_float z = 1.0f-2.0f*u;
+        cl_float r = sqrtf(fmaxf(0.0f, 1.0f-z*z));
+        cl_float phi = 2.0f*M_PI*v;
+
+        samples[i] = (cl_float3){.x = r*cosf(phi), .y = r*sinf(phi), .z = z};
+    }
+
+    return samples;
+}
@@ -0,0 +1,31 @@
+#pragma once
+#include <CL/opencl.h>
+
+#include "cpu_obj.h"
+
+
+#pragma pack(push, 16)
+/* One bucket of the power weighted alias table used for many-light sampling */
+struct __rlight_alias {
+    cl_float            prob;       /* Probability of keeping the bucket's light */
+    cl_uint             alias;      /* Light that is picked otherwise */
+    cl_float            pdf;        /* Probability of picking the bucket's light */
+};
+#pragma pack(pop)
+
+typedef struct __rlight_alias rlight_alias;
+
+
+/* Builds an alias table (Vose's method) over the lights where every light is
+   picked with a probability proportional to its power (intensity * mean rgb).
+   Does the memory allocation automatically don't forget to free.
+   Returns NULL on fail */
+rlight_alias*   rgen_light_alias(const rlight* rlights, cl_uint rlight_num);
+
+/* Generates `count` points on the unit sphere from the first two dimensions of
+   the Sobol sequence, used as the soft shadow sample table. Runs of samples
+   starting at a multiple of a power of two are stratified over the sphere. The
+   second dimension is the angle about the z axis, which the kernels turn per pixel.
+   `count` must be a power of two. Does the memory allocation automatically don't
+   forget to free. Returns NULL on fail */
+cl_float3*      rgen_shadow_samples(cl_uint count);
@@ -0,0 +1,433 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cpu_mesh.h"
+#include "cpu_timeline.h"
+
+
+/* Bins the centroids are sorted into along the split axis */
+#define BVH_BINS 16
+
+/* Box around a triangle or a group of them */
+typedef struct {
+    cl_float    min[3];
+    cl_float    max[3];
+} rbox;
+
+/* Triangles the hierarchy is built over, `order` is their order in the leaves */
+typedef struct {
+    rmesh_node  *nodes;
+    cl_uint     node_num;
+
+    rbox        *boxes;
+    cl_float    *centroids;     /* x, y and z of every triangle in a row */
+    cl_uint     *order;
+} rbvh_build;
+
+static void box_empty(rbox* box) {
+    for (int a = 0; a < 3; a++) {
+        box->min[a] = INFINITY;
+        box->max[a] = -INFINITY;
+    }
+}
+
+static void box_grow(rbox* box, const rbox* other) {
+    for (int a = 0; a < 3; a++) {
+        box->min[a] = fminf(box->min[a], other->min[a]);
+        box->max[a] = fmaxf(box->max[a], other->max[a]);
+    }
+}
+
+/* Half the surface area, 0 for an empty box */
+static float box_area(const rbox* box) {
+    float e[3];
+    for (int a = 0; a < 3; a++) {
+        e[a] = box->max[a]-box->min[a];
+        if (e[a] < 0.0f) { return 0.0f; }
+    }
+    return e[0]*e[1]+e[1]*e[2]+e[2]*e[0];
+}
+
+/* Bin of the centroid `c` along an axis starting at `start` */
+static int bin_of(float c, float start, float scale) {
+    int bin = (int)((c-start)*scale);
+    return (bin < 0) ? 0 : (bin >= BVH_BINS) ? BVH_BINS-1 : bin;
+}
+
+/* Makes `node` the root of the triangles `order[first]` to `order[first+count-1]`,
+   `depth` levels below the root of the mesh */
+static void build_node(rbvh_build* b, cl_uint node, cl_uint first, cl_uint count,
+                       cl_uint depth) {
+
+    rbox bounds, centers;
+    box_empty(&bounds);
+    box_empty(&centers);
+
+    for (cl_uint i = first; i < first+count; i++) {
+        const float *c = b->centroids+3*(size_t)b->order[i];
+        rbox point = {{c[0], c[1], c[2]}, {c[0], c[1], c[2]}};
+
+        box_grow(&bounds, &b->boxes[b->order[i]]);
+        box_grow(&centers, &point);
+    }
+
+    rmesh_node *n = &b->nodes[node];
+    memcpy(n->min, bounds.min, sizeof(n->min));
+    memcpy(n->max, bounds.max, sizeof(n->max));
+    n->index = first;
+    n->count = count;
+
+    if (count <= RMESH_LEAF_SIZE || depth >= RMESH_MAX_DEPTH) { return; }
+
+    /* The centroids are binned along their longest axis */
+    int axis = 0;
+    for (int a = 1; a < 3; a++) {
+        if (centers.max[a]-centers.min[a] > centers.max[axis]-centers.min[axis]) {
+            axis = a;
+        }
+    }
+
+    float start = centers.min[axis];
+    float extent = centers.max[axis]-start;
+    /* Triangles whose centroids cannot be told apart are split in halves */
+    cl_uint middle = first+count/2;
+
+    if (extent > 0.0f) {
+        float   scale = BVH_BINS/extent;
+        rbox    bin_boxes[BVH_BINS];
+        cl_uint bin_counts[BVH_BINS] = {0};
+
+        for (int k = 0; k < BVH_BINS; k++) { box_empty(&bin_boxes[k]); }
+        for (cl_uint i = first; i < first+count; i++) {
+            cl_uint t = b->order[i];
+            int k = bin_of(b->centroids[3*(size_t)t+axis], start, scale);
+
+            box_grow(&bin_boxes[k], &b->boxes[t]);
+            bin_counts[k]++;
+        }
+
+        /* Areas and counts left of every split, then the cheapest split from the
+           right. The cost of a side is its area times its triangles */
+        float   left_area[BVH_BINS];
+        cl_uint left_count[BVH_BINS];
+        rbox    side;
+        cl_uint side_count = 0;
+
+        box_empty(&side);
+        for (int k = 0; k < BVH_BINS-1; k++) {
+            box_grow(&side, &bin_boxes[k]);
+            side_count += bin_counts[k];
+            left_area[k] = box_area(&side);
+            left_count[k] = side_count;
+        }
+
+        float   best_cost = INFINITY;
+        int     best = -1;
+
+        box_empty(&side);
+        side_count = 0;
+        for (int k = BVH_BINS-1; k > 0; k--) {
+            box_grow(&side, &bin_boxes[k]);
+            side_count += bin_counts[k];
+
+            if (left_count[k-1] == 0 || side_count == 0) { continue; }
+
+            float cost = left_area[k-1]*left_count[k-1]+box_area(&side)*side_count;
+            if (cost < best_cost) {
+                best_cost = cost;
+                best = k-1;
+            }
+        }
+
+        /* The triangles of the bins up to `best` go left */
+        if (best >= 0) {
+            cl_uint i = first, j = first+count;
+            while (i < j) {
+                cl_uint t = b->order[i];
+                if (bin_of(b->centroids[3*(size_t)t+axis], start, scale) <= best) {
+                    i++;
+                } else {
+                    b->order[i] = b->order[--j];
+                    b->order[j] = t;
+                }
+            }
+            if (i > first && i < first+count) { middle = i; }
+        }
+    }
+
+    cl_uint children = b->node_num;
+    b->node_num += 2;
+
+    n->index = children;
+    n->count = 0;
+
+    build_node(b, children, first, middle-first, depth+1);
+    build_node(b, children+1, middle, first+count-middle, depth+1);
+}
+
+cl_uint rbuild_mesh_bvh(rmesh_node* nodes, const cl_float* xyz[3], cl_uint* corners[3],
+                        cl_uint triangle_num) {
+
+    if (triangle_num == 0) { return 0; }
+
+    rtimeline_begin("mesh bvh");
+
+    rbvh_build b = {
+        .nodes      = nodes,
+        .node_num   = 1,
+        .boxes      = malloc(sizeof(rbox)*triangle_num),
+        .centroids  = malloc(3*sizeof(cl_float)*triangle_num),
+        .order      = malloc(sizeof(cl_uint)*triangle_num)
+    };
+
+    for (cl_uint t = 0; t < triangle_num; t++) {
+        rbox *box = &b.boxes[t];
+        box_empty(box);
+
+        for (int c = 0; c < 3; c++) {
+            for (int a = 0; a < 3; a++) {
+                box->min[a] = fminf(box->min[a], xyz[a][corners[c][t]]);
+                box->max[a] = fmaxf(box->max[a], xyz[a][corners[c][t]]);
+            }
+        }
+        for (int a = 0; a < 3; a++) {
+            b.centroids[3*(size_t)t+a] = 0.5f*(box->min[a]+box->max[a]);
+        }
+        b.order[t] = t;
+    }
+
+    build_node(&b, 0, 0, triangle_num, 0);
+
+    /* The corners follow the order of the leaves */
+    cl_uint *reordered = malloc(sizeof(cl_uint)*triangle_num);
+    for (int c = 0; c < 3; c++) {
+        for (cl_uint i = 0; i < triangle_num; i++) {
+            reordered[i] = corners[c][b.order[i]];
+        }
+        memcpy(corners[c], reordered, sizeof(cl_uint)*triangle_num);
+    }
+
+    free(reordered);
+    free(b.boxes);
+    free(b.centroids);
+    free(b.order);
+
+    rtimeline_end();
+    return b.node_num;
+}
+
+int dump_rmesh(const char* filename, const cl_float* xyz[3], cl_uint vertex_num,
+               const cl_uint* corners[3], cl_uint triangle_num,
+               const rmesh_node* nodes, cl_uint node_num) {
+
+    unsigned char   header_bytes[RMESH_OFFSET] = {0};
+    rmesh_header    header = {
+        .magic          = RMESH_MAGIC,
+        .version        = RMESH_VERSION,
+        .vertex_num     = vertex_num,
+        .triangle_num   = triangle_num,
+        .min            = {INFINITY, INFINITY, INFINITY},
+        .max            = {-INFINITY, -INFINITY, -INFINITY},
+        .node_num       = node_num
+    };
+
+    for (cl_uint a = 0; a < 3; a++) {
+        for (cl_uint i = 0; i < vertex_num; i++) {
+            if (xyz[a][i] < header.min[a]) { header.min[a] = xyz[a][i]; }
+            if (xyz[a][i] > header.max[a]) { header.max[a] = xyz[a][i]; }
+        }
+    }
+    memcpy(header_bytes, &header, sizeof(header));
+
+    FILE* fp = fopen(filename, "wb");
+    if (!fp) {
+        return 0;
+    }
+
+    int written = fwrite(header_bytes, RMESH_OFFSET, 1, fp) == 1;
+    for (cl_uint a = 0; a < 3; a++) {
+        written &= fwrite(xyz[a], sizeof(cl_float), vertex_num, fp) == vertex_num;
+    }
+    for (cl_uint c = 0; c < 3; c++) {
+        written &= fwrite(corners[c], sizeof(cl_uint), triangle_num, fp) == triangle_num;
+    }
+    written &= fwrite(nodes, sizeof(rmesh_node), node_num, fp) == node_num;
+
+    return (fclose(fp) == 0) && written;
+}
+
+/* True if the hierarchy stays within the triangles and its nodes and no deeper than
+   the stack of the kernels. The children come after their parent, so a single pass
+   knows the deepest level of every node */
+static int check_nodes(const rmesh_node* nodes, cl_uint node_num, cl_uint triangle_num) {
+    if (node_num == 0 || node_num > 2*(cl_ulong)triangle_num-1) { return 0; }
+
+    unsigned char *depth = calloc(node_num, 1);
+    int valid = 1;
+
+    for (cl_uint i = 0; i < node_num && valid; i++) {
+        const rmesh_node *node = &nodes[i];
+
+        if (node->count) {
+            valid = node->index <= triangle_num &&
+                    node->count <= triangle_num-node->index;
+        } else {
+            valid = node->index > i && node->index < node_num-1 &&
+                    depth[i] < RMESH_MAX_DEPTH;
+            for (cl_uint c = node->index; valid && c <= node->index+1; c++) {
+                if (depth[c] < depth[i]+1) { depth[c] = depth[i]+1; }
+            }
+        }
+    }
+
+    free(depth);
+    return valid;
+}
+
+int map_rmesh(rmesh_file* file, const char* filename) {
+    struct stat info;
+    int fd;
+
+
+    if ((fd = open(filename, O_RDONLY)) < 0 || fstat(fd, &info) < 0) {
+        printf("ERROR:\tCannot open the mesh \"%s\"\n", filename);
+        if (fd >= 0) { close(fd); }
+        return 0;
+    }
+
+    file->size = info.st_size;
+    file->map  = (file->size >= RMESH_OFFSET) ?
+                    mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+
+    if (file->map == MAP_FAILED) {
+        printf("ERROR:\t\"%s\" is no mesh file\n", filename);
+        return 0;
+    }
+
+    /* All of it is read right away by the checks and the upload */
+    madvise(file->map, file->size, MADV_WILLNEED);
+
+    file->header    = file->map;
+    file->vertices  = (cl_float*)((unsigned char*)file->map+RMESH_OFFSET);
+    file->indices   = (cl_uint*)(file->vertices+3*(size_t)file->header->vertex_num);
+    file->nodes     = (rmesh_node*)(file->indices+3*(size_t)file->header->triangle_num);
+
+    rmesh_header *header = file->header;
+    if (header->magic != RMESH_MAGIC || header->version != RMESH_VERSION ||
+        file->size < RMESH_OFFSET+3*sizeof(cl_float)*(size_t)header->vertex_num+
+                                  3*sizeof(cl_uint)*(size_t)header->triangle_num+
+                                  sizeof(rmesh_node)*(size_t)header->node_num) {
+        printf("ERROR:\t\"%s\" is no mesh file of version %u, convert the model again "
+               "with raymesh\n", filename, RMESH_VERSION);
+        unmap_rmesh(file);
+        return 0;
+    }
+
+    /* The device buffers cannot be empty */
+    if (header->triangle_num == 0) {
+        printf("ERROR:\tThe mesh \"%s\" has no triangles\n", filename);
+        unmap_rmesh(file);
+        return 0;
+    }
+
+    /* One pass over the corners, the kernels do not check them */
+    cl_uint largest = 0;
+    for (size_t i = 0; i < 3*(size_t)header->triangle_num; i++) {
+        largest = (file->indices[i] > largest) ? file->indices[i] : largest;
+    }
+    if (largest >= header->vertex_num) {
+        printf("ERROR:\tThe mesh \"%s\" has a corner out of its %u vertices\n",
+               filename, header->vertex_num);
+        unmap_rmesh(file);
+        return 0;
+    }
+
+    if (!check_nodes(file->nodes, header->node_num, header->triangle_num)) {
+        printf("ERROR:\tThe mesh \"%s\" has a broken hierarchy\n", filename);
+        unmap_rmesh(file);
+        return 0;
+    }
+
+    return 1;
+}
+
+void unmap_rmesh(rmesh_file* file) {
+    if (file->map) { munmap(file->map, file->size); }
+    file->map = NULL;
+}
+
+void rgen_meshes(rmeshes* meshes, const rmesh_file* files,
+                 const rmaterial* materials, cl_uint num) {
+
+    rtimeline_begin("meshes");
+
+    meshes->meshes          = malloc(sizeof(rmesh)*(num ? num : 1));
+    meshes->mesh_num        = num;
+    meshes->vertex_num      = 0;
+    meshes->triangle_num    = 0;
+    meshes->node_num        = 0;
+
+    for (cl_uint i = 0; i < num; i++) {
+        rmesh_header *header = files[i].header;
+
+        meshes->meshes[i] = (rmesh){
+            .first_vertex   = meshes->vertex_num,
+            .vertex_num     = header->vertex_num,
+            .first_triangle = meshes->triangle_num,
+            .triangle_num   = header->triangle_num,
+            .first_node     = meshes->node_num,
+            .node_num       = header->node_num,
+            .material       = materials[i]
+        };
+
+        meshes->vertex_num   += header->vertex_num;
+        meshes->triangle_num += header->triangle_num;
+        meshes->node_num     += header->node_num;
+    }
+
+    /* The layout of one file is already the one of the kernels */
+    meshes->copied = num > 1;
+    if (num == 1) {
+        meshes->vertices    = files[0].vertices;
+        meshes->indices     = files[0].indices;
+        meshes->nodes       = files[0].nodes;
+        rtimeline_end();
+        return;
+    }
+
+    meshes->vertices    = malloc(3*sizeof(cl_float)*(meshes->vertex_num ?
+                                                     meshes->vertex_num : 1));
+    meshes->indices     = malloc(3*sizeof(cl_uint)*(meshes->triangle_num ?
+                                                    meshes->triangle_num : 1));
+    meshes->nodes       = malloc(sizeof(rmesh_node)*(meshes->node_num ?
+                                                    meshes->node_num : 1));
+
+    for (cl_uint i = 0; i < num; i++) {
+        rmesh *mesh = &meshes->meshes[i];
+
+        memcpy(meshes->vertices+3*(size_t)mesh->first_vertex, files[i].vertices,
+               3*sizeof(cl_float)*(size_t)mesh->vertex_num);
+        memcpy(meshes->indices+3*(size_t)mesh->first_triangle, files[i].indices,
+               3*sizeof(cl_uint)*(size_t)mesh->triangle_num);
+        memcpy(meshes->nodes+mesh->first_node, files[i].nodes,
+               sizeof(rmesh_node)*mesh->node_num);
+    }
+
+    rtimeline_end();
+}
+
+void rfree_meshes(rmeshes* meshes) {
+    free(meshes->meshes);
+    if (meshes->copied) {
+        free(meshes->vertices);
+        free(meshes->indices);
+        free(meshes->nodes);
+    }
+}
@@ -0,0 +1,122 @@
+#pragma once
+#include <stdio.h>
+#include <CL/opencl.h>
+
+#include "cpu_obj.h"
+
+
+/* "RMSH" and the layout version of the binary mesh files */
+#define RMESH_MAGIC     0x48534d52
+#define RMESH_VERSION   2
+/* The arrays start after the header, 16 byte aligned in the file and the map */
+#define RMESH_OFFSET    64
+
+/* Levels of the bounding volume hierarchy below its root at most, the kernels
+   keep a stack of that many nodes. The same as in src/cl/types.cl */
+#define RMESH_MAX_DEPTH 32
+/* Triangles a leaf is split down to */
+#define RMESH_LEAF_SIZE 4
+
+/* Header of a binary mesh file. After it come the vertex positions as the arrays
+   x[vertex_num], y[vertex_num] and z[vertex_num], then the corners of the
+   triangles as first[triangle_num], second[triangle_num] and third[triangle_num]
+   32 bit indices into the vertices and last the `node_num` nodes of the bounding
+   volume hierarchy. Counter-clockwise corners face the viewer. Everything is
+   little-endian like the hosts, the arrays are used in place */
+typedef struct {
+    cl_uint     magic;
+    cl_uint     version;
+    cl_uint     vertex_num;
+    cl_uint     triangle_num;
+
+    cl_float    min[3];         /* Box around the vertices */
+    cl_float    max[3];
+
+    cl_uint     node_num;
+} rmesh_header;
+
+/* Node of the bounding volume hierarchy of a mesh, the same as in src/cl/types.cl.
+   Node 0 is the root. A leaf holds the `count` triangles from `index` on, an inner
+   node has a `count` of 0 and its two children at `index` and `index+1` */
+typedef struct {
+    cl_float    min[3];
+    cl_uint     index;
+    cl_float    max[3];
+    cl_uint     count;
+} rmesh_node;
+
+#pragma scalar_storage_order little-endian
+#pragma pack(push, 16)
+/* Triangle mesh of the scene, the same as in src/cl/types.cl. Its vertices,
+   triangles and nodes are laid out as in the file from `first_vertex*3` floats,
+   `first_triangle*3` indices and `first_node` nodes on in the scene's buffers */
+struct __rmesh {
+    cl_uint             first_vertex;
+    cl_uint             vertex_num;
+    cl_uint             first_triangle;
+    cl_uint             triangle_num;
+    cl_uint             first_node;
+    cl_uint             node_num;
+
+    struct __rmaterial  material;
+};
+#pragma pack(pop)
+#pragma scalar_storage_order default
+
+typedef struct __rmesh      rmesh;
+
+/* Binary mesh file mapped into memory */
+typedef struct {
+    void        *map;
+    size_t      size;
+
+    rmesh_header *header;
+    cl_float    *vertices;      /* x, y and z arrays */
+    cl_uint     *indices;       /* First, second and third corner arrays */
+    rmesh_node  *nodes;
+} rmesh_file;
+
+/* Meshes of a scene laid out for the kernels */
+typedef struct {
+    rmesh       *meshes;
+    cl_uint     mesh_num;
+
+    cl_float    *vertices;
+    cl_uint     vertex_num;
+    cl_uint     *indices;
+    cl_uint     triangle_num;
+    rmesh_node  *nodes;
+    cl_uint     node_num;
+
+    /* The arrays were put together from several files, else they are in the map */
+    int         copied;
+} rmeshes;
+
+
+/* Builds the bounding volume hierarchy of the triangles with the surface area
+   heuristic into `nodes`, room for 2*triangle_num-1 of them. The `corners` arrays
+   are reordered so the triangles of a leaf are consecutive. Returns the number
+   of nodes */
+cl_uint     rbuild_mesh_bvh(rmesh_node* nodes, const cl_float* xyz[3],
+                            cl_uint* corners[3], cl_uint triangle_num);
+
+/* Writes a binary mesh file from the `xyz` arrays of the vertex positions, the
+   `corners` arrays of the triangles and their hierarchy from `rbuild_mesh_bvh`.
+   Returns 0 on fail and 1 on success */
+int         dump_rmesh(const char* filename, const cl_float* xyz[3], cl_uint vertex_num,
+                       const cl_uint* corners[3], cl_uint triangle_num,
+                       const rmesh_node* nodes, cl_uint node_num);
+
+/* Maps a binary mesh file, its arrays are not copied on the host. Returns
+   0 with the reason printed if it is no mesh file, has no triangles, or a corner
+   or node is out of range */
+int         map_rmesh(rmesh_file* file, const char* filename);
+
+void        unmap_rmesh(rmesh_file* file);
+
+/* Lays out the mapped files for the kernels, the mesh i gets `materials[i]`. A
+   single file is used in place, keep it mapped until `rfree_meshes` */
+void        rgen_meshes(rmeshes* meshes, const rmesh_file* files,
+                        const rmaterial* materials, cl_uint num);
+
+void        rfree_meshes(rmeshes* meshes);
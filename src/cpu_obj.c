@@ -1,5 +1,8 @@
 #include <stdio.h>
+#include <math.h>
+#include <string.h>
 #include "cpu_obj.h"
+#include "cpu_timeline.h"
 
 
 /* Smooth stone */
@@ -48,54 +51,126 @@ const rmaterial glass = {   .rgb            = (cl_float3){.x = 0.0f,.y = 0.0f,.z
                             .n              = 1.52f,
                             .reflectivity   = 0.04f, };
 
-int dump_robj(const char* filename, rsphere* rspheres, uint8_t rsphere_num,
-                rplane* rplanes, uint8_t rplane_num, rlight* rlights,
-                uint8_t rlight_num) {
+int dump_robj(const char* filename, rsphere* rspheres, cl_uint rsphere_num,
+                rplane* rplanes, cl_uint rplane_num, rlight* rlights,
+                cl_uint rlight_num) {
 
     FILE* fp = fopen(filename, "wb");
     if (!fp) {
         return 0;
     }
 
-    /* First byte is the number of elements which is followed by the raw data
+    /* First 4 bytes are the number of elements which is followed by the raw data
        of the structs array. The order is rsphere, rplane, rlight*/
-    fwrite(&rsphere_num, 1, 1, fp);
-    fwrite(rspheres, sizeof(rsphere), rsphere_num, fp);
-
-    fwrite(&rplane_num, 1, 1, fp);
-    fwrite(rplanes, sizeof(rplane), rplane_num, fp);
-
-    fwrite(&rlight_num, 1, 1, fp);
-    fwrite(rlights, sizeof(rlight), rlight_num, fp);
-
-    fclose(fp);
-
-    return 1;
+    int written = fwrite(&rsphere_num, sizeof(cl_uint), 1, fp) == 1 &&
+                  fwrite(rspheres, sizeof(rsphere), rsphere_num, fp) == rsphere_num &&
+                  fwrite(&rplane_num, sizeof(cl_uint), 1, fp) == 1 &&
+                  fwrite(rplanes, sizeof(rplane), rplane_num, fp) == rplane_num &&
+                  fwrite(&rlight_num, sizeof(cl_uint), 1, fp) == 1 &&
+                  fwrite(rlights, sizeof(rlight), rlight_num, fp) == rlight_num;
+
+    return (fclose(fp) == 0) && written;
 }
 
-void extract_robj(const char* filename, rsphere** rspheres, uint8_t* rsphere_num,
-                    rplane** rplanes, uint8_t* rplane_num, rlight** rlights,
-                    uint8_t* rlight_num) {
+int extract_robj(const char* filename, rsphere** rspheres, cl_uint* rsphere_num,
+                 rplane** rplanes, cl_uint* rplane_num, rlight** rlights,
+                 cl_uint* rlight_num) {
 
     FILE* fp = fopen(filename, "rb");
     if (!fp) {
-        return;
+        return 0;
     }
+    rtimeline_begin("parse scene");
 
-    /* First byte is the number of elements which is followed by the raw data
+    /* First 4 bytes are the number of elements which is followed by the raw data
        of the structs array. The order is rsphere, rplane, rlight*/
+    *rspheres = NULL;
+    *rplanes = NULL;
+    *rlights = NULL;
 
-    fread(rsphere_num, 1, 1, fp);
-    *rspheres = malloc((*rsphere_num) * sizeof(rsphere));
-    fread(*rspheres, sizeof(rsphere), *rsphere_num, fp);
+    int read = fread(rsphere_num, sizeof(cl_uint), 1, fp) == 1;
+    *rspheres = read ? malloc((*rsphere_num) * sizeof(rsphere)) : NULL;
+    read = read && (*rspheres || !*rsphere_num) &&
+           fread(*rspheres, sizeof(rsphere), *rsphere_num, fp) == *rsphere_num;
 
-    fread(rplane_num, 1, 1, fp);
-    *rplanes = malloc((*rplane_num) * sizeof(rplane));
-    fread(*rplanes, sizeof(rplane), *rplane_num, fp);
+    read = read && fread(rplane_num, sizeof(cl_uint), 1, fp) == 1;
+    *rplanes = read ? malloc((*rplane_num) * sizeof(rplane)) : NULL;
+    read = read && (*rplanes || !*rplane_num) &&
+           fread(*rplanes, sizeof(rplane), *rplane_num, fp) == *rplane_num;
 
-    fread(rlight_num, 1, 1, fp);
-    *rlights = malloc((*rlight_num) * sizeof(rlight));
-    fread(*rlights, sizeof(rlight), *rlight_num, fp);
+    read = read && fread(rlight_num, sizeof(cl_uint), 1, fp) == 1;
+    *rlights = read ? malloc((*rlight_num) * sizeof(rlight)) : NULL;
+    read = read && (*rlights || !*rlight_num) &&
+           fread(*rlights, sizeof(rlight), *rlight_num, fp) == *rlight_num;
 
     fclose(fp);
-}
\ No newline at end of file
+    rtimeline_end();
+
+    /* A cut off scene leaves nothing behind */
+    if (!read) {
+        free(*rspheres);
+        free(*rplanes);
+        free(*rlights);
+        *rspheres = NULL;
+        *rplanes = NULL;
+        *rlights = NULL;
+        *rsphere_num = *rplane_num = *rlight_num = 0;
+    }
+    return read;
+}
+
+int robj_options(char* options, size_t size, cl_uint sphere_num, cl_uint plane_num,
+                 cl_uint light_num, cl_ulong local_size, cl_int staging) {
+
+    size_t scene_size = sizeof(rsphere)*sphere_num+sizeof(rplane)*plane_num+
+                        sizeof(rlight)*light_num;
+
+    if (staging < 0) {
+        staging = scene_size <= local_size;
+    }
+
+    if (!staging) {
+        return 0;
+    }
+
+    /* The local arrays cannot be empty */
+    size_t used = strlen(options);
+    snprintf(options+used, size-used,
+             "%s-D SCENE_LOCAL -D SCENE_SPHERES=%u -D SCENE_PLANES=%u -D SCENE_LIGHTS=%u",
+             used ? " " : "", sphere_num ? sphere_num : 1, plane_num ? plane_num : 1,
+             light_num ? light_num : 1);
+    return 1;
+}
+
+void robj_bounds(rsphere* rspheres, cl_uint rsphere_num, rlight* rlights,
+                 cl_uint rlight_num, cl_float3* min, cl_float3* scale) {
+
+    cl_float3 max = {.x = -INFINITY, .y = -INFINITY, .z = -INFINITY};
+    *min = (cl_float3){.x = INFINITY, .y = INFINITY, .z = INFINITY};
+
+    for (cl_uint i = 0; i < rsphere_num+rlight_num; i++) {
+        cl_float3 origin = (i < rsphere_num) ? rspheres[i].origin :
+                                               rlights[i-rsphere_num].origin;
+        cl_float  radius = (i < rsphere_num) ? rspheres[i].radius :
+                                               rlights[i-rsphere_num].radius;
+
+        min->x = fminf(min->x, origin.x-radius);
+        min->y = fminf(min->y, origin.y-radius);
+        min->z = fminf(min->z, origin.z-radius);
+        max.x  = fmaxf(max.x, origin.x+radius);
+        max.y  = fmaxf(max.y, origin.y+radius);
+        max.z  = fmaxf(max.z, origin.z+radius);
+    }
+
+    /* Empty scenes and flat boxes get a unit sized box */
+    if (rsphere_num+rlight_num == 0) {
+        *min = (cl_float3){.x = 0.0f, .y = 0.0f, .z = 0.0f};
+        max  = (cl_float3){.x = 1.0f, .y = 1.0f, .z = 1.0f};
+    }
+
+    *scale = (cl_float3){
+        .x = 1.0f/fmaxf(max.x-min->x, 1e-3f),
+        .y = 1.0f/fmaxf(max.y-min->y, 1e-3f),
+        .z = 1.0f/fmaxf(max.z-min->z, 1e-3f)
+    };
+}
@@ -63,11 +63,24 @@ extern const rmaterial      glass;
 /* Have written some archive protocol to store everything in the same file */
 /* Dumps all the data to the same file */
 /* Returns 0 on fail and 1 on success */
-int dump_robj(const char* filename, rsphere* rspheres, uint8_t rsphere_num,
-                rplane* rplanes, uint8_t rplane_num, rlight* rlights,
-                uint8_t rlight_num);
+int dump_robj(const char* filename, rsphere* rspheres, cl_uint rsphere_num,
+                rplane* rplanes, cl_uint rplane_num, rlight* rlights,
+                cl_uint rlight_num);
 
 /* Does the memory allocation automatically don't forget to free */
-void extract_robj(const char* filename, rsphere** rspheres, uint8_t* rsphere_num,
-                    rplane** rplanes, uint8_t* rplane_num, rlight** rlights,
-                    uint8_t* rlight_num);
+/* Returns 0 if the file cannot be opened or is cut off, nothing is allocated then */
+int extract_robj(const char* filename, rsphere** rspheres, cl_uint* rsphere_num,
+                 rplane** rplanes, cl_uint* rplane_num, rlight** rlights,
+                 cl_uint* rlight_num);
+
+/* Finds the box around the spheres and lights. `scale` is the inverse of its
+   size, it maps the box to the unit cube */
+void robj_bounds(rsphere* rspheres, cl_uint rsphere_num, rlight* rlights,
+                 cl_uint rlight_num, cl_float3* min, cl_float3* scale);
+
+/* Appends the program build options for the scene to `options`. `staging` is 1 to
+   stage the scene into local memory, 0 to read it from global memory and -1 to
+   stage it if it fits into the `local_size` bytes of the device's local memory,
+   see `cl_wrap_local_memory`. Returns 1 if the scene is staged */
+int robj_options(char* options, size_t size, cl_uint sphere_num, cl_uint plane_num,
+                 cl_uint light_num, cl_ulong local_size, cl_int staging);
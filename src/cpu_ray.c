@@ -1,8 +1,11 @@
 #include <math.h>
 #include <float.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include <png.h>
 #include "cpu_ray.h"
+#include "cpu_timeline.h"
 
 
 static cl_float3 normalize(cl_float3 vec) {
@@ -17,10 +20,6 @@ static cl_float3 normalize(cl_float3 vec) {
     return res;
 }
 
-static inline bool equal(cl_float3 a, cl_float3 b) {
-    return a.x == b.x && a.y == b.y && a.z == b.z;
-}
-
 rcamera rinit_camera(cl_float3 camera_origin, cl_float3 camera_lookdir,
                      cl_float fov, cl_float focal_length) {
     rcamera camera;
@@ -57,8 +56,11 @@ bool rgen_perspective(rcamera* camera, cl_float3* im_corner,
     /* For comparison with floats and by taking in account the floating point */
     is_180              = camera->fov-180.0f <= FLT_EPSILON && camera->fov-180.0f >= 0;
 
-    /* Leave if non-acceptable fov or if tmp top vector equals the lookat pos */
-    if (is_180 || camera->fov <= FLT_EPSILON || equal(tmp_top, camera->pos_dir.dir)) {
+    /* Leave if non-acceptable fov or if the normalized direction is along the tmp
+       top vector, up or down, the right vector would have no length then */
+    cl_float3 dir = camera->pos_dir.dir;
+    if (is_180 || camera->fov <= FLT_EPSILON ||
+        !(dir.x*dir.x+dir.z*dir.z > FLT_EPSILON)) {
         return false;
     }
 
@@ -103,29 +105,211 @@ bool rgen_perspective(rcamera* camera, cl_float3* im_corner,
                         .y = image_center.y-right->y*image_width/2+up->y*image_height/2,
                         .z = image_center.z-right->z*image_width/2+up->z*image_height/2
                         };
+
+    return true;
 }
 
-int png_dump(const char* filename, cl_uint* buffer, cl_int pwidth, cl_int pheight) {
-    FILE* fp;
-    png_structp png_ptr     = NULL;
-    png_infop info_ptr      = NULL;
-    png_byte **row_pointers = NULL;
+bool rgen_view(rcamera* camera, rview* view, cl_uint pwidth, cl_uint pheight) {
+    view->pwidth    = pwidth;
+    view->pheight   = pheight;
 
-    fp = fopen(filename, "wb");
-    if (!fp) {
-        return 0;
+    return rgen_perspective(camera, &view->im_corner, &view->origin,
+                            &view->up, &view->right,
+                            &view->w_factor, &view->h_factor, pwidth, pheight);
+}
+
+/* IEEE half precision with rounding to the nearest even, like `vstore_half` */
+static cl_ushort float_to_half(cl_float f) {
+    cl_uint x;
+    memcpy(&x, &f, sizeof(x));
+
+    cl_uint sign = (x >> 16) & 0x8000;
+    cl_int  exp  = (cl_int)((x >> 23) & 0xFF)-127+15;
+    cl_uint mant = x & 0x7FFFFF;
+
+    if ((x & 0x7FFFFFFF) > 0x7F800000) { return sign | 0x7E00; }
+    if (exp >= 31) { return sign | 0x7C00; }
+
+    cl_uint shift = 13;
+    cl_uint half  = (exp << 10) | (mant >> 13);
+
+    /* Subnormal halfs keep the implicit bit in the mantissa */
+    if (exp <= 0) {
+        if (exp < -10) { return sign; }
+
+        shift = 14-exp;
+        half  = (mant | 0x800000) >> shift;
+        mant |= 0x800000;
     }
 
-    png_ptr = png_create_write_struct (PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    if (!png_ptr) {
-        return 0;
+    cl_uint rest = mant & ((1u << shift)-1);
+    cl_uint mid  = 1u << (shift-1);
+
+    /* A carry into the exponent is still the right value */
+    if (rest > mid || (rest == mid && (half & 1))) { half++; }
+
+    return sign | half;
+}
+
+/* IEEE half precision, like `vload_half` */
+static cl_float half_to_float(cl_ushort h) {
+    cl_uint exp  = (h >> 10) & 0x1F;
+    cl_uint mant = h & 0x3FF;
+    cl_float f;
+
+    if (exp == 0) {
+        f = ldexpf((cl_float)mant, -24);
+    } else if (exp == 31) {
+        f = mant ? NAN : INFINITY;
+    } else {
+        cl_uint x = ((exp-15+127) << 23) | (mant << 13);
+        memcpy(&f, &x, sizeof(f));
     }
 
-    info_ptr = png_create_info_struct (png_ptr);
-    if (!info_ptr) {
-        return 0;
+    return (h & 0x8000) ? -f : f;
+}
+
+static cl_ushort unorm16(cl_float x) {
+    x = x*0.5f+0.5f;
+    return (cl_ushort)lrintf(fminf(fmaxf(x, 0.0f), 1.0f)*65535.0f);
+}
+
+rpacked rpack_ray(rray ray) {
+    rpacked packed;
+
+    packed.origin[0] = ray.origin.x;
+    packed.origin[1] = ray.origin.y;
+    packed.origin[2] = ray.origin.z;
+
+    /* Project the direction onto the octahedron and fold the lower half over */
+    cl_float l1 = fabsf(ray.dir.x)+fabsf(ray.dir.y)+fabsf(ray.dir.z);
+    cl_float ox = ray.dir.x/l1;
+    cl_float oy = ray.dir.y/l1;
+    if (ray.dir.z < 0.0f) {
+        cl_float fx = (1.0f-fabsf(oy))*(ox >= 0.0f ? 1.0f : -1.0f);
+        cl_float fy = (1.0f-fabsf(ox))*(oy >= 0.0f ? 1.0f : -1.0f);
+        ox = fx;
+        oy = fy;
     }
 
+    packed.dir[0] = unorm16(ox);
+    packed.dir[1] = unorm16(oy);
+
+    packed.rgb[0] = float_to_half(ray.rgb.x);
+    packed.rgb[1] = float_to_half(ray.rgb.y);
+    packed.rgb[2] = float_to_half(ray.rgb.z);
+
+    packed.depth_flags = ray.depth & RPACKED_DEPTH_MASK;
+
+    return packed;
+}
+
+rray runpack_ray(rpacked packed) {
+    rray ray;
+
+    ray.origin = (cl_float3){.x = packed.origin[0], .y = packed.origin[1],
+                             .z = packed.origin[2]};
+
+    cl_float3 d;
+    d.x = packed.dir[0]/65535.0f*2.0f-1.0f;
+    d.y = packed.dir[1]/65535.0f*2.0f-1.0f;
+    d.z = 1.0f-fabsf(d.x)-fabsf(d.y);
+
+    cl_float t = fmaxf(-d.z, 0.0f);
+    d.x += (d.x >= 0.0f) ? -t : t;
+    d.y += (d.y >= 0.0f) ? -t : t;
+
+    ray.dir = normalize(d);
+
+    ray.rgb = (cl_float3){.x = half_to_float(packed.rgb[0]),
+                          .y = half_to_float(packed.rgb[1]),
+                          .z = half_to_float(packed.rgb[2])};
+
+    ray.depth = packed.depth_flags & RPACKED_DEPTH_MASK;
+
+    return ray;
+}
+
+void rtrace_options(char* options, size_t size, cl_uint max_depth,
+                    cl_float min_weight, cl_uint roulette) {
+    /* The depth has to fit in the packed rays */
+    if (max_depth == 0 || max_depth > RPACKED_DEPTH_MASK) {
+        printf("ERROR:\tMax depth %u is not in 1-%u\n", max_depth, RPACKED_DEPTH_MASK);
+        exit(1);
+    }
+
+    size_t used = strlen(options);
+    snprintf(options+used, size-used, "%s-D MAX_DEPTH=%u -D MIN_WEIGHT=%.9ef -D ROULETTE=%u",
+             used ? " " : "", max_depth, min_weight, roulette ? 1 : 0);
+}
+
+void rsort_secondary(cl_wrap* wrap, cl_uint secondary_num) {
+    /* The keys and order buffers of `secondarykey` and `sortscatter`, which the
+       passes alternate between */
+    cl_mem *keys[2]  = {&wrap->buffers[KERNEL_SECONDARYKEY][SECONDARYKEY_ARG_KEYS],
+                        &wrap->buffers[KERNEL_SORTSCATTER][SORTSCATTER_ARG_KEYS_OUT]};
+    cl_mem *order[2] = {&wrap->buffers[KERNEL_SECONDARYKEY][SECONDARYKEY_ARG_ORDER],
+                        &wrap->buffers[KERNEL_SORTSCATTER][SORTSCATTER_ARG_ORDER_OUT]};
+
+    /* Only the blocks holding rays are sorted */
+    cl_uint blocks = (secondary_num+SORT_BLOCK-1)/SORT_BLOCK;
+    cl_wrap_load_single_data(wrap, KERNEL_SORTHIST, SORTHIST_ARG_BLOCKS, &blocks,
+                             sizeof(cl_uint));
+    cl_wrap_load_single_data(wrap, KERNEL_SORTSCAN, SORTSCAN_ARG_BLOCKS, &blocks,
+                             sizeof(cl_uint));
+    cl_wrap_load_single_data(wrap, KERNEL_SORTSCATTER, SORTSCATTER_ARG_BLOCKS, &blocks,
+                             sizeof(cl_uint));
+
+    cl_wrap_output(wrap, secondary_num, 0, KERNEL_SECONDARYKEY, 0, 0, NULL);
+    for (cl_uint shift = 0; shift < SORT_KEY_BITS; shift += SORT_RADIX_BITS) {
+        cl_uint from = (shift/SORT_RADIX_BITS) % 2, to = 1-from;
+
+        cl_wrap_load_single_data(wrap, KERNEL_SORTHIST, SORTHIST_ARG_KEYS, keys[from],
+                                 sizeof(cl_mem));
+        cl_wrap_load_single_data(wrap, KERNEL_SORTHIST, SORTHIST_ARG_SHIFT, &shift,
+                                 sizeof(cl_uint));
+        cl_wrap_output(wrap, blocks, 0, KERNEL_SORTHIST, 0, 0, NULL);
+        cl_wrap_output(wrap, SORT_BUCKETS, 0, KERNEL_SORTSCAN, 0, 0, NULL);
+
+        cl_wrap_load_single_data(wrap, KERNEL_SORTSCATTER, SORTSCATTER_ARG_KEYS_IN,
+                                 keys[from], sizeof(cl_mem));
+        cl_wrap_load_single_data(wrap, KERNEL_SORTSCATTER, SORTSCATTER_ARG_ORDER_IN,
+                                 order[from], sizeof(cl_mem));
+        cl_wrap_load_single_data(wrap, KERNEL_SORTSCATTER, SORTSCATTER_ARG_KEYS_OUT,
+                                 keys[to], sizeof(cl_mem));
+        cl_wrap_load_single_data(wrap, KERNEL_SORTSCATTER, SORTSCATTER_ARG_ORDER_OUT,
+                                 order[to], sizeof(cl_mem));
+        cl_wrap_load_single_data(wrap, KERNEL_SORTSCATTER, SORTSCATTER_ARG_SHIFT, &shift,
+                                 sizeof(cl_uint));
+        cl_wrap_output(wrap, blocks, 0, KERNEL_SORTSCATTER, 0, 0, NULL);
+    }
+
+    /* The last scatter wrote the sorted order */
+    cl_wrap_load_single_data(wrap, KERNEL_SECONDARYTRACE, SECONDARYTRACE_ARG_ORDER,
+                             order[(SORT_KEY_BITS/SORT_RADIX_BITS) % 2], sizeof(cl_mem));
+}
+
+void rprecision_options(char* options, size_t size, cl_uint precision) {
+    if (precision != PRECISION_FAST) { return; }
+
+    /* Not -cl-fast-relaxed-math, its finite math only would drop the INFINITY the
+       intersection tests start from and compare against */
+    size_t used = strlen(options);
+    snprintf(options+used, size-used,
+             "%s-cl-mad-enable -cl-no-signed-zeros -D PRECISION_FAST", used ? " " : "");
+}
+
+int rprecision_tier(const char* name) {
+    if (strcmp(name, "exact") == 0) { return PRECISION_EXACT; }
+    if (strcmp(name, "fast") == 0)  { return PRECISION_FAST; }
+    return -1;
+}
+
+/* Writes the packed colors as an 8 bit rgb png through the writer set on `png_ptr` */
+static void png_write_buffer(png_structp png_ptr, png_infop info_ptr, cl_uint* buffer,
+                             cl_int pwidth, cl_int pheight) {
+    png_byte **row_pointers = NULL;
+
     /* PNG information header, set rgb mode and pixel depth of 8 bits */
     png_set_IHDR(png_ptr,
                  info_ptr,
@@ -150,7 +334,6 @@ int png_dump(const char* filename, cl_uint* buffer, cl_int pwidth, cl_int pheigh
         }
     }
 
-    png_init_io(png_ptr, fp);
     png_set_rows(png_ptr, info_ptr, row_pointers);
     png_write_png(png_ptr, info_ptr, PNG_TRANSFORM_IDENTITY, NULL);
 
@@ -159,7 +342,89 @@ int png_dump(const char* filename, cl_uint* buffer, cl_int pwidth, cl_int pheigh
     }
 
     png_free(png_ptr, row_pointers);
+}
+
+int png_dump(const char* filename, cl_uint* buffer, cl_int pwidth, cl_int pheight) {
+    FILE* fp;
+    png_structp png_ptr     = NULL;
+    png_infop info_ptr      = NULL;
+
+    fp = fopen(filename, "wb");
+    if (!fp) {
+        return 0;
+    }
+
+    png_ptr = png_create_write_struct (PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (!png_ptr) {
+        return 0;
+    }
+
+    info_ptr = png_create_info_struct (png_ptr);
+    if (!info_ptr) {
+        return 0;
+    }
+
+    rtimeline_begin("png_dump");
+    png_init_io(png_ptr, fp);
+    png_write_buffer(png_ptr, info_ptr, buffer, pwidth, pheight);
+    png_destroy_write_struct(&png_ptr, &info_ptr);
 
     fclose(fp);
+    rtimeline_end();
     return 1;
-}
\ No newline at end of file
+}
+
+/* Growing memory block the encoded png is written to */
+typedef struct {
+    unsigned char*  data;
+    size_t          size;
+    size_t          capacity;
+} png_memory;
+
+static void png_memory_write(png_structp png_ptr, png_bytep data, png_size_t length) {
+    png_memory* memory = png_get_io_ptr(png_ptr);
+
+    if (memory->size+length > memory->capacity) {
+        size_t capacity = memory->capacity ? memory->capacity : 4096;
+        while (capacity < memory->size+length) { capacity *= 2; }
+
+        unsigned char* grown = realloc(memory->data, capacity);
+        if (!grown) {
+            png_error(png_ptr, "out of memory");
+        }
+        memory->data = grown;
+        memory->capacity = capacity;
+    }
+
+    memcpy(memory->data+memory->size, data, length);
+    memory->size += length;
+}
+
+static void png_memory_flush(png_structp png_ptr) {
+    (void)png_ptr;
+}
+
+unsigned char* png_encode(cl_uint* buffer, cl_int pwidth, cl_int pheight, size_t* size) {
+    png_structp png_ptr     = NULL;
+    png_infop info_ptr      = NULL;
+    png_memory memory       = {.data = NULL, .size = 0, .capacity = 0};
+
+    png_ptr = png_create_write_struct (PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (!png_ptr) {
+        return NULL;
+    }
+
+    info_ptr = png_create_info_struct (png_ptr);
+    if (!info_ptr || setjmp(png_jmpbuf(png_ptr))) {
+        png_destroy_write_struct(&png_ptr, &info_ptr);
+        free(memory.data);
+        return NULL;
+    }
+
+    png_set_write_fn(png_ptr, &memory, png_memory_write, png_memory_flush);
+    png_write_buffer(png_ptr, info_ptr, buffer, pwidth, pheight);
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+
+    *size = memory.size;
+    return memory.data;
+}
@@ -3,6 +3,10 @@
 
 #include <CL/opencl.h>
 
+#include "cl/rpacked.h"
+#include "opencl_wrap.h"
+#include "cpu_kernels.h"
+
 #pragma pack(push, 16)
 struct __rray {
     cl_float3   origin;
@@ -16,6 +20,54 @@ struct __rray {
 
 typedef struct __rray rray;
 
+/* Ray leaving a primary hit, deferred by the raytracer to the secondary pass */
+struct __rsecondary {
+    rpacked     ray;
+
+    cl_float    weight;
+    cl_float    n;
+    cl_uint     pixel;
+    cl_uint     records;
+};
+
+typedef struct __rsecondary rsecondary;
+
+/* 64 bit counters of the `trace_stats` buffer, the same as in src/cl/trace.cl */
+#define TRACE_STAT_SEGMENTS 0
+#define TRACE_STAT_TESTS    1
+#define TRACE_STATS         2
+
+/* Layout of the secondary ray sort, the same as in src/cl/sort.cl */
+#define SORT_KEY_BITS       24
+#define SORT_RADIX_BITS     4
+#define SORT_BUCKETS        (1 << SORT_RADIX_BITS)
+#define SORT_BLOCK          256
+
+/* Shadow ray deferred by the raytracer to the shadow pass. `rgb` is the
+   contribution to the pixel if nothing blocks the path between the points */
+#pragma pack(push, 16)
+struct __rshadow {
+    cl_float3   from;
+    cl_float3   to;
+
+    cl_float3   rgb;
+};
+#pragma pack(pop)
+
+typedef struct __rshadow rshadow;
+
+/* What the primary ray of a pixel hit, guides the denoiser */
+#pragma pack(push, 16)
+struct __rgbuffer {
+    cl_float3   normal;
+    cl_float3   albedo;
+
+    cl_float    depth;
+};
+#pragma pack(pop)
+
+typedef struct __rgbuffer rgbuffer;
+
 struct __rcamera {
     rray        pos_dir;
 
@@ -25,17 +77,67 @@ struct __rcamera {
 
 typedef struct __rcamera rcamera;
 
+/* The perspective values of a camera for a given resolution, passed as a whole
+   to the kernels that need to map between pixels and the scene */
+#pragma pack(push, 16)
+struct __rview {
+    cl_float3   im_corner;
+    cl_float3   origin;
+    cl_float3   up;
+    cl_float3   right;
+
+    cl_float    w_factor;
+    cl_float    h_factor;
+    cl_uint     pwidth;
+    cl_uint     pheight;
+};
+#pragma pack(pop)
+
+typedef struct __rview rview;
+
 
 rcamera     rinit_camera(cl_float3 camera_origin, cl_float3 camera_lookdir,
                          cl_float fov, cl_float focal_length);
 void        rlookat(rcamera *camera, cl_float3 dir);
 
 /* Genereates the perspective values based on the camera location and dir that
-   are essential to generate the rays on the GPU side */
+   are essential to generate the rays on the GPU side. Returns false for a fov out
+   of range or a dir along the y axis, which the image cannot be turned around */
 bool        rgen_perspective(rcamera* camera, cl_float3* im_corner,
                              cl_float3* camera_origin,
                              cl_float3* up, cl_float3* right,
                              cl_float* w_factor, cl_float* h_factor,
                              cl_uint pwidth, cl_uint pheight);
 
-int         png_dump(const char* filename, cl_uint* buffer, cl_int pwidth, cl_int pheight);
\ No newline at end of file
+/* Same as `rgen_perspective` but fills a view */
+bool        rgen_view(rcamera* camera, rview* view, cl_uint pwidth, cl_uint pheight);
+
+/* Compress and expand rays the same way as `pack_ray` and `unpack_ray` in
+   src/cl/primitives.cl, raypack checks the error of the round trip */
+rpacked     rpack_ray(rray ray);
+rray        runpack_ray(rpacked packed);
+
+/* Appends the build options of the ray termination in src/cl/trace.cl to `options`.
+   Rays end after `max_depth` bounces or when their weight in the pixel falls below
+   `min_weight`, at random with `roulette`. A `min_weight` of 0 keeps every ray */
+void        rtrace_options(char* options, size_t size, cl_uint max_depth,
+                           cl_float min_weight, cl_uint roulette);
+
+/* Radix sorts the keys of the `secondary_num` secondary rays and hands the sorted
+   order to the secondary trace kernel. `wrap` has the kernels of cpu_kernels.h up
+   to sortscatter, with the buffers of secondarykey and sortscatter loaded */
+void        rsort_secondary(cl_wrap* wrap, cl_uint secondary_num);
+
+/* Precision tiers of the kernel build, see src/cl/precision.cl */
+#define PRECISION_EXACT     0
+#define PRECISION_FAST      1
+
+/* Appends the build options of the precision tier to `options` */
+void        rprecision_options(char* options, size_t size, cl_uint precision);
+/* The tier named "exact" or "fast", -1 for other names */
+int         rprecision_tier(const char* name);
+
+int         png_dump(const char* filename, cl_uint* buffer, cl_int pwidth, cl_int pheight);
+/* Encodes the same png as `png_dump` into memory. Returns the malloc'd bytes and
+   their count in `size`, NULL on fail */
+unsigned char* png_encode(cl_uint* buffer, cl_int pwidth, cl_int pheight, size_t* size);
\ No newline at end of file
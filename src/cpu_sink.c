@@ -0,0 +1,436 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <png.h>
+
+#include "cpu_sink.h"
+#include "cpu_timeline.h"
+
+
+static int write_all(int fd, const void* data, size_t size) {
+    const unsigned char* bytes = data;
+
+    while (size > 0) {
+        ssize_t written = write(fd, bytes, size);
+        if (written < 0) {
+            if (errno == EINTR) { continue; }
+            return 0;
+        }
+        bytes += written;
+        size -= written;
+    }
+
+    return 1;
+}
+
+/* Packed 0x00RRGGBB colors to rgb bytes */
+static void rgb_row(const cl_uint* packed, unsigned char* rgb, cl_uint pwidth) {
+    for (cl_uint c = 0; c < pwidth; c++) {
+        *rgb++ = packed[c] >> 16;
+        *rgb++ = packed[c] >> 8;
+        *rgb++ = packed[c];
+    }
+}
+
+/* Two rows of packed colors to their full range BT.601 luma rows and one row of
+   chroma from the mean of every 2x2 block, from column `c` on. An odd last row or
+   column is paired with itself */
+static void yuv_rows(const cl_uint* top, const cl_uint* bottom, cl_uint pwidth,
+                     cl_uint c, unsigned char* y_top, unsigned char* y_bottom,
+                     unsigned char* u, unsigned char* v) {
+
+    for (; c < pwidth; c += 2) {
+        cl_uint right = c+1 < pwidth ? c+1 : c;
+        cl_uint block[4] = {top[c], top[right], bottom[c], bottom[right]};
+        unsigned char *luma[4] = {&y_top[c], &y_top[right],
+                                  &y_bottom[c], &y_bottom[right]};
+        cl_int r = 0, g = 0, b = 0;
+
+        for (cl_uint i = 0; i < 4; i++) {
+            cl_int pr = block[i] >> 16 & 0xFF;
+            cl_int pg = block[i] >> 8 & 0xFF;
+            cl_int pb = block[i] & 0xFF;
+
+            *luma[i] = (77*pr + 150*pg + 29*pb + 128) >> 8;
+            r += pr;
+            g += pg;
+            b += pb;
+        }
+
+        r = (r+2) >> 2;
+        g = (g+2) >> 2;
+        b = (b+2) >> 2;
+        u[c/2] = ((-43*r - 85*g + 128*b) >> 8) + 128;
+        v[c/2] = ((128*r - 107*g - 21*b) >> 8) + 128;
+    }
+}
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+
+/* `rgb_row` 4 pixels per shuffle. Every store writes 16 bytes for 12, so the
+   shuffles stop 2 pixels before the end of the row. Used when the cpu has SSSE3 */
+__attribute__((target("ssse3")))
+static void rgb_row_ssse3(const cl_uint* packed, unsigned char* rgb, cl_uint pwidth) {
+    const __m128i order = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12,
+                                        -1, -1, -1, -1);
+    cl_uint c = 0;
+
+    for (; c+6 <= pwidth; c += 4, rgb += 12) {
+        __m128i pixels = _mm_loadu_si128((const __m128i*)(packed+c));
+        _mm_storeu_si128((__m128i*)rgb, _mm_shuffle_epi8(pixels, order));
+    }
+
+    rgb_row(packed+c, rgb, pwidth-c);
+}
+
+/* Red, green and blue of 8 packed colors as 16 bit lanes */
+static inline void sse_channels(const cl_uint* packed, __m128i* r, __m128i* g,
+                                __m128i* b) {
+    const __m128i mask = _mm_set1_epi32(0xFF);
+    __m128i low  = _mm_loadu_si128((const __m128i*)packed);
+    __m128i high = _mm_loadu_si128((const __m128i*)(packed+4));
+
+    *r = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(low, 16), mask),
+                         _mm_and_si128(_mm_srli_epi32(high, 16), mask));
+    *g = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(low, 8), mask),
+                         _mm_and_si128(_mm_srli_epi32(high, 8), mask));
+    *b = _mm_packs_epi32(_mm_and_si128(low, mask), _mm_and_si128(high, mask));
+}
+
+/* Luma of 8 pixels, the weights sum to 256 so the unsigned 16 bit lanes hold it */
+static inline __m128i sse_luma(__m128i r, __m128i g, __m128i b) {
+    __m128i sum = _mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(77)),
+                                _mm_mullo_epi16(g, _mm_set1_epi16(150)));
+    sum = _mm_add_epi16(sum, _mm_mullo_epi16(b, _mm_set1_epi16(29)));
+    return _mm_srli_epi16(_mm_add_epi16(sum, _mm_set1_epi16(128)), 8);
+}
+
+/* Rounded means of the 2x2 blocks of 16 pixels of two rows, 8 lanes */
+static inline __m128i sse_mean(__m128i top_low, __m128i top_high,
+                               __m128i bottom_low, __m128i bottom_high) {
+    const __m128i ones = _mm_set1_epi16(1);
+    __m128i low  = _mm_madd_epi16(_mm_add_epi16(top_low, bottom_low), ones);
+    __m128i high = _mm_madd_epi16(_mm_add_epi16(top_high, bottom_high), ones);
+    return _mm_srli_epi16(_mm_add_epi16(_mm_packs_epi32(low, high),
+                                        _mm_set1_epi16(2)), 2);
+}
+
+/* Chroma of 8 block means, the products of 8 bit means fit the signed lanes */
+static inline __m128i sse_chroma(__m128i r, __m128i g, __m128i b,
+                                 short wr, short wg, short wb) {
+    __m128i sum = _mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(wr)),
+                                _mm_mullo_epi16(g, _mm_set1_epi16(wg)));
+    sum = _mm_add_epi16(sum, _mm_mullo_epi16(b, _mm_set1_epi16(wb)));
+    return _mm_add_epi16(_mm_srai_epi16(sum, 8), _mm_set1_epi16(128));
+}
+
+/* `yuv_rows` 16 pixels of both rows at a time with SSE2, which every x86-64 cpu
+   has. The results are the same as the scalar ones */
+static void yuv_rows_sse2(const cl_uint* top, const cl_uint* bottom, cl_uint pwidth,
+                          unsigned char* y_top, unsigned char* y_bottom,
+                          unsigned char* u, unsigned char* v) {
+    cl_uint c = 0;
+
+    for (; c+16 <= pwidth; c += 16) {
+        __m128i r[4], g[4], b[4];
+        sse_channels(top+c, &r[0], &g[0], &b[0]);
+        sse_channels(top+c+8, &r[1], &g[1], &b[1]);
+        sse_channels(bottom+c, &r[2], &g[2], &b[2]);
+        sse_channels(bottom+c+8, &r[3], &g[3], &b[3]);
+
+        _mm_storeu_si128((__m128i*)(y_top+c),
+                         _mm_packus_epi16(sse_luma(r[0], g[0], b[0]),
+                                          sse_luma(r[1], g[1], b[1])));
+        _mm_storeu_si128((__m128i*)(y_bottom+c),
+                         _mm_packus_epi16(sse_luma(r[2], g[2], b[2]),
+                                          sse_luma(r[3], g[3], b[3])));
+
+        __m128i mr = sse_mean(r[0], r[1], r[2], r[3]);
+        __m128i mg = sse_mean(g[0], g[1], g[2], g[3]);
+        __m128i mb = sse_mean(b[0], b[1], b[2], b[3]);
+
+        __m128i cu = sse_chroma(mr, mg, mb, -43, -85, 128);
+        __m128i cv = sse_chroma(mr, mg, mb, 128, -107, -21);
+        _mm_storel_epi64((__m128i*)(u+c/2), _mm_packus_epi16(cu, cu));
+        _mm_storel_epi64((__m128i*)(v+c/2), _mm_packus_epi16(cv, cv));
+    }
+
+    yuv_rows(top, bottom, pwidth, c, y_top, y_bottom, u, v);
+}
+#endif
+
+/* `rgb_row` with the fastest conversion the cpu has */
+static void rgb_convert(const cl_uint* packed, unsigned char* rgb, cl_uint pwidth) {
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("ssse3")) {
+        rgb_row_ssse3(packed, rgb, pwidth);
+        return;
+    }
+#endif
+    rgb_row(packed, rgb, pwidth);
+}
+
+/* Returns 0 if the end of the png cannot be written */
+static int png_close(rsink* sink) {
+    png_structp png_ptr = sink->png;
+    png_infop   info_ptr = sink->png_info;
+
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+    int closed = fclose(sink->png_file) == 0;
+
+    sink->png = NULL;
+    sink->png_info = NULL;
+    sink->png_file = NULL;
+    return closed;
+}
+
+/* Compresses the rows of the frame up to `rows` into its png, which is opened with
+   the first rows and closed with the last. Same 8 bit rgb png as `png_dump` */
+static int png_rows(rsink* sink, cl_uint rows) {
+    png_structp png_ptr;
+    png_infop   info_ptr;
+
+
+    if (sink->rows == 0) {
+        char filename[RSINK_PATH+16];
+        snprintf(filename, sizeof(filename), sink->path, sink->frame);
+
+        if ((sink->png_file = fopen(filename, "wb")) == NULL) { return 0; }
+
+        png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+        info_ptr = png_ptr ? png_create_info_struct(png_ptr) : NULL;
+        sink->png = png_ptr;
+        sink->png_info = info_ptr;
+
+        if (!info_ptr) {
+            png_close(sink);
+            return 0;
+        }
+    }
+
+    /* An earlier error already dropped the png of this frame */
+    if (!sink->png) { return 0; }
+
+    png_ptr = sink->png;
+    info_ptr = sink->png_info;
+
+    if (setjmp(png_jmpbuf(png_ptr))) {
+        png_close(sink);
+        return 0;
+    }
+
+    if (sink->rows == 0) {
+        png_init_io(png_ptr, sink->png_file);
+        png_set_IHDR(png_ptr, info_ptr, sink->pwidth, sink->pheight, 8,
+                     PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
+                     PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+        png_write_info(png_ptr, info_ptr);
+    }
+
+    for (cl_uint r = sink->rows; r < rows; r++) {
+        rgb_convert(sink->pixels+r*sink->pwidth, sink->converted, sink->pwidth);
+        png_write_row(png_ptr, sink->converted);
+    }
+
+    if (rows == sink->pheight) {
+        png_write_end(png_ptr, NULL);
+        return png_close(sink);
+    }
+    return 1;
+}
+
+int rsink_open(rsink* sink, const char* target, cl_uint pwidth, cl_uint pheight,
+               cl_uint fps) {
+
+    const char* kinds[] = {"png:", "y4m:", "rgb:", "shm:"};
+    const char* path = NULL;
+
+
+    for (cl_uint i = 0; i < sizeof(kinds)/sizeof(kinds[0]); i++) {
+        if (strncmp(target, kinds[i], 4) == 0) {
+            sink->kind = i;
+            path = target+4;
+        }
+    }
+
+    if (!path || !*path || strlen(path) >= RSINK_PATH) {
+        printf("ERROR:\tUnknown output \"%s\"\n", target);
+        return 0;
+    }
+
+    strcpy(sink->path, path);
+    sink->fd = -1;
+    sink->pwidth = pwidth;
+    sink->pheight = pheight;
+    sink->frame = 0;
+    sink->rows = 0;
+    sink->failed = 0;
+    sink->pixels = NULL;
+    sink->converted = NULL;
+    sink->converted_size = 0;
+    sink->shm = NULL;
+    sink->png_file = NULL;
+    sink->png = NULL;
+    sink->png_info = NULL;
+
+    size_t frame_bytes = sizeof(cl_uint)*pwidth*pheight;
+
+    if (sink->kind == RSINK_SHM) {
+        sink->fd = shm_open(path, O_CREAT | O_RDWR, 0600);
+        sink->shm_size = RSINK_SHM_OFFSET+RSINK_SLOTS*frame_bytes;
+
+        if (sink->fd < 0 || ftruncate(sink->fd, sink->shm_size) < 0) {
+            printf("ERROR:\tCannot create the shared memory \"%s\"\n", path);
+            return 0;
+        }
+
+        sink->shm = mmap(NULL, sink->shm_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                         sink->fd, 0);
+        if (sink->shm == MAP_FAILED) {
+            printf("ERROR:\tCannot map the shared memory \"%s\"\n", path);
+            return 0;
+        }
+
+        *sink->shm = (rsink_shm){RSINK_SHM_MAGIC, RSINK_SHM_VERSION, pwidth, pheight,
+                                 RSINK_SLOTS, frame_bytes, 0};
+        return 1;
+    }
+
+    sink->pixels = malloc(frame_bytes);
+    if (sink->kind == RSINK_PNG) {
+        /* One row at a time goes to libpng */
+        sink->converted_size = 3*pwidth;
+        sink->converted = malloc(sink->converted_size);
+        return 1;
+    }
+
+    if (strcmp(path, "-") == 0) {
+        /* The frames get stdout to themselves, the prints go on to stderr */
+        fflush(stdout);
+        sink->fd = dup(STDOUT_FILENO);
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+    } else {
+        sink->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+
+    if (sink->fd < 0) {
+        printf("ERROR:\tCannot open \"%s\" for writing\n", path);
+        return 0;
+    }
+
+    if (sink->kind == RSINK_RGB) {
+        sink->converted_size = 3*pwidth*pheight;
+        sink->converted = malloc(sink->converted_size);
+        return 1;
+    }
+
+    /* Every y4m frame is its tag and the planes, the chroma ones at half size */
+    char header[128];
+    snprintf(header, sizeof(header), "YUV4MPEG2 W%u H%u F%u:1 Ip A1:1 C420jpeg\n",
+             pwidth, pheight, fps);
+
+    sink->converted_size = 6+pwidth*pheight+2*((pwidth+1)/2)*((pheight+1)/2);
+    sink->converted = malloc(sink->converted_size);
+    memcpy(sink->converted, "FRAME\n", 6);
+
+    if (!write_all(sink->fd, header, strlen(header))) {
+        printf("ERROR:\tCannot write to \"%s\"\n", path);
+        return 0;
+    }
+    return 1;
+}
+
+cl_uint* rsink_frame(rsink* sink) {
+    if (sink->kind != RSINK_SHM) { return sink->pixels; }
+
+    return (cl_uint*)((unsigned char*)sink->shm+RSINK_SHM_OFFSET+
+                      (sink->frame % RSINK_SLOTS)*sink->shm->frame_bytes);
+}
+
+int rsink_rows(rsink* sink, cl_uint rows) {
+    cl_uint     pwidth = sink->pwidth, pheight = sink->pheight;
+    cl_uint     *pixels = sink->pixels;
+    cl_uint     r = sink->rows;
+    int         done = 1;
+
+
+    if (rows > pheight) { rows = pheight; }
+    if (rows <= r) { return 1; }
+
+    rtimeline_begin("rsink_rows");
+
+    if (sink->kind == RSINK_PNG) {
+        done = png_rows(sink, rows);
+    }
+
+    if (sink->kind == RSINK_RGB) {
+        for (; r < rows; r++) {
+            rgb_convert(pixels+r*pwidth, sink->converted+3*r*pwidth, pwidth);
+        }
+    }
+
+    if (sink->kind == RSINK_Y4M) {
+        cl_uint cwidth = (pwidth+1)/2, cheight = (pheight+1)/2;
+        unsigned char *y = sink->converted+6;
+        unsigned char *u = y+pwidth*pheight;
+        unsigned char *v = u+cwidth*cheight;
+
+        /* The chroma takes rows in pairs, an odd row waits for the one below it */
+        for (; r+1 < rows || (r < rows && rows == pheight); r += 2) {
+            cl_uint below = r+1 < pheight ? r+1 : r;
+#if defined(__x86_64__)
+            yuv_rows_sse2(pixels+r*pwidth, pixels+below*pwidth, pwidth,
+                          y+r*pwidth, y+below*pwidth, u+r/2*cwidth, v+r/2*cwidth);
+#else
+            yuv_rows(pixels+r*pwidth, pixels+below*pwidth, pwidth, 0,
+                     y+r*pwidth, y+below*pwidth, u+r/2*cwidth, v+r/2*cwidth);
+#endif
+        }
+        rows = r < pheight ? r : pheight;
+    }
+
+    sink->rows = rows;
+    sink->failed |= !done;
+    rtimeline_end();
+    return done;
+}
+
+int rsink_submit(rsink* sink) {
+    int         done;
+
+
+    rtimeline_begin("rsink_submit");
+
+    done = rsink_rows(sink, sink->pheight) && !sink->failed;
+
+    if (sink->kind == RSINK_RGB || sink->kind == RSINK_Y4M) {
+        done = write_all(sink->fd, sink->converted, sink->converted_size) && done;
+    }
+
+    if (sink->kind == RSINK_SHM) {
+        __atomic_store_n(&sink->shm->written, (cl_ulong)sink->frame+1, __ATOMIC_RELEASE);
+    }
+
+    sink->frame++;
+    sink->rows = 0;
+    sink->failed = 0;
+    rtimeline_end();
+    return done;
+}
+
+void rsink_close(rsink* sink) {
+    if (sink->shm) {
+        munmap(sink->shm, sink->shm_size);
+        shm_unlink(sink->path);
+    }
+    if (sink->fd >= 0) { close(sink->fd); }
+    if (sink->png_file) { png_close(sink); }
+
+    free(sink->pixels);
+    free(sink->converted);
+}
@@ -0,0 +1,88 @@
+#pragma once
+#include <stdio.h>
+#include <CL/opencl.h>
+
+
+/* Frames kept in a shared memory sink */
+#define RSINK_SLOTS         4
+#define RSINK_PATH          256
+
+/* "RSHM" and the layout version of the shared memory sink */
+#define RSINK_SHM_MAGIC     0x4d485352
+#define RSINK_SHM_VERSION   1
+/* The frames start page aligned after the header */
+#define RSINK_SHM_OFFSET    4096
+
+typedef enum {
+    RSINK_PNG,
+    RSINK_Y4M,
+    RSINK_RGB,
+    RSINK_SHM
+} rsink_kind;
+
+/* Header of the shared memory sink. Frame n is written into slot n % slots, which
+   starts at RSINK_SHM_OFFSET+slot*frame_bytes and holds the packed 0x00RRGGBB
+   colors row by row. `written` is then raised to n+1. A reader takes frame
+   written-1 after loading `written` with acquire order, and the frame it read was
+   whole if `written` is still below that frame's number plus `slots` afterwards */
+typedef struct {
+    cl_uint     magic;
+    cl_uint     version;
+    cl_uint     pwidth, pheight;
+    cl_uint     slots;
+    cl_uint     frame_bytes;
+    cl_ulong    written;
+} rsink_shm;
+
+/* Output of the rendered frames */
+typedef struct {
+    rsink_kind  kind;
+    char        path[RSINK_PATH];
+    int         fd;
+
+    cl_uint     pwidth, pheight;
+    cl_uint     frame;          /* Frames submitted so far */
+    cl_uint     rows;           /* Rows of the next frame converted so far */
+    int         failed;         /* Rows of the next frame could not be written */
+
+    cl_uint     *pixels;        /* Packed colors of the next frame */
+    unsigned char *converted;   /* Next frame as written out */
+    size_t      converted_size;
+
+    rsink_shm   *shm;
+    size_t      shm_size;
+
+    /* png of the next frame while its rows come in, libpng's write and info structs */
+    FILE        *png_file;
+    void        *png, *png_info;
+} rsink;
+
+
+/* Opens the sink named by `target`:
+
+       png:<file>   a png per frame, a %u in the name is replaced by the frame number
+       y4m:<file>   YUV4MPEG2 video with 4:2:0 chroma for encoders like ffmpeg
+       rgb:<file>   headerless 8 bit rgb frames
+       shm:<name>   the latest RSINK_SLOTS frames in POSIX shared memory, see rsink_shm
+
+   The file of y4m and rgb can be a named pipe, "-" writes to stdout and moves the
+   program's own output to stderr then. `fps` is the frame rate noted in y4m.
+   Returns 0 with the reason printed if the sink cannot be opened */
+int         rsink_open(rsink* sink, const char* target, cl_uint pwidth,
+                       cl_uint pheight, cl_uint fps);
+
+/* Where the packed colors of the next frame go, in shared memory for a shm sink so
+   the device can read back into it directly */
+cl_uint*    rsink_frame(rsink* sink);
+
+/* Converts the rows of the next frame from the last call up to `rows`, for a png
+   they are compressed too. The rows must be final in `rsink_frame` and come in top
+   to bottom, the ones never passed are converted by `rsink_submit`. Returns 0 if
+   they cannot be written, `rsink_submit` reports it again */
+int         rsink_rows(rsink* sink, cl_uint rows);
+
+/* Outputs the frame written to `rsink_frame`. Returns 0 if it or any of its rows
+   passed to `rsink_rows` cannot be written */
+int         rsink_submit(rsink* sink);
+
+void        rsink_close(rsink* sink);
@@ -0,0 +1,167 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "cpu_timeline.h"
+
+
+/* Host scope or device command. Device spans keep their event until the timeline
+   is written and `start` is the host time they were queued at until then */
+typedef struct {
+    const char  *name;
+    cl_ulong    start, duration;    /* Nanoseconds since `rtimeline_start` */
+    cl_uint     thread;             /* 0 for the device */
+    cl_event    event;
+} rspan;
+
+int                 rtimeline_on = 0;
+
+static const char   *timeline_file;
+static rspan        *spans;
+static cl_ulong     span_mask, span_head = 0;
+/* Held while a slot of the ring is handed over, a thread overwriting it must not
+   release the event of a span another thread is still writing there */
+static pthread_mutex_t  span_lock = PTHREAD_MUTEX_INITIALIZER;
+static cl_ulong     origin;
+static cl_uint      threads = 0;
+
+/* Open scopes of the thread, its number on the timeline and its latest enqueue */
+static __thread const char  *scope_names[RTIMELINE_DEPTH];
+static __thread cl_ulong    scope_starts[RTIMELINE_DEPTH];
+static __thread cl_uint     scope_depth = 0;
+static __thread cl_uint     thread = 0;
+static __thread cl_ulong    queued;
+
+
+static cl_ulong now(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (cl_ulong)time.tv_sec*1000000000UL + time.tv_nsec - origin;
+}
+
+static void record(rspan span) {
+    pthread_mutex_lock(&span_lock);
+
+    /* The timeline is written already */
+    if (!spans) {
+        if (span.event) { clReleaseEvent(span.event); }
+        pthread_mutex_unlock(&span_lock);
+        return;
+    }
+
+    rspan *slot = &spans[span_head++ & span_mask];
+
+    /* The overwritten command is not written, nothing else holds its event */
+    if (slot->event) { clReleaseEvent(slot->event); }
+    *slot = span;
+    pthread_mutex_unlock(&span_lock);
+}
+
+/* Writes the spans left in the ring, oldest first. The commands are done by now,
+   they were all waited for */
+static void dump(void) {
+    FILE        *writer;
+    cl_ulong    first;
+    cl_ulong    times[3];
+    cl_uint     written = 0;
+
+
+    /* Threads still recording wait, and record nothing once the ring is freed */
+    pthread_mutex_lock(&span_lock);
+    first = span_head > span_mask ? span_head-span_mask-1 : 0;
+
+    if ((writer = fopen(timeline_file, "w")) == NULL) {
+        printf("ERROR:\tCannot open \"%s\" for writing\n", timeline_file);
+        pthread_mutex_unlock(&span_lock);
+        return;
+    }
+
+    fprintf(writer, "{\"traceEvents\":[\n");
+    fprintf(writer, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,"
+                    "\"args\":{\"name\":\"device\"}}");
+    for (cl_uint i = 1; i <= threads; i++) {
+        fprintf(writer, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,"
+                        "\"args\":{\"name\":\"host %u\"}}", i, i);
+    }
+
+    for (cl_ulong i = first; i < span_head; i++) {
+        rspan *span = &spans[i & span_mask];
+
+        /* The device clock only counts from the queueing of the command */
+        if (span->event) {
+            if (clGetEventProfilingInfo(span->event, CL_PROFILING_COMMAND_QUEUED,
+                                        sizeof(cl_ulong), &times[0], NULL) < 0 ||
+                clGetEventProfilingInfo(span->event, CL_PROFILING_COMMAND_START,
+                                        sizeof(cl_ulong), &times[1], NULL) < 0 ||
+                clGetEventProfilingInfo(span->event, CL_PROFILING_COMMAND_END,
+                                        sizeof(cl_ulong), &times[2], NULL) < 0) {
+                continue;
+            }
+
+            span->start += times[1]-times[0];
+            span->duration = times[2]-times[1];
+        }
+
+        fprintf(writer, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                        "\"pid\":1,\"tid\":%u}", span->name, span->start/1000.0,
+                span->duration/1000.0, span->thread);
+        written++;
+    }
+    fprintf(writer, "\n]}\n");
+    fclose(writer);
+
+    for (cl_ulong i = first; i < span_head; i++) {
+        if (spans[i & span_mask].event) { clReleaseEvent(spans[i & span_mask].event); }
+    }
+    free(spans);
+    spans = NULL;
+    pthread_mutex_unlock(&span_lock);
+
+    printf("Timeline of %u spans written to %s\n", written, timeline_file);
+}
+
+void rtimeline_start(const char* filename, cl_uint capacity) {
+    cl_ulong size = 1;
+
+
+    /* A power of two, so the ring index is a mask of the running count */
+    while (size < capacity) { size <<= 1; }
+
+    spans = calloc(size, sizeof(rspan));
+    span_mask = size-1;
+    timeline_file = filename;
+
+    origin = 0;
+    origin = now();
+
+    atexit(dump);
+    rtimeline_on = 1;
+}
+
+void rtimeline_scope_begin(const char* name) {
+    if (scope_depth < RTIMELINE_DEPTH) {
+        scope_names[scope_depth] = name;
+        scope_starts[scope_depth] = now();
+    }
+    scope_depth++;
+}
+
+void rtimeline_scope_end(void) {
+    if (scope_depth == 0) { return; }
+    if (--scope_depth >= RTIMELINE_DEPTH) { return; }
+
+    if (thread == 0) { thread = __atomic_add_fetch(&threads, 1, __ATOMIC_RELAXED); }
+
+    cl_ulong start = scope_starts[scope_depth];
+    record((rspan){scope_names[scope_depth], start, now()-start, thread, NULL});
+}
+
+cl_event* rtimeline_enqueue(cl_event* event) {
+    queued = now();
+    return event;
+}
+
+void rtimeline_command(const char* name, cl_event event) {
+    record((rspan){name, queued, 0, 0, event});
+}
@@ -0,0 +1,53 @@
+#pragma once
+#include <sys/time.h>
+#include <CL/opencl.h>
+
+
+/* Timeline of host scopes and device commands, written as Chrome trace JSON for
+   chrome://tracing or ui.perfetto.dev when the program exits. Until
+   `rtimeline_start` every call below is a check of `rtimeline_on` and nothing else.
+
+   The names are kept as pointers, they must outlive the program like string
+   literals or the kernel names of cl_wrap */
+
+/* Nested host scopes recorded per thread, deeper ones are dropped */
+#define RTIMELINE_DEPTH 32
+
+extern int rtimeline_on;
+
+/* Starts recording into a ring of `capacity` spans, the oldest are overwritten
+   when it is full. Must come before `cl_wrap_init`, whose command queue then
+   profiles the commands */
+void rtimeline_start(const char* filename, cl_uint capacity);
+
+void rtimeline_scope_begin(const char* name);
+void rtimeline_scope_end(void);
+cl_event* rtimeline_enqueue(cl_event* event);
+void rtimeline_command(const char* name, cl_event event);
+
+
+/* Milliseconds between two times of `gettimeofday` */
+static inline double relapsed_ms(const struct timeval* start, const struct timeval* stop) {
+    return (stop->tv_sec-start->tv_sec)*1000.0+(stop->tv_usec-start->tv_usec)/1000.0;
+}
+
+/* Opens a host scope on the calling thread, closed by the next `rtimeline_end` */
+static inline void rtimeline_begin(const char* name) {
+    if (rtimeline_on) { rtimeline_scope_begin(name); }
+}
+
+static inline void rtimeline_end(void) {
+    if (rtimeline_on) { rtimeline_scope_end(); }
+}
+
+/* Event argument of an enqueue: `event` while recording, NULL otherwise. Notes
+   the host time the command is queued at, which places its device times */
+static inline cl_event* rtimeline_event(cl_event* event) {
+    return rtimeline_on ? rtimeline_enqueue(event) : NULL;
+}
+
+/* Records the device span of the command enqueued with `rtimeline_event`. Its
+   times are read when the timeline is written, the event is released then */
+static inline void rtimeline_device(const char* name, cl_event event) {
+    if (rtimeline_on) { rtimeline_command(name, event); }
+}
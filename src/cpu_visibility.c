@@ -0,0 +1,285 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sys/time.h>
+
+#include "cpu_visibility.h"
+#include "opencl_wrap.h"
+#include "cpu_timeline.h"
+
+
+static const char vis_magic[4] = {'R', 'V', 'I', 'S'};
+
+static cl_ulong fnv1a(cl_ulong hash, const void* data, size_t size) {
+    const unsigned char *bytes = data;
+
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+cl_ulong rscene_hash(const rsphere* rspheres, cl_uint rsphere_num,
+                     const rplane* rplanes, cl_uint rplane_num,
+                     const rlight* rlights, cl_uint rlight_num) {
+
+    cl_ulong hash = 14695981039346656037ULL;
+
+    /* The structs come straight from the scene file, padding included */
+    hash = fnv1a(hash, &rsphere_num, sizeof(cl_uint));
+    hash = fnv1a(hash, rspheres, sizeof(rsphere)*rsphere_num);
+    hash = fnv1a(hash, &rplane_num, sizeof(cl_uint));
+    hash = fnv1a(hash, rplanes, sizeof(rplane)*rplane_num);
+    hash = fnv1a(hash, &rlight_num, sizeof(cl_uint));
+    hash = fnv1a(hash, rlights, sizeof(rlight)*rlight_num);
+
+    return hash;
+}
+
+/* Reads the cache if it was made for `key`, returns 0 otherwise */
+static int read_cache(rvisibility* vis, const char* filename, cl_ulong key) {
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) { return 0; }
+
+    char        magic[4];
+    cl_uint     version;
+    cl_ulong    file_key;
+
+    if (fread(magic, sizeof(magic), 1, fp) != 1 || memcmp(magic, vis_magic, 4) ||
+        fread(&version, sizeof(cl_uint), 1, fp) != 1 || version != VIS_VERSION ||
+        fread(&file_key, sizeof(cl_ulong), 1, fp) != 1 || file_key != key ||
+        fread(&vis->grid, sizeof(rvis_grid), 1, fp) != 1 ||
+        fread(&vis->pool_num, sizeof(cl_uint), 1, fp) != 1) {
+        fclose(fp);
+        return 0;
+    }
+
+    size_t entries = (size_t)vis->grid.lights*vis->grid.bricks*vis->grid.bricks*
+                     vis->grid.bricks;
+    size_t cells   = (size_t)vis->pool_num*VIS_BRICK_CELLS;
+
+    vis->bricks = malloc(sizeof(cl_uint)*entries);
+    vis->cells  = calloc(cells ? cells : VIS_BRICK_CELLS, 1);
+
+    if (fread(vis->bricks, sizeof(cl_uint), entries, fp) != entries ||
+        fread(vis->cells, 1, cells, fp) != cells) {
+        free(vis->bricks);
+        free(vis->cells);
+        fclose(fp);
+        return 0;
+    }
+
+    fclose(fp);
+    return 1;
+}
+
+/* The grid is only a speed up, a cache that can't be written is built again */
+static void write_cache(const rvisibility* vis, const char* filename, cl_ulong key) {
+    FILE *fp = fopen(filename, "wb");
+    if (!fp) { return; }
+
+    cl_uint version = VIS_VERSION;
+    size_t entries = (size_t)vis->grid.lights*vis->grid.bricks*vis->grid.bricks*
+                     vis->grid.bricks;
+
+    fwrite(vis_magic, sizeof(vis_magic), 1, fp);
+    fwrite(&version, sizeof(cl_uint), 1, fp);
+    fwrite(&key, sizeof(cl_ulong), 1, fp);
+    fwrite(&vis->grid, sizeof(rvis_grid), 1, fp);
+    fwrite(&vis->pool_num, sizeof(cl_uint), 1, fp);
+    fwrite(vis->bricks, sizeof(cl_uint), entries, fp);
+    fwrite(vis->cells, 1, (size_t)vis->pool_num*VIS_BRICK_CELLS, fp);
+
+    fclose(fp);
+}
+
+/* Classes the cells of one light from their corners, a cell is VIS_MIXED unless
+   all its corners agree. Cells next to another class become VIS_MIXED too, so the
+   points within a cell of a shadow edge keep tracing their shadow rays */
+static void classify_cells(const cl_uchar* vertex_vis, cl_uint cells,
+                           cl_uchar* corner_class, cl_uchar* cell_class) {
+    cl_uint verts = cells+1;
+
+    for (cl_uint z = 0; z < cells; z++) {
+        for (cl_uint y = 0; y < cells; y++) {
+            for (cl_uint x = 0; x < cells; x++) {
+                cl_uchar c = vertex_vis[(z*verts+y)*verts+x];
+
+                for (cl_uint k = 1; k < 8 && c != VIS_MIXED; k++) {
+                    cl_uint v = ((z+(k>>2))*verts+y+((k>>1)&1))*verts+x+(k&1);
+                    if (vertex_vis[v] != c) { c = VIS_MIXED; }
+                }
+
+                corner_class[(z*cells+y)*cells+x] = c;
+            }
+        }
+    }
+
+    for (cl_int z = 0; z < (cl_int)cells; z++) {
+        for (cl_int y = 0; y < (cl_int)cells; y++) {
+            for (cl_int x = 0; x < (cl_int)cells; x++) {
+                cl_uchar c = corner_class[(z*cells+y)*cells+x];
+
+                for (cl_int n = 0; n < 27 && c != VIS_MIXED; n++) {
+                    cl_int nx = x+n%3-1, ny = y+n/3%3-1, nz = z+n/9-1;
+                    if (nx < 0 || ny < 0 || nz < 0 || nx >= (cl_int)cells ||
+                        ny >= (cl_int)cells || nz >= (cl_int)cells) {
+                        continue;
+                    }
+                    if (corner_class[(nz*cells+ny)*cells+nx] != c) { c = VIS_MIXED; }
+                }
+
+                cell_class[(z*cells+y)*cells+x] = c;
+            }
+        }
+    }
+}
+
+/* Stores the bricks of one light, uniform ones only as their class */
+static void store_bricks(rvisibility* vis, const cl_uchar* cell_class,
+                         cl_uint* bricks, cl_uint* pool_size) {
+    cl_uint b_num = vis->grid.bricks;
+    cl_uint cells = b_num*VIS_BRICK;
+
+    for (cl_uint b = 0; b < b_num*b_num*b_num; b++) {
+        cl_uint bx = b%b_num, by = b/b_num%b_num, bz = b/(b_num*b_num);
+        cl_uchar brick[VIS_BRICK_CELLS];
+        int uniform = 1;
+
+        for (cl_uint l = 0; l < VIS_BRICK_CELLS; l++) {
+            cl_uint x = bx*VIS_BRICK+l%VIS_BRICK;
+            cl_uint y = by*VIS_BRICK+l/VIS_BRICK%VIS_BRICK;
+            cl_uint z = bz*VIS_BRICK+l/(VIS_BRICK*VIS_BRICK);
+
+            brick[l] = cell_class[(z*cells+y)*cells+x];
+            uniform &= brick[l] == brick[0];
+        }
+
+        if (uniform) {
+            bricks[b] = brick[0];
+            continue;
+        }
+
+        if (vis->pool_num == *pool_size) {
+            *pool_size = *pool_size ? 2*(*pool_size) : 64;
+            vis->cells = realloc(vis->cells, (size_t)(*pool_size)*VIS_BRICK_CELLS);
+        }
+        memcpy(vis->cells+(size_t)vis->pool_num*VIS_BRICK_CELLS, brick, VIS_BRICK_CELLS);
+        bricks[b] = VIS_POOL+vis->pool_num++;
+    }
+}
+
+/* Runs the `visibility` kernel for every light and compresses its result */
+static void build_grid(rvisibility* vis, rsphere* rspheres, cl_uint rsphere_num,
+                       rplane* rplanes, cl_uint rplane_num,
+                       rlight* rlights, cl_uint rlight_num,
+                       cl_float3* shadow_samples, cl_uint bricks) {
+
+    /* Cubic cells over the spheres and lights with a cell of margin, planes reach
+       past any box and are covered only where they are inside it */
+    cl_float3 min, scale;
+    robj_bounds(rspheres, rsphere_num, rlights, rlight_num, &min, &scale);
+
+    cl_uint cells = bricks*VIS_BRICK;
+    cl_float size = fmaxf(1.0f/scale.x, fmaxf(1.0f/scale.y, 1.0f/scale.z));
+    cl_float cell = size/(cells-2);
+
+    vis->grid.min    = (cl_float3){.x = min.x-cell, .y = min.y-cell, .z = min.z-cell};
+    vis->grid.cell   = cell;
+    vis->grid.bricks = bricks;
+    vis->grid.lights = rlight_num;
+
+    cl_uint verts = cells+1;
+    cl_uint vert_num = verts*verts*verts;
+    cl_uint brick_num = bricks*bricks*bricks;
+
+    cl_wrap wrap;
+    cl_wrap_init(&wrap, CL_DEVICE_TYPE_GPU, NULL,
+                 "src/cl/visibility.cl", "visibility", NULL);
+
+    cl_uint sphere_num = rsphere_num, plane_num = rplane_num;
+    cl_uint light = 0;
+
+    cl_wrap_load_global_data(&wrap, 0, 0, rspheres, sizeof(rsphere)*rsphere_num,
+                             CL_MEM_READ_ONLY);
+    cl_wrap_load_global_data(&wrap, 0, 1, rplanes, sizeof(rplane)*rplane_num,
+                             CL_MEM_READ_ONLY);
+    cl_wrap_load_global_data(&wrap, 0, 2, rlights, sizeof(rlight)*rlight_num,
+                             CL_MEM_READ_ONLY);
+    cl_wrap_load_single_data(&wrap, 0, 3, &sphere_num, sizeof(cl_uint));
+    cl_wrap_load_single_data(&wrap, 0, 4, &plane_num, sizeof(cl_uint));
+    cl_wrap_load_single_data(&wrap, 0, 5, &light, sizeof(cl_uint));
+    cl_wrap_load_global_data(&wrap, 0, 6, shadow_samples,
+                             sizeof(cl_float3)*(VIS_LIGHT_POINTS-1), CL_MEM_READ_ONLY);
+    cl_wrap_load_single_data(&wrap, 0, 7, &vis->grid, sizeof(rvis_grid));
+    cl_wrap_load_global_data(&wrap, 0, 8, NULL, vert_num, CL_MEM_WRITE_ONLY);
+
+    cl_uchar *vertex_vis   = malloc(vert_num);
+    cl_uchar *corner_class = malloc((size_t)cells*cells*cells);
+    cl_uchar *cell_class   = malloc((size_t)cells*cells*cells);
+    cl_uint  pool_size     = 0;
+
+    vis->bricks   = malloc(sizeof(cl_uint)*brick_num*rlight_num);
+    vis->cells    = NULL;
+    vis->pool_num = 0;
+
+    for (light = 0; light < rlight_num; light++) {
+        cl_wrap_load_single_data(&wrap, 0, 5, &light, sizeof(cl_uint));
+        cl_wrap_output(&wrap, vert_num, 0, 0, 0, 0, NULL);
+        cl_wrap_read_global_data(&wrap, 0, 8, vertex_vis, vert_num);
+
+        classify_cells(vertex_vis, cells, corner_class, cell_class);
+        store_bricks(vis, cell_class, vis->bricks+(size_t)light*brick_num, &pool_size);
+    }
+
+    /* The kernels take a brick of cells even when every brick is uniform */
+    if (!vis->cells) { vis->cells = calloc(VIS_BRICK_CELLS, 1); }
+
+    free(vertex_vis);
+    free(corner_class);
+    free(cell_class);
+    cl_wrap_release(&wrap);
+}
+
+void rgen_visibility(rvisibility* vis, const char* scene_file,
+                     rsphere* rspheres, cl_uint rsphere_num,
+                     rplane* rplanes, cl_uint rplane_num,
+                     rlight* rlights, cl_uint rlight_num,
+                     cl_float3* shadow_samples, cl_uint bricks) {
+
+    char filename[512];
+    snprintf(filename, sizeof(filename), "%s.vis", scene_file);
+
+    /* The grid also depends on its resolution and the tested light points */
+    cl_ulong key = rscene_hash(rspheres, rsphere_num, rplanes, rplane_num,
+                               rlights, rlight_num);
+    key = fnv1a(key, &bricks, sizeof(cl_uint));
+    key = fnv1a(key, shadow_samples, sizeof(cl_float3)*(VIS_LIGHT_POINTS-1));
+
+    if (read_cache(vis, filename, key)) {
+        printf("Visibility cache read from %s\n", filename);
+        return;
+    }
+
+    struct timeval start, stop;
+    gettimeofday(&start, NULL);
+    build_grid(vis, rspheres, rsphere_num, rplanes, rplane_num, rlights, rlight_num,
+               shadow_samples, bricks);
+    gettimeofday(&stop, NULL);
+
+    write_cache(vis, filename, key);
+
+    printf("Visibility cache built in %.0f ms, %u of %u bricks stored cell by cell\n",
+           relapsed_ms(&start, &stop),
+           vis->pool_num, bricks*bricks*bricks*rlight_num);
+}
+
+void rfree_visibility(rvisibility* vis) {
+    free(vis->bricks);
+    free(vis->cells);
+
+    vis->bricks = NULL;
+    vis->cells  = NULL;
+}
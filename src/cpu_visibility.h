@@ -0,0 +1,62 @@
+#pragma once
+#include <CL/opencl.h>
+
+#include "cpu_obj.h"
+
+
+/* Classes of the light visibility grid cells, the same as in src/cl/trace.cl */
+#define VIS_VISIBLE     0
+#define VIS_OCCLUDED    1
+#define VIS_MIXED       2
+#define VIS_POOL        3
+#define VIS_BRICK       4
+#define VIS_BRICK_CELLS (VIS_BRICK*VIS_BRICK*VIS_BRICK)
+
+/* Points tested on every light, the same as in src/cl/visibility.cl */
+#define VIS_LIGHT_POINTS 9
+
+/* Bumped when the cache file layout or the way it is built changes */
+#define VIS_VERSION     1
+
+#pragma pack(push, 16)
+/* Placement of the light visibility grid */
+struct __rvis_grid {
+    cl_float3   min;        /* Corner of the grid */
+    cl_float    cell;       /* Edge length of the cubic cells */
+    cl_uint     bricks;     /* Bricks per axis */
+    cl_uint     lights;
+};
+#pragma pack(pop)
+
+typedef struct __rvis_grid rvis_grid;
+
+/* Sparse per-light visibility of a static scene. Every light has bricks^3 entries
+   in `bricks`, x first. An entry below VIS_POOL is the class of all the brick's
+   cells, the others point to VIS_BRICK_CELLS classes in `cells` */
+typedef struct {
+    rvis_grid   grid;
+
+    cl_uint     *bricks;
+    cl_uchar    *cells;
+    cl_uint     pool_num;   /* Bricks stored in `cells` */
+} rvisibility;
+
+
+/* FNV-1a hash of the scene objects, the cache is built again when it changes */
+cl_ulong    rscene_hash(const rsphere* rspheres, cl_uint rsphere_num,
+                        const rplane* rplanes, cl_uint rplane_num,
+                        const rlight* rlights, cl_uint rlight_num);
+
+/* Reads the light visibility grid of the scene from `<scene_file>.vis`. When the
+   file is missing or was made for other scene contents, the grid is built on the
+   device with `bricks` bricks per axis and stored there. `shadow_samples` is the
+   table of `rgen_shadow_samples`. Points within a cell of a shadow edge are
+   classed mixed, occluders smaller than a cell may be missed. Does the memory
+   allocation automatically, free with `rfree_visibility` */
+void        rgen_visibility(rvisibility* vis, const char* scene_file,
+                            rsphere* rspheres, cl_uint rsphere_num,
+                            rplane* rplanes, cl_uint rplane_num,
+                            rlight* rlights, cl_uint rlight_num,
+                            cl_float3* shadow_samples, cl_uint bricks);
+
+void        rfree_visibility(rvisibility* vis);
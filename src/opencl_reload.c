@@ -0,0 +1,146 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/time.h>
+#include <sys/inotify.h>
+
+#include "opencl_reload.h"
+#include "cpu_timeline.h"
+
+
+
+/* Polling interval of the watcher, how long `cl_reload_stop` waits at most for
+   an idle watcher */
+#define RELOAD_POLL_MS          250
+
+static int is_source(const char* name) {
+    size_t length = strlen(name);
+
+    return (length > 3 && strcmp(name+length-3, ".cl") == 0) ||
+           (length > 2 && strcmp(name+length-2, ".h") == 0);
+}
+
+/* Reads the pending events, returns 1 if a kernel source was among them */
+static int read_events(int fd) {
+    char    events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int     changed = 0;
+    ssize_t length;
+
+    while ((length = read(fd, events, sizeof(events))) > 0) {
+        for (char* e = events; e < events+length;
+             e += sizeof(struct inotify_event)+((struct inotify_event*)e)->len) {
+            struct inotify_event* event = (struct inotify_event*)e;
+
+            if (event->len && is_source(event->name)) { changed = 1; }
+        }
+    }
+
+    return changed;
+}
+
+static void* watch(void* arg) {
+    cl_reload*      reload = arg;
+    struct pollfd   pfd = {.fd = reload->inotify_fd, .events = POLLIN};
+
+    while (reload->running) {
+        if (poll(&pfd, 1, RELOAD_POLL_MS) <= 0 || !read_events(reload->inotify_fd)) {
+            continue;
+        }
+
+        /* Wait until the files have settled */
+        while (poll(&pfd, 1, __RELOAD_SETTLE_MS) > 0) {
+            read_events(reload->inotify_fd);
+        }
+
+        printf("Kernel sources changed, rebuilding\n");
+
+        struct timeval  start, stop;
+        cl_program      program;
+        cl_kernel       kernels[__MAX_KERNELS];
+
+        /* The build compares with the current kernels, they must not be swapped
+           meanwhile. `cl_reload_poll` does not wait for the lock */
+        pthread_mutex_lock(&reload->lock);
+
+        gettimeofday(&start, NULL);
+        if (!cl_wrap_build(reload->wrap, &program, kernels)) {
+            pthread_mutex_unlock(&reload->lock);
+            printf("Build failed, the current kernels keep running\n");
+            continue;
+        }
+        gettimeofday(&stop, NULL);
+
+        /* A build that was never swapped in is replaced by the newer one */
+        if (reload->ready) {
+            for (cl_uint i = 0; i < reload->wrap->kernels_num; i++) {
+                clReleaseKernel(reload->kernels[i]);
+            }
+            clReleaseProgram(reload->program);
+        }
+
+        reload->program = program;
+        memcpy(reload->kernels, kernels, sizeof(kernels));
+        reload->ready = 1;
+        pthread_mutex_unlock(&reload->lock);
+
+        printf("Rebuilt the kernels in %.0f ms\n", relapsed_ms(&start, &stop));
+    }
+
+    return NULL;
+}
+
+void cl_reload_start(cl_reload* reload, cl_wrap* wrap, const char* dir) {
+    reload->wrap    = wrap;
+    reload->ready   = 0;
+    reload->running = 1;
+
+    pthread_mutex_init(&reload->lock, NULL);
+
+    reload->inotify_fd = inotify_init1(IN_NONBLOCK);
+    if (reload->inotify_fd < 0 ||
+        inotify_add_watch(reload->inotify_fd, dir,
+                          IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0) {
+        printf("ERROR:\tCannot watch \"%s\" for changes\n", dir);
+        exit(1);
+    }
+
+    if (pthread_create(&reload->thread, NULL, watch, reload) != 0) {
+        printf("ERROR:\tCannot start the kernel watcher\n");
+        exit(1);
+    }
+}
+
+int cl_reload_poll(cl_reload* reload) {
+    int swapped = 0;
+
+    /* Never wait for the watcher, the frame goes on with the current kernels */
+    if (pthread_mutex_trylock(&reload->lock) != 0) {
+        return 0;
+    }
+
+    if (reload->ready) {
+        cl_wrap_swap(reload->wrap, reload->program, reload->kernels);
+        reload->ready = 0;
+        swapped = 1;
+    }
+    pthread_mutex_unlock(&reload->lock);
+
+    return swapped;
+}
+
+void cl_reload_stop(cl_reload* reload) {
+    reload->running = 0;
+    pthread_join(reload->thread, NULL);
+
+    if (reload->ready) {
+        for (cl_uint i = 0; i < reload->wrap->kernels_num; i++) {
+            clReleaseKernel(reload->kernels[i]);
+        }
+        clReleaseProgram(reload->program);
+    }
+
+    close(reload->inotify_fd);
+    pthread_mutex_destroy(&reload->lock);
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <pthread.h>
+#include <CL/opencl.h>
+
+#include "opencl_wrap.h"
+
+
+/* Quiet time after the last change of a source file before the program is rebuilt,
+   editors often write a file in several steps */
+#define __RELOAD_SETTLE_MS      100
+
+/* Rebuilds the program of a cl_wrap on a background thread whenever a kernel
+   source in the watched directory changes. The finished build is swapped in by
+   `cl_reload_poll` between frames, a failed build leaves the current kernels */
+typedef struct {
+    cl_wrap*            wrap;
+
+    int                 inotify_fd;
+    pthread_t           thread;
+    volatile int        running;
+
+    /* Build waiting for `cl_reload_poll`, guarded by `lock` */
+    pthread_mutex_t     lock;
+    int                 ready;
+    cl_program          program;
+    cl_kernel           kernels[__MAX_KERNELS];
+}   cl_reload;
+
+
+/* Starts watching the .cl and .h files of `dir` */
+void cl_reload_start(cl_reload* reload, cl_wrap* wrap, const char* dir);
+/* Swaps in the latest finished build, call it between frames on the thread that
+   launches the kernels. Returns 1 if the kernels were replaced */
+int  cl_reload_poll(cl_reload* reload);
+/* Stops the watcher, waits for a build in progress and drops an unused build */
+void cl_reload_stop(cl_reload* reload);
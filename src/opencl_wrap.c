@@ -2,17 +2,108 @@
 #include <math.h>
 #include <string.h>
 #include <stdarg.h>
+#include <limits.h>
 
 #include <png.h>
 #include "opencl_wrap.h"
+#include "cpu_timeline.h"
 
 
+/* Where the errors of this thread jump to, see `cl_wrap_recover` */
+static __thread jmp_buf *recover_point = NULL;
 
-void cl_wrap_init(cl_wrap* wrap, cl_device_type type, ...) {
+/* Ends the program after an error was printed, or jumps to the recovery point */
+_Noreturn static void fail(void) {
+    if (recover_point) { longjmp(*recover_point, 1); }
+    exit(1);
+}
+
+/* Reads the source files and builds them into a program with its kernels.
+   Returns 0 with the reason printed if a file cannot be read or the build fails */
+static int build_program(cl_wrap* wrap, cl_program* program, cl_kernel* kernels) {
     FILE*           source_reader;
     size_t          source_sizes[__MAX_KERNELS], log_size;
     char            *sources[__MAX_KERNELS], *log;
-    const char      *current_source_file, *kernel_names[__MAX_KERNELS];
+    cl_uint         read_num;
+    cl_int          cl_error;
+    int             built = 0;
+
+
+    rtimeline_begin("load sources");
+    for (read_num = 0; read_num < wrap->kernels_num; read_num++) {
+        if ((source_reader = fopen(wrap->sources[read_num], "r")) == NULL) {
+            printf("ERROR:\tCannot open \"%s\" for reading\n", wrap->sources[read_num]);
+            rtimeline_end();
+            goto free_sources;
+        }
+
+        fseek(source_reader, 0, SEEK_END);
+        source_sizes[read_num] = ftell(source_reader);
+        rewind(source_reader);
+
+        /* +1 for the null byte */
+        sources[read_num] = malloc(source_sizes[read_num] + 1);
+        /* Make the readin from the source file behave as a C string */
+        sources[read_num][source_sizes[read_num]] = '\0';
+
+        /* Read the kernel source file, close the file and continue for all kernels */
+        fread(sources[read_num], 1, source_sizes[read_num], source_reader);
+        fclose(source_reader);
+    }
+    rtimeline_end();
+
+
+    /* Firstly load the source to the compiler. We do explicit casting to `const char**`
+       because the source codes are used once and are free'd after program build */
+    *program = clCreateProgramWithSource(wrap->context, wrap->kernels_num,
+                                         (const char**)&sources[0],
+                                         &source_sizes[0], &cl_error);
+    if (cl_error < 0) {
+        printf("ERROR:\tCouldn't load the source codes to the compiler\n");
+        goto free_sources;
+    }
+
+    rtimeline_begin("clBuildProgram");
+    cl_error = clBuildProgram(*program, 0, NULL, wrap->options, NULL, NULL);
+    rtimeline_end();
+
+    if (cl_error < 0) {
+        /* Try to get the log from the compiler and output it */
+        clGetProgramBuildInfo(*program, wrap->device, CL_PROGRAM_BUILD_LOG, 0,
+                              NULL, &log_size);
+        log = malloc(log_size + 1);
+        log[log_size] = '\0';
+        clGetProgramBuildInfo(*program, wrap->device, CL_PROGRAM_BUILD_LOG,
+                              log_size + 1, log, NULL);
+        printf("ERROR:\tCouldn't compile the source. Compiler LOG is shown below:\n");
+        printf("%s\n", log);
+        free(log);
+
+        clReleaseProgram(*program);
+        goto free_sources;
+    }
+
+    /* Create the kernels */
+    for (cl_uint i = 0; i < wrap->kernels_num; i++) {
+        kernels[i] = clCreateKernel(*program, wrap->kernel_names[i], &cl_error);
+        if (cl_error < 0) {
+            printf("ERROR:\tCouldn't create the CL kernel from: %s\n",
+                   wrap->kernel_names[i]);
+
+            for (cl_uint j = 0; j < i; j++) { clReleaseKernel(kernels[j]); }
+            clReleaseProgram(*program);
+            goto free_sources;
+        }
+    }
+    built = 1;
+
+free_sources:
+    for (cl_uint i = 0; i < read_num; i++) { free(sources[i]); }
+    return built;
+}
+
+void cl_wrap_init(cl_wrap* wrap, cl_device_type type, const char* options, ...) {
+    const char      *current_source_file, *kernel_name;
     cl_platform_id  platform;
     cl_int          cl_error;
 
@@ -22,153 +113,347 @@ void cl_wrap_init(cl_wrap* wrap, cl_device_type type, ...) {
     /* No kernels when initializing */
     wrap->kernels_num = 0;
 
+    if (options && strlen(options) >= __MAX_OPTIONS) {
+        printf("ERROR:\tThe build options are too long\n");
+        fail();
+    }
+    strcpy(wrap->options, options ? options : "");
+
 
     if (clGetPlatformIDs(1, &platform, NULL) < 0) {
         printf("ERROR:\tCannot find a CL platform\n");
-        exit(1);
+        fail();
     }
 
     if (clGetDeviceIDs(platform, type, 1, &wrap->device, NULL) == CL_DEVICE_NOT_FOUND) {
         printf("ERROR:\tCannot find a device of the given type\n");
-        exit(1);
+        fail();
     }
 
     wrap->context = clCreateContext(NULL, 1, &wrap->device, NULL, NULL, &cl_error);
     if (cl_error < 0) {
         printf("ERROR:\t Could not create a CL context from device\n");
-        exit(1);
+        fail();
     }
 
-    va_start(vars, type);
+    /* The sub-buffers of the pool start at multiples of the base address alignment */
+    cl_uint align_bits;
+    if (clGetDeviceInfo(wrap->device, CL_DEVICE_MEM_BASE_ADDR_ALIGN, sizeof(cl_uint),
+                        &align_bits, NULL) < 0) {
+        printf("ERROR:\tCannot get the memory alignment of the device\n");
+        fail();
+    }
+
+    /* No pool memory when initializing */
+    wrap->pool_align = align_bits/8 ? align_bits/8 : 1;
+    wrap->pool_blocks_num = 0;
+    wrap->pool_extents_num = 0;
+    wrap->pool_buffers_num = 0;
+    wrap->pool_roles_num = 0;
+
+    va_start(vars, options);
     current_source_file = va_arg(vars, const char*);
         
     while (current_source_file) {
-        kernel_names[wrap->kernels_num] = va_arg(vars, const char*);
-        if (!kernel_names[wrap->kernels_num]) {
+        kernel_name = va_arg(vars, const char*);
+        if (!kernel_name) {
             printf("ERROR:\tSource file was not followed by kernel name\n");
             va_end(vars);
-            exit(1);
+            fail();
         }
 
-        if ((source_reader = fopen(current_source_file, "r")) == NULL) {
-            printf("ERROR:\tCannot open \"%s\" for reading\n", current_source_file);
+        if (wrap->kernels_num == __MAX_KERNELS ||
+            strlen(current_source_file) >= __MAX_NAME ||
+            strlen(kernel_name) >= __MAX_NAME) {
+            printf("ERROR:\tToo many kernels or too long names\n");
             va_end(vars);
-            exit(1);
+            fail();
         }
 
-        /* No buffers when initializing */
-        wrap->buffers_num[wrap->kernels_num] = 0;
-
-
-        fseek(source_reader, 0, SEEK_END);
-        source_sizes[wrap->kernels_num] = ftell(source_reader);
-        rewind(source_reader);
+        strcpy(wrap->sources[wrap->kernels_num], current_source_file);
+        strcpy(wrap->kernel_names[wrap->kernels_num], kernel_name);
 
-        /* +1 for the null byte */
-        sources[wrap->kernels_num] = malloc(source_sizes[wrap->kernels_num] + 1);
-        /* Make the readin from the source file behave as a C string */
-        sources[wrap->kernels_num][source_sizes[wrap->kernels_num]] = '\0';
+        /* No buffers or arguments when initializing */
+        wrap->buffers_num[wrap->kernels_num] = 0;
+        memset(wrap->arg_sizes[wrap->kernels_num], 0,
+               sizeof(wrap->arg_sizes[wrap->kernels_num]));
+        memset(wrap->pool_args[wrap->kernels_num], 0,
+               sizeof(wrap->pool_args[wrap->kernels_num]));
 
-        /* Read the kernel source file, close the file and continue for all kernels */
-        fread(sources[wrap->kernels_num], 1, source_sizes[wrap->kernels_num],
-              source_reader);
-        fclose(source_reader);
+        /* The work group shape is looked up on the first 2D launch */
+        wrap->tile[wrap->kernels_num][0] = 0;
+        wrap->tile[wrap->kernels_num][1] = 0;
+        wrap->tile_launches[wrap->kernels_num] = 0;
 
         wrap->kernels_num++;
         current_source_file = va_arg(vars, const char*);
     }
-    
+    va_end(vars);
 
+    if (!build_program(wrap, &wrap->program, wrap->kernels)) {
+        fail();
+    }
 
-    /* Firstly load the source to the compiler. We do explicit casting to `const char**`
-       because the source codes are used once and are free'd after program build */
-    wrap->program = clCreateProgramWithSource(wrap->context, wrap->kernels_num,
-                                              (const char**)&sources[0],
-                                              &source_sizes[0], &cl_error);
+    /* Create the command queues, profiling the commands for the timeline. The
+       launches are always profiled, the 2D ones measure their tile shapes */
+    cl_queue_properties profiling[] = {CL_QUEUE_PROPERTIES, CL_QUEUE_PROFILING_ENABLE, 0};
+    wrap->queue = clCreateCommandQueueWithProperties(wrap->context, wrap->device,
+                                                     profiling, &cl_error);
     if (cl_error < 0) {
-        printf("ERROR:\tCouldn't load the source codes to the compiler\n");
-        exit(1);
+        printf("ERROR:\tCouldn't create a command queue for the given device\n");
+        fail();
     }
 
-    if (clBuildProgram(wrap->program, 0, NULL, NULL, NULL, NULL) < 0) {
-        /* Try to get the log from the compiler and output it */
-        clGetProgramBuildInfo(wrap->program, wrap->device, CL_PROGRAM_BUILD_LOG, 0,
-                              NULL, &log_size);
-        log = malloc(log_size + 1);
-        log[log_size] = '\0';
-        clGetProgramBuildInfo(wrap->program, wrap->device, CL_PROGRAM_BUILD_LOG,
-                              log_size + 1, log, NULL);
-        printf("ERROR:\tCouldn't compile the source. Compiler LOG is shown below:\n");
-        printf("%s\n", log);
-        free(log);
-        exit(1);
+    wrap->transfer_queue = clCreateCommandQueueWithProperties(wrap->context,
+                                                              wrap->device,
+                                                              rtimeline_on ? profiling : NULL,
+                                                              &cl_error);
+    if (cl_error < 0) {
+        printf("ERROR:\tCouldn't create a command queue for the given device\n");
+        fail();
     }
+}
+
+int cl_wrap_build(cl_wrap* wrap, cl_program* program, cl_kernel* kernels) {
+    cl_uint     old_args, new_args;
+
 
-    /* Free the sources and create the kernels at the same time */
+    if (!build_program(wrap, program, kernels)) {
+        return 0;
+    }
+
+    /* The kept arguments only fit kernels with the same signature */
     for (cl_uint i = 0; i < wrap->kernels_num; i++) {
-        wrap->kernels[i] = clCreateKernel(wrap->program, kernel_names[i], &cl_error);
-        if (cl_error < 0) {
-            printf("ERROR:\tCouldn't create the CL kernel from: %s\n", kernel_names[i]);
-            exit(1);
+        clGetKernelInfo(wrap->kernels[i], CL_KERNEL_NUM_ARGS, sizeof(cl_uint),
+                        &old_args, NULL);
+        clGetKernelInfo(kernels[i], CL_KERNEL_NUM_ARGS, sizeof(cl_uint),
+                        &new_args, NULL);
+
+        if (old_args != new_args) {
+            printf("ERROR:\tKernel %s has %u arguments instead of %u\n",
+                   wrap->kernel_names[i], new_args, old_args);
+
+            for (cl_uint j = 0; j < wrap->kernels_num; j++) {
+                clReleaseKernel(kernels[j]);
+            }
+            clReleaseProgram(*program);
+            return 0;
         }
-        free(sources[i]);
     }
 
-    /* Create the command queue */
-    wrap->queue = clCreateCommandQueueWithProperties(wrap->context, wrap->device,
-                                                     NULL, &cl_error);
-    if (cl_error < 0) {
-        printf("ERROR:\tCouldn't create a command queue for the given device\n");
-        exit(1);
+    return 1;
+}
+
+void cl_wrap_swap(cl_wrap* wrap, cl_program program, cl_kernel* kernels) {
+
+    for (cl_uint kernel_id = 0; kernel_id < wrap->kernels_num; kernel_id++) {
+        for (cl_uint arg_id = 0; arg_id < __MAX_BUFFERS; arg_id++) {
+            size_t size = wrap->arg_sizes[kernel_id][arg_id];
+            if (!size) { continue; }
+
+            if (clSetKernelArg(kernels[kernel_id], arg_id, size,
+                               wrap->args[kernel_id][arg_id]) < 0) {
+                printf("ERROR:\tCouldn't pass the kept argument %u to kernel %s\n",
+                       arg_id, wrap->kernel_names[kernel_id]);
+                fail();
+            }
+        }
+
+        clReleaseKernel(wrap->kernels[kernel_id]);
+        wrap->kernels[kernel_id] = kernels[kernel_id];
+
+        /* The work group limits may have changed, the shapes are looked up again */
+        wrap->tile[kernel_id][0] = 0;
+        wrap->tile[kernel_id][1] = 0;
+        wrap->tile_launches[kernel_id] = 0;
     }
 
+    clReleaseProgram(wrap->program);
+    wrap->program = program;
+}
 
-    va_end(vars);
+/* Sets the kernel argument and keeps its value for `cl_wrap_swap` */
+static cl_int set_arg(cl_wrap* wrap, cl_uint kernel_id, cl_uint arg_id,
+                      size_t size, const void* data) {
+
+    if (arg_id >= __MAX_BUFFERS || size > __MAX_ARG_SIZE) {
+        printf("ERROR:\tKernel argument %u is out of range or larger than %d bytes\n",
+               arg_id, __MAX_ARG_SIZE);
+        fail();
+    }
+
+    cl_int cl_error = clSetKernelArg(wrap->kernels[kernel_id], arg_id, size, data);
+    if (cl_error >= 0 && data) {
+        memcpy(wrap->args[kernel_id][arg_id], data, size);
+        wrap->arg_sizes[kernel_id][arg_id] = size;
+    }
+
+    return cl_error;
 }
 
 void cl_wrap_load_global_data(cl_wrap* wrap, cl_uint kernel_id, cl_uint arg_id, 
                               const void* data, size_t size, cl_mem_flags mem_flags) {
 
     cl_int      cl_error;
+    cl_event    event;
 
 
     /* Check if the kernel id is already in use */
     for (cl_uint i = 0; i < wrap->buffers_num[kernel_id]; i++) {
         if (wrap->buffers_ids[kernel_id][i] == arg_id) {
             printf("ERROR:\tGiven kernel argument already in use\n");
-            exit(1);
+            fail();
         }
     }
+    if (arg_id < __MAX_BUFFERS && wrap->pool_args[kernel_id][arg_id]) {
+        printf("ERROR:\tGiven kernel argument already in use\n");
+        fail();
+    }
 
     if (arg_id >= __MAX_BUFFERS) {
         printf("ERROR:\tWrong kernel ID given\n");
-        exit(1);
+        fail();
     }
 
-    /* Create the buffer and append it to the corresponding kernel */
-    wrap->buffers[kernel_id][arg_id] = clCreateBuffer(wrap->context, mem_flags, size,
-                                                      NULL, NULL);
+    /* Create the buffer and append it to the corresponding kernel. An empty array,
+       like a scene without lights, still gets a byte since buffers cannot be empty */
+    wrap->buffers[kernel_id][arg_id] = clCreateBuffer(wrap->context, mem_flags,
+                                                      size ? size : 1, NULL, &cl_error);
+    if (cl_error < 0) {
+        printf("ERROR:\tCouldn't create a buffer of %zu bytes on the device\n", size);
+        fail();
+    }
 
     /* If data is not NULL, try to transfer the data from the host to the device */
-    if (data) {
+    if (data && size) {
         cl_error = clEnqueueWriteBuffer(wrap->queue, wrap->buffers[kernel_id][arg_id],
-                                        CL_TRUE, 0, size, data, 0, NULL, NULL);
+                                        CL_TRUE, 0, size, data, 0, NULL,
+                                        rtimeline_event(&event));
         if (cl_error < 0) {
             printf("ERROR:\tCouldn't transfer the data from host to the device\n");
-            exit(1);
+            fail();
         }
+        rtimeline_device("upload", event);
     }
 
-    if (clSetKernelArg(wrap->kernels[kernel_id], arg_id, sizeof(cl_mem),
-                       &wrap->buffers[kernel_id][arg_id]) < 0) {
+    if (set_arg(wrap, kernel_id, arg_id, sizeof(cl_mem),
+                &wrap->buffers[kernel_id][arg_id]) < 0) {
         printf("ERROR:\tCouldn't pass the data argument to the kernel\n");
-        exit(1);
+        fail();
     }
 
     /* Register the given kernel id as used */
     wrap->buffers_ids[kernel_id][wrap->buffers_num[kernel_id]++] = arg_id;
 }
 
+void cl_wrap_update_global_data(cl_wrap* wrap, cl_uint kernel_id, cl_uint arg_id,
+                                const void* data, size_t size) {
+
+    cl_int      cl_error;
+    cl_event    event;
+
+
+    if (size == 0) { return; }
+
+    cl_error = clEnqueueWriteBuffer(wrap->queue, wrap->buffers[kernel_id][arg_id],
+                                    CL_TRUE, 0, size, data, 0, NULL,
+                                    rtimeline_event(&event));
+    if (cl_error < 0) {
+        printf("ERROR:\tCouldn't transfer the data from host to the device\n");
+        fail();
+    }
+    rtimeline_device("upload", event);
+}
+
+void cl_wrap_read_global_data(cl_wrap* wrap, cl_uint kernel_id, cl_uint arg_id,
+                              void* host_output, size_t size) {
+
+    cl_int      cl_error;
+    cl_event    event;
+
+
+    cl_error = clEnqueueReadBuffer(wrap->queue, wrap->buffers[kernel_id][arg_id],
+                                   CL_TRUE, 0, size, host_output, 0, NULL,
+                                   rtimeline_event(&event));
+    if (cl_error < 0) {
+        printf("ERROR:\tFailed to transfer device memory to host\n");
+        fail();
+    }
+    rtimeline_device("read-back", event);
+}
+
+void cl_wrap_memory(cl_wrap* wrap, cl_ulong* global_size, cl_ulong* max_alloc) {
+
+    if (clGetDeviceInfo(wrap->device, CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(cl_ulong),
+                        global_size, NULL) < 0 ||
+        clGetDeviceInfo(wrap->device, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(cl_ulong),
+                        max_alloc, NULL) < 0) {
+        printf("ERROR:\tCannot get the memory sizes of the device\n");
+        fail();
+    }
+}
+
+cl_ulong cl_wrap_local_memory(cl_device_type type) {
+    cl_platform_id  platform;
+    cl_device_id    device;
+    cl_ulong        local_size;
+
+    if (clGetPlatformIDs(1, &platform, NULL) < 0 ||
+        clGetDeviceIDs(platform, type, 1, &device, NULL) < 0 ||
+        clGetDeviceInfo(device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(cl_ulong),
+                        &local_size, NULL) < 0) {
+        return 0;
+    }
+    return local_size;
+}
+
+int cl_wrap_fit_local(cl_wrap* wrap, const char* options) {
+    cl_ulong    device_size, kernel_size;
+    cl_program  program;
+    cl_kernel   kernels[__MAX_KERNELS];
+    cl_uint     kernel_id;
+
+
+    if (clGetDeviceInfo(wrap->device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(cl_ulong),
+                        &device_size, NULL) < 0) {
+        printf("ERROR:\tCannot get the local memory size of the device\n");
+        fail();
+    }
+
+    for (kernel_id = 0; kernel_id < wrap->kernels_num; kernel_id++) {
+        if (clGetKernelWorkGroupInfo(wrap->kernels[kernel_id], wrap->device,
+                                     CL_KERNEL_LOCAL_MEM_SIZE, sizeof(cl_ulong),
+                                     &kernel_size, NULL) < 0) {
+            printf("ERROR:\tCannot get the local memory size of kernel %s\n",
+                   wrap->kernel_names[kernel_id]);
+            fail();
+        }
+        if (kernel_size > device_size) { break; }
+    }
+    if (kernel_id == wrap->kernels_num) { return 0; }
+
+    if (strlen(options) >= __MAX_OPTIONS) {
+        printf("ERROR:\tThe build options are too long\n");
+        fail();
+    }
+    strcpy(wrap->options, options);
+
+    if (!cl_wrap_build(wrap, &program, kernels)) { fail(); }
+    cl_wrap_swap(wrap, program, kernels);
+    return 1;
+}
+
+size_t cl_wrap_buffer_size(cl_wrap* wrap, cl_uint kernel_id, cl_uint arg_id) {
+    size_t size;
+
+    if (clGetMemObjectInfo(wrap->buffers[kernel_id][arg_id], CL_MEM_SIZE, sizeof(size),
+                           &size, NULL) < 0) {
+        printf("ERROR:\tCannot get the size of a device buffer\n");
+        fail();
+    }
+    return size;
+}
+
 void cl_wrap_load_single_data(cl_wrap* wrap, cl_uint kernel_id, cl_uint arg_id,
                               const void* data, size_t obj_size) {
 
@@ -176,14 +461,304 @@ void cl_wrap_load_single_data(cl_wrap* wrap, cl_uint kernel_id, cl_uint arg_id,
     for (cl_uint i = 0; i < wrap->buffers_num[kernel_id]; i++) {
         if (wrap->buffers_ids[kernel_id][i] == arg_id) {
             printf("ERROR:\tGiven kernel argument already in use\n");
-            exit(1);
+            fail();
+        }
+    }
+    if (arg_id < __MAX_BUFFERS && wrap->pool_args[kernel_id][arg_id]) {
+        printf("ERROR:\tGiven kernel argument already in use\n");
+        fail();
+    }
+
+    if (set_arg(wrap, kernel_id, arg_id, obj_size, data) < 0) {
+        printf("ERROR:\tCouldn't pass the data argument to the kernel\n");
+        fail();
+    }
+}
+
+/* Returns an unused extent entry */
+static cl_uint pool_entry(cl_wrap* wrap) {
+    for (cl_uint i = 0; i < wrap->pool_extents_num; i++) {
+        if (!wrap->pool_extents[i].capacity) { return i; }
+    }
+
+    if (wrap->pool_extents_num == __MAX_POOL_EXTENTS) {
+        printf("ERROR:\tThe device memory pool is too fragmented\n");
+        fail();
+    }
+    return wrap->pool_extents_num++;
+}
+
+/* Returns a used extent of `size` aligned bytes: from the smallest free one that
+   fits, else on top of a block, else in a new block */
+static cl_uint pool_take(cl_wrap* wrap, size_t size) {
+    cl_wrap_extent  *extent;
+    cl_uint         best = wrap->pool_extents_num;
+    cl_ulong        global_size, max_alloc;
+    cl_int          cl_error;
+
+
+    for (cl_uint i = 0; i < wrap->pool_extents_num; i++) {
+        extent = &wrap->pool_extents[i];
+        if (!extent->used && extent->capacity >= size &&
+            (best == wrap->pool_extents_num ||
+             extent->capacity < wrap->pool_extents[best].capacity)) {
+            best = i;
+        }
+    }
+
+    if (best < wrap->pool_extents_num) {
+        /* The rest of a larger extent stays free for other buffers */
+        if (wrap->pool_extents[best].capacity > size) {
+            cl_uint rest = pool_entry(wrap);
+            wrap->pool_extents[rest] = wrap->pool_extents[best];
+            wrap->pool_extents[rest].offset += size;
+            wrap->pool_extents[rest].capacity -= size;
+            wrap->pool_extents[best].capacity = size;
+        }
+
+        wrap->pool_extents[best].used = 1;
+        return best;
+    }
+
+    cl_uint block, empty = wrap->pool_blocks_num;
+    for (block = 0; block < wrap->pool_blocks_num; block++) {
+        if (!wrap->pool_sizes[block]) { empty = block; }
+        else if (wrap->pool_sizes[block]-wrap->pool_tops[block] >= size) { break; }
+    }
+
+    if (block == wrap->pool_blocks_num) {
+        cl_wrap_memory(wrap, &global_size, &max_alloc);
+
+        /* Released blocks leave their entries for the new ones */
+        block = empty;
+        if (block == __MAX_POOL_BLOCKS || size > max_alloc) {
+            printf("ERROR:\tCouldn't create a buffer of %zu bytes on the device\n", size);
+            fail();
+        }
+
+        size_t block_size = size > __POOL_BLOCK ? size : __POOL_BLOCK;
+        if (block_size > max_alloc) { block_size = max_alloc; }
+
+        wrap->pool_blocks[block] = clCreateBuffer(wrap->context, CL_MEM_READ_WRITE,
+                                                  block_size, NULL, &cl_error);
+        if (cl_error < 0) {
+            printf("ERROR:\tCouldn't create a buffer of %zu bytes on the device\n",
+                   block_size);
+            fail();
+        }
+
+        wrap->pool_sizes[block] = block_size;
+        wrap->pool_tops[block] = 0;
+        if (block == wrap->pool_blocks_num) { wrap->pool_blocks_num++; }
+    }
+
+    cl_uint taken = pool_entry(wrap);
+    extent = &wrap->pool_extents[taken];
+    extent->block = block;
+    extent->offset = wrap->pool_tops[block];
+    extent->capacity = size;
+    extent->used = 1;
+
+    wrap->pool_tops[block] += size;
+    return taken;
+}
+
+/* Frees the extent and merges it with the free ones next to it. When it is the
+   last one of its block, the top of the block comes down instead and an empty
+   block is released */
+static void pool_give(cl_wrap* wrap, cl_uint taken) {
+    cl_wrap_extent  *extent = &wrap->pool_extents[taken];
+    cl_wrap_extent  *other;
+
+
+    extent->used = 0;
+
+    for (cl_uint i = 0; i < wrap->pool_extents_num; i++) {
+        other = &wrap->pool_extents[i];
+        if (i == taken || other->used || !other->capacity ||
+            other->block != extent->block) {
+            continue;
+        }
+
+        if (other->offset+other->capacity == extent->offset) {
+            extent->offset = other->offset;
+            extent->capacity += other->capacity;
+            other->capacity = 0;
+        } else if (extent->offset+extent->capacity == other->offset) {
+            extent->capacity += other->capacity;
+            other->capacity = 0;
+        }
+    }
+
+    if (extent->offset+extent->capacity == wrap->pool_tops[extent->block]) {
+        wrap->pool_tops[extent->block] = extent->offset;
+        extent->capacity = 0;
+    }
+
+    if (wrap->pool_tops[extent->block] == 0) {
+        clReleaseMemObject(wrap->pool_blocks[extent->block]);
+        wrap->pool_sizes[extent->block] = 0;
+    }
+}
+
+/* Creates the sub-buffer of the pool buffer over the start of its extent and sets
+   it to every kernel argument using the buffer */
+static void pool_map(cl_wrap* wrap, cl_uint buffer_id) {
+    cl_wrap_pooled      *buffer = &wrap->pool_buffers[buffer_id];
+    cl_wrap_extent      *extent = &wrap->pool_extents[buffer->extent];
+    cl_buffer_region    region  = { extent->offset, buffer->size };
+    cl_int              cl_error;
+
+
+    buffer->mem = clCreateSubBuffer(wrap->pool_blocks[extent->block], buffer->flags,
+                                    CL_BUFFER_CREATE_TYPE_REGION, &region, &cl_error);
+    if (cl_error < 0) {
+        printf("ERROR:\tCouldn't create a buffer of %zu bytes on the device\n",
+               buffer->size);
+        fail();
+    }
+
+    for (cl_uint kernel_id = 0; kernel_id < wrap->kernels_num; kernel_id++) {
+        for (cl_uint arg_id = 0; arg_id < __MAX_BUFFERS; arg_id++) {
+            if (wrap->pool_args[kernel_id][arg_id] != buffer_id+1) { continue; }
+
+            wrap->buffers[kernel_id][arg_id] = buffer->mem;
+            if (set_arg(wrap, kernel_id, arg_id, sizeof(cl_mem), &buffer->mem) < 0) {
+                printf("ERROR:\tCouldn't pass the data argument to the kernel\n");
+                fail();
+            }
+        }
+    }
+}
+
+/* Changes the bytes of the role by a buffer going from `from` to `to` bytes */
+static void pool_count(cl_wrap* wrap, cl_uint role, size_t from, size_t to) {
+    wrap->pool_current[role] = wrap->pool_current[role]-from+to;
+
+    if (wrap->pool_current[role] > wrap->pool_peak[role]) {
+        wrap->pool_peak[role] = wrap->pool_current[role];
+    }
+}
+
+static size_t pool_aligned(cl_wrap* wrap, size_t size) {
+    return (size+wrap->pool_align-1)/wrap->pool_align*wrap->pool_align;
+}
+
+cl_uint cl_wrap_pool_alloc(cl_wrap* wrap, const char* role, size_t size,
+                           cl_mem_flags mem_flags) {
+
+    cl_uint     role_id;
+
+
+    if (size == 0 || wrap->pool_buffers_num == __MAX_POOL_BUFFERS) {
+        printf("ERROR:\tEmpty buffer or too many buffers in the device memory pool\n");
+        fail();
+    }
+
+    for (role_id = 0; role_id < wrap->pool_roles_num; role_id++) {
+        if (strcmp(wrap->pool_roles[role_id], role) == 0) { break; }
+    }
+
+    if (role_id == wrap->pool_roles_num) {
+        if (role_id == __MAX_POOL_ROLES || strlen(role) >= __MAX_ROLE) {
+            printf("ERROR:\tToo many buffer roles or too long names\n");
+            fail();
+        }
+
+        strcpy(wrap->pool_roles[role_id], role);
+        wrap->pool_current[role_id] = 0;
+        wrap->pool_peak[role_id] = 0;
+        wrap->pool_roles_num++;
+    }
+
+    cl_uint buffer_id = wrap->pool_buffers_num++;
+    cl_wrap_pooled *buffer = &wrap->pool_buffers[buffer_id];
+
+    /* Sub-buffers take only the access flags, the memory belongs to the pool */
+    buffer->flags  = mem_flags & (CL_MEM_READ_WRITE|CL_MEM_READ_ONLY|CL_MEM_WRITE_ONLY);
+    buffer->size   = size;
+    buffer->role   = role_id;
+    buffer->extent = pool_take(wrap, pool_aligned(wrap, size));
+
+    pool_map(wrap, buffer_id);
+    pool_count(wrap, role_id, 0, size);
+
+    return buffer_id;
+}
+
+void cl_wrap_load_pool_data(cl_wrap* wrap, cl_uint kernel_id, cl_uint arg_id,
+                            cl_uint buffer_id) {
+
+    /* Check if the kernel id is already in use */
+    for (cl_uint i = 0; i < wrap->buffers_num[kernel_id]; i++) {
+        if (wrap->buffers_ids[kernel_id][i] == arg_id) {
+            printf("ERROR:\tGiven kernel argument already in use\n");
+            fail();
         }
     }
 
-    if (clSetKernelArg(wrap->kernels[kernel_id], arg_id, obj_size, data) < 0) {
+    if (arg_id >= __MAX_BUFFERS || buffer_id >= wrap->pool_buffers_num) {
+        printf("ERROR:\tWrong kernel ID or pool buffer given\n");
+        fail();
+    }
+
+    wrap->pool_args[kernel_id][arg_id] = buffer_id+1;
+    wrap->buffers[kernel_id][arg_id] = wrap->pool_buffers[buffer_id].mem;
+
+    if (set_arg(wrap, kernel_id, arg_id, sizeof(cl_mem),
+                &wrap->pool_buffers[buffer_id].mem) < 0) {
         printf("ERROR:\tCouldn't pass the data argument to the kernel\n");
-        exit(1);
+        fail();
+    }
+}
+
+void cl_wrap_pool_resize(cl_wrap* wrap, cl_uint buffer_id, size_t size) {
+    cl_wrap_pooled  *buffer = &wrap->pool_buffers[buffer_id];
+
+
+    if (size == 0) {
+        printf("ERROR:\tCannot resize a pool buffer to 0 bytes\n");
+        fail();
+    }
+
+    if (size == buffer->size) { return; }
+
+    /* The queued kernels may still use the old sub-buffer */
+    clFinish(wrap->queue);
+    clReleaseMemObject(buffer->mem);
+
+    if (pool_aligned(wrap, size) > wrap->pool_extents[buffer->extent].capacity) {
+        pool_give(wrap, buffer->extent);
+        buffer->extent = pool_take(wrap, pool_aligned(wrap, size));
+    }
+
+    pool_count(wrap, buffer->role, buffer->size, size);
+    buffer->size = size;
+    pool_map(wrap, buffer_id);
+}
+
+void cl_wrap_pool_report(cl_wrap* wrap) {
+    size_t      current = 0, peak = 0, allocated = 0;
+
+
+    printf("Device memory by role, current / peak MB:\n");
+    for (cl_uint i = 0; i < wrap->pool_roles_num; i++) {
+        printf("    %-16s %8.1f / %8.1f\n", wrap->pool_roles[i],
+               wrap->pool_current[i]/1048576.0, wrap->pool_peak[i]/1048576.0);
+
+        current += wrap->pool_current[i];
+        peak += wrap->pool_peak[i];
+    }
+
+    cl_uint blocks = 0;
+    for (cl_uint i = 0; i < wrap->pool_blocks_num; i++) {
+        allocated += wrap->pool_sizes[i];
+        blocks += wrap->pool_sizes[i] > 0;
     }
+
+    /* The roles can peak at different times, so the summed peak is an upper bound */
+    printf("    %-16s %8.1f / %8.1f, %.1f MB allocated in %u blocks\n", "all",
+           current/1048576.0, peak/1048576.0, allocated/1048576.0, blocks);
 }
 
 void cl_wrap_load_images(cl_wrap* wrap, cl_uint kernel_id, cl_uint arg_id,
@@ -227,10 +802,15 @@ void cl_wrap_load_images(cl_wrap* wrap, cl_uint kernel_id, cl_uint arg_id,
     for (cl_uint i = 0; i < wrap->buffers_num[kernel_id]; i++) {
         if (wrap->buffers_ids[kernel_id][i] == arg_id) {
             printf("ERROR:\tGiven kernel argument already in use\n");
-            exit(1);
+            fail();
         }
     }
+    if (arg_id < __MAX_BUFFERS && wrap->pool_args[kernel_id][arg_id]) {
+        printf("ERROR:\tGiven kernel argument already in use\n");
+        fail();
+    }
 
+    rtimeline_begin("decode textures");
     va_start(vars, image_num);
     /* Read all given images and append the raw data into the same buffer */
     for (cl_uint i = 0; i < image_num; i++) {
@@ -238,7 +818,7 @@ void cl_wrap_load_images(cl_wrap* wrap, cl_uint kernel_id, cl_uint arg_id,
         ireader = fopen(filename, "rb");
         if (!ireader) {
             printf("ERROR:\tCannot open file \"%s\"\n", filename);
-            exit(1);
+            fail();
         }
 
         cl_uchar header[8];
@@ -247,14 +827,14 @@ void cl_wrap_load_images(cl_wrap* wrap, cl_uint kernel_id, cl_uint arg_id,
             fclose(ireader);
 
             printf("ERROR:\t\"%s\" is not a PNG file\n", filename);
-            exit(1);
+            fail();
         }
 
         png_structp png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL,
                                                      NULL);
         if (!png_ptr) {
             printf("ERROR:\tCould not create a PNG general file structure\n");
-            exit(1);
+            fail();
         }
         png_infop png_info = png_create_info_struct(png_ptr);
         if (!png_info) {
@@ -262,7 +842,7 @@ void cl_wrap_load_images(cl_wrap* wrap, cl_uint kernel_id, cl_uint arg_id,
             fclose(ireader);
 
             printf("ERROR:\tCould not create a PNG info file structure\n");
-            exit(1);
+            fail();
         }
 
         png_init_io(png_ptr, ireader);
@@ -294,7 +874,7 @@ void cl_wrap_load_images(cl_wrap* wrap, cl_uint kernel_id, cl_uint arg_id,
             fclose(ireader);
 
             printf("ERROR:\tAll images must have same dimensions\n");
-            exit(1);
+            fail();
         }
 
         if (bdepth != 8 || ctype != PNG_COLOR_TYPE_RGB) {
@@ -303,7 +883,7 @@ void cl_wrap_load_images(cl_wrap* wrap, cl_uint kernel_id, cl_uint arg_id,
             fclose(ireader);
 
             printf("ERROR:\t\"%s\" must have a depth of 8 bits and be RGB\n", filename);
-            exit(1);
+            fail();
         }
 
         png_set_filler(png_ptr, 255, PNG_FILLER_AFTER);
@@ -326,21 +906,25 @@ void cl_wrap_load_images(cl_wrap* wrap, cl_uint kernel_id, cl_uint arg_id,
         fclose(ireader);
     }
     va_end(vars);
+    rtimeline_end();
 
+    /* The image is copied to the device by the creation */
+    rtimeline_begin("upload textures");
     wrap->buffers[kernel_id][arg_id] = clCreateImage(wrap->context, mem_flags,
                                                         &iformat, &idesc, images,
                                                         &cl_error);
+    rtimeline_end();
     if (cl_error < 0) {
         free(images);
         printf("ERROR:\tCouldn't create an image array %d\n", cl_error);
-        exit(1);
+        fail();
     }
 
-    if (clSetKernelArg(wrap->kernels[kernel_id], arg_id, sizeof(cl_mem),
-                       &wrap->buffers[kernel_id][arg_id]) < 0) {
+    if (set_arg(wrap, kernel_id, arg_id, sizeof(cl_mem),
+                &wrap->buffers[kernel_id][arg_id]) < 0) {
         free(images);
         printf("ERROR:\tCouldn't pass the image array to the kernel\n");
-        exit(1);
+        fail();
     }
 
     /* Register the given kernel id as used */
@@ -353,6 +937,7 @@ void cl_wrap_output(cl_wrap* wrap, size_t array_size, size_t output_size,
                     void* host_output) {
     size_t global_size, local_size;
     cl_int cl_error;
+    cl_event event;
 
 
     /* Get the suitable local size for the used device */
@@ -361,7 +946,7 @@ void cl_wrap_output(cl_wrap* wrap, size_t array_size, size_t output_size,
                                         &local_size, NULL);
     if (cl_error < 0) {
         printf("ERROR:\tCannot get the work group size for the given device\n");
-        exit(1);
+        fail();
     }
 
     /* Calculate the global size based on the local one */
@@ -371,17 +956,19 @@ void cl_wrap_output(cl_wrap* wrap, size_t array_size, size_t output_size,
 
 
     cl_error = clEnqueueNDRangeKernel(wrap->queue, wrap->kernels[kernel_run_id], 1, NULL,
-                                      &global_size, &local_size, 0, NULL, NULL);
+                                      &global_size, &local_size, 0, NULL,
+                                      rtimeline_event(&event));
     if (cl_error < 0) {
         printf("ERROR:\tCouldn't run the kernel\n");
-        exit(1);
+        fail();
     }
+    rtimeline_device(wrap->kernel_names[kernel_run_id], event);
 
     cl_error = clFinish(wrap->queue);
     if (cl_error < 0) {
         printf("%d\n", cl_error);
         printf("ERROR:\tThe device kernel failed\n");
-        exit(1);
+        fail();
     }
 
     /* Ignoring memory copy from device to host if `host_output` is set to NULL */
@@ -389,12 +976,397 @@ void cl_wrap_output(cl_wrap* wrap, size_t array_size, size_t output_size,
 
     /* Transfer the data from the device to the host otherwise */
     cl_error = clEnqueueReadBuffer(wrap->queue, wrap->buffers[kernel_id][arg_id],
-                        CL_TRUE, 0, output_size, host_output, 0, NULL, NULL);
+                        CL_TRUE, 0, output_size, host_output, 0, NULL,
+                        rtimeline_event(&event));
 
     if (cl_error < 0) {
         printf("ERROR:\tFailed to transfer device memory to host\n");
-        exit(1);
+        fail();
     }
+    rtimeline_device("read-back", event);
+}
+
+/* Candidate work group shapes of the 2D launches */
+static const size_t tile_shapes[__MAX_TILES][2] = {
+    {8, 8}, {16, 4}, {4, 16}, {16, 8}, {8, 16},
+    {32, 2}, {32, 4}, {16, 16}, {32, 8}, {64, 4}
+};
+
+/* Keeps the fastest measured shape, the times of unusable shapes are LONG_MAX */
+static void tile_pick(cl_wrap* wrap, cl_uint kernel_id) {
+    long best = LONG_MAX;
+
+    /* Every device can run single work item groups */
+    wrap->tile[kernel_id][0] = 1;
+    wrap->tile[kernel_id][1] = 1;
+
+    for (cl_uint i = 0; i < __MAX_TILES; i++) {
+        if (wrap->tile_times[kernel_id][i] < best) {
+            best = wrap->tile_times[kernel_id][i];
+            wrap->tile[kernel_id][0] = tile_shapes[i][0];
+            wrap->tile[kernel_id][1] = tile_shapes[i][1];
+        }
+    }
+}
+
+/* Writes the device and kernel names and the hash of the build options that key
+   the tile cache, the options change the code and so the fastest shape */
+static void tile_key(cl_wrap* wrap, cl_uint kernel_id, char* device, char* kernel,
+                     char* options, size_t size) {
+    unsigned long long hash = 14695981039346656037ULL;
+
+    clGetDeviceInfo(wrap->device, CL_DEVICE_NAME, size, device, NULL);
+    clGetKernelInfo(wrap->kernels[kernel_id], CL_KERNEL_FUNCTION_NAME, size, kernel,
+                    NULL);
+
+    /* 64 bit FNV-1a */
+    for (const char* c = wrap->options; *c; c++) {
+        hash = (hash^(unsigned char)*c)*1099511628211ULL;
+    }
+    snprintf(options, size, "%016llx", hash);
+}
+
+/* Reads the shapes measured by earlier runs and rules out the ones the kernel
+   cannot run with */
+static void tile_load(cl_wrap* wrap, cl_uint kernel_id) {
+    char    device[256], kernel[256], options[256], line[1024];
+    char    line_device[256], line_kernel[256], line_options[256];
+    size_t  group_size, item_sizes[3], tile_w, tile_h;
+    long    time;
+    FILE*   cache;
+
+    if (clGetKernelWorkGroupInfo(wrap->kernels[kernel_id], wrap->device,
+                                 CL_KERNEL_WORK_GROUP_SIZE, sizeof(group_size),
+                                 &group_size, NULL) < 0 ||
+        clGetDeviceInfo(wrap->device, CL_DEVICE_MAX_WORK_ITEM_SIZES,
+                        sizeof(item_sizes), item_sizes, NULL) < 0) {
+        printf("ERROR:\tCannot get the work group limits for the given device\n");
+        fail();
+    }
+
+    for (cl_uint i = 0; i < __MAX_TILES; i++) {
+        wrap->tile_times[kernel_id][i] =
+            (tile_shapes[i][0]*tile_shapes[i][1] > group_size ||
+             tile_shapes[i][0] > item_sizes[0] ||
+             tile_shapes[i][1] > item_sizes[1]) ? LONG_MAX : -1;
+    }
+
+    tile_key(wrap, kernel_id, device, kernel, options, sizeof(device));
+
+    if ((cache = fopen(__TILE_CACHE, "r"))) {
+        while (fgets(line, sizeof(line), cache)) {
+            if (sscanf(line, "%255[^\t]\t%255[^\t]\t%255[^\t]\t%zu\t%zu\t%ld",
+                       line_device, line_kernel, line_options, &tile_w, &tile_h,
+                       &time) != 6 ||
+                strcmp(line_device, device) || strcmp(line_kernel, kernel) ||
+                strcmp(line_options, options)) {
+                continue;
+            }
+
+            for (cl_uint i = 0; i < __MAX_TILES; i++) {
+                if (tile_shapes[i][0] == tile_w && tile_shapes[i][1] == tile_h &&
+                    wrap->tile_times[kernel_id][i] != LONG_MAX) {
+                    wrap->tile_times[kernel_id][i] = time;
+                }
+            }
+        }
+        fclose(cache);
+    }
+
+    for (cl_uint i = 0; i < __MAX_TILES; i++) {
+        if (wrap->tile_times[kernel_id][i] == -1) { return; }
+    }
+    tile_pick(wrap, kernel_id);
+}
+
+/* Stores the time of a shape for the later runs */
+static void tile_store(cl_wrap* wrap, cl_uint kernel_id, cl_uint shape, long time) {
+    char    device[256], kernel[256], options[256];
+    FILE*   cache;
+
+    wrap->tile_times[kernel_id][shape] = time;
+
+    tile_key(wrap, kernel_id, device, kernel, options, sizeof(device));
+    if ((cache = fopen(__TILE_CACHE, "a"))) {
+        fprintf(cache, "%s\t%s\t%s\t%zu\t%zu\t%ld\n", device, kernel, options,
+                tile_shapes[shape][0], tile_shapes[shape][1], time);
+        fclose(cache);
+    }
+}
+
+/* Copies of the buffers a kernel can write, taken before the shapes are timed */
+typedef struct {
+    cl_mem      buffers[__MAX_BUFFERS];
+    cl_mem      copies[__MAX_BUFFERS];
+    size_t      sizes[__MAX_BUFFERS];
+    cl_uint     num;
+}   tile_snapshot;
+
+/* 1 if `mem` is a buffer or image of the wrapper, the other pointer sized
+   arguments are plain values */
+static int tile_known(cl_wrap* wrap, cl_mem mem) {
+    for (cl_uint i = 0; i < wrap->kernels_num; i++) {
+        for (cl_uint j = 0; j < __MAX_BUFFERS; j++) {
+            if (wrap->buffers[i][j] == mem) { return 1; }
+        }
+    }
+    for (cl_uint i = 0; i < wrap->pool_buffers_num; i++) {
+        if (wrap->pool_buffers[i].mem == mem) { return 1; }
+    }
+    return 0;
+}
+
+static void tile_release(tile_snapshot* snapshot) {
+    for (cl_uint i = 0; i < snapshot->num; i++) {
+        clReleaseMemObject(snapshot->copies[i]);
+    }
+    snapshot->num = 0;
+}
+
+/* Copies every buffer argument of the kernel that is not read only. Returns 0
+   without copies if the device has no memory left for them */
+static int tile_copy(cl_wrap* wrap, cl_uint kernel_id, tile_snapshot* snapshot) {
+    cl_mem_object_type  type;
+    cl_mem_flags        flags;
+    cl_mem              mem;
+    cl_int              cl_error;
+
+
+    snapshot->num = 0;
+    for (cl_uint arg_id = 0; arg_id < __MAX_BUFFERS; arg_id++) {
+        if (wrap->arg_sizes[kernel_id][arg_id] != sizeof(cl_mem)) { continue; }
+        memcpy(&mem, wrap->args[kernel_id][arg_id], sizeof(cl_mem));
+        if (!mem || !tile_known(wrap, mem)) { continue; }
+
+        if (clGetMemObjectInfo(mem, CL_MEM_TYPE, sizeof(type), &type, NULL) < 0 ||
+            clGetMemObjectInfo(mem, CL_MEM_FLAGS, sizeof(flags), &flags, NULL) < 0) {
+            tile_release(snapshot);
+            return 0;
+        }
+        if (type != CL_MEM_OBJECT_BUFFER || (flags & CL_MEM_READ_ONLY)) { continue; }
+
+        /* An argument can repeat a buffer of an earlier one */
+        cl_uint i;
+        for (i = 0; i < snapshot->num && snapshot->buffers[i] != mem; i++);
+        if (i < snapshot->num) { continue; }
+
+        snapshot->buffers[i] = mem;
+        if (clGetMemObjectInfo(mem, CL_MEM_SIZE, sizeof(size_t), &snapshot->sizes[i],
+                               NULL) < 0) {
+            tile_release(snapshot);
+            return 0;
+        }
+        snapshot->copies[i] = clCreateBuffer(wrap->context, CL_MEM_READ_WRITE,
+                                             snapshot->sizes[i], NULL, &cl_error);
+        if (cl_error < 0) {
+            tile_release(snapshot);
+            return 0;
+        }
+        snapshot->num++;
+
+        if (clEnqueueCopyBuffer(wrap->queue, mem, snapshot->copies[i], 0, 0,
+                                snapshot->sizes[i], 0, NULL, NULL) < 0) {
+            tile_release(snapshot);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Puts the copied buffers back, undoing a timed launch */
+static void tile_restore(cl_wrap* wrap, tile_snapshot* snapshot) {
+    for (cl_uint i = 0; i < snapshot->num; i++) {
+        if (clEnqueueCopyBuffer(wrap->queue, snapshot->copies[i], snapshot->buffers[i],
+                                0, 0, snapshot->sizes[i], 0, NULL, NULL) < 0) {
+            printf("ERROR:\tCannot restore a buffer after timing the tile shapes\n");
+            fail();
+        }
+    }
+}
+
+/* Runs the kernel in tiles of `local_size` and waits for it. Returns its device
+   time in nanoseconds if `timed`, 0 otherwise */
+static long tile_launch(cl_wrap* wrap, size_t width, size_t height,
+                        cl_uint kernel_run_id, const size_t* local_size, int timed) {
+    size_t          global_size[2];
+    cl_ulong        start, stop;
+    cl_int          cl_error;
+    cl_event        event, *listed;
+
+
+    /* Round the range up to whole tiles */
+    global_size[0] = (width+local_size[0]-1)/local_size[0]*local_size[0];
+    global_size[1] = (height+local_size[1]-1)/local_size[1]*local_size[1];
+
+    /* A measured launch always gets an event. Its time on the device leaves out
+       the compilation and upload a driver may do on the first launch */
+    listed = rtimeline_event(&event);
+
+    cl_error = clEnqueueNDRangeKernel(wrap->queue, wrap->kernels[kernel_run_id], 2, NULL,
+                                      global_size, local_size, 0, NULL,
+                                      (listed || !timed) ? listed : &event);
+    if (cl_error < 0) {
+        printf("ERROR:\tCouldn't run the kernel\n");
+        fail();
+    }
+    rtimeline_device(wrap->kernel_names[kernel_run_id], event);
+
+    cl_error = clFinish(wrap->queue);
+    if (cl_error < 0) {
+        printf("%d\n", cl_error);
+        printf("ERROR:\tThe device kernel failed\n");
+        fail();
+    }
+
+    if (!timed) { return 0; }
+
+    cl_error = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START,
+                                       sizeof(start), &start, NULL);
+    if (cl_error >= 0) {
+        cl_error = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END,
+                                           sizeof(stop), &stop, NULL);
+    }
+    /* The timeline releases its events when it is written */
+    if (!listed) { clReleaseEvent(event); }
+
+    if (cl_error < 0) {
+        printf("ERROR:\tCannot read the time of the kernel %s\n",
+               wrap->kernel_names[kernel_run_id]);
+        fail();
+    }
+    return (long)(stop-start);
+}
+
+void cl_wrap_output_2d(cl_wrap* wrap, size_t width, size_t height,
+                       cl_uint kernel_run_id) {
+    size_t          local_size[2];
+    cl_int          shape = -1;
+    tile_snapshot   snapshot;
+
+
+    if (wrap->tile_launches[kernel_run_id]++ == 0) {
+        tile_load(wrap, kernel_run_id);
+
+        /* Times every shape left over a few launches on the real arguments, with
+           the written buffers put back after each */
+        if (!wrap->tile[kernel_run_id][0] && tile_copy(wrap, kernel_run_id, &snapshot)) {
+            for (cl_uint i = 0; i < __MAX_TILES; i++) {
+                if (wrap->tile_times[kernel_run_id][i] != -1) { continue; }
+
+                long best = LONG_MAX;
+                for (cl_uint run = 0; run < __TILE_RUNS; run++) {
+                    long time = tile_launch(wrap, width, height, kernel_run_id,
+                                            tile_shapes[i], 1);
+                    tile_restore(wrap, &snapshot);
+                    if (time < best) { best = time; }
+                }
+                tile_store(wrap, kernel_run_id, i, best);
+            }
+            tile_release(&snapshot);
+            tile_pick(wrap, kernel_run_id);
+        }
+    }
+
+    local_size[0] = wrap->tile[kernel_run_id][0];
+    local_size[1] = wrap->tile[kernel_run_id][1];
+
+    if (!local_size[0]) {
+        /* Without room for the copies, every launch measures the next shape */
+        for (shape = 0; wrap->tile_times[kernel_run_id][shape] != -1; shape++);
+
+        local_size[0] = tile_shapes[shape][0];
+        local_size[1] = tile_shapes[shape][1];
+    }
+
+    long time = tile_launch(wrap, width, height, kernel_run_id, local_size, shape >= 0);
+    if (shape < 0) { return; }
+
+    tile_store(wrap, kernel_run_id, shape, time);
+
+    for (cl_uint i = 0; i < __MAX_TILES; i++) {
+        if (wrap->tile_times[kernel_run_id][i] == -1) { return; }
+    }
+    tile_pick(wrap, kernel_run_id);
+}
+
+void cl_wrap_enqueue(cl_wrap* wrap, size_t offset, size_t array_size,
+                     cl_uint kernel_run_id) {
+    cl_int      cl_error;
+    cl_event    event;
+
+
+    cl_error = clEnqueueNDRangeKernel(wrap->queue, wrap->kernels[kernel_run_id], 1,
+                                      &offset, &array_size, NULL, 0, NULL,
+                                      rtimeline_event(&event));
+    if (cl_error < 0) {
+        printf("ERROR:\tCouldn't run the kernel\n");
+        fail();
+    }
+    rtimeline_device(wrap->kernel_names[kernel_run_id], event);
+}
+
+void cl_wrap_enqueue_2d(cl_wrap* wrap, size_t width, size_t row, size_t height,
+                        cl_uint kernel_run_id) {
+    size_t      offset[2] = {0, row}, global_size[2] = {width, height};
+    size_t      *tile = wrap->tile[kernel_run_id];
+    cl_int      cl_error;
+    cl_event    event;
+
+
+    /* Padding up to whole tiles would reach into the rows after the range */
+    int whole = tile[0] && width % tile[0] == 0 && height % tile[1] == 0;
+
+    cl_error = clEnqueueNDRangeKernel(wrap->queue, wrap->kernels[kernel_run_id], 2,
+                                      offset, global_size, whole ? tile : NULL, 0, NULL,
+                                      rtimeline_event(&event));
+    if (cl_error < 0) {
+        printf("ERROR:\tCouldn't run the kernel\n");
+        fail();
+    }
+    rtimeline_device(wrap->kernel_names[kernel_run_id], event);
+}
+
+cl_event cl_wrap_read_async(cl_wrap* wrap, cl_uint kernel_id, cl_uint arg_id,
+                            size_t offset, size_t size, void* host_output) {
+    cl_event    done, event;
+    cl_int      cl_error;
+
+
+    /* The marker completes with everything enqueued on the launch queue before it */
+    cl_error = clEnqueueMarkerWithWaitList(wrap->queue, 0, NULL, &done);
+    if (cl_error < 0) {
+        printf("ERROR:\tFailed to transfer device memory to host\n");
+        fail();
+    }
+    clFlush(wrap->queue);
+
+    rtimeline_event(&event);
+    cl_error = clEnqueueReadBuffer(wrap->transfer_queue, wrap->buffers[kernel_id][arg_id],
+                                   CL_FALSE, offset, size, host_output, 1, &done, &event);
+    clReleaseEvent(done);
+    if (cl_error < 0) {
+        printf("ERROR:\tFailed to transfer device memory to host\n");
+        fail();
+    }
+    clFlush(wrap->transfer_queue);
+
+    /* The timeline releases its own reference */
+    if (rtimeline_on) { clRetainEvent(event); }
+    rtimeline_device("read-back", event);
+    return event;
+}
+
+void cl_wrap_wait(cl_event event) {
+    cl_int cl_error = clWaitForEvents(1, &event);
+    clReleaseEvent(event);
+    if (cl_error < 0) {
+        printf("ERROR:\tFailed to transfer device memory to host\n");
+        fail();
+    }
+}
+
+void cl_wrap_recover(jmp_buf* point) {
+    recover_point = point;
 }
 
 void cl_wrap_release(cl_wrap* wrap) {
@@ -409,7 +1381,16 @@ void cl_wrap_release(cl_wrap* wrap) {
         }
     }
 
+    /* The pool buffers are released before the blocks they are part of */
+    for (cl_uint i = 0; i < wrap->pool_buffers_num; i++) {
+        clReleaseMemObject(wrap->pool_buffers[i].mem);
+    }
+    for (cl_uint i = 0; i < wrap->pool_blocks_num; i++) {
+        if (wrap->pool_sizes[i]) { clReleaseMemObject(wrap->pool_blocks[i]); }
+    }
+
 
+    clReleaseCommandQueue(wrap->transfer_queue);
     clReleaseCommandQueue(wrap->queue);
     clReleaseProgram(wrap->program);
     clReleaseContext(wrap->context);
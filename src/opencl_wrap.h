@@ -1,42 +1,194 @@
 #pragma once
 
+#include <setjmp.h>
 #include <CL/opencl.h>
 
 
 #define __MAX_KERNELS           16
-#define __MAX_BUFFERS           32
+#define __MAX_BUFFERS           40
+#define __MAX_OPTIONS           512
+#define __MAX_NAME              256
+/* Largest argument passed by value, kept for setting it again on rebuilt kernels.
+   The frontends check their structs against it, `rview` is the largest with 80 */
+#define __MAX_ARG_SIZE          128
+/* Work group shapes tried by the 2D launches, and launches timed per shape */
+#define __MAX_TILES             10
+#define __TILE_RUNS             3
+/* Measured shapes of every device, kernel and hash of the build options, one per
+   line with the device time in nanoseconds */
+#define __TILE_CACHE            "tiles.cache"
+/* Device memory pool: allocations, buffers handed out, ranges of the allocations
+   and buffer roles it keeps */
+#define __MAX_POOL_BLOCKS       16
+#define __MAX_POOL_BUFFERS      32
+#define __MAX_POOL_EXTENTS      64
+#define __MAX_POOL_ROLES        16
+#define __MAX_ROLE              32
+/* Smallest device allocation of the pool, larger buffers get one of their own */
+#define __POOL_BLOCK            ((size_t)64 << 20)
 
-/*All functions for the opencl wrapper handles error checking and terminates the program*/
+/*All functions for the opencl wrapper handles error checking and terminates the program,
+  or jumps to the point given to `cl_wrap_recover`*/
+
+/* Range of a pool allocation, free or holding one pool buffer. Unused entries have
+   no capacity */
+typedef struct {
+    cl_uint             block;
+    size_t              offset;
+    size_t              capacity;
+    int                 used;
+}   cl_wrap_extent;
+
+/* Pool buffer, a sub-buffer of `size` bytes at the start of its extent */
+typedef struct {
+    cl_mem              mem;
+    cl_mem_flags        flags;
+    size_t              size;
+    cl_uint             extent;
+    cl_uint             role;
+}   cl_wrap_pooled;
 
 typedef struct {
     cl_context          context;
     cl_device_id        device;
     cl_program          program;
     cl_command_queue    queue;
+    /* Read-backs overlapping the launches on `queue`, see `cl_wrap_read_async` */
+    cl_command_queue    transfer_queue;
+
+    char                options[__MAX_OPTIONS];     /* Program build options */
 
     cl_uint             kernels_num;
     cl_kernel           kernels[__MAX_KERNELS];
 
+    /* Source file and kernel name of every kernel, read again by the rebuilds */
+    char                sources[__MAX_KERNELS][__MAX_NAME];
+    char                kernel_names[__MAX_KERNELS][__MAX_NAME];
+
+    /* Latest value of every kernel argument, `arg_sizes` is 0 for unset ones */
+    unsigned char       args[__MAX_KERNELS][__MAX_BUFFERS][__MAX_ARG_SIZE];
+    size_t              arg_sizes[__MAX_KERNELS][__MAX_BUFFERS];
+
     cl_mem              buffers[__MAX_KERNELS][__MAX_BUFFERS];
     cl_uint             buffers_ids[__MAX_KERNELS][__MAX_BUFFERS];
     cl_uint             buffers_num[__MAX_KERNELS];
+
+    /* Work group shape of the 2D launches, zero until every shape is measured.
+       The times are device nanoseconds, -1 when the shape is not measured yet */
+    size_t              tile[__MAX_KERNELS][2];
+    long                tile_times[__MAX_KERNELS][__MAX_TILES];
+    cl_uint             tile_launches[__MAX_KERNELS];
+
+    /* Device memory pool. The blocks are filled upwards from their start, the
+       extents below `pool_tops` are reused when their buffers move */
+    size_t              pool_align;
+    cl_mem              pool_blocks[__MAX_POOL_BLOCKS];
+    size_t              pool_sizes[__MAX_POOL_BLOCKS];
+    size_t              pool_tops[__MAX_POOL_BLOCKS];
+    cl_uint             pool_blocks_num;
+
+    cl_wrap_extent      pool_extents[__MAX_POOL_EXTENTS];
+    cl_uint             pool_extents_num;
+    cl_wrap_pooled      pool_buffers[__MAX_POOL_BUFFERS];
+    cl_uint             pool_buffers_num;
+
+    /* Pool buffer of every kernel argument plus one, 0 for the other arguments */
+    cl_uint             pool_args[__MAX_KERNELS][__MAX_BUFFERS];
+
+    /* Bytes of the pool buffers of every role, now and at most so far */
+    char                pool_roles[__MAX_POOL_ROLES][__MAX_ROLE];
+    size_t              pool_current[__MAX_POOL_ROLES];
+    size_t              pool_peak[__MAX_POOL_ROLES];
+    cl_uint             pool_roles_num;
 }   cl_wrap;
 
 
 /* Sets the device and builds the program from source.
    Every source code is followed by kernel name and terminated by NULL, for example:
-   "src/raygen.cl", "raygen", "src/raytracing.cl", "raytracer", NULL */
-void cl_wrap_init(cl_wrap* wrap, cl_device_type type, ...);
+   "src/raygen.cl", "raygen", "src/raytracing.cl", "raytracer", NULL
+   `options` are passed to the compiler, can be NULL */
+void cl_wrap_init(cl_wrap* wrap, cl_device_type type, const char* options, ...);
 /* If `data` is NULL, then no data is transfered, only a cl buffer is created.
 It sets the data buffer to the kernel after transfering*/
 void cl_wrap_load_global_data(cl_wrap* wrap, cl_uint kernel_id, cl_uint arg_id,
                               const void* data, size_t size, cl_mem_flags mem_flags);
+/* Overwrites the start of a global buffer loaded earlier with the host data */
+void cl_wrap_update_global_data(cl_wrap* wrap, cl_uint kernel_id, cl_uint arg_id,
+                                const void* data, size_t size);
+/* Transfers the start of a global buffer loaded earlier to the host */
+void cl_wrap_read_global_data(cl_wrap* wrap, cl_uint kernel_id, cl_uint arg_id,
+                              void* host_output, size_t size);
+/* Sizes of the device memory and of the largest buffer it can allocate */
+void cl_wrap_memory(cl_wrap* wrap, cl_ulong* global_size, cl_ulong* max_alloc);
+/* Bytes of local memory a work group has on the device `cl_wrap_init` picks for
+   `type`, 0 if there is no such device. Can be called before `cl_wrap_init` */
+cl_ulong cl_wrap_local_memory(cl_device_type type);
+/* Builds the program again with `options` if a kernel takes more local memory
+   than the device has, which the compiler's own local memory can cause. Must be
+   called before the kernel arguments are set. Returns 1 if it was built again */
+int cl_wrap_fit_local(cl_wrap* wrap, const char* options);
+/* Bytes of the buffer or images of a kernel argument on the device */
+size_t cl_wrap_buffer_size(cl_wrap* wrap, cl_uint kernel_id, cl_uint arg_id);
 void cl_wrap_load_single_data(cl_wrap* wrap, cl_uint kernel_id, cl_uint arg_id,
                               const void* data, size_t obj_size);
+/* Hands out a `size` bytes buffer of the device memory pool and returns its id.
+   `role` names what it holds in `cl_wrap_pool_report`, like "rays" */
+cl_uint cl_wrap_pool_alloc(cl_wrap* wrap, const char* role, size_t size,
+                           cl_mem_flags mem_flags);
+/* Sets the pool buffer to the kernel argument, which follows it on resizes. The
+   argument can then be updated and read like the ones of `cl_wrap_load_global_data` */
+void cl_wrap_load_pool_data(cl_wrap* wrap, cl_uint kernel_id, cl_uint arg_id,
+                            cl_uint buffer_id);
+/* Changes the size of the pool buffer. Up to the capacity it was handed out with
+   the buffer keeps its memory and contents, larger sizes move it to another range
+   of the pool and leave the contents undefined */
+void cl_wrap_pool_resize(cl_wrap* wrap, cl_uint buffer_id, size_t size);
+/* Prints the current and the peak device memory of every role and of the pool */
+void cl_wrap_pool_report(cl_wrap* wrap);
 void cl_wrap_load_images(cl_wrap* wrap, cl_uint kernel_id, cl_uint arg_id,
                          cl_mem_flags mem_flags, cl_uint image_num, ...);
 /* Runs the kernel and outputs the result to host */
 void cl_wrap_output(cl_wrap* wrap, size_t array_size, size_t output_size, 
                     cl_uint kernel_run_id, cl_uint kernel_id, cl_int arg_id,
                     void* host_output);
+/* Runs the kernel over a `width`x`height` range in tiles. The first launch of a
+   kernel whose shapes are not in __TILE_CACHE for the device and build options
+   first times every candidate shape, the fastest of __TILE_RUNS launches each,
+   and puts back the buffers the kernel writes after every one. The times go to
+   __TILE_CACHE for the later runs and the launch runs with the fastest shape. If
+   the device has no memory to copy the buffers, every launch tries the next
+   shape instead */
+void cl_wrap_output_2d(cl_wrap* wrap, size_t width, size_t height,
+                       cl_uint kernel_run_id);
+/* Enqueues the kernel over the `array_size` work items from `offset` on and returns
+   without waiting for it. The work groups are left to the device, so no work item
+   reaches past the range */
+void cl_wrap_enqueue(cl_wrap* wrap, size_t offset, size_t array_size,
+                     cl_uint kernel_run_id);
+/* Same for the rows `row` to `row+height` of a `width` wide 2D range. The tile
+   shape measured by `cl_wrap_output_2d` is used if the range is made of whole tiles */
+void cl_wrap_enqueue_2d(cl_wrap* wrap, size_t width, size_t row, size_t height,
+                        cl_uint kernel_run_id);
+/* Starts transferring `size` bytes from `offset` of a global buffer to the host
+   once every command enqueued so far has finished. The transfer goes through its
+   own queue, so it overlaps the launches enqueued after it. Returns its event for
+   `cl_wrap_wait`, `host_output` must stay valid until then */
+cl_event cl_wrap_read_async(cl_wrap* wrap, cl_uint kernel_id, cl_uint arg_id,
+                            size_t offset, size_t size, void* host_output);
+/* Waits for the transfer of `cl_wrap_read_async` and releases its event */
+void cl_wrap_wait(cl_event event);
+/* Builds the program again from the source files, for example after they changed.
+   The launches can go on with the current kernels on another thread meanwhile.
+   Returns 1 with the new program and its kernels, or 0 with the compiler log
+   printed if the build fails or a kernel's argument count changed */
+int  cl_wrap_build(cl_wrap* wrap, cl_program* program, cl_kernel* kernels);
+/* Replaces the program and the kernels with a build of `cl_wrap_build` and sets
+   every argument set so far again, the buffers are kept. Must be called between
+   launches on the thread that runs them */
+void cl_wrap_swap(cl_wrap* wrap, cl_program program, cl_kernel* kernels);
+/* Errors of the wrapper in the calling thread jump to `point`, which `setjmp` set,
+   instead of ending the program, NULL ends it again. The reason is printed before.
+   The failed wrapper is only good for `cl_wrap_release`, and only once
+   `cl_wrap_init` has returned */
+void cl_wrap_recover(jmp_buf* point);
 void cl_wrap_release(cl_wrap* wrap);
\ No newline at end of file